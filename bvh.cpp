@@ -0,0 +1,445 @@
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "bvh.h"
+
+void aabb_empty(AABB* box) {
+    int a;
+    for(a = 0; a < 3; a++) {
+        box->bmin[a] = FLT_MAX;
+        box->bmax[a] = -FLT_MAX;
+    }
+}
+
+void aabb_grow(AABB* box, const AABB* other) {
+    int a;
+    for(a = 0; a < 3; a++) {
+        if(other->bmin[a] < box->bmin[a]) box->bmin[a] = other->bmin[a];
+        if(other->bmax[a] > box->bmax[a]) box->bmax[a] = other->bmax[a];
+    }
+}
+
+void aabb_grow_point(AABB* box, const float p[3]) {
+    int a;
+    for(a = 0; a < 3; a++) {
+        if(p[a] < box->bmin[a]) box->bmin[a] = p[a];
+        if(p[a] > box->bmax[a]) box->bmax[a] = p[a];
+    }
+}
+
+float aabb_area(const AABB* box) {
+    const float x = box->bmax[0] - box->bmin[0];
+    const float y = box->bmax[1] - box->bmin[1];
+    const float z = box->bmax[2] - box->bmin[2];
+    if(x < 0 || y < 0 || z < 0) return 0;
+    return 2.0f * (x*y + y*z + z*x);
+}
+
+static inline float centroid(const AABB* box, int axis) {
+    return 0.5f * (box->bmin[axis] + box->bmax[axis]);
+}
+
+typedef struct {
+    const AABB* bounds;
+    unsigned int* indices;
+    BVHNode* nodes;
+    unsigned int node_count;
+    unsigned int max_leaf;
+    unsigned int max_depth;
+} BuildState;
+
+/**
+ * Bounds of the centroids of [first, first + count), returns the axis
+ * they spread the most along.
+ */
+static int centroid_bounds(const BuildState* state, unsigned int first, unsigned int count, AABB* centroids) {
+    unsigned int i;
+    int axis = 0, a;
+
+    aabb_empty(centroids);
+    for(i = first; i < first + count; i++) {
+        float c[3];
+        for(a = 0; a < 3; a++) c[a] = centroid(&state->bounds[state->indices[i]], a);
+        aabb_grow_point(centroids, c);
+    }
+    for(a = 1; a < 3; a++)
+        if(centroids->bmax[a] - centroids->bmin[a] > centroids->bmax[axis] - centroids->bmin[axis])
+            axis = a;
+    return axis;
+}
+
+/**
+ * Levels below a node of count items when every split halves it.
+ */
+static unsigned int balanced_depth(unsigned int count, unsigned int max_leaf) {
+    unsigned int depth = 0;
+    while(count > max_leaf) {
+        count = count - count / 2;
+        depth++;
+    }
+    return depth;
+}
+
+/**
+ * Splits [first, first + count) in half at the median centroid of the
+ * widest axis (Hoare's quickselect), so the subtree is as shallow as it
+ * can be. Returns the index of the first item in the right half.
+ */
+static unsigned int bvh_median_split(BuildState* state, unsigned int first, unsigned int count) {
+    unsigned int* indices = state->indices;
+    AABB centroids;
+    const int axis = centroid_bounds(state, first, count, &centroids);
+    const long mid = first + count / 2;
+    long lo = first, hi = (long)first + count - 1;
+
+    while(lo < hi) {
+        const float pivot = centroid(&state->bounds[indices[(lo + hi) / 2]], axis);
+        long l = lo, r = hi;
+        while(l <= r) {
+            while(centroid(&state->bounds[indices[l]], axis) < pivot) l++;
+            while(centroid(&state->bounds[indices[r]], axis) > pivot) r--;
+            if(l <= r) {
+                const unsigned int tmp = indices[l];
+                indices[l++] = indices[r];
+                indices[r--] = tmp;
+            }
+        }
+        // [lo, r] is not above the pivot, [l, hi] not below, between equals it
+        if(mid <= r) hi = r;
+        else if(mid >= l) lo = l;
+        else break;
+    }
+    return (unsigned int)mid;
+}
+
+/**
+ * Picks a split with the surface area heuristic evaluated over BVH_SAH_BINS
+ * centroid bins on the widest centroid axis. Returns the index of the first
+ * item in the right half after partitioning [first, first + count).
+ */
+static unsigned int bvh_split(BuildState* state, unsigned int first, unsigned int count) {
+    unsigned int* indices = state->indices;
+    AABB centroids;
+    unsigned int i;
+    const int axis = centroid_bounds(state, first, count, &centroids);
+
+    const float lo = centroids.bmin[axis];
+    const float extent = centroids.bmax[axis] - lo;
+
+    // all centroids coincide, fall back to splitting the range in half
+    if(extent <= 0) return first + count / 2;
+
+    AABB bin_bounds[BVH_SAH_BINS];
+    unsigned int bin_count[BVH_SAH_BINS];
+    const float scale = BVH_SAH_BINS / extent;
+    int b;
+
+    for(b = 0; b < BVH_SAH_BINS; b++) {
+        aabb_empty(&bin_bounds[b]);
+        bin_count[b] = 0;
+    }
+
+    for(i = first; i < first + count; i++) {
+        const AABB* box = &state->bounds[indices[i]];
+        b = (int)((centroid(box, axis) - lo) * scale);
+        if(b >= BVH_SAH_BINS) b = BVH_SAH_BINS - 1;
+        bin_count[b]++;
+        aabb_grow(&bin_bounds[b], box);
+    }
+
+    // sweep from the right to get the cost of every right half
+    float right_cost[BVH_SAH_BINS];
+    AABB right;
+    unsigned int right_count = 0;
+    aabb_empty(&right);
+    for(b = BVH_SAH_BINS - 1; b > 0; b--) {
+        aabb_grow(&right, &bin_bounds[b]);
+        right_count += bin_count[b];
+        right_cost[b] = right_count * aabb_area(&right);
+    }
+
+    // then from the left, keeping the cheapest plane
+    AABB left;
+    unsigned int left_count = 0;
+    float best_cost = FLT_MAX;
+    int best_bin = -1;
+    aabb_empty(&left);
+    for(b = 0; b < BVH_SAH_BINS - 1; b++) {
+        aabb_grow(&left, &bin_bounds[b]);
+        left_count += bin_count[b];
+        if(left_count == 0 || left_count == count) continue;
+        const float cost = left_count * aabb_area(&left) + right_cost[b + 1];
+        if(cost < best_cost) {
+            best_cost = cost;
+            best_bin = b;
+        }
+    }
+
+    if(best_bin < 0) return first + count / 2;
+
+    // partition indices around the chosen plane
+    unsigned int l = first, r = first + count;
+    while(l < r) {
+        b = (int)((centroid(&state->bounds[indices[l]], axis) - lo) * scale);
+        if(b >= BVH_SAH_BINS) b = BVH_SAH_BINS - 1;
+        if(b <= best_bin) {
+            l++;
+        } else {
+            const unsigned int tmp = indices[l];
+            indices[l] = indices[--r];
+            indices[r] = tmp;
+        }
+    }
+    return l;
+}
+
+/**
+ * Builds the subtree of [first, first + count) at node_index, depth levels
+ * below the root. SAH splits that would leave a half too many items to fit
+ * under max_depth give way to median splits.
+ */
+static void bvh_subdivide(BuildState* state, unsigned int node_index, unsigned int first, unsigned int count,
+        unsigned int depth) {
+    BVHNode* node = &state->nodes[node_index];
+    AABB box;
+    unsigned int i;
+
+    aabb_empty(&box);
+    for(i = first; i < first + count; i++)
+        aabb_grow(&box, &state->bounds[state->indices[i]]);
+
+    for(i = 0; i < 3; i++) {
+        node->bmin[i] = box.bmin[i];
+        node->bmax[i] = box.bmax[i];
+    }
+
+    if(count <= state->max_leaf) {
+        assert(depth <= state->max_depth);
+        node->left_first = first;
+        node->count = count;
+        return;
+    }
+
+    unsigned int mid = bvh_split(state, first, count);
+    const unsigned int larger = mid - first > first + count - mid ? mid - first : first + count - mid;
+    if(depth + 1 + balanced_depth(larger, state->max_leaf) > state->max_depth)
+        mid = bvh_median_split(state, first, count);
+    const unsigned int left = state->node_count;
+    state->node_count += 2;
+
+    node->left_first = left;
+    node->count = 0;
+
+    bvh_subdivide(state, left, first, mid - first, depth + 1);
+    bvh_subdivide(state, left + 1, mid, first + count - mid, depth + 1);
+}
+
+/**
+ * Builds a binary SAH BVH over count bounding boxes, no leaf deeper than
+ * max_depth so kernels can walk it with a fixed stack: BVH_MAX_DEPTH for
+ * trees traversed as they are, BVH8_MAX_DEPTH for bvh_collapse.
+ * nodes must have room for 2 * count - 1 entries, the root is nodes[0].
+ * On return indices holds the item order the leaves refer to.
+ * Returns the number of nodes written.
+ */
+unsigned int bvh_build(const AABB* bounds, unsigned int count, unsigned int max_leaf, unsigned int max_depth,
+        BVHNode* nodes, unsigned int* indices) {
+    BuildState state;
+    unsigned int i;
+
+    for(i = 0; i < count; i++) indices[i] = i;
+    if(count == 0) return 0;
+
+    state.bounds = bounds;
+    state.indices = indices;
+    state.nodes = nodes;
+    state.node_count = 1;
+    state.max_leaf = max_leaf < 1 ? 1 : max_leaf;
+    state.max_depth = max_depth;
+
+    assert(balanced_depth(count, state.max_leaf) <= max_depth);
+    bvh_subdivide(&state, 0, 0, count, 0);
+    return state.node_count;
+}
+
+typedef struct {
+    const BVHNode* nodes;
+    const unsigned int* indices;
+    BVH8Node* wide;
+    unsigned int* order;
+    unsigned int wide_count;
+    unsigned int prim_count;
+} CollapseState;
+
+static void node_bounds(const BVHNode* node, AABB* box) {
+    int a;
+    for(a = 0; a < 3; a++) {
+        box->bmin[a] = node->bmin[a];
+        box->bmax[a] = node->bmax[a];
+    }
+}
+
+/**
+ * Copies child slot from of src to slot to of dst.
+ */
+static void bvh8_copy_slot(BVH8Node* dst, int to, const BVH8Node* src, int from) {
+    dst->meta[to] = src->meta[from];
+    dst->qlo_x[to] = src->qlo_x[from];
+    dst->qlo_y[to] = src->qlo_y[from];
+    dst->qlo_z[to] = src->qlo_z[from];
+    dst->qhi_x[to] = src->qhi_x[from];
+    dst->qhi_y[to] = src->qhi_y[from];
+    dst->qhi_z[to] = src->qhi_z[from];
+    dst->imask = (cl_uchar)((dst->imask & ~(1 << to)) | (((src->imask >> from) & 1) << to));
+}
+
+/**
+ * Fills wide node wide_index from the binary subtree at binary_index.
+ * Interior children with the largest surface area are opened until the
+ * node has BVH8_WIDTH children or only leaves remain.
+ * Returns the most stack entries traversal holds below the node once it
+ * is popped. Kernels push interior children in slot order, so the slots
+ * are sorted by what their subtrees need, most first: the deepest subtree
+ * then has no siblings waiting under it.
+ */
+static unsigned int bvh8_fill(CollapseState* state, unsigned int wide_index, unsigned int binary_index) {
+    const BVHNode* nodes = state->nodes;
+    BVH8Node* wide = &state->wide[wide_index];
+    unsigned int children[BVH8_WIDTH];
+    int n = 0, i, a;
+
+    if(nodes[binary_index].count > 0) {
+        children[n++] = binary_index;
+    } else {
+        children[n++] = nodes[binary_index].left_first;
+        children[n++] = nodes[binary_index].left_first + 1;
+    }
+
+    while(n < BVH8_WIDTH) {
+        int best = -1;
+        float best_area = -1;
+        for(i = 0; i < n; i++) {
+            AABB box;
+            if(nodes[children[i]].count > 0) continue;
+            node_bounds(&nodes[children[i]], &box);
+            if(aabb_area(&box) > best_area) {
+                best_area = aabb_area(&box);
+                best = i;
+            }
+        }
+        if(best < 0) break;
+        const unsigned int opened = children[best];
+        children[best] = nodes[opened].left_first;
+        children[n++] = nodes[opened].left_first + 1;
+    }
+
+    // quantisation grid over the union of the children
+    AABB box;
+    aabb_empty(&box);
+    for(i = 0; i < n; i++) {
+        AABB child;
+        node_bounds(&nodes[children[i]], &child);
+        aabb_grow(&box, &child);
+    }
+
+    float scale[3];
+    memset(wide, 0, sizeof(BVH8Node));
+    for(a = 0; a < 3; a++) {
+        int e;
+        wide->p[a] = box.bmin[a];
+        frexpf((box.bmax[a] - box.bmin[a]) / 255.0f, &e);
+        if(e < -126) e = -126;
+        if(e > 127) e = 127;
+        wide->e[a] = (cl_uchar)(e + 127);
+        scale[a] = ldexpf(1.0f, e);
+    }
+
+    // interior children are stored next to each other
+    unsigned int interior = 0;
+    for(i = 0; i < n; i++)
+        if(nodes[children[i]].count == 0) interior++;
+    wide->child_base = state->wide_count;
+    wide->prim_base = state->prim_count;
+    state->wide_count += interior;
+
+    unsigned int next_child = 0;
+    cl_uchar* qlo[3] = { wide->qlo_x, wide->qlo_y, wide->qlo_z };
+    cl_uchar* qhi[3] = { wide->qhi_x, wide->qhi_y, wide->qhi_z };
+    for(i = 0; i < n; i++) {
+        const BVHNode* child = &nodes[children[i]];
+        for(a = 0; a < 3; a++) {
+            const float lo = floorf((child->bmin[a] - wide->p[a]) / scale[a]);
+            const float hi = ceilf((child->bmax[a] - wide->p[a]) / scale[a]);
+            qlo[a][i] = (cl_uchar)(lo < 0 ? 0 : lo > 255 ? 255 : lo);
+            qhi[a][i] = (cl_uchar)(hi < 0 ? 0 : hi > 255 ? 255 : hi);
+        }
+
+        if(child->count > 0) {
+            unsigned int p;
+            wide->meta[i] = (cl_uchar)((child->count << 5) | (state->prim_count - wide->prim_base));
+            for(p = child->left_first; p < child->left_first + child->count; p++)
+                state->order[state->prim_count++] = state->indices[p];
+        } else {
+            wide->imask |= 1 << i;
+            wide->meta[i] = (cl_uchar)next_child++;
+        }
+    }
+
+    unsigned int need[BVH8_WIDTH];
+    next_child = 0;
+    for(i = 0; i < n; i++) {
+        need[i] = 0;
+        if(nodes[children[i]].count > 0) continue;
+        need[i] = bvh8_fill(state, state->wide[wide_index].child_base + next_child++, children[i]);
+    }
+
+    // slot order by need, interior children before leaves
+    int slots[BVH8_WIDTH];
+    for(i = 0; i < n; i++) {
+        int j = i;
+        while(j > 0) {
+            const int prev = slots[j - 1];
+            const int prev_interior = nodes[children[prev]].count == 0;
+            const int interior = nodes[children[i]].count == 0;
+            if(prev_interior > interior || (prev_interior == interior && need[prev] >= need[i])) break;
+            slots[j] = prev;
+            j--;
+        }
+        slots[j] = i;
+    }
+
+    const BVH8Node unsorted = state->wide[wide_index];
+    unsigned int pushed = 0, result = 0;
+    for(i = 0; i < n; i++) {
+        bvh8_copy_slot(&state->wide[wide_index], i, &unsorted, slots[i]);
+        if(nodes[children[slots[i]]].count > 0) continue;
+        // pushed siblings wait below the child while its subtree is walked
+        if(pushed + need[slots[i]] > result) result = pushed + need[slots[i]];
+        pushed++;
+    }
+    return pushed > result ? pushed : result;
+}
+
+/**
+ * Collapses a binary BVH from bvh_build into compressed 8 wide nodes.
+ * wide needs room for one node per binary interior node (at least one).
+ * Leaves of a wide node reference consecutive primitives, order receives
+ * the item order they expect. Returns the number of wide nodes written.
+ */
+unsigned int bvh_collapse(const BVHNode* nodes, const unsigned int* indices, BVH8Node* wide, unsigned int* order) {
+    CollapseState state;
+
+    state.nodes = nodes;
+    state.indices = indices;
+    state.wide = wide;
+    state.order = order;
+    state.wide_count = 1;
+    state.prim_count = 0;
+
+    // the root is pushed before the walk starts
+    const unsigned int stack = bvh8_fill(&state, 0, 0);
+    assert((stack > 1 ? stack : 1) <= BVH_STACK_SIZE);
+    return state.wide_count;
+}
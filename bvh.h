@@ -0,0 +1,103 @@
+#ifndef BVH_H
+#define BVH_H
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+// largest number of primitives stored in a bottom level leaf
+#define BVH_MAX_LEAF_SIZE 4
+// number of centroid bins evaluated per split
+#define BVH_SAH_BINS 12
+// children per compressed node
+#define BVH8_WIDTH 8
+// traversal stack entries per ray, must match STACK_SIZE in kernels/trace.cl
+#ifndef BVH_STACK_SIZE
+#define BVH_STACK_SIZE 64
+#endif
+// deepest leaf of a binary BVH, its traversal then never holds more than
+// BVH_STACK_SIZE nodes
+#define BVH_MAX_DEPTH (BVH_STACK_SIZE - 1)
+// deepest leaf of a binary BVH collapsed by bvh_collapse: a wide node adds at
+// most 7 stack entries for every 3 binary levels it spans
+#define BVH8_MAX_DEPTH (3 * BVH_STACK_SIZE / 7)
+
+// leaf metadata packs the primitive count in 3 bits and its offset in 5
+#if BVH_MAX_LEAF_SIZE * (BVH8_WIDTH - 1) > 31
+#error "BVH_MAX_LEAF_SIZE too large for BVH8Node leaf offsets"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    float bmin[3];
+    float bmax[3];
+} AABB;
+
+/**
+ * Binary BVH node, 32 bytes. Must match BVHNode in kernels/scene.cl.
+ * Interior nodes have count == 0 and their children at left_first and
+ * left_first + 1, leaves reference count items starting at left_first.
+ */
+typedef struct {
+    cl_float bmin[3];
+    cl_uint left_first;
+    cl_float bmax[3];
+    cl_uint count;
+} BVHNode;
+
+/**
+ * Compressed 8 wide node, 80 bytes. Must match BVH8Node in kernels/scene.cl.
+ * Child boxes are stored as 8 bit offsets on a grid anchored at p with a
+ * power of two cell size 2^(e - 127) per axis, rounded outwards.
+ * Interior children (imask bit set) are child_base + (meta & 31).
+ * Leaf children hold meta >> 5 primitives from prim_base + (meta & 31),
+ * a meta of 0 marks an empty slot.
+ */
+typedef struct {
+    cl_float p[3];
+    cl_uchar e[3];
+    cl_uchar imask;
+    cl_uint child_base;
+    cl_uint prim_base;
+    cl_uchar meta[BVH8_WIDTH];
+    cl_uchar qlo_x[BVH8_WIDTH];
+    cl_uchar qlo_y[BVH8_WIDTH];
+    cl_uchar qlo_z[BVH8_WIDTH];
+    cl_uchar qhi_x[BVH8_WIDTH];
+    cl_uchar qhi_y[BVH8_WIDTH];
+    cl_uchar qhi_z[BVH8_WIDTH];
+} BVH8Node;
+
+/**
+ * Binary node written by the device LBVH builder in kernels/lbvh.cl, only
+ * declared here for buffer sizing. Children with LBVH_LEAF set are
+ * primitives of the mesh, others are nodes relative to the mesh root.
+ */
+typedef struct {
+    cl_float bmin[3];
+    cl_uint left;
+    cl_float bmax[3];
+    cl_uint right;
+} LBVHNode;
+
+#define LBVH_LEAF 0x80000000u
+
+void aabb_empty(AABB* box);
+void aabb_grow(AABB* box, const AABB* other);
+void aabb_grow_point(AABB* box, const float p[3]);
+float aabb_area(const AABB* box);
+
+unsigned int bvh_build(const AABB* bounds, unsigned int count, unsigned int max_leaf, unsigned int max_depth,
+    BVHNode* nodes, unsigned int* indices);
+unsigned int bvh_collapse(const BVHNode* nodes, const unsigned int* indices, BVH8Node* wide, unsigned int* order);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
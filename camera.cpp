@@ -0,0 +1,92 @@
+#include <math.h>
+
+#include "camera.h"
+
+static cl_float4 make_float4(float x, float y, float z, float w) {
+    cl_float4 v;
+    v.s[0] = x;
+    v.s[1] = y;
+    v.s[2] = z;
+    v.s[3] = w;
+    return v;
+}
+
+/**
+ * The view the tracer always had: 0.95 behind the origin looking down +z,
+ * with an image plane half a unit high at the origin.
+ */
+void camera_defaults(Camera* camera) {
+    camera->position[0] = 0;
+    camera->position[1] = 0;
+    camera->position[2] = -0.95f;
+    camera->yaw = 0;
+    camera->pitch = 0;
+    camera->fov = 2.0f * atanf(0.25f / 0.95f);
+    camera->aperture = 0;
+    camera->focus_distance = 1.0f;
+}
+
+static void camera_axes(const Camera* camera, float* forward, float* right, float* up) {
+    const float cy = cosf(camera->yaw), sy = sinf(camera->yaw);
+    const float cp = cosf(camera->pitch), sp = sinf(camera->pitch);
+    forward[0] = sy * cp;
+    forward[1] = sp;
+    forward[2] = cy * cp;
+    right[0] = cy;
+    right[1] = 0;
+    right[2] = -sy;
+    // forward x right
+    up[0] = forward[1] * right[2] - forward[2] * right[1];
+    up[1] = forward[2] * right[0] - forward[0] * right[2];
+    up[2] = forward[0] * right[1] - forward[1] * right[0];
+}
+
+/**
+ * Moves the camera along its own axes.
+ */
+void camera_move(Camera* camera, float forward, float right, float up) {
+    float f[3], r[3], u[3];
+    int i;
+    camera_axes(camera, f, r, u);
+    for(i = 0; i < 3; i++) camera->position[i] += forward * f[i] + right * r[i] + up * u[i];
+}
+
+/**
+ * Turns by yaw and pitch radians, pitch is clamped short of the poles.
+ */
+void camera_turn(Camera* camera, float yaw, float pitch) {
+    camera->yaw = fmodf(camera->yaw + yaw, 2.0f * (float)M_PI);
+    camera->pitch = fminf(fmaxf(camera->pitch + pitch, -CAMERA_MAX_PITCH), CAMERA_MAX_PITCH);
+}
+
+/**
+ * Scales the field of view, below 1 zooms in.
+ */
+void camera_zoom(Camera* camera, float scale) {
+    camera->fov = fminf(fmaxf(camera->fov * scale, CAMERA_MIN_FOV), CAMERA_MAX_FOV);
+}
+
+/**
+ * Ray basis of the camera for a width x height frame, computed once per
+ * frame so the kernels only do a multiply-add per pixel.
+ */
+void camera_basis(const Camera* camera, unsigned int width, unsigned int height, CameraBasis* basis) {
+    const float plane_height = 2.0f * tanf(0.5f * camera->fov);
+    const float plane_width = plane_height * width / height;
+    const float dx = plane_width / width, dy = plane_height / height;
+    float f[3], r[3], u[3];
+    camera_axes(camera, f, r, u);
+
+    basis->position = make_float4(camera->position[0], camera->position[1], camera->position[2], 0);
+    basis->right = make_float4(r[0], r[1], r[2], 0);
+    basis->up = make_float4(u[0], u[1], u[2], 0);
+    basis->forward = make_float4(f[0], f[1], f[2], 0);
+    basis->pixel_dx = make_float4(dx * r[0], dx * r[1], dx * r[2], 0);
+    basis->pixel_dy = make_float4(dy * u[0], dy * u[1], dy * u[2], 0);
+    // half a pixel in from the lower left corner of the plane
+    const float cx = 0.5f * (dx - plane_width), cy = 0.5f * (dy - plane_height);
+    basis->corner = make_float4(f[0] + cx * r[0] + cy * u[0], f[1] + cx * r[1] + cy * u[1], f[2] + cx * r[2] + cy * u[2], 0);
+    basis->lens_radius = camera->aperture;
+    basis->focus_distance = camera->focus_distance;
+    basis->pad[0] = basis->pad[1] = 0;
+}
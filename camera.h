@@ -0,0 +1,64 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+// pitch stops short of straight up or down, where yaw is undefined
+#define CAMERA_MAX_PITCH 1.55f
+#define CAMERA_MIN_FOV 0.1f
+#define CAMERA_MAX_FOV 2.5f
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Camera state the controls edit. Yaw turns about +y and pitch tilts
+ * toward it, both 0 look down +z with +x to the right. fov is the vertical
+ * field of view, angles are in radians. aperture is the lens radius and
+ * focus_distance how far in front of it the image is sharp, an aperture
+ * of 0 is a pinhole.
+ */
+typedef struct {
+    float position[3];
+    float yaw;
+    float pitch;
+    float fov;
+    float aperture;
+    float focus_distance;
+} Camera;
+
+/**
+ * Camera as the kernels use it, CameraBasis in kernels/scene.cl. The ray
+ * through pixel (x, y) points along corner + x * pixel_dx + y * pixel_dy,
+ * corner being the centre of pixel (0, 0) on the image plane one unit in
+ * front of position.
+ */
+typedef struct {
+    cl_float4 position;
+    cl_float4 right;
+    cl_float4 up;
+    cl_float4 forward;
+    cl_float4 corner;
+    cl_float4 pixel_dx;
+    cl_float4 pixel_dy;
+    cl_float lens_radius;
+    cl_float focus_distance;
+    cl_float pad[2];
+} CameraBasis;
+
+void camera_defaults(Camera* camera);
+void camera_move(Camera* camera, float forward, float right, float up);
+void camera_turn(Camera* camera, float yaw, float pitch);
+void camera_zoom(Camera* camera, float scale);
+void camera_basis(const Camera* camera, unsigned int width, unsigned int height, CameraBasis* basis);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,3 +1,6 @@
+#include <assert.h>
+#include <math.h>
+
 #include "compute.h"
 
 void cl_info() {
@@ -163,63 +166,233 @@ void cl_select_context(cl_platform_id* platform, cl_device_id* device, cl_contex
 #endif
 }
 
-void cl_load_kernel(cl_context* context, cl_device_id* device, const char* source, cl_command_queue* command_queue, cl_kernel* kernel) {
-    cl_mem memobj;
-    cl_int err;
-    cl_program program;
-    char string[MEM_SIZE];
-
-    FILE *fp;
-    char *source_str;
-    size_t source_size;
+/**
+ * Reads a whole file into a new nul terminated buffer, NULL on failure.
+ */
+static char* cl_read_source(const char* path, size_t* size) {
+    FILE* fp = fopen(path, "rb");
+    char* source;
+    long length;
 
-    /* Load the source code containing the kernel*/
-    fp = fopen(source, "r");
-    if (!fp) {
-        fprintf(stderr, "Failed to load kernel.\n");
-        exit(1);
+    if(!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if(length < 0) {
+        fclose(fp);
+        return NULL;
     }
-    source_str = (char *) malloc(MAX_SOURCE_SIZE);
-    source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
+
+    source = (char*) malloc(length + 1);
+    *size = fread(source, 1, length, fp);
+    source[*size] = 0;
     fclose(fp);
+    return source;
+}
+
+/**
+ * Builds a program from one or more source files, compiled as if they were
+ * concatenated in order, with optional build options. On failure the build
+ * log is printed, *program is left NULL and the error returned, so callers
+ * decide whether it is fatal. Safe to call from a worker thread.
+ */
+cl_int cl_build_program(cl_context* context, cl_device_id* device, const char** sources, unsigned int num_sources, const char* options, cl_program* program) {
+    cl_int err = CL_SUCCESS;
+    unsigned int i;
+
+    char **source_str = (char **) calloc(num_sources, sizeof(char*));
+    size_t *source_size = (size_t *) calloc(num_sources, sizeof(size_t));
+    *program = NULL;
+
+    /* Load the source code containing the kernels */
+    for(i = 0; i < num_sources; i++) {
+        source_str[i] = cl_read_source(sources[i], &source_size[i]);
+        if(!source_str[i]) {
+            fprintf(stderr, "Failed to load kernel %s.\n", sources[i]);
+            err = CL_INVALID_VALUE;
+        }
+    }
+
+    /* Create Kernel Program from the source */
+    if(err == CL_SUCCESS) {
+        *program = clCreateProgramWithSource(*context, num_sources, (const char **) source_str,
+                (const size_t *) source_size, &err);
+        CHECK_ERR(err);
+    }
 
-    // create a command queue
+    for(i = 0; i < num_sources; i++) free(source_str[i]);
+    free(source_str);
+    free(source_size);
+    if(err != CL_SUCCESS) return err;
+
+    /* Build Kernel Program */
+    err = clBuildProgram(*program, 1, device, options, NULL, NULL);
+    if(err != CL_SUCCESS) {
+        size_t len = 0;
+        cl_int log_err = clGetProgramBuildInfo(*program, *device, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
+        CHECK_ERR(log_err);
+        char* log = (char*) malloc(len + 1);
+        log[0] = 0;
+        log_err = clGetProgramBuildInfo(*program, *device, CL_PROGRAM_BUILD_LOG, len, log, NULL);
+        CHECK_ERR(log_err);
+        log[len] = 0;
+        printf("Build Log:\n%s\n", log);
+        free(log);
+
+        clReleaseProgram(*program);
+        *program = NULL;
+    }
+    return err;
+}
+
+void cl_create_queue(cl_context* context, cl_device_id* device, cl_command_queue* command_queue) {
+    cl_int err;
     *command_queue = clCreateCommandQueue(*context, *device, 0, &err);
     CHECK_ERR(err);
+}
 
+/**
+ * Writes the -D options that specialise kernels/trace.cl for config.
+ */
+void cl_kernel_options(const KernelConfig* config, char* options, size_t size) {
+    snprintf(options, size, "-DAA_GRID=%u -DMAX_BOUNCES=%u -DSHADOWS=%d -DNUM_PLANES=%u -DFRAME_STORAGE=%u -DAOVS=%u -DADAPTIVE=%d -DSAMPLER=%u -DENV_SAMPLES=%u -DMOTION_BLUR=%d",
+        config->aa_grid, config->max_bounces, config->shadows ? 1 : 0, config->num_planes, config->storage, config->aovs,
+        config->adaptive ? 1 : 0, config->sampler, config->env_samples, config->motion_blur ? 1 : 0);
+}
 
-    memobj = clCreateBuffer(*context, CL_MEM_READ_WRITE, MEM_SIZE * sizeof(char), NULL, &err);
-    CHECK_ERR(err);
+/**
+ * Adds a built program to the cache. A full cache evicts the oldest
+ * variant, kernels created from it stay valid.
+ */
+void cl_cache_store(KernelCache* cache, const KernelConfig* config, cl_program program) {
+    const unsigned int i = cache->count % KERNEL_CACHE_SIZE;
+    if(cache->count >= KERNEL_CACHE_SIZE) clReleaseProgram(cache->programs[i]);
+    cache->configs[i] = *config;
+    cache->programs[i] = program;
+    cache->count++;
+}
+
+/**
+ * Drops every cached variant, used when the sources change.
+ */
+void cl_cache_clear(KernelCache* cache) {
+    const unsigned int stored = cache->count < KERNEL_CACHE_SIZE ? cache->count : KERNEL_CACHE_SIZE;
+    unsigned int i;
+    for(i = 0; i < stored; i++) clReleaseProgram(cache->programs[i]);
+    cache->count = 0;
+}
+
+/**
+ * Returns the program built for config, building it on first use.
+ * Returns NULL if the variant fails to build.
+ */
+cl_program cl_cached_program(cl_context* context, cl_device_id* device, KernelCache* cache, const char** sources, unsigned int num_sources, const KernelConfig* config) {
+    const unsigned int stored = cache->count < KERNEL_CACHE_SIZE ? cache->count : KERNEL_CACHE_SIZE;
+    cl_program program;
+    char options[256];
+    unsigned int i;
+
+    for(i = 0; i < stored; i++)
+        if(memcmp(&cache->configs[i], config, sizeof(KernelConfig)) == 0)
+            return cache->programs[i];
+
+    cl_kernel_options(config, options, sizeof(options));
+    printf("Building kernel variant: %s\n", options);
+    if(cl_build_program(context, device, sources, num_sources, options, &program) != CL_SUCCESS) return NULL;
+
+    cl_cache_store(cache, config, program);
+    return program;
+}
 
-    /* Create Kernel Program from the sour
-    ce */
-    program = clCreateProgramWithSource(*context, 1, (const char **) &source_str,
-            (const size_t *) &source_size, &err);
+/**
+ * Selects the program variant for config and creates its pixel kernel,
+ * releasing the previous one. Arguments have to be set again afterwards.
+ * If the variant fails to build the current program and kernel are kept.
+ */
+cl_int cl_load_kernel(cl_context* context, cl_device_id* device, KernelCache* cache, const char** sources, unsigned int num_sources, const KernelConfig* config, cl_program* program, cl_kernel* kernel) {
+    cl_program variant = cl_cached_program(context, device, cache, sources, num_sources, config);
+    cl_int err;
+
+    if(!variant) return CL_BUILD_PROGRAM_FAILURE;
+
+    /* Create OpenCL Kernel */
+    cl_kernel created = clCreateKernel(variant, "pixel_kernel", &err);
     CHECK_ERR(err);
+    if(err != CL_SUCCESS) return err;
 
+    if(*kernel) clReleaseKernel(*kernel);
+    *program = variant;
+    *kernel = created;
+    return CL_SUCCESS;
+}
 
-    /* Build Kernel Program */
-    err = clBuildProgram(program, 1, device, NULL, NULL, NULL);
+/**
+ * Builds sources and registers their entry point under name. Returns the
+ * build error and registers nothing if it fails.
+ */
+cl_int cl_registry_add(cl_context* context, cl_device_id* device, KernelRegistry* registry, const char* name, const char** sources, unsigned int num_sources, const char* entry) {
+    const unsigned int i = registry->count;
+    cl_int err;
+
+    if(i >= KERNEL_REGISTRY_SIZE) {
+        fprintf(stderr, "Kernel registry full, %s not added.\n", name);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    err = cl_build_program(context, device, sources, num_sources, NULL, &registry->programs[i]);
+    if(err != CL_SUCCESS) return err;
+
+    registry->kernels[i] = clCreateKernel(registry->programs[i], entry, &err);
+    CHECK_ERR(err);
     if(err != CL_SUCCESS) {
-        size_t len;
-        cl_build_status build_status;
-        char buffer[204800];
-        err = clGetProgramBuildInfo(program, *device, CL_PROGRAM_BUILD_STATUS, sizeof(build_status), (void *)&build_status, &len);
-        CHECK_ERR(err);
-        err = clGetProgramBuildInfo(program, *device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
-        CHECK_ERR(err);
-        printf("Build Log:\n%s\n", buffer);
-        exit(1);
+        clReleaseProgram(registry->programs[i]);
+        return err;
     }
 
-    /* Create OpenCL Kernel */
-    *kernel = clCreateKernel(program, "pixel_kernel", &err);
+    registry->names[i] = name;
+    registry->count++;
+    return CL_SUCCESS;
+}
+
+/**
+ * Looks a registered kernel up by name, NULL if there is none.
+ */
+cl_kernel cl_registry_find(KernelRegistry* registry, const char* name) {
+    unsigned int i;
+    for(i = 0; i < registry->count; i++)
+        if(strcmp(registry->names[i], name) == 0) return registry->kernels[i];
+    return NULL;
+}
+
+/**
+ * Runs a registered image kernel on the columns from x_offset onwards, so
+ * it can overwrite part of a frame another kernel rendered.
+ */
+void cl_run_image_kernel(cl_command_queue* command_queue, cl_kernel* kernel, cl_mem* texture_cl, unsigned int width, unsigned int height, unsigned int x_offset, float time) {
+    cl_int err;
+
+    err = clEnqueueAcquireGLObjects(*command_queue, 1, texture_cl, 0,0,0);
+    CHECK_ERR(err);
+
+    size_t offset[] = {x_offset, 0};
+    size_t work[] = {width - x_offset, height};
+    cl_set_constant_args(kernel, texture_cl, width, height);
+    err = clSetKernelArg(*kernel, 3, sizeof(float), &time);
+    CHECK_ERR(err);
+
+    err = clEnqueueNDRangeKernel(*command_queue, *kernel, 2, offset, work, NULL, 0,0,0 );
+    CHECK_ERR(err);
+
+    err = clEnqueueReleaseGLObjects(*command_queue, 1, texture_cl, 0,0,0);
+    CHECK_ERR(err);
+
+    err = clFinish(*command_queue);
     CHECK_ERR(err);
 }
 
-void cl_set_constant_args(cl_kernel * kernel, cl_mem* cl_texture, unsigned int width, unsigned int height) {
+void cl_set_constant_args(cl_kernel * kernel, cl_mem* output, unsigned int width, unsigned int height) {
     cl_int err;
-    err = clSetKernelArg(*kernel, 0, sizeof(cl_mem), (void*)cl_texture);
+    err = clSetKernelArg(*kernel, 0, sizeof(cl_mem), (void*)output);
     CHECK_ERR(err);
     err = clSetKernelArg(*kernel, 1,  sizeof(unsigned int), &width);
     CHECK_ERR(err);
@@ -251,26 +424,1135 @@ void cl_create_texture(cl_context *context, GLuint *texture, cl_mem *cl_texture,
     CHECK_ERR(err);
 }
 
-float anim = 0;
-void cl_run_kernel(cl_command_queue* command_queue, cl_kernel* kernel, cl_mem*texture_cl, unsigned int width, unsigned int height) {
+/**
+ * Creates a read only buffer initialised from host memory.
+ * Empty arrays still get a small buffer so every kernel argument is valid.
+ */
+static cl_mem cl_create_input_buffer(cl_context* context, size_t size, void* data) {
     cl_int err;
-    // map OpenGL buffer object for writing from OpenCL
-    //glFinish();
-    err = clEnqueueAcquireGLObjects(*command_queue, 1, texture_cl, 0,0,0);
+    cl_mem buffer;
+    if(size == 0)
+        buffer = clCreateBuffer(*context, CL_MEM_READ_ONLY, 16, NULL, &err);
+    else
+        buffer = clCreateBuffer(*context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, data, &err);
     CHECK_ERR(err);
+    return buffer;
+}
 
-    // Set arg 3 and execute the kernel
-    size_t work[] = {width, height};
-    anim = (anim + 0.01);
-    err = clSetKernelArg(*kernel, 3, sizeof(float), &anim);
+/**
+ * Uploads the scene. Meshes and their bottom level BVHs are only written
+ * here, instances and the top level BVH are refreshed by cl_update_instances.
+ */
+void cl_create_scene_buffers(cl_context* context, Scene* scene, SceneBuffers* buffers) {
+    cl_int err;
+    buffers->planes = cl_create_input_buffer(context, sizeof(Primitive) * scene->num_planes, scene->planes);
+    buffers->prims = cl_create_input_buffer(context, sizeof(Primitive) * scene->num_prims, scene->prims);
+    buffers->meshes = cl_create_input_buffer(context, sizeof(Mesh) * scene->num_meshes, scene->meshes);
+    buffers->blas_nodes = cl_create_input_buffer(context, sizeof(BVH8Node) * scene->num_blas_nodes, scene->blas_nodes);
+    buffers->instances = cl_create_input_buffer(context, sizeof(Instance) * scene->num_instances, scene->instances);
+    buffers->instances_close = cl_create_input_buffer(context, sizeof(Instance) * scene->num_instances, scene->instances_close);
+    buffers->prev_instances = cl_create_input_buffer(context, sizeof(Instance) * scene->num_instances, scene->instances);
+    buffers->tlas_nodes = cl_create_input_buffer(context, sizeof(BVHNode) * scene->num_tlas_nodes, scene->tlas_nodes);
+    buffers->materials = cl_create_input_buffer(context, sizeof(Material) * scene->num_materials, scene->materials);
+    buffers->lights = cl_create_input_buffer(context, sizeof(Light) * scene->num_lights, scene->lights);
+    buffers->env_info = cl_create_input_buffer(context, sizeof(EnvironmentInfo), &scene->environment.info);
+    buffers->env_texels = cl_create_input_buffer(context,
+        sizeof(cl_uint) * scene->environment.info.width * scene->environment.info.height, scene->environment.texels);
+    buffers->env_cdf = cl_create_input_buffer(context,
+        scene->environment.info.width > 0 ? sizeof(float) * environment_cdf_size(&scene->environment) : 0, scene->environment.cdf);
+
+    // written by the LBVH builder every frame
+    buffers->dynamic_nodes = clCreateBuffer(*context, CL_MEM_READ_WRITE,
+        sizeof(LBVHNode) * (scene->num_dynamic_nodes > 0 ? scene->num_dynamic_nodes : 1), NULL, &err);
     CHECK_ERR(err);
+    buffers->camera = clCreateBuffer(*context, CL_MEM_READ_ONLY, 2 * sizeof(CameraBasis), NULL, &err);
+    CHECK_ERR(err);
+
+    printf("Scene: %u meshes, %u instances, %u primitives, %u BLAS nodes, %u TLAS nodes, %u materials, %u lights\n",
+        scene->num_meshes, scene->num_instances, scene->num_prims, scene->num_blas_nodes, scene->num_tlas_nodes,
+        scene->num_materials, scene->num_lights);
+    if(scene->environment.info.width > 0)
+        printf("Environment: %ux%u\n", scene->environment.info.width, scene->environment.info.height);
+}
 
-    err = clEnqueueNDRangeKernel(*command_queue, *kernel, 2, NULL, work, NULL, 0,0,0 );
+/**
+ * Copies the instance transforms a frame was traced with to prev_instances,
+ * once the frame is enqueued. Frames traced again without moving anything
+ * then see no motion.
+ */
+void cl_keep_instances(cl_command_queue* command_queue, Scene* scene, SceneBuffers* buffers) {
+    if(scene->num_instances == 0) return;
+    cl_int err = clEnqueueCopyBuffer(*command_queue, buffers->instances, buffers->prev_instances, 0, 0,
+        sizeof(Instance) * scene->num_instances, 0, NULL, NULL);
     CHECK_ERR(err);
+}
 
-    err = clEnqueueReleaseGLObjects(*command_queue, 1, texture_cl, 0,0,0);
+/**
+ * Writes the camera of the next frame and of the last traced one. Like
+ * cl_update_instances the writes are non blocking, both must stay in place
+ * until the frame finishes.
+ */
+void cl_update_camera(cl_command_queue* command_queue, SceneBuffers* buffers, const CameraBasis* current, const CameraBasis* previous) {
+    cl_int err;
+    err = clEnqueueWriteBuffer(*command_queue, buffers->camera, CL_FALSE, 0, sizeof(CameraBasis), current, 0, NULL, NULL);
     CHECK_ERR(err);
+    err = clEnqueueWriteBuffer(*command_queue, buffers->camera, CL_FALSE, sizeof(CameraBasis), sizeof(CameraBasis), previous, 0, NULL, NULL);
+    CHECK_ERR(err);
+}
 
-    err = clFinish(*command_queue);
+void cl_set_camera_arg(cl_kernel* kernel, cl_uint arg, SceneBuffers* buffers) {
+    cl_int err = clSetKernelArg(*kernel, arg, sizeof(cl_mem), &buffers->camera);
+    CHECK_ERR(err);
+}
+
+/**
+ * Sets the scene buffers as the ten kernel arguments starting at first_arg,
+ * in the order pixel_kernel declares them.
+ */
+void cl_set_scene_args(cl_kernel* kernel, cl_uint first_arg, Scene* scene, SceneBuffers* buffers) {
+    cl_int err;
+    err = clSetKernelArg(*kernel, first_arg, sizeof(cl_mem), &buffers->planes);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 1, sizeof(unsigned int), &scene->num_planes);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 2, sizeof(cl_mem), &buffers->prims);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 3, sizeof(cl_mem), &buffers->meshes);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 4, sizeof(cl_mem), &buffers->blas_nodes);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 5, sizeof(cl_mem), &buffers->instances);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 6, sizeof(unsigned int), &scene->num_instances);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 7, sizeof(cl_mem), &buffers->tlas_nodes);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 8, sizeof(cl_mem), &buffers->dynamic_nodes);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 9, sizeof(cl_mem), &buffers->materials);
+    CHECK_ERR(err);
+}
+
+/**
+ * Sets the environment as the three kernel arguments starting at
+ * first_arg: info, RGB9E5 texels and sampling CDF.
+ */
+void cl_set_environment_args(cl_kernel* kernel, cl_uint first_arg, SceneBuffers* buffers) {
+    cl_int err;
+    err = clSetKernelArg(*kernel, first_arg, sizeof(cl_mem), &buffers->env_info);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 1, sizeof(cl_mem), &buffers->env_texels);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 2, sizeof(cl_mem), &buffers->env_cdf);
+    CHECK_ERR(err);
+}
+
+/**
+ * Sets the area lights and their count as the two kernel arguments
+ * starting at first_arg.
+ */
+void cl_set_light_args(cl_kernel* kernel, cl_uint first_arg, Scene* scene, SceneBuffers* buffers) {
+    cl_int err;
+    err = clSetKernelArg(*kernel, first_arg, sizeof(cl_mem), &buffers->lights);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 1, sizeof(unsigned int), &scene->num_lights);
+    CHECK_ERR(err);
+}
+
+/**
+ * Sets the side of the per light sample grid, see scene_light_grid.
+ */
+void cl_set_light_grid(cl_kernel* kernel, cl_uint arg, unsigned int grid) {
+    cl_int err = clSetKernelArg(*kernel, arg, sizeof(cl_uint), &grid);
+    CHECK_ERR(err);
+}
+
+/**
+ * Sets the instance transforms at shutter close, see scene_set_motion.
+ */
+void cl_set_motion_arg(cl_kernel* kernel, cl_uint arg, SceneBuffers* buffers) {
+    cl_int err = clSetKernelArg(*kernel, arg, sizeof(cl_mem), &buffers->instances_close);
+    CHECK_ERR(err);
+}
+
+/**
+ * Writes instance transforms at shutter open and close and the rebuilt top
+ * level BVH. The writes are non blocking, cl_run_kernel finishes the queue
+ * before the host touches the scene again.
+ */
+void cl_update_instances(cl_command_queue* command_queue, Scene* scene, SceneBuffers* buffers) {
+    cl_int err;
+    if(scene->num_instances == 0) return;
+    err = clEnqueueWriteBuffer(*command_queue, buffers->instances, CL_FALSE, 0,
+        sizeof(Instance) * scene->num_instances, scene->instances, 0, NULL, NULL);
+    CHECK_ERR(err);
+    err = clEnqueueWriteBuffer(*command_queue, buffers->instances_close, CL_FALSE, 0,
+        sizeof(Instance) * scene->num_instances, scene->instances_close, 0, NULL, NULL);
+    CHECK_ERR(err);
+    err = clEnqueueWriteBuffer(*command_queue, buffers->tlas_nodes, CL_FALSE, 0,
+        sizeof(BVHNode) * scene->num_tlas_nodes, scene->tlas_nodes, 0, NULL, NULL);
+    CHECK_ERR(err);
+}
+
+static cl_kernel cl_create_kernel(cl_program program, const char* name) {
+    cl_int err;
+    cl_kernel kernel = clCreateKernel(program, name, &err);
+    CHECK_ERR(err);
+    return kernel;
+}
+
+/**
+ * Builds the scan and sort program with scratch space for arrays of up to
+ * capacity elements. Only core OpenCL 1.1 features are used so the
+ * primitives also run on CPU devices.
+ */
+void cl_primitives_init(cl_context* context, cl_device_id* device, ParallelPrimitives* primitives, unsigned int capacity) {
+    const char* sources[] = { KERNEL_DIR "/scan.cl", KERNEL_DIR "/radix_sort.cl" };
+    // whole radix blocks, so the digit histogram also fits the scan scratch
+    const size_t groups = ((capacity > 0 ? capacity : 1) + RADIX_BLOCK - 1) / RADIX_BLOCK;
+    const size_t n = groups * RADIX_BLOCK;
+    size_t level_size = n;
+    cl_int err;
+    int i;
+
+    if(cl_build_program(context, device, sources, 2, NULL, &primitives->program) != CL_SUCCESS) exit(1);
+    primitives->scan_blocks = cl_create_kernel(primitives->program, "scan_blocks");
+    primitives->scan_add = cl_create_kernel(primitives->program, "scan_add");
+    primitives->compact_scatter = cl_create_kernel(primitives->program, "compact_scatter");
+    primitives->compact_indices = cl_create_kernel(primitives->program, "compact_indices");
+    primitives->histogram32 = cl_create_kernel(primitives->program, "radix_histogram_32");
+    primitives->scatter32 = cl_create_kernel(primitives->program, "radix_scatter_32");
+    primitives->histogram64 = cl_create_kernel(primitives->program, "radix_histogram_64");
+    primitives->scatter64 = cl_create_kernel(primitives->program, "radix_scatter_64");
+
+    for(i = 0; i < SCAN_LEVELS; i++) {
+        level_size = (level_size + SCAN_BLOCK - 1) / SCAN_BLOCK;
+        primitives->block_sums[i] = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * level_size, NULL, &err);
+        CHECK_ERR(err);
+    }
+    primitives->positions = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * n, NULL, &err);
+    CHECK_ERR(err);
+    primitives->hist = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * RADIX_DIGITS * groups, NULL, &err);
+    CHECK_ERR(err);
+    primitives->keys = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_ulong) * n, NULL, &err);
+    CHECK_ERR(err);
+    primitives->values = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * n, NULL, &err);
+    CHECK_ERR(err);
+    primitives->capacity = (unsigned int)n;
+}
+
+/**
+ * Scans one level in blocks, then scans the block totals one level up and
+ * adds them back unless everything fit in a single block.
+ */
+static void cl_scan_level(cl_command_queue* command_queue, ParallelPrimitives* primitives, cl_mem* in, cl_mem* out, cl_uint n, unsigned int level) {
+    const size_t blocks = (n + SCAN_BLOCK - 1) / SCAN_BLOCK;
+    const size_t global = blocks * SCAN_GROUP_SIZE;
+    const size_t local = SCAN_GROUP_SIZE;
+    const size_t items = n;
+    cl_mem* sums = &primitives->block_sums[level];
+    cl_int err;
+
+    err = clSetKernelArg(primitives->scan_blocks, 0, sizeof(cl_mem), in);
+    CHECK_ERR(err);
+    err = clSetKernelArg(primitives->scan_blocks, 1, sizeof(cl_mem), out);
+    CHECK_ERR(err);
+    err = clSetKernelArg(primitives->scan_blocks, 2, sizeof(cl_mem), sums);
+    CHECK_ERR(err);
+    err = clSetKernelArg(primitives->scan_blocks, 3, sizeof(cl_uint), &n);
+    CHECK_ERR(err);
+    err = clEnqueueNDRangeKernel(*command_queue, primitives->scan_blocks, 1, NULL, &global, &local, 0, NULL, NULL);
+    CHECK_ERR(err);
+
+    if(blocks == 1) return;
+    cl_scan_level(command_queue, primitives, sums, sums, (cl_uint)blocks, level + 1);
+
+    err = clSetKernelArg(primitives->scan_add, 0, sizeof(cl_mem), out);
+    CHECK_ERR(err);
+    err = clSetKernelArg(primitives->scan_add, 1, sizeof(cl_mem), sums);
+    CHECK_ERR(err);
+    err = clSetKernelArg(primitives->scan_add, 2, sizeof(cl_uint), &n);
+    CHECK_ERR(err);
+    err = clEnqueueNDRangeKernel(*command_queue, primitives->scan_add, 1, NULL, &items, NULL, 0, NULL, NULL);
+    CHECK_ERR(err);
+}
+
+/**
+ * Exclusive prefix sum of n uints from in to out, which may be the same
+ * buffer. Work is only enqueued.
+ */
+void cl_scan(cl_command_queue* command_queue, ParallelPrimitives* primitives, cl_mem* in, cl_mem* out, unsigned int n) {
+    if(n == 0) return;
+    if(n > primitives->capacity) {
+        fprintf(stderr, "Scan capacity %u too small for %u elements\n", primitives->capacity, n);
+        return;
+    }
+    cl_scan_level(command_queue, primitives, in, out, n, 0);
+}
+
+/**
+ * Copies the values whose flag is non zero to the front of out, keeping
+ * their order, and writes how many there were to count on the device.
+ * With values NULL the indices of the set flags are written instead.
+ * flags must be 0 or 1. Work is only enqueued.
+ */
+void cl_compact(cl_command_queue* command_queue, ParallelPrimitives* primitives, cl_mem* values, cl_mem* flags, cl_mem* out, cl_mem* count, unsigned int n) {
+    static const cl_uint zero = 0;
+    cl_kernel kernel = values ? primitives->compact_scatter : primitives->compact_indices;
+    const size_t global = n;
+    cl_uint items = n;
+    cl_uint arg = 0;
+    cl_int err;
+
+    if(n == 0) {
+        err = clEnqueueWriteBuffer(*command_queue, *count, CL_FALSE, 0, sizeof(cl_uint), &zero, 0, NULL, NULL);
+        CHECK_ERR(err);
+        return;
+    }
+    if(n > primitives->capacity) {
+        fprintf(stderr, "Compaction capacity %u too small for %u elements\n", primitives->capacity, n);
+        return;
+    }
+
+    cl_scan(command_queue, primitives, flags, &primitives->positions, n);
+
+    if(values) {
+        err = clSetKernelArg(kernel, arg++, sizeof(cl_mem), values);
+        CHECK_ERR(err);
+    }
+    err = clSetKernelArg(kernel, arg++, sizeof(cl_mem), flags);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, arg++, sizeof(cl_mem), &primitives->positions);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, arg++, sizeof(cl_uint), &items);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, arg++, sizeof(cl_mem), out);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, arg++, sizeof(cl_mem), count);
+    CHECK_ERR(err);
+    err = clEnqueueNDRangeKernel(*command_queue, kernel, 1, NULL, &global, NULL, 0, NULL, NULL);
+    CHECK_ERR(err);
+}
+
+/**
+ * Stable sort of n keys with uint values in place, RADIX_BITS per pass over
+ * the low key_bits bits. Keys are cl_uint for key_bits up to 32 and cl_ulong
+ * up to 64. An odd pass count costs one extra copy back. Work is only enqueued.
+ */
+void cl_radix_sort(cl_command_queue* command_queue, ParallelPrimitives* primitives, cl_mem* keys, cl_mem* values, unsigned int n, unsigned int key_bits) {
+    const int wide = key_bits > 32;
+    const size_t key_size = wide ? sizeof(cl_ulong) : sizeof(cl_uint);
+    cl_kernel histogram = wide ? primitives->histogram64 : primitives->histogram32;
+    cl_kernel scatter = wide ? primitives->scatter64 : primitives->scatter32;
+    const size_t groups = (n + RADIX_BLOCK - 1) / RADIX_BLOCK;
+    const size_t global = groups * RADIX_GROUP_SIZE;
+    const size_t local = RADIX_GROUP_SIZE;
+    const unsigned int hist_size = (unsigned int)(RADIX_DIGITS * groups);
+    cl_mem key_buffers[2] = { *keys, primitives->keys };
+    cl_mem value_buffers[2] = { *values, primitives->values };
+    cl_uint items = n;
+    cl_uint shift;
+    cl_int err;
+    int in = 0;
+
+    if(n < 2) return;
+    if(n > primitives->capacity || key_bits > 64) {
+        fprintf(stderr, "Radix sort of %u elements with %u bit keys not supported\n", n, key_bits);
+        return;
+    }
+
+    for(shift = 0; shift < key_bits; shift += RADIX_BITS) {
+        err = clSetKernelArg(histogram, 0, sizeof(cl_mem), &key_buffers[in]);
+        CHECK_ERR(err);
+        err = clSetKernelArg(histogram, 1, sizeof(cl_uint), &items);
+        CHECK_ERR(err);
+        err = clSetKernelArg(histogram, 2, sizeof(cl_uint), &shift);
+        CHECK_ERR(err);
+        err = clSetKernelArg(histogram, 3, sizeof(cl_mem), &primitives->hist);
+        CHECK_ERR(err);
+        err = clEnqueueNDRangeKernel(*command_queue, histogram, 1, NULL, &global, &local, 0, NULL, NULL);
+        CHECK_ERR(err);
+
+        cl_scan(command_queue, primitives, &primitives->hist, &primitives->hist, hist_size);
+
+        err = clSetKernelArg(scatter, 0, sizeof(cl_mem), &key_buffers[in]);
+        CHECK_ERR(err);
+        err = clSetKernelArg(scatter, 1, sizeof(cl_mem), &value_buffers[in]);
+        CHECK_ERR(err);
+        err = clSetKernelArg(scatter, 2, sizeof(cl_uint), &items);
+        CHECK_ERR(err);
+        err = clSetKernelArg(scatter, 3, sizeof(cl_uint), &shift);
+        CHECK_ERR(err);
+        err = clSetKernelArg(scatter, 4, sizeof(cl_mem), &primitives->hist);
+        CHECK_ERR(err);
+        err = clSetKernelArg(scatter, 5, sizeof(cl_mem), &key_buffers[1 - in]);
+        CHECK_ERR(err);
+        err = clSetKernelArg(scatter, 6, sizeof(cl_mem), &value_buffers[1 - in]);
+        CHECK_ERR(err);
+        err = clEnqueueNDRangeKernel(*command_queue, scatter, 1, NULL, &global, &local, 0, NULL, NULL);
+        CHECK_ERR(err);
+
+        in = 1 - in;
+    }
+
+    if(in == 1) {
+        err = clEnqueueCopyBuffer(*command_queue, primitives->keys, *keys, 0, 0, key_size * n, 0, NULL, NULL);
+        CHECK_ERR(err);
+        err = clEnqueueCopyBuffer(*command_queue, primitives->values, *values, 0, 0, sizeof(cl_uint) * n, 0, NULL, NULL);
+        CHECK_ERR(err);
+    }
+}
+
+/**
+ * Builds the LBVH program and scratch space for meshes of up to capacity
+ * primitives. Codes are sorted with primitives, which must have at least
+ * the same capacity.
+ */
+void cl_lbvh_init(cl_context* context, cl_device_id* device, LBVHBuilder* builder, ParallelPrimitives* primitives, unsigned int capacity) {
+    const char* sources[] = { KERNEL_DIR "/scene.cl", KERNEL_DIR "/lbvh.cl" };
+    const unsigned int n = capacity > 0 ? capacity : 1;
+    unsigned int index_bits = 0;
+    cl_int err;
+
+    // every Karras node splits at a longer prefix than its parent, of the 30
+    // bit code and then of the index breaking ties, and lbvh_refit never
+    // rotates a subtree taller, which bounds the leaf depth
+    while(index_bits < 32 && (1ull << index_bits) < n) index_bits++;
+    assert(30 + index_bits <= BVH_MAX_DEPTH);
+
+    if(cl_build_program(context, device, sources, 2, NULL, &builder->program) != CL_SUCCESS) exit(1);
+    builder->morton = cl_create_kernel(builder->program, "lbvh_morton");
+    builder->hierarchy = cl_create_kernel(builder->program, "lbvh_hierarchy");
+    builder->refit = cl_create_kernel(builder->program, "lbvh_refit");
+
+    builder->keys = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * n, NULL, &err);
+    CHECK_ERR(err);
+    builder->values = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * n, NULL, &err);
+    CHECK_ERR(err);
+    builder->leaf_bounds = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_float4) * 2 * n, NULL, &err);
+    CHECK_ERR(err);
+    builder->parents = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * 2 * n, NULL, &err);
+    CHECK_ERR(err);
+    builder->visits = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * n, NULL, &err);
+    CHECK_ERR(err);
+    builder->heights = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * n, NULL, &err);
+    CHECK_ERR(err);
+    builder->primitives = primitives;
+    builder->capacity = n < primitives->capacity ? n : primitives->capacity;
+}
+
+/**
+ * Rebuilds the BVH of a dynamic mesh from the primitives already on the
+ * device. Every step is linear in the primitive count: Morton codes, eight
+ * radix passes, Karras hierarchy emission and a bottom up refit that can
+ * also rotate treelets when optimize is set. Work is only enqueued.
+ */
+void cl_lbvh_build(cl_command_queue* command_queue, LBVHBuilder* builder, cl_mem* prims, const Mesh* mesh, cl_mem* nodes, int optimize) {
+    cl_uint n = mesh->prim_count;
+    cl_uint first_prim = mesh->first_prim;
+    cl_uint offset = mesh->root;
+    cl_uint opt = optimize ? 1 : 0;
+    cl_float4 mesh_min, inv_extent;
+    const size_t global = n;
+    cl_int err;
+    int a;
+
+    if(n == 0) return;
+    if(n > builder->capacity) {
+        fprintf(stderr, "LBVH capacity %u too small for %u primitives\n", builder->capacity, n);
+        return;
+    }
+
+    // centroids are quantised relative to the mesh bounds
+    for(a = 0; a < 3; a++) {
+        const float extent = mesh->bmax[a] - mesh->bmin[a];
+        mesh_min.s[a] = mesh->bmin[a];
+        inv_extent.s[a] = extent > 0 ? 1.0f / extent : 0;
+    }
+    mesh_min.s[3] = inv_extent.s[3] = 0;
+
+    err = clSetKernelArg(builder->morton, 0, sizeof(cl_mem), prims);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->morton, 1, sizeof(cl_uint), &first_prim);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->morton, 2, sizeof(cl_uint), &n);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->morton, 3, sizeof(cl_float4), &mesh_min);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->morton, 4, sizeof(cl_float4), &inv_extent);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->morton, 5, sizeof(cl_mem), &builder->keys);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->morton, 6, sizeof(cl_mem), &builder->values);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->morton, 7, sizeof(cl_mem), &builder->leaf_bounds);
+    CHECK_ERR(err);
+    err = clEnqueueNDRangeKernel(*command_queue, builder->morton, 1, NULL, &global, NULL, 0, NULL, NULL);
+    CHECK_ERR(err);
+
+    // Morton codes use the low 30 bits
+    cl_radix_sort(command_queue, builder->primitives, &builder->keys, &builder->values, n, 30);
+
+    err = clSetKernelArg(builder->hierarchy, 0, sizeof(cl_mem), &builder->keys);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->hierarchy, 1, sizeof(cl_mem), &builder->values);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->hierarchy, 2, sizeof(cl_uint), &n);
     CHECK_ERR(err);
-}
\ No newline at end of file
+    err = clSetKernelArg(builder->hierarchy, 3, sizeof(cl_mem), nodes);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->hierarchy, 4, sizeof(cl_uint), &offset);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->hierarchy, 5, sizeof(cl_mem), &builder->parents);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->hierarchy, 6, sizeof(cl_mem), &builder->visits);
+    CHECK_ERR(err);
+    err = clEnqueueNDRangeKernel(*command_queue, builder->hierarchy, 1, NULL, &global, NULL, 0, NULL, NULL);
+    CHECK_ERR(err);
+
+    err = clSetKernelArg(builder->refit, 0, sizeof(cl_mem), nodes);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->refit, 1, sizeof(cl_uint), &offset);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->refit, 2, sizeof(cl_mem), &builder->leaf_bounds);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->refit, 3, sizeof(cl_mem), &builder->parents);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->refit, 4, sizeof(cl_mem), &builder->visits);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->refit, 5, sizeof(cl_mem), &builder->heights);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->refit, 6, sizeof(cl_uint), &n);
+    CHECK_ERR(err);
+    err = clSetKernelArg(builder->refit, 7, sizeof(cl_uint), &opt);
+    CHECK_ERR(err);
+    err = clEnqueueNDRangeKernel(*command_queue, builder->refit, 1, NULL, &global, NULL, 0, NULL, NULL);
+    CHECK_ERR(err);
+}
+
+/**
+ * Uploads the primitives of every dynamic mesh and rebuilds their BVHs.
+ */
+void cl_update_dynamic_meshes(cl_command_queue* command_queue, Scene* scene, SceneBuffers* buffers, LBVHBuilder* builder, int optimize) {
+    unsigned int m;
+    cl_int err;
+
+    for(m = 0; m < scene->num_meshes; m++) {
+        const Mesh* mesh = &scene->meshes[m];
+        if(!(mesh->flags & MESH_DYNAMIC)) continue;
+
+        err = clEnqueueWriteBuffer(*command_queue, buffers->prims, CL_FALSE, sizeof(Primitive) * mesh->first_prim,
+            sizeof(Primitive) * mesh->prim_count, &scene->prims[mesh->first_prim], 0, NULL, NULL);
+        CHECK_ERR(err);
+        cl_lbvh_build(command_queue, builder, &buffers->prims, mesh, &buffers->dynamic_nodes, optimize);
+    }
+}
+
+/**
+ * Bytes per pixel of a STORAGE_* format.
+ */
+size_t cl_storage_size(unsigned int storage) {
+    if(storage == STORAGE_HALF) return sizeof(cl_half) * 4;
+    if(storage == STORAGE_RGBE) return sizeof(cl_uint);
+    return sizeof(cl_float4);
+}
+
+/**
+ * Half storage where the device has cl_khr_fp16, packed RGBE otherwise.
+ */
+unsigned int cl_default_storage(cl_device_id* device) {
+    unsigned int storage = STORAGE_RGBE;
+    size_t extensionSize = 0;
+    cl_int err;
+
+    err = clGetDeviceInfo(*device, CL_DEVICE_EXTENSIONS, 0, NULL, &extensionSize);
+    CHECK_ERR(err);
+    char* extensions = (char*)malloc(extensionSize + 1);
+    err = clGetDeviceInfo(*device, CL_DEVICE_EXTENSIONS, extensionSize, extensions, NULL);
+    CHECK_ERR(err);
+    extensions[extensionSize] = 0;
+    if(strstr(extensions, "cl_khr_fp16")) storage = STORAGE_HALF;
+    free(extensions);
+    return storage;
+}
+
+/**
+ * Allocates the frame and a reflection queue with room for samples rays per
+ * pixel of a width x height image. Queued rays are compacted and sorted
+ * with primitives, which needs the same capacity.
+ */
+void cl_secondary_init(cl_context* context, SecondaryPass* pass, ParallelPrimitives* primitives, unsigned int width, unsigned int height, unsigned int samples, unsigned int storage) {
+    const size_t n = (size_t)width * height * samples;
+    cl_int err;
+
+    pass->frame = clCreateBuffer(*context, CL_MEM_READ_WRITE, cl_storage_size(storage) * width * height, NULL, &err);
+    CHECK_ERR(err);
+    pass->radiance = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_half) * 4 * width * height, NULL, &err);
+    CHECK_ERR(err);
+    pass->rays = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(SecondaryRay) * n, NULL, &err);
+    CHECK_ERR(err);
+    pass->flags = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * n, NULL, &err);
+    CHECK_ERR(err);
+    pass->slots = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * n, NULL, &err);
+    CHECK_ERR(err);
+    pass->keys = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * n, NULL, &err);
+    CHECK_ERR(err);
+    pass->count = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err);
+    CHECK_ERR(err);
+    pass->primitives = primitives;
+    pass->samples = samples;
+    pass->capacity = (unsigned int)n;
+}
+
+/**
+ * Creates the secondary kernels from a trace program variant, releasing
+ * earlier ones, and points them and the pixel kernel at the pass buffers.
+ * The scene arguments of pass->trace are left to cl_set_scene_args.
+ */
+void cl_secondary_bind(cl_program* program, cl_kernel* kernel, SecondaryPass* pass, unsigned int width, unsigned int height) {
+    cl_int err;
+
+    if(pass->keys_kernel) clReleaseKernel(pass->keys_kernel);
+    if(pass->trace) clReleaseKernel(pass->trace);
+    if(pass->resolve) clReleaseKernel(pass->resolve);
+    pass->keys_kernel = cl_create_kernel(*program, "ray_keys");
+    pass->trace = cl_create_kernel(*program, "secondary_kernel");
+    pass->resolve = cl_create_kernel(*program, "resolve_kernel");
+
+    err = clSetKernelArg(*kernel, PIXEL_ARG_RAYS, sizeof(cl_mem), &pass->rays);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, PIXEL_ARG_FLAGS, sizeof(cl_mem), &pass->flags);
+    CHECK_ERR(err);
+
+    err = clSetKernelArg(pass->keys_kernel, 0, sizeof(cl_mem), &pass->rays);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->keys_kernel, 1, sizeof(cl_mem), &pass->slots);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->keys_kernel, 3, sizeof(cl_mem), &pass->keys);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->trace, SECONDARY_ARG_RAYS, sizeof(cl_mem), &pass->rays);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->trace, SECONDARY_ARG_SLOTS, sizeof(cl_mem), &pass->slots);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->resolve, 0, sizeof(cl_mem), &pass->radiance);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->resolve, 1, sizeof(unsigned int), &width);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->resolve, 2, sizeof(unsigned int), &height);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->resolve, 3, sizeof(cl_mem), &pass->frame);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->resolve, 4, sizeof(cl_mem), &pass->rays);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->resolve, 5, sizeof(cl_mem), &pass->flags);
+    CHECK_ERR(err);
+}
+
+/**
+ * Traces the primary rays into the frame buffer. Work is only enqueued.
+ */
+void cl_run_kernel(cl_command_queue* command_queue, cl_kernel* kernel, unsigned int width, unsigned int height) {
+    size_t work[] = {width, height};
+    cl_int err = clEnqueueNDRangeKernel(*command_queue, *kernel, 2, NULL, work, NULL, 0,0,0 );
+    CHECK_ERR(err);
+}
+
+/**
+ * Compacts the reflection rays queued by the primary pass and traces them.
+ * With sort set they are first ordered by direction octant and origin cell
+ * so neighbouring work-items walk similar parts of the BVH. Waits for the
+ * ray count, returns it.
+ */
+unsigned int cl_trace_secondary(cl_command_queue* command_queue, SecondaryPass* pass, int sort) {
+    cl_uint n;
+    cl_int err;
+
+    cl_compact(command_queue, pass->primitives, NULL, &pass->flags, &pass->slots, &pass->count, pass->capacity);
+    err = clEnqueueReadBuffer(*command_queue, pass->count, CL_TRUE, 0, sizeof(cl_uint), &n, 0, NULL, NULL);
+    CHECK_ERR(err);
+    if(n == 0) return 0;
+
+    const size_t global = n;
+    if(sort) {
+        err = clSetKernelArg(pass->keys_kernel, 2, sizeof(cl_uint), &n);
+        CHECK_ERR(err);
+        err = clEnqueueNDRangeKernel(*command_queue, pass->keys_kernel, 1, NULL, &global, NULL, 0, NULL, NULL);
+        CHECK_ERR(err);
+        cl_radix_sort(command_queue, pass->primitives, &pass->keys, &pass->slots, n, RAY_KEY_BITS);
+    }
+
+    err = clSetKernelArg(pass->trace, SECONDARY_ARG_COUNT, sizeof(cl_uint), &n);
+    CHECK_ERR(err);
+    err = clEnqueueNDRangeKernel(*command_queue, pass->trace, 1, NULL, &global, NULL, 0, NULL, NULL);
+    CHECK_ERR(err);
+    return n;
+}
+
+/**
+ * Adds the traced reflections to the frame and stores it as radiance.
+ * Work is only enqueued.
+ */
+void cl_resolve_frame(cl_command_queue* command_queue, SecondaryPass* pass, unsigned int width, unsigned int height) {
+    size_t work[] = {width, height};
+    cl_int err = clEnqueueNDRangeKernel(*command_queue, pass->resolve, 2, NULL, work, NULL, 0,0,0 );
+    CHECK_ERR(err);
+}
+
+/**
+ * Generates the blue noise tile of kernels/sampler.cl and uploads it. The
+ * tile is the same for every run.
+ */
+void cl_sampler_init(cl_context* context, cl_mem* blue_noise) {
+    float* shifts = (float*)malloc(sizeof(cl_float2) * BLUE_NOISE_SIZE * BLUE_NOISE_SIZE);
+    cl_int err;
+
+    sampler_blue_noise(0, shifts);
+    *blue_noise = clCreateBuffer(*context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        sizeof(cl_float2) * BLUE_NOISE_SIZE * BLUE_NOISE_SIZE, shifts, &err);
+    CHECK_ERR(err);
+    free(shifts);
+}
+
+void cl_set_sampler_arg(cl_kernel* kernel, cl_uint arg, cl_mem* blue_noise) {
+    cl_int err = clSetKernelArg(*kernel, arg, sizeof(cl_mem), blue_noise);
+    CHECK_ERR(err);
+}
+
+/**
+ * Sets the frame the kernel's random numbers and sample sequences are
+ * keyed on, see kernels/rng.h.
+ */
+void cl_set_frame_index(cl_kernel* kernel, cl_uint arg, unsigned int frame) {
+    cl_int err = clSetKernelArg(*kernel, arg, sizeof(cl_uint), &frame);
+    CHECK_ERR(err);
+}
+
+/**
+ * Copies a tile into its atlas slot, blocking as the staging tile is reused.
+ */
+static void cl_texture_upload(cl_command_queue* command_queue, TextureAtlas* atlas, unsigned int page) {
+    unsigned int texture, level, tx, ty;
+    const size_t tile_size = sizeof(cl_uint) * TEXTURE_TILE * TEXTURE_TILE;
+
+    texture_cache_page_tile(&atlas->cache, page, &texture, &level, &tx, &ty);
+    texture_copy_tile(&atlas->textures[texture], level, tx, ty, atlas->staging);
+    cl_int err = clEnqueueWriteBuffer(*command_queue, atlas->atlas, CL_TRUE, tile_size * (atlas->cache.pages[page] - 1),
+        tile_size, atlas->staging, 0, NULL, NULL);
+    CHECK_ERR(err);
+}
+
+/**
+ * Sets up the texture cache of count textures with an atlas of
+ * TEXTURE_SLOTS tiles and streams in the pinned last level of each. The
+ * host textures must outlive the atlas.
+ */
+void cl_texture_init(cl_context* context, cl_command_queue* command_queue, TextureAtlas* atlas, const Texture* textures, unsigned int count) {
+    cl_int err;
+    unsigned int page;
+
+    texture_cache_init(&atlas->cache, textures, count, TEXTURE_SLOTS);
+    atlas->textures = textures;
+    const size_t pages = atlas->cache.num_pages > 0 ? atlas->cache.num_pages : 1;
+
+    atlas->info = cl_create_input_buffer(context, sizeof(TextureInfo) * count, atlas->cache.info);
+    atlas->pages = clCreateBuffer(*context, CL_MEM_READ_ONLY, sizeof(cl_uint) * pages, NULL, &err);
+    CHECK_ERR(err);
+    atlas->atlas = clCreateBuffer(*context, CL_MEM_READ_ONLY, sizeof(cl_uint) * TEXTURE_TILE * TEXTURE_TILE * TEXTURE_SLOTS, NULL, &err);
+    CHECK_ERR(err);
+    atlas->request_flags = (cl_uint*)calloc(pages, sizeof(cl_uint));
+    atlas->requests = clCreateBuffer(*context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint) * pages, atlas->request_flags, &err);
+    CHECK_ERR(err);
+    atlas->staging = (cl_uint*)malloc(sizeof(cl_uint) * TEXTURE_TILE * TEXTURE_TILE);
+    atlas->uploads = (unsigned int*)malloc(sizeof(unsigned int) * TEXTURE_UPLOADS);
+
+    for(page = 0; page < atlas->cache.num_pages; page++)
+        if(atlas->cache.pages[page]) cl_texture_upload(command_queue, atlas, page);
+    err = clEnqueueWriteBuffer(*command_queue, atlas->pages, CL_TRUE, 0, sizeof(cl_uint) * pages, atlas->cache.pages, 0, NULL, NULL);
+    CHECK_ERR(err);
+
+    printf("Textures: %u textures, %u tiles, %u atlas slots\n", count, atlas->cache.num_pages, TEXTURE_SLOTS);
+}
+
+/**
+ * Streams in up to TEXTURE_UPLOADS of the tiles lookups asked for since
+ * the last call and clears the requests. Call between frames, it reads
+ * back what the last one flagged. Returns the tiles uploaded.
+ */
+unsigned int cl_texture_stream(cl_command_queue* command_queue, TextureAtlas* atlas) {
+    const size_t size = sizeof(cl_uint) * atlas->cache.num_pages;
+    unsigned int i, count;
+    cl_int err;
+
+    if(atlas->cache.num_pages == 0) return 0;
+    err = clEnqueueReadBuffer(*command_queue, atlas->requests, CL_TRUE, 0, size, atlas->request_flags, 0, NULL, NULL);
+    CHECK_ERR(err);
+    count = texture_cache_update(&atlas->cache, atlas->request_flags, TEXTURE_UPLOADS, atlas->uploads);
+    for(i = 0; i < count; i++)
+        cl_texture_upload(command_queue, atlas, atlas->uploads[i]);
+    if(count > 0) {
+        err = clEnqueueWriteBuffer(*command_queue, atlas->pages, CL_TRUE, 0, size, atlas->cache.pages, 0, NULL, NULL);
+        CHECK_ERR(err);
+    }
+
+    memset(atlas->request_flags, 0, size);
+    err = clEnqueueWriteBuffer(*command_queue, atlas->requests, CL_TRUE, 0, size, atlas->request_flags, 0, NULL, NULL);
+    CHECK_ERR(err);
+    return count;
+}
+
+/**
+ * Sets the texture buffers as the four kernel arguments starting at
+ * first_arg: info, page table, atlas and requests.
+ */
+void cl_set_texture_args(cl_kernel* kernel, cl_uint first_arg, TextureAtlas* atlas) {
+    cl_int err;
+    err = clSetKernelArg(*kernel, first_arg, sizeof(cl_mem), &atlas->info);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 1, sizeof(cl_mem), &atlas->pages);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 2, sizeof(cl_mem), &atlas->atlas);
+    CHECK_ERR(err);
+    err = clSetKernelArg(*kernel, first_arg + 3, sizeof(cl_mem), &atlas->requests);
+    CHECK_ERR(err);
+}
+
+/**
+ * Allocates the error estimates and pixel lists of adaptive sampling for
+ * frames of samples primary samples per pixel.
+ */
+void cl_adaptive_init(cl_context* context, AdaptivePass* pass, ParallelPrimitives* primitives, unsigned int width, unsigned int height, unsigned int samples) {
+    const size_t pixels = (size_t)width * height;
+    cl_int err;
+
+    pass->luminance = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_float) * pixels * samples, NULL, &err);
+    CHECK_ERR(err);
+    pass->moments = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_float4) * pixels, NULL, &err);
+    CHECK_ERR(err);
+    pass->refine = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * pixels, NULL, &err);
+    CHECK_ERR(err);
+    pass->pixels = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * pixels, NULL, &err);
+    CHECK_ERR(err);
+    pass->count = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err);
+    CHECK_ERR(err);
+    pass->primitives = primitives;
+    pass->threshold = ADAPTIVE_THRESHOLD;
+    pass->capacity = (unsigned int)pixels;
+}
+
+/**
+ * Creates adaptive_kernel from a trace program variant, releasing the
+ * earlier one, and points it, the pixel kernel and the resolve kernel at
+ * the pass buffers. cl_secondary_bind must have run first. The scene and
+ * camera arguments of pass->kernel are left to the caller.
+ */
+void cl_adaptive_bind(cl_program* program, cl_kernel* kernel, AdaptivePass* pass, SecondaryPass* secondary, unsigned int width) {
+    cl_int err;
+
+    if(pass->kernel) clReleaseKernel(pass->kernel);
+    pass->kernel = cl_create_kernel(*program, "adaptive_kernel");
+
+    err = clSetKernelArg(*kernel, PIXEL_ARG_LUMINANCE, sizeof(cl_mem), &pass->luminance);
+    CHECK_ERR(err);
+    err = clSetKernelArg(secondary->resolve, 6, sizeof(cl_mem), &pass->luminance);
+    CHECK_ERR(err);
+    err = clSetKernelArg(secondary->resolve, 7, sizeof(cl_mem), &pass->moments);
+    CHECK_ERR(err);
+    err = clSetKernelArg(secondary->resolve, 8, sizeof(cl_mem), &pass->refine);
+    CHECK_ERR(err);
+    err = clSetKernelArg(secondary->resolve, 9, sizeof(float), &pass->threshold);
+    CHECK_ERR(err);
+
+    err = clSetKernelArg(pass->kernel, ADAPTIVE_ARG_PIXELS, sizeof(cl_mem), &pass->pixels);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->kernel, ADAPTIVE_ARG_RADIANCE, sizeof(cl_mem), &secondary->radiance);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->kernel, ADAPTIVE_ARG_MOMENTS, sizeof(cl_mem), &pass->moments);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->kernel, ADAPTIVE_ARG_REFINE, sizeof(cl_mem), &pass->refine);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->kernel, ADAPTIVE_ARG_WIDTH, sizeof(unsigned int), &width);
+    CHECK_ERR(err);
+    err = clSetKernelArg(pass->kernel, ADAPTIVE_ARG_THRESHOLD, sizeof(float), &pass->threshold);
+    CHECK_ERR(err);
+}
+
+/**
+ * Refines the pixels cl_resolve_frame flagged, round by round, compacting
+ * the ones still flagged each time. Waits for the pixel count of every
+ * round, returns the number of samples added.
+ */
+unsigned int cl_adaptive(cl_command_queue* command_queue, AdaptivePass* pass) {
+    unsigned int samples = 0;
+    cl_uint n;
+    cl_int err;
+    int round;
+
+    for(round = 0; round < ADAPTIVE_ROUNDS; round++) {
+        cl_compact(command_queue, pass->primitives, NULL, &pass->refine, &pass->pixels, &pass->count, pass->capacity);
+        err = clEnqueueReadBuffer(*command_queue, pass->count, CL_TRUE, 0, sizeof(cl_uint), &n, 0, NULL, NULL);
+        CHECK_ERR(err);
+        if(n == 0) break;
+
+        const size_t global = n;
+        err = clSetKernelArg(pass->kernel, ADAPTIVE_ARG_COUNT, sizeof(cl_uint), &n);
+        CHECK_ERR(err);
+        err = clEnqueueNDRangeKernel(*command_queue, pass->kernel, 1, NULL, &global, NULL, 0, NULL, NULL);
+        CHECK_ERR(err);
+        samples += n * ADAPTIVE_SAMPLES;
+    }
+    return samples;
+}
+
+static cl_mem cl_aov_buffer(cl_context* context, AovBuffers* aovs, unsigned int aov, size_t size) {
+    cl_int err;
+    if(!(aovs->mask & aov)) return NULL;
+    cl_mem buffer = clCreateBuffer(*context, CL_MEM_READ_WRITE, size, NULL, &err);
+    CHECK_ERR(err);
+    return buffer;
+}
+
+/**
+ * Allocates the AOV buffers selected in mask.
+ */
+void cl_aov_init(cl_context* context, AovBuffers* aovs, unsigned int mask, unsigned int width, unsigned int height, unsigned int storage) {
+    const size_t pixels = (size_t)width * height;
+    aovs->mask = mask;
+    aovs->depth = cl_aov_buffer(context, aovs, AOV_DEPTH, sizeof(cl_float) * pixels);
+    aovs->normal = cl_aov_buffer(context, aovs, AOV_NORMAL, sizeof(cl_uint) * pixels);
+    aovs->albedo = cl_aov_buffer(context, aovs, AOV_ALBEDO, cl_storage_size(storage) * pixels);
+    aovs->prim_id = cl_aov_buffer(context, aovs, AOV_PRIM_ID, sizeof(cl_uint) * pixels);
+    aovs->motion = cl_aov_buffer(context, aovs, AOV_MOTION, sizeof(cl_float4) * pixels);
+}
+
+/**
+ * Points the AOV arguments of the pixel kernel at the buffers, NULL for
+ * the ones not selected, along with the previous instance transforms the
+ * motion AOV needs. The sample grid starts without jitter.
+ */
+void cl_aov_bind(cl_kernel* kernel, AovBuffers* aovs, SceneBuffers* buffers) {
+    const cl_mem outputs[] = { aovs->depth, aovs->normal, aovs->albedo, aovs->prim_id, aovs->motion };
+    cl_int err;
+    int i;
+    for(i = 0; i < 5; i++) {
+        err = clSetKernelArg(*kernel, PIXEL_ARG_AOVS + i, sizeof(cl_mem), outputs[i] ? &outputs[i] : NULL);
+        CHECK_ERR(err);
+    }
+    err = clSetKernelArg(*kernel, PIXEL_ARG_PREV_INSTANCES, sizeof(cl_mem), &buffers->prev_instances);
+    CHECK_ERR(err);
+    cl_set_jitter(kernel, 0, 0);
+}
+
+/**
+ * Offsets every sample of the pixel kernel by x and y pixels.
+ */
+void cl_set_jitter(cl_kernel* kernel, float x, float y) {
+    cl_float2 jitter;
+    jitter.s[0] = x;
+    jitter.s[1] = y;
+    cl_int err = clSetKernelArg(*kernel, PIXEL_ARG_JITTER, sizeof(cl_float2), &jitter);
+    CHECK_ERR(err);
+}
+
+/**
+ * Builds the denoiser for AOVs stored as storage and allocates its
+ * ping-pong buffers.
+ */
+void cl_denoise_init(cl_context* context, cl_device_id* device, Denoiser* denoiser, unsigned int width, unsigned int height, unsigned int storage) {
+    const char* sources[] = { KERNEL_DIR "/storage.cl", KERNEL_DIR "/atrous.h", KERNEL_DIR "/denoise.cl" };
+    char options[64];
+    cl_int err;
+    int i;
+
+    snprintf(options, sizeof(options), "-DFRAME_STORAGE=%u", storage);
+    if(cl_build_program(context, device, sources, 3, options, &denoiser->program) != CL_SUCCESS) exit(1);
+    denoiser->kernel = cl_create_kernel(denoiser->program, "denoise_atrous");
+    for(i = 0; i < 2; i++) {
+        denoiser->temp[i] = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_half) * 4 * width * height, NULL, &err);
+        CHECK_ERR(err);
+    }
+    denoise_defaults(&denoiser->params);
+}
+
+/**
+ * Filters radiance in place, guided by the depth, normal and albedo AOVs.
+ * Work is only enqueued.
+ */
+void cl_denoise(cl_command_queue* command_queue, Denoiser* denoiser, cl_mem* radiance, AovBuffers* aovs, unsigned int width, unsigned int height) {
+    const unsigned int iterations = denoiser->params.iterations;
+    size_t work[] = {width, height};
+    cl_int err;
+    unsigned int i;
+
+    if((aovs->mask & DENOISE_AOVS) != DENOISE_AOVS || iterations == 0) return;
+
+    err = clSetKernelArg(denoiser->kernel, 2, sizeof(cl_mem), &aovs->depth);
+    CHECK_ERR(err);
+    err = clSetKernelArg(denoiser->kernel, 3, sizeof(cl_mem), &aovs->normal);
+    CHECK_ERR(err);
+    err = clSetKernelArg(denoiser->kernel, 4, sizeof(cl_mem), &aovs->albedo);
+    CHECK_ERR(err);
+    err = clSetKernelArg(denoiser->kernel, 5, sizeof(unsigned int), &width);
+    CHECK_ERR(err);
+    err = clSetKernelArg(denoiser->kernel, 6, sizeof(unsigned int), &height);
+    CHECK_ERR(err);
+    err = clSetKernelArg(denoiser->kernel, 9, sizeof(float), &denoiser->params.sigma_normal);
+    CHECK_ERR(err);
+    err = clSetKernelArg(denoiser->kernel, 10, sizeof(float), &denoiser->params.sigma_depth);
+    CHECK_ERR(err);
+
+    for(i = 0; i < iterations; i++) {
+        // radiance -> temp[0] -> temp[1] -> ... -> radiance
+        cl_mem* in = i == 0 ? radiance : &denoiser->temp[(i - 1) % 2];
+        cl_mem* out = i + 1 == iterations && i > 0 ? radiance : &denoiser->temp[i % 2];
+        const cl_int step = 1 << i;
+        const float sigma = denoise_sigma_color(&denoiser->params, i);
+        const cl_uint flags = (i == 0 ? DENOISE_DEMODULATE : 0) | (i + 1 == iterations ? DENOISE_REMODULATE : 0);
+
+        err = clSetKernelArg(denoiser->kernel, 0, sizeof(cl_mem), in);
+        CHECK_ERR(err);
+        err = clSetKernelArg(denoiser->kernel, 1, sizeof(cl_mem), out);
+        CHECK_ERR(err);
+        err = clSetKernelArg(denoiser->kernel, 7, sizeof(cl_int), &step);
+        CHECK_ERR(err);
+        err = clSetKernelArg(denoiser->kernel, 8, sizeof(float), &sigma);
+        CHECK_ERR(err);
+        err = clSetKernelArg(denoiser->kernel, 11, sizeof(cl_uint), &flags);
+        CHECK_ERR(err);
+        err = clEnqueueNDRangeKernel(*command_queue, denoiser->kernel, 2, NULL, work, NULL, 0,0,0 );
+        CHECK_ERR(err);
+    }
+
+    // a single pass cannot filter in place
+    if(iterations == 1) {
+        err = clEnqueueCopyBuffer(*command_queue, denoiser->temp[0], *radiance, 0, 0, sizeof(cl_half) * 4 * width * height, 0, NULL, NULL);
+        CHECK_ERR(err);
+    }
+}
+
+/**
+ * Builds the temporal accumulation kernel and allocates both history sets.
+ * History starts out invalid.
+ */
+void cl_temporal_init(cl_context* context, cl_device_id* device, TemporalPass* temporal, unsigned int width, unsigned int height) {
+    const char* sources[] = { KERNEL_DIR "/storage.cl", KERNEL_DIR "/temporal.cl" };
+    const size_t pixels = (size_t)width * height;
+    cl_int err;
+    int i;
+
+    if(cl_build_program(context, device, sources, 2, NULL, &temporal->program) != CL_SUCCESS) exit(1);
+    temporal->kernel = cl_create_kernel(temporal->program, "temporal_accumulate");
+    for(i = 0; i < 2; i++) {
+        temporal->history[i] = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_half) * 4 * pixels, NULL, &err);
+        CHECK_ERR(err);
+        temporal->depth[i] = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_float) * pixels, NULL, &err);
+        CHECK_ERR(err);
+        temporal->normal[i] = clCreateBuffer(*context, CL_MEM_READ_WRITE, sizeof(cl_uint) * pixels, NULL, &err);
+        CHECK_ERR(err);
+    }
+    temporal->current = 0;
+    temporal->alpha_min = TEMPORAL_ALPHA_MIN;
+    cl_temporal_reset(temporal);
+}
+
+/**
+ * Drops the history, the next frame starts accumulating from scratch.
+ */
+void cl_temporal_reset(TemporalPass* temporal) {
+    temporal->valid = 0;
+}
+
+/**
+ * Blends radiance with the history reprojected by the motion AOV, in
+ * place, and keeps the result as the next frame's history. Work is only
+ * enqueued.
+ */
+void cl_temporal(cl_command_queue* command_queue, TemporalPass* temporal, cl_mem* radiance, AovBuffers* aovs, unsigned int width, unsigned int height) {
+    const unsigned int prev = temporal->current;
+    const unsigned int next = 1 - prev;
+    size_t work[] = {width, height};
+    cl_int err;
+
+    if((aovs->mask & TEMPORAL_AOVS) != TEMPORAL_AOVS) return;
+
+    err = clSetKernelArg(temporal->kernel, 0, sizeof(cl_mem), radiance);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 1, sizeof(cl_mem), &aovs->motion);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 2, sizeof(cl_mem), &aovs->depth);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 3, sizeof(cl_mem), &aovs->normal);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 4, sizeof(cl_mem), &temporal->history[prev]);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 5, sizeof(cl_mem), &temporal->depth[prev]);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 6, sizeof(cl_mem), &temporal->normal[prev]);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 7, sizeof(cl_mem), &temporal->history[next]);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 8, sizeof(cl_mem), &temporal->depth[next]);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 9, sizeof(cl_mem), &temporal->normal[next]);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 10, sizeof(unsigned int), &width);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 11, sizeof(unsigned int), &height);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 12, sizeof(float), &temporal->alpha_min);
+    CHECK_ERR(err);
+    err = clSetKernelArg(temporal->kernel, 13, sizeof(cl_int), &temporal->valid);
+    CHECK_ERR(err);
+    err = clEnqueueNDRangeKernel(*command_queue, temporal->kernel, 2, NULL, work, NULL, 0,0,0 );
+    CHECK_ERR(err);
+
+    temporal->current = next;
+    temporal->valid = 1;
+}
+
+/**
+ * Builds the display transform, starting at exposure 0 with the clamp
+ * the tracer always used.
+ */
+void cl_tonemap_init(cl_context* context, cl_device_id* device, ToneMapper* tonemapper) {
+    const char* sources[] = { KERNEL_DIR "/tonemap.cl" };
+    if(cl_build_program(context, device, sources, 1, NULL, &tonemapper->program) != CL_SUCCESS) exit(1);
+    tonemapper->kernel = cl_create_kernel(tonemapper->program, "tonemap_kernel");
+    tonemapper->exposure = 0;
+    tonemapper->op = TONEMAP_CLAMP;
+}
+
+/**
+ * Maps radiance to the texture with the current exposure and operator and
+ * waits for the frame to finish.
+ */
+void cl_tonemap(cl_command_queue* command_queue, ToneMapper* tonemapper, cl_mem* radiance, cl_mem* texture_cl, unsigned int width, unsigned int height) {
+    const float scale = powf(2.0f, tonemapper->exposure);
+    cl_int err;
+
+    // map OpenGL buffer object for writing from OpenCL
+    err = clEnqueueAcquireGLObjects(*command_queue, 1, texture_cl, 0,0,0);
+    CHECK_ERR(err);
+
+    size_t work[] = {width, height};
+    err = clSetKernelArg(tonemapper->kernel, 0, sizeof(cl_mem), radiance);
+    CHECK_ERR(err);
+    err = clSetKernelArg(tonemapper->kernel, 1, sizeof(cl_mem), texture_cl);
+    CHECK_ERR(err);
+    err = clSetKernelArg(tonemapper->kernel, 2, sizeof(unsigned int), &width);
+    CHECK_ERR(err);
+    err = clSetKernelArg(tonemapper->kernel, 3, sizeof(unsigned int), &height);
+    CHECK_ERR(err);
+    err = clSetKernelArg(tonemapper->kernel, 4, sizeof(float), &scale);
+    CHECK_ERR(err);
+    err = clSetKernelArg(tonemapper->kernel, 5, sizeof(unsigned int), &tonemapper->op);
+    CHECK_ERR(err);
+
+    err = clEnqueueNDRangeKernel(*command_queue, tonemapper->kernel, 2, NULL, work, NULL, 0,0,0 );
+    CHECK_ERR(err);
+
+    err = clEnqueueReleaseGLObjects(*command_queue, 1, texture_cl, 0,0,0);
+    CHECK_ERR(err);
+
+    err = clFinish(*command_queue);
+    CHECK_ERR(err);
+}
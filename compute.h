@@ -7,9 +7,6 @@
     #define GL_SHARING_EXTENSION "cl_khr_gl_sharing"
 #endif
 
-#define MEM_SIZE (128)
-#define MAX_SOURCE_SIZE (0x100000)
-
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -33,16 +30,405 @@ extern "C" {
 
 #include <CL/cl_gl.h>
 
+#include "scene.h"
+#include "denoise.h"
+#include "camera.h"
+#include "sampler.h"
+
+// kernel sources are read from here at run time, the build points it at
+// kernels/ in the source tree so the hot reloader sees edits made there
+#ifndef KERNEL_DIR
+#define KERNEL_DIR "."
+#endif
+
 #define CHECK_ERR(E) if(E != CL_SUCCESS) fprintf (stderr, "CL ERROR (%d) in %s:%d\n", E,__FILE__, __LINE__);
 #define CHECK_GL(C) C; do {GLenum glerr = glGetError(); if(glerr != GL_NO_ERROR) printf("GL ERROR (%d) in %s:%d\n", glerr, __FILE__, __LINE__);} while(0)
 
+/**
+ * Device copies of the scene arrays, see scene.h.
+ */
+typedef struct {
+    cl_mem planes;
+    cl_mem prims;
+    cl_mem meshes;
+    cl_mem blas_nodes;
+    cl_mem instances;
+    cl_mem instances_close;     // transforms at shutter close, for motion blur
+    cl_mem prev_instances;      // last frame's transforms, for motion vectors
+    cl_mem tlas_nodes;
+    cl_mem dynamic_nodes;
+    cl_mem materials;
+    cl_mem lights;
+    cl_mem camera;              // CameraBasis of this frame and the last traced one
+    cl_mem env_info;            // EnvironmentInfo, width 0 without an environment
+    cl_mem env_texels;
+    cl_mem env_cdf;
+} SceneBuffers;
+
+// must match the defines in kernels/scan.cl and kernels/radix_sort.cl
+#define SCAN_GROUP_SIZE 128
+#define SCAN_BLOCK (2 * SCAN_GROUP_SIZE)
+// scan levels kept, each one reduces the element count by SCAN_BLOCK
+#define SCAN_LEVELS 4
+#define RADIX_BITS 4
+#define RADIX_DIGITS (1 << RADIX_BITS)
+#define RADIX_GROUP_SIZE 128
+#define RADIX_ITEMS 8
+#define RADIX_BLOCK (RADIX_GROUP_SIZE * RADIX_ITEMS)
+
+/**
+ * Scan, compaction and radix sort kernels with scratch space for arrays of
+ * up to capacity elements, see kernels/scan.cl and kernels/radix_sort.cl.
+ */
+typedef struct {
+    cl_program program;
+    cl_kernel scan_blocks;
+    cl_kernel scan_add;
+    cl_kernel compact_scatter;
+    cl_kernel compact_indices;
+    cl_kernel histogram32;
+    cl_kernel scatter32;
+    cl_kernel histogram64;
+    cl_kernel scatter64;
+    cl_mem block_sums[SCAN_LEVELS];
+    cl_mem positions;
+    cl_mem hist;
+    cl_mem keys;
+    cl_mem values;
+    unsigned int capacity;
+} ParallelPrimitives;
+
+// bits of the secondary ray sort key built by ray_keys
+#define RAY_KEY_BITS 27
+// compiled trace program variants kept at once
+#define KERNEL_CACHE_SIZE 8
+
+// pixel buffer storage, must match kernels/storage.cl
+#define STORAGE_FLOAT 0
+#define STORAGE_HALF 1
+#define STORAGE_RGBE 2
+
+/**
+ * Compile time specialisation of kernels/trace.cl, passed as -D options.
+ * Loop bounds become constants and disabled features are compiled out.
+ */
+typedef struct {
+    unsigned int aa_grid;       // primary samples per pixel are aa_grid^2
+    unsigned int max_bounces;   // 0 disables reflections
+    int shadows;                // shadow rays towards the light samples
+    unsigned int num_planes;    // unbounded primitives in the scene
+    unsigned int storage;       // STORAGE_* of the frame buffer
+    unsigned int aovs;          // AOV_* written by pixel_kernel
+    int adaptive;               // error estimates for AdaptivePass
+    unsigned int sampler;       // SAMPLER_* sample sequence
+    unsigned int env_samples;   // environment light samples per shaded point, 0 for constant ambient
+    int motion_blur;            // rays sample the shutter, instances move while it is open
+} KernelConfig;
+
+// entry points the kernel registry can hold
+#define KERNEL_REGISTRY_SIZE 8
+
+/**
+ * Programs built so far, keyed by their configuration.
+ */
+typedef struct {
+    KernelConfig configs[KERNEL_CACHE_SIZE];
+    cl_program programs[KERNEL_CACHE_SIZE];
+    unsigned int count;
+} KernelCache;
+
+/**
+ * Entry points built once at start up and looked up by name. Registered
+ * kernels take (image, width, height, time) and write the frame directly,
+ * like sine_wave in kernels/glow.cl and kernels/xy.cl.
+ */
+typedef struct {
+    const char* names[KERNEL_REGISTRY_SIZE];
+    cl_program programs[KERNEL_REGISTRY_SIZE];
+    cl_kernel kernels[KERNEL_REGISTRY_SIZE];
+    unsigned int count;
+} KernelRegistry;
+
+/**
+ * Reflection ray queued by pixel_kernel, see kernels/trace.cl. col holds
+ * its weight until secondary_kernel replaces it with the weighted colour,
+ * origin.w and dir.w the width and spread of its ray cone, col.w its
+ * shutter time until then.
+ */
+typedef struct {
+    cl_float4 origin;
+    cl_float4 dir;
+    cl_float4 col;
+} SecondaryRay;
+
+/**
+ * Wavefront reflection bounce: pixel_kernel traces primary rays into frame
+ * and queues a ray per reflective sample, the active slots are compacted,
+ * optionally sorted for coherence, traced, and resolved into radiance as
+ * unclamped RGBA16F, see ToneMapper for the display image.
+ */
+typedef struct {
+    cl_kernel keys_kernel;
+    cl_kernel trace;
+    cl_kernel resolve;
+    cl_mem frame;
+    cl_mem radiance;
+    cl_mem rays;
+    cl_mem flags;
+    cl_mem slots;
+    cl_mem keys;
+    cl_mem count;
+    ParallelPrimitives* primitives;
+    unsigned int samples;
+    unsigned int capacity;
+} SecondaryPass;
+
+// argument indices of pixel_kernel and secondary_kernel in kernels/trace.cl,
+// the first of each group the cl_set_*_arg helpers take
+#define PIXEL_ARG_SCENE 3
+#define PIXEL_ARG_RAYS 13
+#define PIXEL_ARG_FLAGS 14
+#define PIXEL_ARG_AOVS 15
+#define PIXEL_ARG_PREV_INSTANCES 20
+#define PIXEL_ARG_JITTER 21
+#define PIXEL_ARG_CAMERA 22
+#define PIXEL_ARG_LUMINANCE 23
+#define PIXEL_ARG_BLUE_NOISE 24
+#define PIXEL_ARG_FRAME_INDEX 25
+#define PIXEL_ARG_TEXTURES 26
+#define PIXEL_ARG_ENVIRONMENT 30
+#define PIXEL_ARG_LIGHTS 33
+#define PIXEL_ARG_LIGHT_GRID 35
+#define PIXEL_ARG_INSTANCES_CLOSE 36
+#define SECONDARY_ARG_RAYS 0
+#define SECONDARY_ARG_SLOTS 1
+#define SECONDARY_ARG_COUNT 2
+#define SECONDARY_ARG_SCENE 3
+#define SECONDARY_ARG_TEXTURES 13
+#define SECONDARY_ARG_FRAME_INDEX 17
+#define SECONDARY_ARG_ENVIRONMENT 18
+#define SECONDARY_ARG_LIGHTS 21
+#define SECONDARY_ARG_LIGHT_GRID 23
+#define SECONDARY_ARG_INSTANCES_CLOSE 24
+
+// must match the defines in kernels/trace.cl
+#define ADAPTIVE_SAMPLES 4
+#define ADAPTIVE_ROUNDS 3
+// largest accepted standard error of a pixel, relative to its luminance
+#define ADAPTIVE_THRESHOLD 0.02f
+
+/**
+ * Adaptive sampling after the reflection pass. resolve_kernel estimates the
+ * error of every pixel from the luminance moments of its samples and flags
+ * the ones above threshold. Those are compacted into pixels and
+ * adaptive_kernel gives each ADAPTIVE_SAMPLES more, for up to
+ * ADAPTIVE_ROUNDS rounds or until no pixel is left. Needs a trace program
+ * built with adaptive set.
+ */
+typedef struct {
+    cl_kernel kernel;
+    cl_mem luminance;           // float per primary sample
+    cl_mem moments;             // float4 per pixel: sum, sum of squares, count
+    cl_mem refine;
+    cl_mem pixels;
+    cl_mem count;
+    ParallelPrimitives* primitives;
+    float threshold;
+    unsigned int capacity;
+} AdaptivePass;
+
+// argument indices of adaptive_kernel in kernels/trace.cl
+#define ADAPTIVE_ARG_PIXELS 0
+#define ADAPTIVE_ARG_COUNT 1
+#define ADAPTIVE_ARG_RADIANCE 2
+#define ADAPTIVE_ARG_SCENE 3
+#define ADAPTIVE_ARG_MOMENTS 13
+#define ADAPTIVE_ARG_REFINE 14
+#define ADAPTIVE_ARG_WIDTH 15
+#define ADAPTIVE_ARG_THRESHOLD 16
+#define ADAPTIVE_ARG_CAMERA 17
+#define ADAPTIVE_ARG_BLUE_NOISE 18
+#define ADAPTIVE_ARG_FRAME_INDEX 19
+#define ADAPTIVE_ARG_TEXTURES 20
+#define ADAPTIVE_ARG_ENVIRONMENT 24
+#define ADAPTIVE_ARG_LIGHTS 27
+#define ADAPTIVE_ARG_LIGHT_GRID 29
+#define ADAPTIVE_ARG_INSTANCES_CLOSE 30
+
+// arbitrary output variables, must match kernels/trace.cl
+#define AOV_DEPTH 1
+#define AOV_NORMAL 2
+#define AOV_ALBEDO 4
+#define AOV_PRIM_ID 8
+#define AOV_MOTION 16
+#define AOV_MISS 0xFFFFFFFFu
+
+/**
+ * Per-pixel outputs pixel_kernel writes next to the frame: float depth,
+ * normals packed by pack_normal in kernels/storage.cl, albedo in the frame
+ * storage format, uint primitive ids and float4 motion: the previous pixel
+ * position and depth of the surface. Only the buffers in mask exist.
+ */
+typedef struct {
+    cl_mem depth;
+    cl_mem normal;
+    cl_mem albedo;
+    cl_mem prim_id;
+    cl_mem motion;
+    unsigned int mask;
+} AovBuffers;
+
+// AOVs the denoiser is guided by
+#define DENOISE_AOVS (AOV_DEPTH | AOV_NORMAL | AOV_ALBEDO)
+
+/**
+ * A-trous filter over SecondaryPass radiance, see kernels/denoise.cl.
+ * Passes ping-pong through two half float buffers and the last one writes
+ * radiance again.
+ */
+typedef struct {
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem temp[2];
+    DenoiseParams params;
+} Denoiser;
+
+// AOVs history is reprojected and validated with
+#define TEMPORAL_AOVS (AOV_DEPTH | AOV_NORMAL | AOV_MOTION)
+// lowest weight of the new frame once history has converged
+#define TEMPORAL_ALPHA_MIN 0.1f
+
+/**
+ * Temporal accumulation over SecondaryPass radiance, see kernels/temporal.cl.
+ * History radiance, depth and normals ping-pong between two sets of
+ * buffers, current is the set the last frame wrote. valid is cleared when
+ * the history no longer belongs to the frames being rendered.
+ */
+typedef struct {
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem history[2];
+    cl_mem depth[2];
+    cl_mem normal[2];
+    unsigned int current;
+    int valid;
+    float alpha_min;
+} TemporalPass;
+
+// must match the defines in kernels/tonemap.cl
+#define TONEMAP_CLAMP 0
+#define TONEMAP_REINHARD 1
+#define TONEMAP_ACES 2
+#define TONEMAP_COUNT 3
+
+/**
+ * Turns SecondaryPass radiance into the display texture, exposure in stops.
+ */
+typedef struct {
+    cl_program program;
+    cl_kernel kernel;
+    float exposure;
+    unsigned int op;
+} ToneMapper;
+
+/**
+ * Kernels and scratch buffers of the device LBVH builder, see kernels/lbvh.cl.
+ * Morton codes are sorted with the shared parallel primitives.
+ */
+typedef struct {
+    cl_program program;
+    cl_kernel morton;
+    cl_kernel hierarchy;
+    cl_kernel refit;
+    cl_mem keys;
+    cl_mem values;
+    cl_mem leaf_bounds;
+    cl_mem parents;
+    cl_mem visits;
+    cl_mem heights;             // levels below each node, keeps rotations from deepening the tree
+    ParallelPrimitives* primitives;
+    unsigned int capacity;
+} LBVHBuilder;
+
+// atlas size in tiles and tiles streamed in per frame at most
+#define TEXTURE_SLOTS 256
+#define TEXTURE_UPLOADS 32
+
+/**
+ * Device side of the texture cache: the atlas of TEXTURE_TILE squared
+ * tiles, the page table and the request flags lookups set, see
+ * kernels/texture.cl. textures are the host copies tiles are cut from.
+ */
+typedef struct {
+    TextureCache cache;
+    const Texture* textures;
+    cl_mem info;
+    cl_mem pages;
+    cl_mem atlas;
+    cl_mem requests;
+    cl_uint* request_flags;     // host copy of requests
+    cl_uint* staging;           // a tile on its way to the atlas
+    unsigned int* uploads;
+} TextureAtlas;
+
 void cl_info();
 void cl_select(cl_platform_id* platform_id, cl_device_id* device_id);
 void cl_select_context(cl_platform_id* platform, cl_device_id* device, cl_context* context);
-void cl_load_kernel(cl_context* context, cl_device_id* device, const char* source, cl_command_queue* command_queue, cl_kernel* kernel);
-void cl_set_constant_args(cl_kernel * kernel, cl_mem* texture, unsigned int width, unsigned int height);
+cl_int cl_build_program(cl_context* context, cl_device_id* device, const char** sources, unsigned int num_sources, const char* options, cl_program* program);
+void cl_create_queue(cl_context* context, cl_device_id* device, cl_command_queue* command_queue);
+void cl_kernel_options(const KernelConfig* config, char* options, size_t size);
+void cl_cache_store(KernelCache* cache, const KernelConfig* config, cl_program program);
+void cl_cache_clear(KernelCache* cache);
+cl_program cl_cached_program(cl_context* context, cl_device_id* device, KernelCache* cache, const char** sources, unsigned int num_sources, const KernelConfig* config);
+cl_int cl_load_kernel(cl_context* context, cl_device_id* device, KernelCache* cache, const char** sources, unsigned int num_sources, const KernelConfig* config, cl_program* program, cl_kernel* kernel);
+cl_int cl_registry_add(cl_context* context, cl_device_id* device, KernelRegistry* registry, const char* name, const char** sources, unsigned int num_sources, const char* entry);
+cl_kernel cl_registry_find(KernelRegistry* registry, const char* name);
+void cl_run_image_kernel(cl_command_queue* command_queue, cl_kernel* kernel, cl_mem* texture_cl, unsigned int width, unsigned int height, unsigned int x_offset, float time);
+void cl_set_constant_args(cl_kernel * kernel, cl_mem* output, unsigned int width, unsigned int height);
 void cl_create_texture(cl_context* context, GLuint* texture, cl_mem* cl_texture, unsigned int width, unsigned int height);
-void cl_run_kernel(cl_command_queue* command_queue, cl_kernel* kernel, cl_mem*texture_cl, unsigned int width, unsigned int height);
+void cl_create_scene_buffers(cl_context* context, Scene* scene, SceneBuffers* buffers);
+void cl_set_scene_args(cl_kernel* kernel, cl_uint first_arg, Scene* scene, SceneBuffers* buffers);
+void cl_set_environment_args(cl_kernel* kernel, cl_uint first_arg, SceneBuffers* buffers);
+void cl_set_light_args(cl_kernel* kernel, cl_uint first_arg, Scene* scene, SceneBuffers* buffers);
+void cl_set_light_grid(cl_kernel* kernel, cl_uint arg, unsigned int grid);
+void cl_set_motion_arg(cl_kernel* kernel, cl_uint arg, SceneBuffers* buffers);
+void cl_update_instances(cl_command_queue* command_queue, Scene* scene, SceneBuffers* buffers);
+void cl_keep_instances(cl_command_queue* command_queue, Scene* scene, SceneBuffers* buffers);
+void cl_update_camera(cl_command_queue* command_queue, SceneBuffers* buffers, const CameraBasis* current, const CameraBasis* previous);
+void cl_set_camera_arg(cl_kernel* kernel, cl_uint arg, SceneBuffers* buffers);
+void cl_primitives_init(cl_context* context, cl_device_id* device, ParallelPrimitives* primitives, unsigned int capacity);
+void cl_scan(cl_command_queue* command_queue, ParallelPrimitives* primitives, cl_mem* in, cl_mem* out, unsigned int n);
+void cl_compact(cl_command_queue* command_queue, ParallelPrimitives* primitives, cl_mem* values, cl_mem* flags, cl_mem* out, cl_mem* count, unsigned int n);
+void cl_radix_sort(cl_command_queue* command_queue, ParallelPrimitives* primitives, cl_mem* keys, cl_mem* values, unsigned int n, unsigned int key_bits);
+void cl_lbvh_init(cl_context* context, cl_device_id* device, LBVHBuilder* builder, ParallelPrimitives* primitives, unsigned int capacity);
+void cl_lbvh_build(cl_command_queue* command_queue, LBVHBuilder* builder, cl_mem* prims, const Mesh* mesh, cl_mem* nodes, int optimize);
+void cl_update_dynamic_meshes(cl_command_queue* command_queue, Scene* scene, SceneBuffers* buffers, LBVHBuilder* builder, int optimize);
+size_t cl_storage_size(unsigned int storage);
+unsigned int cl_default_storage(cl_device_id* device);
+void cl_secondary_init(cl_context* context, SecondaryPass* pass, ParallelPrimitives* primitives, unsigned int width, unsigned int height, unsigned int samples, unsigned int storage);
+void cl_secondary_bind(cl_program* program, cl_kernel* kernel, SecondaryPass* pass, unsigned int width, unsigned int height);
+void cl_run_kernel(cl_command_queue* command_queue, cl_kernel* kernel, unsigned int width, unsigned int height);
+unsigned int cl_trace_secondary(cl_command_queue* command_queue, SecondaryPass* pass, int sort);
+void cl_resolve_frame(cl_command_queue* command_queue, SecondaryPass* pass, unsigned int width, unsigned int height);
+void cl_sampler_init(cl_context* context, cl_mem* blue_noise);
+void cl_set_sampler_arg(cl_kernel* kernel, cl_uint arg, cl_mem* blue_noise);
+void cl_set_frame_index(cl_kernel* kernel, cl_uint arg, unsigned int frame);
+void cl_texture_init(cl_context* context, cl_command_queue* command_queue, TextureAtlas* atlas, const Texture* textures, unsigned int count);
+unsigned int cl_texture_stream(cl_command_queue* command_queue, TextureAtlas* atlas);
+void cl_set_texture_args(cl_kernel* kernel, cl_uint first_arg, TextureAtlas* atlas);
+void cl_adaptive_init(cl_context* context, AdaptivePass* pass, ParallelPrimitives* primitives, unsigned int width, unsigned int height, unsigned int samples);
+void cl_adaptive_bind(cl_program* program, cl_kernel* kernel, AdaptivePass* pass, SecondaryPass* secondary, unsigned int width);
+unsigned int cl_adaptive(cl_command_queue* command_queue, AdaptivePass* pass);
+void cl_aov_init(cl_context* context, AovBuffers* aovs, unsigned int mask, unsigned int width, unsigned int height, unsigned int storage);
+void cl_aov_bind(cl_kernel* kernel, AovBuffers* aovs, SceneBuffers* buffers);
+void cl_set_jitter(cl_kernel* kernel, float x, float y);
+void cl_denoise_init(cl_context* context, cl_device_id* device, Denoiser* denoiser, unsigned int width, unsigned int height, unsigned int storage);
+void cl_denoise(cl_command_queue* command_queue, Denoiser* denoiser, cl_mem* radiance, AovBuffers* aovs, unsigned int width, unsigned int height);
+void cl_temporal_init(cl_context* context, cl_device_id* device, TemporalPass* temporal, unsigned int width, unsigned int height);
+void cl_temporal_reset(TemporalPass* temporal);
+void cl_temporal(cl_command_queue* command_queue, TemporalPass* temporal, cl_mem* radiance, AovBuffers* aovs, unsigned int width, unsigned int height);
+void cl_tonemap_init(cl_context* context, cl_device_id* device, ToneMapper* tonemapper);
+void cl_tonemap(cl_command_queue* command_queue, ToneMapper* tonemapper, cl_mem* radiance, cl_mem* texture_cl, unsigned int width, unsigned int height);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,103 @@
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "denoise.h"
+
+void denoise_defaults(DenoiseParams* params) {
+    params->iterations = DENOISE_ITERATIONS;
+    params->sigma_color = 1.0f;
+    params->sigma_normal = 128.0f;
+    params->sigma_depth = 0.1f;
+}
+
+float denoise_sigma_color(const DenoiseParams* params, unsigned int iteration) {
+    return ldexpf(params->sigma_color, -(int)iteration);
+}
+
+/**
+ * pack_normal in kernels/storage.cl, undone.
+ */
+static void unpack_normal(unsigned int v, float* n) {
+    n[0] = ((float)(v & 0x3FF) - 512.0f) / 511.0f;
+    n[1] = ((float)((v >> 10) & 0x3FF) - 512.0f) / 511.0f;
+    n[2] = ((float)((v >> 20) & 0x3FF) - 512.0f) / 511.0f;
+}
+
+/**
+ * One pass over rows [first, last) of the frame, as denoise_atrous.
+ */
+static void denoise_rows(const float* in, float* out, const float* depth, const unsigned int* normals,
+        unsigned int width, unsigned int height, int step, float sigma_color, const DenoiseParams* params,
+        unsigned int first, unsigned int last) {
+    static const float kernel_weights[3] = DENOISE_B3_WEIGHTS;
+    for(unsigned int y = first; y < last; y++) {
+        for(unsigned int x = 0; x < width; x++) {
+            const unsigned int p = y * width + x;
+            const float* cp = &in[4 * p];
+            const float zp = depth[p];
+            float np[3], nq[3];
+            float sum[4] = { 0, 0, 0, 0 };
+            float weights = 0;
+            unpack_normal(normals[p], np);
+
+            for(int j = -2; j <= 2; j++) {
+                const int qy = (int)y + j * step;
+                if(qy < 0 || qy >= (int)height) continue;
+                for(int i = -2; i <= 2; i++) {
+                    const int qx = (int)x + i * step;
+                    if(qx < 0 || qx >= (int)width) continue;
+                    const unsigned int q = qy * width + qx;
+                    const float* cq = &in[4 * q];
+
+                    const float d[3] = { cp[0] - cq[0], cp[1] - cq[1], cp[2] - cq[2] };
+                    const float w_color = expf(-(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]) / (sigma_color * sigma_color + 1e-6f));
+                    const float zq = depth[q];
+                    float w_normal = 1.0f;
+                    if(zp != FLT_MAX) {
+                        unpack_normal(normals[q], nq);
+                        w_normal = powf(std::max(np[0] * nq[0] + np[1] * nq[1] + np[2] * nq[2], 0.0f), params->sigma_normal);
+                    }
+                    const float w_depth = zp == FLT_MAX || zq == FLT_MAX ? (zp == zq ? 1.0f : 0.0f)
+                        : expf(-fabsf(zp - zq) / (params->sigma_depth * zp * step * sqrtf((float)(i * i + j * j)) + 1e-4f));
+
+                    const float w = kernel_weights[abs(i)] * kernel_weights[abs(j)] * w_color * w_normal * w_depth;
+                    for(int c = 0; c < 4; c++) sum[c] += w * cq[c];
+                    weights += w;
+                }
+            }
+            for(int c = 0; c < 4; c++) out[4 * p + c] = sum[c] / weights;
+        }
+    }
+}
+
+/**
+ * Reference for kernels/denoise.cl on RGBA float color and albedo, float
+ * depth (FLT_MAX on a miss) and packed normals as the AOV buffers hold
+ * them. out may alias color. Rows are split across the hardware threads.
+ */
+void denoise_cpu(const float* color, const float* depth, const unsigned int* normals, const float* albedo,
+        unsigned int width, unsigned int height, const DenoiseParams* params, float* out) {
+    const size_t size = (size_t)width * height * 4;
+    const unsigned int threads = std::max(1u, std::min(std::thread::hardware_concurrency(), height));
+    std::vector<float> ping(size), pong(size);
+    unsigned int i, t;
+
+    for(i = 0; i < size; i++) ping[i] = color[i] / std::max(albedo[i], DENOISE_ALBEDO_MIN);
+
+    for(i = 0; i < params->iterations; i++) {
+        std::vector<std::thread> workers;
+        const float sigma = denoise_sigma_color(params, i);
+        for(t = 0; t < threads; t++)
+            workers.push_back(std::thread(denoise_rows, ping.data(), pong.data(), depth, normals, width, height,
+                1 << i, sigma, params, height * t / threads, height * (t + 1) / threads));
+        for(t = 0; t < threads; t++) workers[t].join();
+        ping.swap(pong);
+    }
+
+    for(i = 0; i < size; i++) out[i] = ping[i] * std::max(albedo[i], DENOISE_ALBEDO_MIN);
+}
@@ -0,0 +1,33 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "kernels/atrous.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a-trous passes, the last one reaches 2^(iterations + 1) pixels out
+#define DENOISE_ITERATIONS 5
+
+/**
+ * Edge stopping of the a-trous denoiser, see kernels/denoise.cl. The colour
+ * sigma halves every pass so later, wider passes only smooth what is left.
+ */
+typedef struct {
+    unsigned int iterations;
+    float sigma_color;      // demodulated colour distance
+    float sigma_normal;     // exponent on the cosine between normals
+    float sigma_depth;      // relative depth change per pixel
+} DenoiseParams;
+
+void denoise_defaults(DenoiseParams* params);
+float denoise_sigma_color(const DenoiseParams* params, unsigned int iteration);
+void denoise_cpu(const float* color, const float* depth, const unsigned int* normals, const float* albedo,
+    unsigned int width, unsigned int height, const DenoiseParams* params, float* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
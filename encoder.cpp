@@ -0,0 +1,451 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "encoder.h"
+
+// output rows compressed together by one task
+#define ENCODER_STRIP_ROWS 32
+// file buffers are aligned and padded to this for O_DIRECT
+#define ENCODER_ALIGNMENT 4096
+// largest stored deflate block
+#define DEFLATE_STORED_MAX 65535
+
+/**
+ * A frame being encoded. Every strip becomes one IDAT chunk, complete with
+ * its CRC, so the writer only has to concatenate them.
+ */
+struct EncodeJob {
+    Frame frame;
+    std::vector<std::vector<unsigned char> > chunks;
+    std::vector<unsigned int> adlers;
+    std::vector<size_t> raw_sizes;
+    std::atomic<unsigned int> remaining;
+};
+
+struct StripTask {
+    EncodeJob* job;
+    unsigned int strip;
+};
+
+struct FrameEncoder {
+    std::string prefix;
+    ReadbackRing* ring;
+    unsigned int depth;
+    bool direct_io;
+    std::vector<std::thread> workers;
+    std::thread writer;
+
+    // guarded by lock
+    std::mutex lock;
+    std::condition_variable task_ready;
+    std::condition_variable job_done;
+    std::condition_variable space;
+    std::deque<StripTask> tasks;
+    std::deque<EncodeJob*> done;
+    unsigned int in_flight;
+    bool stopping;
+
+    // reported by encoder_stop
+    unsigned int max_depth;
+    unsigned int frames_written;
+    double blocked_seconds;
+};
+
+static unsigned int crc_table[256];
+
+static void crc_init() {
+    unsigned int n, k;
+    for(n = 0; n < 256; n++) {
+        unsigned int c = n;
+        for(k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+static unsigned int crc32_update(unsigned int crc, const unsigned char* data, size_t length) {
+    size_t i;
+    crc = ~crc;
+    for(i = 0; i < length; i++) crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static unsigned int adler32_update(unsigned int adler, const unsigned char* data, size_t length) {
+    unsigned int a = adler & 0xFFFF, b = adler >> 16;
+    while(length > 0) {
+        // largest run before the sums can overflow
+        size_t run = length < 5552 ? length : 5552;
+        length -= run;
+        while(run--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+/**
+ * Checksum of two concatenated runs from the checksums of each, as in zlib.
+ */
+static unsigned int adler32_combine_runs(unsigned int adler1, unsigned int adler2, size_t length2) {
+    const unsigned int base = 65521;
+    const unsigned int rem = (unsigned int)(length2 % base);
+    unsigned int sum1 = adler1 & 0xFFFF;
+    unsigned int sum2 = (unsigned int)(((unsigned long long)rem * sum1) % base);
+    sum1 += (adler2 & 0xFFFF) + base - 1;
+    sum2 += ((adler1 >> 16) & 0xFFFF) + ((adler2 >> 16) & 0xFFFF) + base - rem;
+    if(sum1 >= base) sum1 -= base;
+    if(sum1 >= base) sum1 -= base;
+    if(sum2 >= (base << 1)) sum2 -= (base << 1);
+    if(sum2 >= base) sum2 -= base;
+    return sum1 | (sum2 << 16);
+}
+
+static void put_u32(unsigned char* p, unsigned int v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+/**
+ * Appends a PNG chunk with its length and CRC.
+ */
+static void put_chunk(std::vector<unsigned char>* out, const char* type, const unsigned char* data, size_t length) {
+    const size_t start = out->size();
+    out->resize(start + 12 + length);
+    unsigned char* p = &(*out)[start];
+    put_u32(p, (unsigned int)length);
+    memcpy(p + 4, type, 4);
+    if(length > 0) memcpy(p + 8, data, length);
+    put_u32(p + 8 + length, crc32_update(0, p + 4, length + 4));
+}
+
+/**
+ * Raw deflate of one strip. Strips are separate streams ending on a byte
+ * boundary, only the last one sets the final block bit, so they can be
+ * concatenated into a single zlib stream.
+ */
+static void deflate_strip(const std::vector<unsigned char>& raw, bool last, std::vector<unsigned char>* out) {
+#ifdef HAVE_ZLIB
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    out->resize(deflateBound(&stream, (uLong)raw.size()) + 16);
+    stream.next_in = (Bytef*)&raw[0];
+    stream.avail_in = (uInt)raw.size();
+    stream.next_out = &(*out)[0];
+    stream.avail_out = (uInt)out->size();
+    deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    out->resize(stream.total_out);
+    deflateEnd(&stream);
+#else
+    // without zlib the rows go out as stored blocks
+    size_t offset = 0;
+    out->clear();
+    while(offset < raw.size()) {
+        const size_t length = raw.size() - offset < DEFLATE_STORED_MAX ? raw.size() - offset : DEFLATE_STORED_MAX;
+        const bool final_block = last && offset + length == raw.size();
+        out->push_back(final_block ? 1 : 0);
+        out->push_back((unsigned char)length);
+        out->push_back((unsigned char)(length >> 8));
+        out->push_back((unsigned char)~length);
+        out->push_back((unsigned char)(~length >> 8));
+        out->insert(out->end(), raw.begin() + offset, raw.begin() + offset + length);
+        offset += length;
+    }
+#endif
+}
+
+/**
+ * Filters and compresses one strip of output rows into an IDAT chunk.
+ * Texture rows start at the bottom of the image, so output row r is
+ * texture row height - 1 - r. Rows use the Up filter.
+ */
+static void encode_strip(EncodeJob* job, unsigned int strip) {
+    const Frame* frame = &job->frame;
+    const unsigned int first = strip * ENCODER_STRIP_ROWS;
+    const unsigned int last = first + ENCODER_STRIP_ROWS < frame->height ? first + ENCODER_STRIP_ROWS : frame->height;
+    const size_t row_size = 1 + (size_t)frame->width * 3;
+    std::vector<unsigned char> raw((last - first) * row_size);
+    std::vector<unsigned char> compressed;
+    unsigned int r, x, c;
+
+    for(r = first; r < last; r++) {
+        const unsigned char* src = frame->pixels + (size_t)(frame->height - 1 - r) * frame->stride;
+        const unsigned char* above = r > 0 ? src + frame->stride : NULL;
+        unsigned char* dst = &raw[(r - first) * row_size];
+        *dst++ = above ? 2 : 0;
+        for(x = 0; x < frame->width; x++)
+            for(c = 0; c < 3; c++)
+                *dst++ = (unsigned char)(src[4 * x + c] - (above ? above[4 * x + c] : 0));
+    }
+
+    job->adlers[strip] = adler32_update(1, &raw[0], raw.size());
+    job->raw_sizes[strip] = raw.size();
+    deflate_strip(raw, last == frame->height, &compressed);
+    put_chunk(&job->chunks[strip], "IDAT", &compressed[0], compressed.size());
+}
+
+static void encode_worker(FrameEncoder* encoder) {
+    while(1) {
+        StripTask task;
+        {
+            std::unique_lock<std::mutex> guard(encoder->lock);
+            while(encoder->tasks.empty() && !encoder->stopping) encoder->task_ready.wait(guard);
+            if(encoder->tasks.empty()) return;
+            task = encoder->tasks.front();
+            encoder->tasks.pop_front();
+        }
+
+        encode_strip(task.job, task.strip);
+
+        if(--task.job->remaining == 0) {
+            std::lock_guard<std::mutex> guard(encoder->lock);
+            encoder->done.push_back(task.job);
+            encoder->job_done.notify_one();
+        }
+    }
+}
+
+static unsigned char* alloc_aligned(size_t size) {
+#ifdef _WIN32
+    return (unsigned char*)_aligned_malloc(size, ENCODER_ALIGNMENT);
+#else
+    void* p = NULL;
+    return posix_memalign(&p, ENCODER_ALIGNMENT, size) == 0 ? (unsigned char*)p : NULL;
+#endif
+}
+
+static void free_aligned(unsigned char* p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+/**
+ * Writes a whole file in one call. data is padded to ENCODER_ALIGNMENT so
+ * it can bypass the page cache with O_DIRECT, the file is truncated back
+ * to size afterwards.
+ */
+static void write_file(const char* path, const unsigned char* data, size_t size, size_t padded, bool direct_io) {
+#ifdef __linux__
+    int fd = -1;
+    if(direct_io) fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    // not every file system supports O_DIRECT
+    if(fd < 0) {
+        direct_io = false;
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if(fd < 0) {
+        fprintf(stderr, "Failed to open %s for writing.\n", path);
+        return;
+    }
+    const size_t length = direct_io ? padded : size;
+    size_t written = 0;
+    while(written < length) {
+        const ssize_t n = write(fd, data + written, length - written);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) {
+            fprintf(stderr, "Failed to write %s.\n", path);
+            break;
+        }
+        written += n;
+    }
+    if(direct_io && ftruncate(fd, size) != 0) fprintf(stderr, "Failed to truncate %s.\n", path);
+    close(fd);
+#else
+    FILE* fp = fopen(path, "wb");
+    if(!fp) {
+        fprintf(stderr, "Failed to open %s for writing.\n", path);
+        return;
+    }
+    // one large write, no point buffering it again
+    setvbuf(fp, NULL, _IONBF, 0);
+    fwrite(data, 1, size, fp);
+    fclose(fp);
+#endif
+}
+
+/**
+ * Assembles the chunks of a finished frame into one aligned buffer and
+ * writes it out.
+ */
+static void write_png(FrameEncoder* encoder, EncodeJob* job) {
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    // deflate with a 32K window, default level
+    static const unsigned char zlib_header[2] = { 0x78, 0x9C };
+    std::vector<unsigned char> head, tail;
+    unsigned char ihdr[13], trailer[4];
+    unsigned int adler = 1;
+    size_t i, size, offset;
+    char path[1024];
+
+    put_u32(ihdr, job->frame.width);
+    put_u32(ihdr + 4, job->frame.height);
+    ihdr[8] = 8;    // bit depth
+    ihdr[9] = 2;    // RGB
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    head.insert(head.end(), signature, signature + 8);
+    put_chunk(&head, "IHDR", ihdr, sizeof(ihdr));
+    put_chunk(&head, "IDAT", zlib_header, sizeof(zlib_header));
+
+    for(i = 0; i < job->chunks.size(); i++)
+        adler = adler32_combine_runs(adler, job->adlers[i], job->raw_sizes[i]);
+    put_u32(trailer, adler);
+    put_chunk(&tail, "IDAT", trailer, sizeof(trailer));
+    put_chunk(&tail, "IEND", NULL, 0);
+
+    size = head.size() + tail.size();
+    for(i = 0; i < job->chunks.size(); i++) size += job->chunks[i].size();
+    const size_t padded = (size + ENCODER_ALIGNMENT - 1) / ENCODER_ALIGNMENT * ENCODER_ALIGNMENT;
+
+    unsigned char* buffer = alloc_aligned(padded);
+    if(!buffer) {
+        fprintf(stderr, "Out of memory encoding frame %u.\n", job->frame.index);
+        return;
+    }
+    memcpy(buffer, &head[0], head.size());
+    offset = head.size();
+    for(i = 0; i < job->chunks.size(); i++) {
+        memcpy(buffer + offset, &job->chunks[i][0], job->chunks[i].size());
+        offset += job->chunks[i].size();
+    }
+    memcpy(buffer + offset, &tail[0], tail.size());
+    memset(buffer + size, 0, padded - size);
+
+    snprintf(path, sizeof(path), "%s%05u.png", encoder->prefix.c_str(), job->frame.index);
+    write_file(path, buffer, size, padded, encoder->direct_io);
+    free_aligned(buffer);
+}
+
+static void write_worker(FrameEncoder* encoder) {
+    while(1) {
+        EncodeJob* job;
+        {
+            std::unique_lock<std::mutex> guard(encoder->lock);
+            while(encoder->done.empty() && !(encoder->stopping && encoder->in_flight == 0)) encoder->job_done.wait(guard);
+            if(encoder->done.empty()) return;
+            job = encoder->done.front();
+            encoder->done.pop_front();
+        }
+
+        write_png(encoder, job);
+        readback_release(encoder->ring, &job->frame);
+        delete job;
+
+        std::lock_guard<std::mutex> guard(encoder->lock);
+        encoder->in_flight--;
+        encoder->frames_written++;
+        encoder->space.notify_one();
+        if(encoder->stopping && encoder->in_flight == 0) encoder->job_done.notify_all();
+    }
+}
+
+/**
+ * Starts threads compression workers, all cores but one when 0, and a
+ * writer for files named prefix followed by the frame index. At most depth
+ * frames are queued.
+ */
+FrameEncoder* encoder_start(const char* prefix, ReadbackRing* ring, unsigned int threads, unsigned int depth, int direct_io) {
+    FrameEncoder* encoder = new FrameEncoder();
+    unsigned int i;
+
+    crc_init();
+    encoder->prefix = prefix;
+    encoder->ring = ring;
+    encoder->depth = depth > 0 ? depth : 1;
+    encoder->direct_io = direct_io != 0;
+    encoder->in_flight = 0;
+    encoder->stopping = false;
+    encoder->max_depth = 0;
+    encoder->frames_written = 0;
+    encoder->blocked_seconds = 0;
+
+    if(threads == 0) threads = std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 1;
+    for(i = 0; i < threads; i++) encoder->workers.push_back(std::thread(encode_worker, encoder));
+    encoder->writer = std::thread(write_worker, encoder);
+
+#ifndef HAVE_ZLIB
+    printf("Encoder built without zlib, frames are stored uncompressed.\n");
+#endif
+    return encoder;
+}
+
+/**
+ * Queues a mapped frame without copying it and returns at once, unless
+ * depth frames are already waiting.
+ */
+void encoder_submit(FrameEncoder* encoder, const Frame* frame) {
+    EncodeJob* job = new EncodeJob();
+    const unsigned int strips = (frame->height + ENCODER_STRIP_ROWS - 1) / ENCODER_STRIP_ROWS;
+    unsigned int s;
+
+    job->frame = *frame;
+    job->chunks.resize(strips);
+    job->adlers.resize(strips);
+    job->raw_sizes.resize(strips);
+    job->remaining = strips;
+
+    std::unique_lock<std::mutex> guard(encoder->lock);
+    if(encoder->in_flight >= encoder->depth) {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while(encoder->in_flight >= encoder->depth) encoder->space.wait(guard);
+        encoder->blocked_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    encoder->in_flight++;
+    if(encoder->in_flight > encoder->max_depth) encoder->max_depth = encoder->in_flight;
+    for(s = 0; s < strips; s++) {
+        StripTask task = { job, s };
+        encoder->tasks.push_back(task);
+    }
+    encoder->task_ready.notify_all();
+}
+
+/**
+ * Frames queued or being encoded.
+ */
+unsigned int encoder_depth(FrameEncoder* encoder) {
+    std::lock_guard<std::mutex> guard(encoder->lock);
+    return encoder->in_flight;
+}
+
+/**
+ * Finishes every queued frame, stops the threads and reports the queue.
+ */
+void encoder_stop(FrameEncoder* encoder) {
+    size_t i;
+    {
+        std::lock_guard<std::mutex> guard(encoder->lock);
+        encoder->stopping = true;
+        encoder->task_ready.notify_all();
+        encoder->job_done.notify_all();
+    }
+    for(i = 0; i < encoder->workers.size(); i++) encoder->workers[i].join();
+    encoder->writer.join();
+
+    printf("Encoder: %u frames, max queue depth %u of %u, trace loop blocked %.2f s\n",
+        encoder->frames_written, encoder->max_depth, encoder->depth, encoder->blocked_seconds);
+    delete encoder;
+}
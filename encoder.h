@@ -0,0 +1,20 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include "readback.h"
+
+/**
+ * Asynchronous PNG encoder for captured frames. Frames wait in a bounded
+ * queue, their rows are filtered and compressed in strips on a pool of
+ * threads and a writer thread puts each file out with one large aligned
+ * write. Frames are read straight from the mapped staging buffers and
+ * released to the readback ring once written.
+ */
+typedef struct FrameEncoder FrameEncoder;
+
+FrameEncoder* encoder_start(const char* prefix, ReadbackRing* ring, unsigned int threads, unsigned int depth, int direct_io);
+void encoder_submit(FrameEncoder* encoder, const Frame* frame);
+unsigned int encoder_depth(FrameEncoder* encoder);
+void encoder_stop(FrameEncoder* encoder);
+
+#endif
@@ -0,0 +1,209 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "environment.h"
+#include "scene.h"
+
+// angular radius of the procedural sky's sun in radians and its radiance,
+// about as much light as the rest of the sky together
+#define SKY_SUN_RADIUS 0.03f
+#define SKY_SUN_RADIANCE 400.0f
+
+static float env_luminance(const float* rgb) {
+    return 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+}
+
+/**
+ * Allocates a black map, without texels or CDF until environment_build.
+ */
+void environment_init(Environment* env, unsigned int width, unsigned int height) {
+    memset(env, 0, sizeof(Environment));
+    env->info.width = width;
+    env->info.height = height;
+    env->info.intensity = 1.0f;
+    env->radiance = (float*) calloc((size_t)width * height * 3, sizeof(float));
+}
+
+void environment_free(Environment* env) {
+    free(env->radiance);
+    free(env->texels);
+    free(env->cdf);
+    memset(env, 0, sizeof(Environment));
+}
+
+size_t environment_cdf_size(const Environment* env) {
+    return (env->info.height + 1) + (size_t)env->info.height * (env->info.width + 1);
+}
+
+/**
+ * Reads one scanline of RGBE pixels, run length encoded per channel as
+ * Radiance has written them since 1991, or flat. The older per pixel run
+ * length encoding is not supported. Returns 0 on a short or broken file.
+ */
+static int hdr_read_scanline(FILE* file, unsigned char* scanline, unsigned int width) {
+    unsigned char head[4];
+    unsigned int c, x;
+    int count, value;
+
+    if(fread(head, 1, 4, file) != 4) return 0;
+    if(width < 8 || width > 0x7FFF || head[0] != 2 || head[1] != 2 || (unsigned int)((head[2] << 8) | head[3]) != width) {
+        memcpy(scanline, head, 4);
+        return fread(scanline + 4, 4, width - 1, file) == width - 1;
+    }
+
+    for(c = 0; c < 4; c++) {
+        for(x = 0; x < width;) {
+            count = getc(file);
+            if(count == EOF || count == 0 || count == 128) return 0;
+            if(count > 128) {
+                count -= 128;
+                value = getc(file);
+                if(value == EOF || x + count > width) return 0;
+                while(count--) scanline[4 * x++ + c] = (unsigned char)value;
+            } else {
+                if(x + count > width) return 0;
+                while(count--) {
+                    value = getc(file);
+                    if(value == EOF) return 0;
+                    scanline[4 * x++ + c] = (unsigned char)value;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * Loads an equirectangular Radiance .hdr file in the usual -Y +X
+ * orientation, top row looking up. Returns 0 and leaves env empty on
+ * failure.
+ */
+int environment_load_hdr(Environment* env, const char* path) {
+    FILE* file = fopen(path, "rb");
+    char line[256];
+    unsigned char* scanline;
+    unsigned int x, y, c;
+    int width, height, ok = 0;
+
+    memset(env, 0, sizeof(Environment));
+    if(!file) {
+        fprintf(stderr, "Could not open environment %s\n", path);
+        return 0;
+    }
+
+    if(!fgets(line, sizeof(line), file) || strncmp(line, "#?", 2) != 0) {
+        fprintf(stderr, "%s is not a Radiance HDR file\n", path);
+        fclose(file);
+        return 0;
+    }
+    // header lines up to a blank one, only the pixel format matters
+    while(fgets(line, sizeof(line), file) && line[0] != '\n') {
+        if(strncmp(line, "FORMAT=", 7) == 0 && strncmp(line + 7, "32-bit_rle_rgbe", 15) != 0) {
+            fprintf(stderr, "%s: unsupported format %s", path, line + 7);
+            fclose(file);
+            return 0;
+        }
+    }
+    if(!fgets(line, sizeof(line), file) || sscanf(line, "-Y %d +X %d", &height, &width) != 2 ||
+            width <= 0 || height <= 0) {
+        fprintf(stderr, "%s: unsupported resolution line\n", path);
+        fclose(file);
+        return 0;
+    }
+
+    environment_init(env, width, height);
+    scanline = (unsigned char*) malloc(4 * (size_t)width);
+    for(y = 0; y < (unsigned int)height; y++) {
+        if(!hdr_read_scanline(file, scanline, width)) break;
+        for(x = 0; x < (unsigned int)width; x++) {
+            const unsigned char* rgbe = &scanline[4 * x];
+            float* rgb = &env->radiance[3 * ((size_t)y * width + x)];
+            // the mantissas are the lower edges of their intervals
+            const float f = rgbe[3] ? ldexpf(1.0f, rgbe[3] - (128 + 8)) : 0.0f;
+            for(c = 0; c < 3; c++) rgb[c] = rgbe[3] ? (rgbe[c] + 0.5f) * f : 0.0f;
+        }
+    }
+    ok = y == (unsigned int)height;
+    free(scanline);
+    fclose(file);
+
+    if(!ok) {
+        fprintf(stderr, "%s: truncated or corrupt after %u of %d rows\n", path, y, height);
+        environment_free(env);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Procedural stand-in when no map is given: a blue gradient sky with a
+ * small bright sun behind the default camera and dark ground below the
+ * horizon.
+ */
+void environment_sky(Environment* env, unsigned int width, unsigned int height) {
+    const float zenith[3] = { 0.15f, 0.3f, 0.8f };
+    const float horizon[3] = { 0.7f, 0.75f, 0.85f };
+    const float ground[3] = { 0.15f, 0.13f, 0.1f };
+    const float sun[3] = { -0.5f, 0.7f, -0.5f };
+    const float sun_length = sqrtf(sun[0] * sun[0] + sun[1] * sun[1] + sun[2] * sun[2]);
+    unsigned int x, y, c;
+
+    environment_init(env, width, height);
+    for(y = 0; y < height; y++) {
+        const float theta = (float)M_PI * (y + 0.5f) / height;
+        for(x = 0; x < width; x++) {
+            const float phi = 2.0f * (float)M_PI * ((x + 0.5f) / width - 0.5f);
+            const float d[3] = { sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi) };
+            float* rgb = &env->radiance[3 * ((size_t)y * width + x)];
+            const float t = d[1] > 0 ? powf(1.0f - d[1], 3.0f) : 0;
+            const float to_sun = (d[0] * sun[0] + d[1] * sun[1] + d[2] * sun[2]) / sun_length;
+
+            for(c = 0; c < 3; c++) {
+                rgb[c] = d[1] > 0 ? zenith[c] + t * (horizon[c] - zenith[c]) : ground[c];
+                if(to_sun > cosf(SKY_SUN_RADIUS)) rgb[c] += SKY_SUN_RADIANCE;
+            }
+        }
+    }
+}
+
+/**
+ * Packs the texels and builds the piecewise constant 2D distribution
+ * (Pharr et al., PBRT 13.6.5) the kernels importance sample the map with.
+ * Texels are weighted by luminance and by the sine of their row's polar
+ * angle, which is how much solid angle they cover. Rows or maps without
+ * any light fall back to uniform CDFs.
+ */
+void environment_build(Environment* env) {
+    const unsigned int width = env->info.width, height = env->info.height;
+    unsigned int x, y;
+    float* marginal;
+
+    free(env->texels);
+    free(env->cdf);
+    env->texels = (cl_uint*) malloc(sizeof(cl_uint) * width * height);
+    env->cdf = (float*) malloc(sizeof(float) * environment_cdf_size(env));
+    marginal = env->cdf;
+
+    marginal[0] = 0;
+    for(y = 0; y < height; y++) {
+        const float sin_theta = sinf((float)M_PI * (y + 0.5f) / height);
+        float* conditional = env->cdf + (height + 1) + (size_t)y * (width + 1);
+
+        conditional[0] = 0;
+        for(x = 0; x < width; x++) {
+            const float* rgb = &env->radiance[3 * ((size_t)y * width + x)];
+            env->texels[y * width + x] = rgb9e5_encode(rgb);
+            conditional[x + 1] = conditional[x] + env_luminance(rgb) * sin_theta / width;
+        }
+
+        const float row = conditional[width];
+        for(x = 1; x <= width; x++) conditional[x] = row > 0 ? conditional[x] / row : (float)x / width;
+        marginal[y + 1] = marginal[y] + row / height;
+    }
+
+    env->info.integral = marginal[height];
+    for(y = 1; y <= height; y++)
+        marginal[y] = env->info.integral > 0 ? marginal[y] / env->info.integral : (float)y / height;
+}
@@ -0,0 +1,51 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * What the kernels read about the environment, EnvironmentInfo in
+ * kernels/scene.cl. integral is the mean of the sampling function over
+ * the map, intensity scales the radiance.
+ */
+typedef struct {
+    cl_uint width;
+    cl_uint height;
+    cl_float integral;
+    cl_float intensity;
+} EnvironmentInfo;
+
+/**
+ * Equirectangular map of the radiance arriving from infinitely far away.
+ * Row 0 looks straight up, columns go round the y axis. radiance holds RGB
+ * floats, texels the same packed as RGB9E5 for the kernels. cdf holds the
+ * marginal CDF over rows, height + 1 values, followed by the conditional
+ * CDF of each row, width + 1 values each. A width of 0 means no environment.
+ */
+typedef struct {
+    EnvironmentInfo info;
+    float* radiance;
+    cl_uint* texels;
+    float* cdf;
+} Environment;
+
+void environment_init(Environment* env, unsigned int width, unsigned int height);
+void environment_free(Environment* env);
+int environment_load_hdr(Environment* env, const char* path);
+void environment_sky(Environment* env, unsigned int width, unsigned int height);
+void environment_build(Environment* env);
+size_t environment_cdf_size(const Environment* env);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,17 @@
+/**
+ * Constants of the a-trous denoiser shared by the kernels and the host: the
+ * denoise program is built with this file ahead of denoise.cl, host code
+ * includes it as "kernels/atrous.h" so denoise_cpu filters the same way.
+ */
+#ifndef ATROUS_H
+#define ATROUS_H
+
+// pass flags of denoise_atrous
+#define DENOISE_DEMODULATE 1
+#define DENOISE_REMODULATE 2
+// keeps black albedo from dividing by zero
+#define DENOISE_ALBEDO_MIN 0.01f
+// B3 spline taps from the centre out, the 5x5 kernel is their outer product
+#define DENOISE_B3_WEIGHTS { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f }
+
+#endif
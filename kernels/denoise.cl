@@ -0,0 +1,67 @@
+/**
+ * Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) over the half
+ * float radiance, built with storage.cl and the -DFRAME_STORAGE of the
+ * trace. Each pass applies the 5x5 B3 spline kernel with taps step pixels
+ * apart, weighted by how alike the depth, normal and colour of the tap are
+ * to the centre. Colour is divided by albedo in the first pass and
+ * multiplied back in the last, so texture detail is not blurred. denoise.cpp
+ * has the same filter on the CPU, keep the two in step. The constants both
+ * use are in atrous.h.
+ */
+
+float4 denoise_albedo(__global const pixel_t* albedo, uint i)
+{
+    return max(load_pixel(albedo, i), DENOISE_ALBEDO_MIN);
+}
+
+float4 denoise_load(__global const half* in, __global const pixel_t* albedo, uint i, uint flags)
+{
+    float4 c = vload_half4(i, in);
+    if(flags & DENOISE_DEMODULATE) c /= denoise_albedo(albedo, i);
+    return c;
+}
+
+__kernel void denoise_atrous(__global const half* in, __global half* out,
+        __global const float* depth, __global const uint* normals, __global const pixel_t* albedo,
+        unsigned int width, unsigned int height, int step,
+        float sigma_color, float sigma_normal, float sigma_depth, unsigned int flags)
+{
+    const float kernel_weights[3] = DENOISE_B3_WEIGHTS;
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    const uint p = y * width + x;
+
+    const float4 cp = denoise_load(in, albedo, p, flags);
+    const float4 np = unpack_normal(normals[p]);
+    const float zp = depth[p];
+
+    float4 sum = 0;
+    float weights = 0;
+    for(int j = -2; j <= 2; j++) {
+        const int qy = y + j * step;
+        if(qy < 0 || qy >= (int)height) continue;
+        for(int i = -2; i <= 2; i++) {
+            const int qx = x + i * step;
+            if(qx < 0 || qx >= (int)width) continue;
+            const uint q = qy * width + qx;
+
+            const float4 cq = denoise_load(in, albedo, q, flags);
+            const float4 d = cp - cq;
+            const float w_color = exp(-dot(d.xyz, d.xyz) / (sigma_color * sigma_color + 1e-6f));
+            // relative depth difference, sky only blends with sky and has no normal
+            const float zq = depth[q];
+            const float w_normal = zp == MAXFLOAT ? 1.0f : pow(max(dot(np, unpack_normal(normals[q])), 0.0f), sigma_normal);
+            const float w_depth = zp == MAXFLOAT || zq == MAXFLOAT ? (zp == zq ? 1.0f : 0.0f)
+                : exp(-fabs(zp - zq) / (sigma_depth * zp * step * length((float2)(i, j)) + 1e-4f));
+
+            const float w = kernel_weights[abs(i)] * kernel_weights[abs(j)] * w_color * w_normal * w_depth;
+            sum += w * cq;
+            weights += w;
+        }
+    }
+
+    // the centre tap always has weight, weights is never 0
+    float4 c = sum / weights;
+    if(flags & DENOISE_REMODULATE) c *= denoise_albedo(albedo, p);
+    vstore_half4(c, p, out);
+}
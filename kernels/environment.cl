@@ -0,0 +1,71 @@
+/**
+ * Equirectangular environment map lighting rays that leave the scene, built
+ * after scene.cl. Row 0 looks straight up, u goes round the y axis. Texels
+ * are RGB9E5. cdf holds the marginal CDF over rows followed by each row's
+ * conditional CDF, built by environment_build in environment.cpp, so
+ * directions are drawn in proportion to luminance times solid angle.
+ */
+
+/**
+ * Environment buffers of the scene, gathered like Scene.
+ */
+typedef struct {
+    __global const EnvironmentInfo* info;
+    __global const uint* texels;
+    __global const float* cdf;
+} Environment;
+
+/**
+ * Index of the interval of a CDF of n intervals holding u, the last one
+ * whose start is not above it, so empty intervals are never picked.
+ */
+inline uint environment_search(__global const float* cdf, uint n, float u) {
+    uint lo = 0, hi = n;
+    while(hi - lo > 1) {
+        const uint mid = (lo + hi) / 2;
+        if(cdf[mid] <= u) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Radiance arriving along dir, which need not be normalised.
+ */
+float4 environment_radiance(const Environment* env, float4 dir) {
+    const uint width = env->info->width, height = env->info->height;
+    const float4 d = normalize((float4)(dir.xyz, 0));
+    const float u = atan2(d.z, d.x) * (0.5f / M_PI_F) + 0.5f;
+    const float v = acos(clamp(d.y, -1.0f, 1.0f)) * (1.0f / M_PI_F);
+    const uint x = (uint)clamp(u * width, 0.0f, width - 1.0f);
+    const uint y = (uint)clamp(v * height, 0.0f, height - 1.0f);
+    return rgb9e5_decode(env->texels[y * width + x]) * env->info->intensity;
+}
+
+/**
+ * Draws a direction from the map's luminance with the uniform numbers xi.
+ * Returns the radiance arriving along it and sets its density per unit
+ * solid angle in pdf, 0 where the map is black.
+ */
+float4 environment_sample(const Environment* env, float2 xi, float4* dir, float* pdf) {
+    const uint width = env->info->width, height = env->info->height;
+    __global const float* marginal = env->cdf;
+    const uint y = environment_search(marginal, height, xi.y);
+    __global const float* conditional = env->cdf + (height + 1) + y * (width + 1);
+    const uint x = environment_search(conditional, width, xi.x);
+
+    // continuous within the texel, so the same texel gives different directions
+    const float row = marginal[y + 1] - marginal[y];
+    const float column = conditional[x + 1] - conditional[x];
+    const float dv = row > 0 ? (xi.y - marginal[y]) / row : 0.5f;
+    const float du = column > 0 ? (xi.x - conditional[x]) / column : 0.5f;
+    const float theta = M_PI_F * (y + clamp(dv, 0.0f, 1.0f)) / height;
+    const float phi = 2.0f * M_PI_F * ((x + clamp(du, 0.0f, 1.0f)) / width - 0.5f);
+    const float sin_theta = sin(theta);
+    *dir = (float4)(sin_theta * cos(phi), cos(theta), sin_theta * sin(phi), 0);
+
+    // density over the map is row * height * column * width, its texels
+    // cover 2 pi^2 sin(theta) of solid angle per unit of uv
+    *pdf = sin_theta > 0 ? row * column * width * height / (2.0f * M_PI_F * M_PI_F * sin_theta) : 0;
+    return rgb9e5_decode(env->texels[y * width + x]) * env->info->intensity;
+}
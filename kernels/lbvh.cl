@@ -0,0 +1,246 @@
+/**
+ * Linear BVH builder for dynamic meshes, built together with scene.cl.
+ * A rebuild is a fixed number of linear passes:
+ *   lbvh_morton     30 bit Morton code and bounds of every primitive
+ *   radix sort      8 passes over the codes, primitive indices as values,
+ *                   see radix_sort.cl
+ *   lbvh_hierarchy  Karras 2012 split search, one work-item per internal node
+ *   lbvh_refit      bottom up bounds, optionally rotating treelets on the way
+ *                   where that does not make the subtree taller
+ * Node i of a mesh with n primitives lives at nodes[offset + i], node 0 is
+ * the root. Leaf children reference the primitive index within the mesh.
+ */
+
+/**
+ * Spreads the low 10 bits of v so there are two zero bits between each.
+ */
+uint expand_bits(uint v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+uint morton3(float3 p) {
+    p = clamp(p * 1024.0f, 0.0f, 1023.0f);
+    return (expand_bits((uint)p.x) << 2) | (expand_bits((uint)p.y) << 1) | expand_bits((uint)p.z);
+}
+
+__kernel void lbvh_morton(__global const Primitive* prims, uint first_prim, uint n, float4 mesh_min, float4 mesh_inv_extent,
+        __global uint* keys, __global uint* values, __global float4* leaf_bounds)
+{
+    const uint i = get_global_id(0);
+    if(i >= n) return;
+
+    __global const Primitive* prim = &prims[first_prim + i];
+    const float3 radius = (float3)(RADIUS((*prim)));
+    const float3 bmin = prim->pos.xyz - radius;
+    const float3 bmax = prim->pos.xyz + radius;
+
+    const float3 centroid = 0.5f * (bmin + bmax);
+    keys[i] = morton3((centroid - mesh_min.xyz) * mesh_inv_extent.xyz);
+    values[i] = i;
+
+    leaf_bounds[2 * i] = (float4)(bmin, 0);
+    leaf_bounds[2 * i + 1] = (float4)(bmax, 0);
+}
+
+/**
+ * Length of the common prefix of the keys at i and j, -1 outside the range.
+ * Equal keys fall back to comparing indices so every split is well defined.
+ */
+int lbvh_delta(__global const uint* keys, int n, int i, int j) {
+    if(j < 0 || j >= n) return -1;
+    const uint a = keys[i];
+    const uint b = keys[j];
+    if(a == b) return 32 + clz((uint)i ^ (uint)j);
+    return clz(a ^ b);
+}
+
+/**
+ * Child reference for position p in the sorted order: a leaf when the range
+ * it covers is a single key, otherwise internal node p.
+ */
+uint lbvh_child(__global const uint* values, uint p, int leaf) {
+    return leaf ? LBVH_LEAF | values[p] : p;
+}
+
+__kernel void lbvh_hierarchy(__global const uint* keys, __global const uint* values, uint n,
+        __global LBVHNode* nodes, uint offset, __global uint* parents, __global uint* visits)
+{
+    const int i = get_global_id(0);
+    const int count = n;
+
+    // a single primitive still gets a root node
+    if(count == 1) {
+        if(i == 0) {
+            nodes[offset].left = LBVH_LEAF | values[0];
+            nodes[offset].right = LBVH_LEAF | values[0];
+            parents[count - 1] = 0;
+            visits[0] = 1;
+        }
+        return;
+    }
+    if(i >= count - 1) return;
+
+    // direction of the range covered by node i
+    const int d = lbvh_delta(keys, count, i, i + 1) - lbvh_delta(keys, count, i, i - 1) >= 0 ? 1 : -1;
+    const int delta_min = lbvh_delta(keys, count, i, i - d);
+
+    // upper bound for the range length, then binary search for the other end
+    int lmax = 2;
+    while(lbvh_delta(keys, count, i, i + lmax * d) > delta_min) lmax *= 2;
+    int l = 0;
+    for(int t = lmax / 2; t >= 1; t /= 2)
+        if(lbvh_delta(keys, count, i, i + (l + t) * d) > delta_min) l += t;
+    const int j = i + l * d;
+
+    // binary search for the split position
+    const int delta_node = lbvh_delta(keys, count, i, j);
+    int s = 0;
+    for(int div = 2; ; div *= 2) {
+        const int t = (l + div - 1) / div;
+        if(lbvh_delta(keys, count, i, i + (s + t) * d) > delta_node) s += t;
+        if(t == 1) break;
+    }
+    const int gamma = i + s * d + min(d, 0);
+
+    const int left_leaf = min(i, j) == gamma;
+    const int right_leaf = max(i, j) == gamma + 1;
+    nodes[offset + i].left = lbvh_child(values, gamma, left_leaf);
+    nodes[offset + i].right = lbvh_child(values, gamma + 1, right_leaf);
+
+    // leaves are indexed after the n - 1 internal nodes
+    parents[left_leaf ? count - 1 + gamma : gamma] = i;
+    parents[right_leaf ? count - 1 + gamma + 1 : gamma + 1] = i;
+    visits[i] = 0;
+}
+
+typedef struct {
+    float3 bmin;
+    float3 bmax;
+} Box;
+
+Box lbvh_bounds(volatile __global LBVHNode* nodes, uint offset, __global const float4* leaf_bounds, uint child) {
+    Box box;
+    if(child & LBVH_LEAF) {
+        const uint p = child & ~LBVH_LEAF;
+        box.bmin = leaf_bounds[2 * p].xyz;
+        box.bmax = leaf_bounds[2 * p + 1].xyz;
+    } else {
+        volatile __global LBVHNode* node = &nodes[offset + child];
+        box.bmin = (float3)(node->bmin[0], node->bmin[1], node->bmin[2]);
+        box.bmax = (float3)(node->bmax[0], node->bmax[1], node->bmax[2]);
+    }
+    return box;
+}
+
+Box lbvh_union(Box a, Box b) {
+    Box box;
+    box.bmin = fmin(a.bmin, b.bmin);
+    box.bmax = fmax(a.bmax, b.bmax);
+    return box;
+}
+
+float lbvh_area(Box box) {
+    const float3 e = box.bmax - box.bmin;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+void lbvh_store(volatile __global LBVHNode* node, Box box) {
+    node->bmin[0] = box.bmin.x;
+    node->bmin[1] = box.bmin.y;
+    node->bmin[2] = box.bmin.z;
+    node->bmax[0] = box.bmax.x;
+    node->bmax[1] = box.bmax.y;
+    node->bmax[2] = box.bmax.z;
+}
+
+/**
+ * Levels below child, 0 for a leaf.
+ */
+uint lbvh_height(volatile __global uint* heights, uint child) {
+    return (child & LBVH_LEAF) ? 0 : heights[child];
+}
+
+/**
+ * Three node treelet rotation at an internal child c of a finished node:
+ * swaps the sibling of c with whichever grandchild gives c the smallest
+ * surface area. The leaves under the node are unchanged so its own bounds
+ * stay valid, and nothing else touches a finished subtree. Swaps that would
+ * make the node taller are skipped, so the tree is never deeper than the
+ * Karras hierarchy and traversal stays within STACK_SIZE.
+ */
+void lbvh_rotate(volatile __global LBVHNode* nodes, uint offset, __global const float4* leaf_bounds,
+        volatile __global uint* heights, uint node, int c_is_left) {
+    volatile __global LBVHNode* parent = &nodes[offset + node];
+    const uint c = c_is_left ? parent->left : parent->right;
+    const uint sibling = c_is_left ? parent->right : parent->left;
+    if(c & LBVH_LEAF) return;
+
+    volatile __global LBVHNode* child = &nodes[offset + c];
+    const Box a = lbvh_bounds(nodes, offset, leaf_bounds, child->left);
+    const Box b = lbvh_bounds(nodes, offset, leaf_bounds, child->right);
+    const Box s = lbvh_bounds(nodes, offset, leaf_bounds, sibling);
+
+    const uint ha = lbvh_height(heights, child->left);
+    const uint hb = lbvh_height(heights, child->right);
+    const uint hs = lbvh_height(heights, sibling);
+    const uint height = 1 + max(hs, 1 + max(ha, hb));
+
+    const float keep = lbvh_area(lbvh_union(a, b));
+    float swap_left = lbvh_area(lbvh_union(s, b));
+    float swap_right = lbvh_area(lbvh_union(a, s));
+    if(1 + max(ha, 1 + max(hs, hb)) > height) swap_left = INFINITY;
+    if(1 + max(hb, 1 + max(ha, hs)) > height) swap_right = INFINITY;
+
+    if(swap_left < keep && swap_left <= swap_right) {
+        // sibling moves under c, c's left child moves up
+        const uint up = child->left;
+        child->left = sibling;
+        if(c_is_left) parent->right = up; else parent->left = up;
+        lbvh_store(child, lbvh_union(s, b));
+        heights[c] = 1 + max(hs, hb);
+    } else if(swap_right < keep) {
+        const uint up = child->right;
+        child->right = sibling;
+        if(c_is_left) parent->right = up; else parent->left = up;
+        lbvh_store(child, lbvh_union(a, s));
+        heights[c] = 1 + max(ha, hs);
+    }
+}
+
+/**
+ * One work-item per leaf walks towards the root. The first to reach a node
+ * stops, the second knows both children are final and fits the node.
+ */
+__kernel void lbvh_refit(volatile __global LBVHNode* nodes, uint offset, __global const float4* leaf_bounds,
+        __global const uint* parents, volatile __global uint* visits, volatile __global uint* heights,
+        uint n, uint optimize)
+{
+    const uint i = get_global_id(0);
+    if(i >= n) return;
+
+    uint node = parents[n - 1 + i];
+    while(1) {
+        if(atomic_inc(&visits[node]) == 0) return;
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+        if(optimize) {
+            lbvh_rotate(nodes, offset, leaf_bounds, heights, node, 1);
+            lbvh_rotate(nodes, offset, leaf_bounds, heights, node, 0);
+        }
+
+        const uint l = nodes[offset + node].left;
+        const uint r = nodes[offset + node].right;
+        const Box left = lbvh_bounds(nodes, offset, leaf_bounds, l);
+        const Box right = lbvh_bounds(nodes, offset, leaf_bounds, r);
+        lbvh_store(&nodes[offset + node], lbvh_union(left, right));
+        heights[node] = 1 + max(lbvh_height(heights, l), lbvh_height(heights, r));
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+        if(node == 0) return;
+        node = parents[node];
+    }
+}
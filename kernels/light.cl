@@ -0,0 +1,115 @@
+/**
+ * Sphere and quad area lights, built after scene.cl. Samples come with their
+ * density per unit solid angle, so trace.cl can weigh light and BSDF
+ * samples against each other. Values must match scene.h.
+ */
+#define LIGHT_SPHERE 0
+#define LIGHT_QUAD 1
+
+/**
+ * Area light, see scene.h.
+ */
+typedef struct {
+    float4 position;
+    float4 edge0;
+    float4 edge1;
+    uint radiance;
+    uint type;
+    float radius;
+    float area;
+} Light;
+
+/**
+ * Two unit vectors completing n to an orthonormal basis (Duff et al. 2017).
+ */
+inline void orthonormal_basis(float4 n, float4* t, float4* b) {
+    const float sign = n.z >= 0 ? 1.0f : -1.0f;
+    const float a = -1.0f / (sign + n.z);
+    const float c = n.x * n.y * a;
+    *t = (float4)(1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x, 0);
+    *b = (float4)(c, sign + n.y * n.y * a, -n.y, 0);
+}
+
+/**
+ * Distance along the normalised dir from origin to the emitting surface of
+ * a light, MAXFLOAT if the ray misses it or sees a quad from behind.
+ */
+float light_intersect(__global const Light* light, float4 origin, float4 dir) {
+    if(light->type == LIGHT_SPHERE) {
+        const float4 v = light->position - origin;
+        const float b = dot(v, dir);
+        const float d2 = dot(v, v) - b * b;
+        const float r2 = light->radius * light->radius;
+        if(d2 > r2) return MAXFLOAT;
+        const float h = sqrt(r2 - d2);
+        const float t = b - h > 0 ? b - h : b + h;
+        return t > 0 ? t : MAXFLOAT;
+    }
+
+    const float4 n = cross(light->edge0, light->edge1);
+    const float dn = dot(dir, n);
+    if(dn >= 0) return MAXFLOAT;
+    const float t = dot(light->position - origin, n) / dn;
+    if(t <= 0) return MAXFLOAT;
+    const float4 p = origin + t * dir - light->position;
+    const float u = dot(p, light->edge0) / dot(light->edge0, light->edge0);
+    const float v = dot(p, light->edge1) / dot(light->edge1, light->edge1);
+    return u >= 0 && u <= 1.0f && v >= 0 && v <= 1.0f ? t : MAXFLOAT;
+}
+
+/**
+ * Solid angle density with which light_sample picks the normalised dir
+ * from origin, dir reaching the light at distance t. Points inside a sphere
+ * light are not sampled and get 0.
+ */
+float light_pdf(__global const Light* light, float4 origin, float4 dir, float t) {
+    if(light->type == LIGHT_SPHERE) {
+        const float4 v = light->position - origin;
+        const float sin2 = light->radius * light->radius / dot(v, v);
+        if(sin2 >= 1.0f) return 0;
+        // 1 - cos of the cone, without the cancellation for distant lights
+        return (1.0f + sqrt(1.0f - sin2)) / (2.0f * M_PI_F * sin2);
+    }
+
+    const float4 n = cross(light->edge0, light->edge1);
+    const float cos_l = -dot(dir, n) / light->area;
+    return cos_l > 0 ? t * t / (light->area * cos_l) : 0;
+}
+
+/**
+ * Normalised direction from origin to a point on the light picked with the
+ * uniform numbers xi, its distance in t and its solid angle density in pdf.
+ * Spheres are sampled uniformly over the cone they subtend, quads uniformly
+ * over their area, so a stratified xi stays stratified over the light.
+ */
+float4 light_sample(__global const Light* light, float4 origin, float2 xi, float* t, float* pdf) {
+    if(light->type == LIGHT_SPHERE) {
+        const float4 v = light->position - origin;
+        const float d2 = dot(v, v);
+        const float r2 = light->radius * light->radius;
+        const float sin2 = r2 / d2;
+        *pdf = 0;
+        *t = 0;
+        if(sin2 >= 1.0f) return v;
+
+        const float one_minus_cos = sin2 / (1.0f + sqrt(1.0f - sin2));
+        const float cos_theta = 1.0f - xi.x * one_minus_cos;
+        const float sin_theta = sqrt(max(1.0f - cos_theta * cos_theta, 0.0f));
+        const float phi = 2.0f * M_PI_F * xi.y;
+        const float4 w = v * rsqrt(d2);
+        float4 u, b;
+        orthonormal_basis(w, &u, &b);
+
+        // nearest of the two points where dir meets the sphere
+        const float along = sqrt(d2) * cos_theta;
+        *t = along - sqrt(max(r2 - (d2 - along * along), 0.0f));
+        *pdf = 1.0f / (2.0f * M_PI_F * one_minus_cos);
+        return cos_theta * w + sin_theta * (cos(phi) * u + sin(phi) * b);
+    }
+
+    const float4 d = light->position + xi.x * light->edge0 + xi.y * light->edge1 - origin;
+    *t = length(d);
+    const float4 dir = d / *t;
+    *pdf = light_pdf(light, origin, dir, *t);
+    return dir;
+}
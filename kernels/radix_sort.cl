@@ -0,0 +1,150 @@
+/**
+ * Stable least significant digit radix sort of 32 or 64 bit keys with 32 bit
+ * values, built together with scan.cl. Every pass sorts RADIX_BITS bits:
+ *   radix_histogram_*  digit counts per work-group, stored digit major
+ *   scan               exclusive scan of the counts, see scan.cl
+ *   radix_scatter_*    stable scatter using the scanned counts
+ * Work-groups must be RADIX_GROUP_SIZE wide and each covers RADIX_BLOCK keys,
+ * a work-item owns RADIX_ITEMS consecutive keys so scattering them in order
+ * keeps the sort stable. The typed kernels only load keys and extract
+ * digits, counting and ranking are shared. Only core OpenCL 1.1 is used so
+ * it runs on CPU runtimes such as PoCL.
+ */
+#define RADIX_BITS 4
+#define RADIX_DIGITS (1 << RADIX_BITS)
+#define RADIX_GROUP_SIZE 128
+#define RADIX_ITEMS 8
+#define RADIX_BLOCK (RADIX_GROUP_SIZE * RADIX_ITEMS)
+// digit of keys past the end, never counted or moved
+#define RADIX_NONE RADIX_DIGITS
+
+/**
+ * Inclusive Hillis-Steele scan of RADIX_GROUP_SIZE values in local memory.
+ */
+void radix_local_scan(__local uint* sums, uint lid) {
+    for(uint offset = 1; offset < RADIX_GROUP_SIZE; offset <<= 1) {
+        const uint t = lid >= offset ? sums[lid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        sums[lid] += t;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+/**
+ * Adds the digits of this work-item's keys to the group histogram.
+ */
+void radix_histogram(const uint* digits, __local uint* counts, __global uint* hist) {
+    const uint lid = get_local_id(0);
+
+    if(lid < RADIX_DIGITS) counts[lid] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint k = 0; k < RADIX_ITEMS; k++)
+        if(digits[k] != RADIX_NONE) atomic_inc(&counts[digits[k]]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(lid < RADIX_DIGITS) hist[lid * get_num_groups(0) + get_group_id(0)] = counts[lid];
+}
+
+/**
+ * Turns digits into global destinations. ranks holds digit major counts per
+ * work-item, scanned in place, so an item's rank within the group is its
+ * scanned entry minus the digit start plus the same digits it already placed.
+ */
+void radix_rank(const uint* digits, uint* dst, __local uint* ranks, __local uint* sums, __global const uint* hist) {
+    const uint lid = get_local_id(0);
+    const uint group = get_group_id(0);
+    const uint num_groups = get_num_groups(0);
+    uint counts[RADIX_DIGITS];
+
+    for(uint d = 0; d < RADIX_DIGITS; d++) counts[d] = 0;
+    for(uint k = 0; k < RADIX_ITEMS; k++)
+        if(digits[k] != RADIX_NONE) counts[digits[k]]++;
+    for(uint d = 0; d < RADIX_DIGITS; d++) ranks[d * RADIX_GROUP_SIZE + lid] = counts[d];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // exclusive scan of the flattened table, each work-item owns RADIX_DIGITS entries
+    uint sum = 0;
+    for(uint k = 0; k < RADIX_DIGITS; k++) sum += ranks[lid * RADIX_DIGITS + k];
+    sums[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    radix_local_scan(sums, lid);
+
+    uint run = sums[lid] - sum;
+    for(uint k = 0; k < RADIX_DIGITS; k++) {
+        const uint v = ranks[lid * RADIX_DIGITS + k];
+        ranks[lid * RADIX_DIGITS + k] = run;
+        run += v;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint d = 0; d < RADIX_DIGITS; d++) counts[d] = 0;
+    for(uint k = 0; k < RADIX_ITEMS; k++) {
+        const uint d = digits[k];
+        if(d == RADIX_NONE) continue;
+        const uint rank = ranks[d * RADIX_GROUP_SIZE + lid] - ranks[d * RADIX_GROUP_SIZE] + counts[d]++;
+        dst[k] = hist[d * num_groups + group] + rank;
+    }
+}
+
+__kernel void radix_histogram_32(__global const uint* keys, uint n, uint shift, __global uint* hist)
+{
+    __local uint counts[RADIX_DIGITS];
+    const uint first = get_group_id(0) * RADIX_BLOCK + get_local_id(0) * RADIX_ITEMS;
+    uint digits[RADIX_ITEMS];
+
+    for(uint k = 0; k < RADIX_ITEMS; k++)
+        digits[k] = first + k < n ? (keys[first + k] >> shift) & (RADIX_DIGITS - 1) : RADIX_NONE;
+    radix_histogram(digits, counts, hist);
+}
+
+__kernel void radix_scatter_32(__global const uint* keys_in, __global const uint* values_in, uint n, uint shift,
+        __global const uint* hist, __global uint* keys_out, __global uint* values_out)
+{
+    __local uint ranks[RADIX_DIGITS * RADIX_GROUP_SIZE];
+    __local uint sums[RADIX_GROUP_SIZE];
+    const uint first = get_group_id(0) * RADIX_BLOCK + get_local_id(0) * RADIX_ITEMS;
+    uint digits[RADIX_ITEMS];
+    uint dst[RADIX_ITEMS];
+
+    for(uint k = 0; k < RADIX_ITEMS; k++)
+        digits[k] = first + k < n ? (keys_in[first + k] >> shift) & (RADIX_DIGITS - 1) : RADIX_NONE;
+    radix_rank(digits, dst, ranks, sums, hist);
+
+    for(uint k = 0; k < RADIX_ITEMS; k++) {
+        if(digits[k] == RADIX_NONE) continue;
+        keys_out[dst[k]] = keys_in[first + k];
+        values_out[dst[k]] = values_in[first + k];
+    }
+}
+
+__kernel void radix_histogram_64(__global const ulong* keys, uint n, uint shift, __global uint* hist)
+{
+    __local uint counts[RADIX_DIGITS];
+    const uint first = get_group_id(0) * RADIX_BLOCK + get_local_id(0) * RADIX_ITEMS;
+    uint digits[RADIX_ITEMS];
+
+    for(uint k = 0; k < RADIX_ITEMS; k++)
+        digits[k] = first + k < n ? (uint)(keys[first + k] >> shift) & (RADIX_DIGITS - 1) : RADIX_NONE;
+    radix_histogram(digits, counts, hist);
+}
+
+__kernel void radix_scatter_64(__global const ulong* keys_in, __global const uint* values_in, uint n, uint shift,
+        __global const uint* hist, __global ulong* keys_out, __global uint* values_out)
+{
+    __local uint ranks[RADIX_DIGITS * RADIX_GROUP_SIZE];
+    __local uint sums[RADIX_GROUP_SIZE];
+    const uint first = get_group_id(0) * RADIX_BLOCK + get_local_id(0) * RADIX_ITEMS;
+    uint digits[RADIX_ITEMS];
+    uint dst[RADIX_ITEMS];
+
+    for(uint k = 0; k < RADIX_ITEMS; k++)
+        digits[k] = first + k < n ? (uint)(keys_in[first + k] >> shift) & (RADIX_DIGITS - 1) : RADIX_NONE;
+    radix_rank(digits, dst, ranks, sums, hist);
+
+    for(uint k = 0; k < RADIX_ITEMS; k++) {
+        if(digits[k] == RADIX_NONE) continue;
+        keys_out[dst[k]] = keys_in[first + k];
+        values_out[dst[k]] = values_in[first + k];
+    }
+}
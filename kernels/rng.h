@@ -0,0 +1,87 @@
+/**
+ * Counter-based random numbers shared by the kernels and the host: the
+ * trace program is built with this file ahead of sampler.cl, host code
+ * includes it as "kernels/rng.h". Philox4x32-10 (Salmon et al. 2011) turns
+ * a 128 bit counter and a 64 bit key into 128 random bits with no state,
+ * so a value depends only on where it is used: the pixel's absolute
+ * coordinates are the key, the frame, sample and stream make up the
+ * counter. Any device, tile split or host thread draws the same numbers.
+ * Only plain C is used, both languages must accept it.
+ */
+#ifndef RNG_H
+#define RNG_H
+
+#ifdef __OPENCL_VERSION__
+#define RNG_FUNC inline
+#define RNG_MULHI(a, b) mul_hi((a), (b))
+#else
+#define RNG_FUNC static inline
+#define RNG_MULHI(a, b) (unsigned int)(((unsigned long long)(a) * (b)) >> 32)
+#endif
+
+// independent uses of the same pixel, sample and frame
+#define RNG_STREAM_SAMPLER 0
+#define RNG_STREAM_USER 16
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+/**
+ * Philox4x32-10 of counter under key, in place.
+ */
+RNG_FUNC void rng_philox(unsigned int* counter, unsigned int k0, unsigned int k1) {
+    int round;
+    for(round = 0; round < 10; round++) {
+        const unsigned int hi0 = RNG_MULHI(PHILOX_M0, counter[0]), lo0 = PHILOX_M0 * counter[0];
+        const unsigned int hi1 = RNG_MULHI(PHILOX_M1, counter[2]), lo1 = PHILOX_M1 * counter[2];
+        counter[0] = hi1 ^ counter[1] ^ k0;
+        counter[1] = lo1;
+        counter[2] = hi0 ^ counter[3] ^ k1;
+        counter[3] = lo0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+/**
+ * Random numbers of one pixel sample, drawn four at a time. Lives in
+ * registers, nothing is kept between kernel launches.
+ */
+typedef struct {
+    unsigned int key[2];
+    unsigned int counter[4];
+    unsigned int block[4];
+    unsigned int used;
+} Rng;
+
+RNG_FUNC void rng_init(Rng* rng, unsigned int x, unsigned int y, unsigned int frame, unsigned int sample, unsigned int stream) {
+    rng->key[0] = x;
+    rng->key[1] = y;
+    rng->counter[0] = sample;
+    rng->counter[1] = frame;
+    rng->counter[2] = stream;
+    rng->counter[3] = 0;
+    rng->used = 4;
+}
+
+RNG_FUNC unsigned int rng_uint(Rng* rng) {
+    if(rng->used == 4) {
+        int i;
+        for(i = 0; i < 4; i++) rng->block[i] = rng->counter[i];
+        rng_philox(rng->block, rng->key[0], rng->key[1]);
+        rng->counter[3]++;
+        rng->used = 0;
+    }
+    return rng->block[rng->used++];
+}
+
+/**
+ * Uniform in [0, 1), from the top 24 bits.
+ */
+RNG_FUNC float rng_float(Rng* rng) {
+    return (rng_uint(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+#endif
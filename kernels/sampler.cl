@@ -0,0 +1,140 @@
+/**
+ * Per-pixel sample sequences over the unit square, picked with -DSAMPLER,
+ * built after rng.h. Each pixel gets its own decorrelated copy of the
+ * sequence, keyed on its coordinates and the frame, so the first n samples
+ * of any pixel are well stratified and neighbouring pixels and frames do
+ * not repeat each other's pattern:
+ *   SAMPLER_GRID        cell centres of a grid x grid grid, then plain
+ *                       Halton points, the same in every pixel
+ *   SAMPLER_HALTON      Halton (2, 3), Owen scrambled per pixel
+ *   SAMPLER_SOBOL       Sobol (0, 2) sequence, shuffled and Owen scrambled
+ *                       per pixel (Burley 2020)
+ *   SAMPLER_BLUE_NOISE  Sobol, toroidally shifted per pixel by a tiled
+ *                       blue noise mask so the error of neighbouring
+ *                       pixels is spread to high frequencies, the tile
+ *                       moves every frame
+ * Values must match sampler.h.
+ */
+#define SAMPLER_GRID 0
+#define SAMPLER_HALTON 1
+#define SAMPLER_SOBOL 2
+#define SAMPLER_BLUE_NOISE 3
+
+#ifndef SAMPLER
+#define SAMPLER SAMPLER_SOBOL
+#endif
+
+// side of the blue noise tile, must match sampler.h
+#define BLUE_NOISE_SIZE 64
+// base 3 digits scrambled, 3^16 is past float precision
+#define HALTON3_DIGITS 16
+
+inline uint sampler_reverse_bits(uint x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00FF00FFu) << 8) | ((x & 0xFF00FF00u) >> 8);
+    x = ((x & 0x0F0F0F0Fu) << 4) | ((x & 0xF0F0F0F0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xCCCCCCCCu) >> 2);
+    return ((x & 0x55555555u) << 1) | ((x & 0xAAAAAAAAu) >> 1);
+}
+
+/**
+ * 32 bit integer hash, lowbias32 by Chris Wellons, for the base 3 digit
+ * permutations.
+ */
+inline uint sampler_hash(uint x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+/**
+ * Owen scramble of a 32 bit fraction, every bit flipped by a hash of the
+ * bits above it (Laine-Karras permutation on the reversed bits).
+ */
+inline uint sampler_owen(uint x, uint seed) {
+    x = sampler_reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return sampler_reverse_bits(x);
+}
+
+// the top 24 bits, so the float stays below 1
+inline float sampler_float(uint x) {
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+/**
+ * Second dimension of the Sobol sequence, the first is the bit reversed
+ * index.
+ */
+inline uint sobol_y(uint index) {
+    uint v = 0x80000000u, y = 0;
+    for(; index; index >>= 1, v ^= v >> 1)
+        if(index & 1) y ^= v;
+    return y;
+}
+
+/**
+ * Radical inverse of index in base 3. With seed non zero every digit is
+ * permuted by a hash of the digits below it, Owen scrambling in base 3.
+ */
+float halton3(uint index, uint seed) {
+    float y = 0, f = 1.0f;
+    uint prefix = 1;
+    for(int d = 0; d < HALTON3_DIGITS && (index || seed); d++) {
+        uint digit = index % 3;
+        index /= 3;
+        if(seed) {
+            // one of the 6 permutations of {0, 1, 2}: a rotation and a flip
+            const uint h = sampler_hash(seed ^ sampler_hash(prefix));
+            const uint flipped = (h & 8) ? 2 - digit : digit;
+            prefix = prefix * 3 + digit;
+            digit = (flipped + h % 3) % 3;
+        }
+        f /= 3;
+        y += f * digit;
+    }
+    // all 2s sum to 1 in float
+    return min(y, 0.99999994f);
+}
+
+/**
+ * Sample index of pixel (x, y) in frame, in [0, 1) squared. grid is the
+ * side of the SAMPLER_GRID grid, blue_noise the BLUE_NOISE_SIZE squared
+ * tile of shifts SAMPLER_BLUE_NOISE uses.
+ */
+float2 sample_2d(uint x, uint y, uint frame, uint index, uint grid, __global const float2* blue_noise) {
+#if SAMPLER == SAMPLER_GRID
+    if(index < grid * grid)
+        return ((float2)(index / grid, index % grid) + 0.5f) / grid;
+    return (float2)(sampler_float(sampler_reverse_bits(index)), halton3(index, 0));
+#else
+    Rng rng;
+#if SAMPLER == SAMPLER_BLUE_NOISE
+    // one tile offset per frame keeps the mask intact across the frame
+    rng_init(&rng, 0, 0, frame, 0, RNG_STREAM_SAMPLER);
+#else
+    rng_init(&rng, x, y, frame, 0, RNG_STREAM_SAMPLER);
+#endif
+    const uint seed = rng_uint(&rng);
+#if SAMPLER == SAMPLER_HALTON
+    return (float2)(sampler_float(sampler_owen(sampler_reverse_bits(index), seed)), halton3(index, rng_uint(&rng) | 1));
+#elif SAMPLER == SAMPLER_SOBOL
+    // shuffling the index keeps each pixel's prefix a (0, 2) net
+    const uint i = sampler_owen(index, seed);
+    const uint seed_x = rng_uint(&rng), seed_y = rng_uint(&rng);
+    return (float2)(sampler_float(sampler_owen(sampler_reverse_bits(i), seed_x)), sampler_float(sampler_owen(sobol_y(i), seed_y)));
+#else
+    const uint tx = (x + seed) % BLUE_NOISE_SIZE, ty = (y + (seed >> 16)) % BLUE_NOISE_SIZE;
+    const float2 shift = blue_noise[ty * BLUE_NOISE_SIZE + tx];
+    const float2 p = (float2)(sampler_float(sampler_reverse_bits(index)), sampler_float(sobol_y(index)));
+    return p + shift - floor(p + shift);
+#endif
+#endif
+}
@@ -0,0 +1,91 @@
+/**
+ * Work-efficient exclusive prefix sum and stream compaction over uints.
+ * scan_blocks runs the Blelloch up and down sweep over SCAN_BLOCK elements
+ * per work-group and writes each block total to block_sums. The host scans
+ * the block sums the same way and scan_add folds them back in, so a scan of
+ * n elements is O(n) work in O(log n) levels. Work-groups must be
+ * SCAN_GROUP_SIZE wide. Only core OpenCL 1.1 is used.
+ */
+#define SCAN_GROUP_SIZE 128
+#define SCAN_BLOCK (2 * SCAN_GROUP_SIZE)
+
+__kernel void scan_blocks(__global const uint* in, __global uint* out, __global uint* block_sums, uint n)
+{
+    __local uint temp[SCAN_BLOCK];
+    const uint lid = get_local_id(0);
+    const uint group = get_group_id(0);
+    const uint a = group * SCAN_BLOCK + 2 * lid;
+    const uint b = a + 1;
+
+    temp[2 * lid] = a < n ? in[a] : 0;
+    temp[2 * lid + 1] = b < n ? in[b] : 0;
+
+    // up sweep builds partial sums in place
+    uint offset = 1;
+    for(uint d = SCAN_BLOCK >> 1; d > 0; d >>= 1) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if(lid < d) {
+            const uint ai = offset * (2 * lid + 1) - 1;
+            const uint bi = offset * (2 * lid + 2) - 1;
+            temp[bi] += temp[ai];
+        }
+        offset <<= 1;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if(lid == 0) {
+        block_sums[group] = temp[SCAN_BLOCK - 1];
+        temp[SCAN_BLOCK - 1] = 0;
+    }
+
+    // down sweep turns them into an exclusive scan
+    for(uint d = 1; d < SCAN_BLOCK; d <<= 1) {
+        offset >>= 1;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if(lid < d) {
+            const uint ai = offset * (2 * lid + 1) - 1;
+            const uint bi = offset * (2 * lid + 2) - 1;
+            const uint t = temp[ai];
+            temp[ai] = temp[bi];
+            temp[bi] += t;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(a < n) out[a] = temp[2 * lid];
+    if(b < n) out[b] = temp[2 * lid + 1];
+}
+
+/**
+ * Adds the scanned total of all preceding blocks to every element.
+ */
+__kernel void scan_add(__global uint* data, __global const uint* block_sums, uint n)
+{
+    const uint i = get_global_id(0);
+    if(i < n) data[i] += block_sums[i / SCAN_BLOCK];
+}
+
+/**
+ * Writes values whose flag is set to out at their scanned position.
+ * The last work-item also stores how many values were kept.
+ */
+__kernel void compact_scatter(__global const uint* values, __global const uint* flags, __global const uint* positions,
+        uint n, __global uint* out, __global uint* count)
+{
+    const uint i = get_global_id(0);
+    if(i >= n) return;
+    if(flags[i]) out[positions[i]] = values[i];
+    if(i == n - 1) *count = positions[i] + (flags[i] ? 1 : 0);
+}
+
+/**
+ * Same as compact_scatter with the element index as the value.
+ */
+__kernel void compact_indices(__global const uint* flags, __global const uint* positions,
+        uint n, __global uint* out, __global uint* count)
+{
+    const uint i = get_global_id(0);
+    if(i >= n) return;
+    if(flags[i]) out[positions[i]] = i;
+    if(i == n - 1) *count = positions[i] + (flags[i] ? 1 : 0);
+}
@@ -0,0 +1,152 @@
+/**
+ * Structs shared between the host and the kernels, see scene.h and bvh.h.
+ * Positions and directions keep w = 0. Only what intersection needs is
+ * kept per primitive, shading looks material up in the material table.
+ */
+typedef struct {
+    float4 pos;
+    float4 normal;
+    float scale[3];
+    ushort type;
+    ushort material;
+} Primitive;
+
+/**
+ * Entry of the material table, colours are RGB9E5 and scalars half floats,
+ * read with rgb9e5_decode and MATERIAL_HALF. texture, unless TEXTURE_NONE,
+ * scales albedo.
+ */
+typedef struct {
+    uint albedo;
+    uint specular;
+    ushort type;
+    ushort texture;
+    ushort roughness;
+    ushort ior;
+    ushort reflect;
+    ushort pad;
+} Material;
+
+/**
+ * Size, levels and first page table entry of each level of a texture, see
+ * texture.h.
+ */
+typedef struct {
+    uint size;
+    uint levels;
+    uint pages[14];
+} TextureInfo;
+
+/**
+ * Size of the environment map, the mean of its sampling function and a
+ * radiance scale, see environment.h.
+ */
+typedef struct {
+    uint width;
+    uint height;
+    float integral;
+    float intensity;
+} EnvironmentInfo;
+
+/**
+ * Shared geometry, its bounds, root of its bottom level BVH and primitive range.
+ * Dynamic meshes are rebuilt on the device every frame and root indexes the
+ * LBVH node buffer instead of the compressed one.
+ */
+typedef struct {
+    float bmin[3];
+    uint root;
+    float bmax[3];
+    uint first_prim;
+    uint prim_count;
+    uint node_count;
+    uint flags;
+    uint pad;   // 48 byte stride like the host
+} Mesh;
+
+/**
+ * Mesh placement, rows of 3x4 affine matrices with translation in w.
+ */
+typedef struct {
+    float4 world_to_object[3];
+    float4 object_to_world[3];
+    uint mesh;
+} Instance;
+
+/**
+ * Interior nodes have count 0 and children at left_first, left_first + 1.
+ */
+typedef struct {
+    float bmin[3];
+    uint left_first;
+    float bmax[3];
+    uint count;
+} BVHNode;
+
+/**
+ * Compressed 8 wide node, see bvh.h. Child boxes are 8 bit offsets on a
+ * grid at p with cell size 2^(e - 127).
+ */
+typedef struct {
+    float p[3];
+    uchar e[3];
+    uchar imask;
+    uint child_base;
+    uint prim_base;
+    uchar meta[8];
+    uchar qlo_x[8];
+    uchar qlo_y[8];
+    uchar qlo_z[8];
+    uchar qhi_x[8];
+    uchar qhi_y[8];
+    uchar qhi_z[8];
+} BVH8Node;
+
+/**
+ * Binary node emitted by the device LBVH builder, see lbvh.cl. Children with
+ * LBVH_LEAF set reference a mesh primitive, others a node of the same mesh.
+ */
+typedef struct {
+    float bmin[3];
+    uint left;
+    float bmax[3];
+    uint right;
+} LBVHNode;
+
+/**
+ * Camera ray basis, see camera.h. Rays through pixel (x, y) point along
+ * corner + x * pixel_dx + y * pixel_dy.
+ */
+typedef struct {
+    float4 position;
+    float4 right;
+    float4 up;
+    float4 forward;
+    float4 corner;
+    float4 pixel_dx;
+    float4 pixel_dy;
+    float lens_radius;
+    float focus_distance;
+} CameraBasis;
+
+#define PRIM_TYPE(P) (int)((P).type)
+#define RADIUS(P) P.scale[0]
+#define SCALE(P) (float3)(P.scale[0], P.scale[1], P.scale[2])
+#define PRIM_PLANE 1
+#define PRIM_SPHERE 2
+#define MATERIAL_LAMBERT 0
+#define MATERIAL_GGX 1
+#define MATERIAL_DIELECTRIC 2
+#define MATERIAL_EMISSIVE 3
+#define MATERIAL_HALF(M, FIELD) vload_half(0, (__global const half*)&(M)->FIELD)
+#define MESH_DYNAMIC 1
+#define LBVH_LEAF 0x80000000u
+
+/**
+ * Shared exponent RGB: 9 bit mantissas in the low bits, the 5 bit exponent
+ * with a bias of 15 on top.
+ */
+inline float4 rgb9e5_decode(uint v) {
+    const float f = ldexp(1.0f, (int)(v >> 27) - 24);
+    return (float4)(convert_float3((uint3)(v & 0x1FF, (v >> 9) & 0x1FF, (v >> 18) & 0x1FF)) * f, 0);
+}
@@ -0,0 +1,76 @@
+/**
+ * Storage of per-pixel float4 buffers, picked with -DFRAME_STORAGE.
+ * Arithmetic stays in float, only loads and stores convert:
+ *   STORAGE_FLOAT  float4, 16 bytes
+ *   STORAGE_HALF   half4 through vload_half4 / vstore_half4, 8 bytes
+ *   STORAGE_RGBE   shared exponent RGB in a uint, 4 bytes, alpha reads as 1
+ * Values must match STORAGE_* in compute.h. Normals, which are signed, are
+ * always packed into a uint.
+ */
+#define STORAGE_FLOAT 0
+#define STORAGE_HALF 1
+#define STORAGE_RGBE 2
+
+#ifndef FRAME_STORAGE
+#define FRAME_STORAGE STORAGE_FLOAT
+#endif
+
+#if FRAME_STORAGE == STORAGE_HALF
+
+#ifdef cl_khr_fp16
+#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+#endif
+typedef half pixel_t;
+#define load_pixel(buffer, i) vload_half4((i), (buffer))
+#define store_pixel(buffer, i, col) vstore_half4((col), (i), (buffer))
+
+#elif FRAME_STORAGE == STORAGE_RGBE
+
+typedef uint pixel_t;
+
+// Ward's RGBE, 8 bit mantissas sharing the exponent of the largest channel
+uint rgbe_encode(float4 col)
+{
+    const float3 c = max(col.xyz, 0.0f);
+    const float m = max(max(c.x, c.y), c.z);
+    int e;
+    if(m < 1e-32f) return 0;
+    const float scale = frexp(m, &e) * 256.0f / m;
+    const uint3 q = convert_uint3(min(c * scale, 255.0f));
+    return q.x | (q.y << 8) | (q.z << 16) | ((uint)(e + 128) << 24);
+}
+
+float4 rgbe_decode(uint v)
+{
+    const int e = (int)(v >> 24);
+    if(e == 0) return (float4)(0, 0, 0, 1.0f);
+    const float f = ldexp(1.0f, e - (128 + 8));
+    const float3 q = convert_float3((uint3)(v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF));
+    return (float4)((q + 0.5f) * f, 1.0f);
+}
+
+#define load_pixel(buffer, i) rgbe_decode((buffer)[i])
+#define store_pixel(buffer, i, col) ((buffer)[i] = rgbe_encode(col))
+
+#else
+
+typedef float4 pixel_t;
+#define load_pixel(buffer, i) ((buffer)[i])
+#define store_pixel(buffer, i, col) ((buffer)[i] = (col))
+
+#endif
+
+/**
+ * Unit vectors as 10 bit signed normalised components in a uint.
+ */
+uint pack_normal(float4 n)
+{
+    const uint3 q = convert_uint3(clamp(n.xyz, -1.0f, 1.0f) * 511.0f + 512.5f);
+    return q.x | (q.y << 10) | (q.z << 20);
+}
+
+float4 unpack_normal(uint v)
+{
+    const float3 q = convert_float3((uint3)(v & 0x3FF, (v >> 10) & 0x3FF, (v >> 20) & 0x3FF));
+    return (float4)((q - 512.0f) / 511.0f, 0);
+}
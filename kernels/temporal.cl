@@ -0,0 +1,74 @@
+/**
+ * Temporal accumulation of the half float radiance, built with storage.cl.
+ * Each pixel fetches its history where the motion AOV says its surface was
+ * in the previous frame, bilinearly from the taps whose stored depth and
+ * normal agree with the surface, and blends the new frame in with weight
+ * 1 / samples, no lower than alpha_min. History keeps the sample count in
+ * w. When no tap agrees the pixel starts over. Depth and normals are copied
+ * alongside the history for the next frame's tests.
+ */
+// relative depth difference accepted between a tap and the reprojection
+#define TEMPORAL_DEPTH_TOLERANCE 0.05f
+// smallest cosine accepted between a tap's normal and the surface's
+#define TEMPORAL_NORMAL_COS 0.9f
+// sample count history is capped at, so it cannot go stale forever
+#define TEMPORAL_MAX_SAMPLES 64.0f
+
+int temporal_tap_valid(int2 q, unsigned int width, unsigned int height, float expected_depth, float4 normal,
+        __global const float* history_depth, __global const uint* history_normals)
+{
+    if(q.x < 0 || q.y < 0 || q.x >= (int)width || q.y >= (int)height) return 0;
+    const uint i = q.y * width + q.x;
+    const float z = history_depth[i];
+    // background only continues background
+    if(expected_depth == MAXFLOAT || z == MAXFLOAT) return expected_depth == z;
+    if(fabs(z - expected_depth) > TEMPORAL_DEPTH_TOLERANCE * expected_depth) return 0;
+    return dot(unpack_normal(history_normals[i]), normal) >= TEMPORAL_NORMAL_COS;
+}
+
+__kernel void temporal_accumulate(__global half* radiance, __global const float4* motion,
+        __global const float* depth, __global const uint* normals,
+        __global const half* history_in, __global const float* history_depth_in, __global const uint* history_normals_in,
+        __global half* history_out, __global float* history_depth_out, __global uint* history_normals_out,
+        unsigned int width, unsigned int height, float alpha_min, int history_valid)
+{
+    const unsigned int x = get_global_id(0);
+    const unsigned int y = get_global_id(1);
+    const uint p = y * width + x;
+
+    const float4 current = vload_half4(p, radiance);
+    const float4 m = motion[p];
+    const float4 normal = unpack_normal(normals[p]);
+
+    float4 history = 0;
+    float weights = 0;
+    // surfaces that were behind the camera come back as (-1, -1), off screen
+    if(history_valid) {
+        const float2 base = floor(m.xy);
+        const float2 f = m.xy - base;
+        const int2 q0 = convert_int2(base);
+        for(int j = 0; j < 2; j++) {
+            for(int i = 0; i < 2; i++) {
+                const int2 q = q0 + (int2)(i, j);
+                if(!temporal_tap_valid(q, width, height, m.z, normal, history_depth_in, history_normals_in)) continue;
+                const float w = (i ? f.x : 1.0f - f.x) * (j ? f.y : 1.0f - f.y);
+                history += w * vload_half4(q.y * width + q.x, history_in);
+                weights += w;
+            }
+        }
+    }
+
+    float4 result = current;
+    float samples = 1.0f;
+    // a sliver of a valid tap is not enough to carry history over
+    if(weights > 0.01f) {
+        history /= weights;
+        samples = min(history.w + 1.0f, TEMPORAL_MAX_SAMPLES);
+        result.xyz = mix(history.xyz, current.xyz, max(1.0f / samples, alpha_min));
+    }
+
+    vstore_half4(result, p, radiance);
+    vstore_half4((float4)(result.xyz, samples), p, history_out);
+    history_depth_out[p] = depth[p];
+    history_normals_out[p] = normals[p];
+}
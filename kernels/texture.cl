@@ -0,0 +1,83 @@
+/**
+ * Streamed textures, built after scene.cl. Every level of a texture is cut
+ * into TEXTURE_TILE squared tiles and only the tiles the host streamed in
+ * live in the atlas, see texture.h. pages maps a tile to its atlas slot + 1,
+ * 0 when it is not resident. Lookups flag the tile they wanted in requests
+ * and fall back to the finest coarser level that is resident, the last
+ * level of each texture always is. Texels are RGBA8. Values must match
+ * texture.h.
+ */
+#define TEXTURE_TILE 64
+#define TEXTURE_NONE 0xFFFF
+
+/**
+ * Texture buffers of the scene, gathered like Scene.
+ */
+typedef struct {
+    __global const TextureInfo* info;
+    __global const uint* pages;
+    __global const uint* atlas;
+    __global uint* requests;
+} Textures;
+
+inline int texture_wrap(int x, int side) {
+    x %= side;
+    return x < 0 ? x + side : x;
+}
+
+/**
+ * Page table entry of the tile holding texel (x, y) of a level, x and y
+ * already wrapped.
+ */
+inline uint texture_page(__global const TextureInfo* info, uint level, int x, int y) {
+    const uint side = info->size >> level;
+    const uint tiles = side > TEXTURE_TILE ? side / TEXTURE_TILE : 1;
+    return info->pages[level] + (y / TEXTURE_TILE) * tiles + x / TEXTURE_TILE;
+}
+
+/**
+ * Texel (x, y) of a level, wrapping around, its tile requested if request
+ * is set. Clears resident and returns 0 when the tile is not in the atlas.
+ */
+float4 texture_texel(const Textures* textures, __global const TextureInfo* info, uint level, int x, int y,
+        int request, int* resident) {
+    const int side = max((int)(info->size >> level), 1);
+    x = texture_wrap(x, side);
+    y = texture_wrap(y, side);
+    const uint page = texture_page(info, level, x, y);
+    if(request) textures->requests[page] = 1;
+    const uint slot = textures->pages[page];
+    if(!slot) {
+        *resident = 0;
+        return 0;
+    }
+    const uint texel = textures->atlas[(slot - 1) * TEXTURE_TILE * TEXTURE_TILE + (y % TEXTURE_TILE) * TEXTURE_TILE + x % TEXTURE_TILE];
+    return convert_float4((uint4)(texel & 0xFF, (texel >> 8) & 0xFF, (texel >> 16) & 0xFF, texel >> 24)) * (1.0f / 255.0f);
+}
+
+/**
+ * Bilinear lookup at uv, repeating, from the level nearest lod. The tiles
+ * that level needs are requested, a coarser resident level answers until
+ * the host has streamed them in.
+ */
+float4 texture_sample(const Textures* textures, uint texture, float2 uv, float lod) {
+    __global const TextureInfo* info = &textures->info[texture];
+    const uint wanted = (uint)clamp(lod + 0.5f, 0.0f, (float)(info->levels - 1));
+    uv -= floor(uv);
+
+    for(uint level = wanted; level < info->levels; level++) {
+        const int side = max((int)(info->size >> level), 1);
+        const float2 p = uv * (float)side - 0.5f;
+        const float2 f = p - floor(p);
+        const int x = (int)floor(p.x), y = (int)floor(p.y);
+        const int request = level == wanted;
+
+        int resident = 1;
+        const float4 a = texture_texel(textures, info, level, x, y, request, &resident);
+        const float4 b = texture_texel(textures, info, level, x + 1, y, request, &resident);
+        const float4 c = texture_texel(textures, info, level, x, y + 1, request, &resident);
+        const float4 d = texture_texel(textures, info, level, x + 1, y + 1, request, &resident);
+        if(resident) return mix(mix(a, b, f.x), mix(c, d, f.x), f.y);
+    }
+    return (float4)(1.0f);
+}
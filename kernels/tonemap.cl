@@ -0,0 +1,28 @@
+/**
+ * Display transform from the half float radiance the trace resolves into,
+ * see resolve_kernel. Runs on its own, so exposure and operator changes
+ * only cost this pass. Operators must match TONEMAP_* in compute.h.
+ */
+#define TONEMAP_CLAMP 0
+#define TONEMAP_REINHARD 1
+#define TONEMAP_ACES 2
+
+// Narkowicz' fit of the ACES filmic curve
+float3 aces(float3 x)
+{
+    return clamp((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 0.0f, 1.0f);
+}
+
+__kernel void tonemap_kernel(__global const half* radiance, __write_only image2d_t img,
+        unsigned int width, unsigned int height, float exposure, unsigned int op)
+{
+    const unsigned int x = get_global_id(0);
+    const unsigned int y = get_global_id(1);
+    float4 col = vload_half4(y * width + x, radiance);
+    float3 c = col.xyz * exposure;
+
+    if(op == TONEMAP_REINHARD) c = c / (1.0f + c);
+    else if(op == TONEMAP_ACES) c = aces(c);
+
+    write_imagef(img, (int2)(x, y), (float4)(clamp(c, 0.0f, 1.0f), clamp(col.w, 0.0f, 1.0f)));
+}
@@ -1,31 +1,139 @@
+/**
+ * Built together with scene.cl, which holds the structs shared with the host,
+ * texture.cl for surface textures, environment.cl for the environment map,
+ * light.cl for the area lights and rng.h and sampler.cl for the sample
+ * positions.
+ * The host specialises the program with -D options, see cl_kernel_options.
+ * The defaults below apply when a define is not given.
+ */
+#ifndef AA_GRID
+// primary samples per pixel are AA_GRID * AA_GRID
+#define AA_GRID 2
+#endif
+#ifndef MAX_BOUNCES
+// reflection bounces, 0 compiles the secondary pass out
+#define MAX_BOUNCES 1
+#endif
+#ifndef SHADOWS
+// trace a shadow ray for every light sample
+#define SHADOWS 0
+#endif
+#ifndef ENV_SAMPLES
+// environment map light samples at every shaded point, 0 lights the scene
+// with constant ambient and leaves the background black
+#define ENV_SAMPLES 0
+#endif
+#ifndef MOTION_BLUR
+// blend instance transforms over the shutter, rays carry a time in [0, 1]
+#define MOTION_BLUR 0
+#endif
+#ifdef NUM_PLANES
+#define PLANE_COUNT(scene) NUM_PLANES
+#else
+#define PLANE_COUNT(scene) ((scene)->num_planes)
+#endif
+
+#define PIXEL_SAMPLES (AA_GRID * AA_GRID)
+// arbitrary output variables of pixel_kernel, -DAOVS is an OR of these
+#define AOV_DEPTH 1
+#define AOV_NORMAL 2
+#define AOV_ALBEDO 4
+#define AOV_PRIM_ID 8
+#define AOV_MOTION 16
+#ifndef AOVS
+#define AOVS 0
+#endif
+// primitive id of pixels whose first sample hit nothing
+#define AOV_MISS 0xFFFFFFFFu
+#ifndef ADAPTIVE
+// estimate per-pixel error in resolve_kernel for adaptive_kernel
+#define ADAPTIVE 0
+#endif
+// samples adaptive_kernel adds per round, and the rounds, must match compute.h
+#define ADAPTIVE_SAMPLES 4
+#define ADAPTIVE_ROUNDS 3
+#define ADAPTIVE_MAX_SAMPLES (PIXEL_SAMPLES + ADAPTIVE_ROUNDS * ADAPTIVE_SAMPLES)
+// luminance added to the mean before the relative error test, so noise in
+// near black pixels does not keep them refining
+#define ADAPTIVE_DARK 0.05f
+// overall brightness, kept from the original 2x2 samples weighted by 1/9
+#define EXPOSURE (4.0f / 9.0f)
+
+/**
+ * The ray's footprint is a cone (Akenine-Moller et al. 2019), an isotropic
+ * stand-in for ray differentials: cone_width across at the origin,
+ * widening by cone_spread per unit travelled. Texture lookups pick their
+ * mip level from it. time is the moment within the shutter interval the
+ * ray sees the scene at, 0 when it opens and 1 when it closes, passed on
+ * to bounces and shadow rays.
+ */
 typedef struct {
     float4 origin;
     float4 dir;
     float4 col;
+    float cone_width;
+    float cone_spread;
+    float time;
 } Ray;
 
+/**
+ * Reflection ray queued by pixel_kernel for the secondary pass, one slot per
+ * pixel sample. col holds its weight until secondary_kernel replaces it
+ * with the weighted colour. The cone of the ray rides in origin.w and
+ * dir.w, its shutter time in col.w. Must match SecondaryRay in compute.h.
+ */
+typedef struct {
+    float4 origin;
+    float4 dir;
+    float4 col;
+} SecondaryRay;
+
+/**
+ * Closest intersection found so far. instance is NONE for planes.
+ */
 typedef struct {
-    float4 diffuse_col;
-    float diffuse;
-    float4 specular_col;
-    float specular;
-    float reflect;
-    float4 pos;
-    float4 normal;
-    float4 scale;
-} Primitive;
-
-#define PRIM_TYPE(P) (int)((P).scale.w)
-#define RADIUS(P) P.scale.x
-#define SCALE(P) (float3)(P.scale.x, P.scale.y, P.scale.z)
-#define PRIM_PLANE 1
-#define PRIM_SPHERE 2
-#define DELTA  0.001
+    float t;
+    int prim;
+    int instance;
+} Hit;
+
+/**
+ * Global scene arrays gathered from the kernel arguments, passed around by
+ * pointer instead of threading every buffer through each call.
+ */
+typedef struct {
+    __global const Primitive* planes;
+    uint num_planes;
+    __global const Primitive* prims;
+    __global const Mesh* meshes;
+    __global const BVH8Node* blas;
+    __global const LBVHNode* dynamic_nodes;
+    __global const Instance* instances;
+    // the same instances at shutter close, instances holds them at open
+    __global const Instance* instances_close;
+    uint num_instances;
+    __global const BVHNode* tlas;
+    __global const Material* materials;
+    Textures textures;
+    Environment environment;
+    __global const Light* lights;
+    uint num_lights;
+    // side of the sample grid each light gets per shaded point this frame
+    uint light_grid;
+} Scene;
+
 #define HIT 1
 #define MISS 0
 #define NONE -1
+// must match BVH_STACK_SIZE in bvh.h, the host keeps its trees shallow
+// enough that traversal never needs more
+#define STACK_SIZE 64
+// reflection rays start this far back along the incoming ray
+#define BOUNCE_BIAS 0.001f
+// world space size of the origin cells rays are sorted by
+#define RAY_SORT_CELL 0.5f
 
-int ray_plane(Ray* ray, Primitive* prim, float* t) {
+int ray_plane(Ray* ray, __global const Primitive* prim, float* t) {
     // calculate dotproduct of ray and plane normal
     const float dp = dot(ray->dir, prim->normal);
     // ray orthogonal to plane
@@ -42,220 +150,1110 @@ int ray_plane(Ray* ray, Primitive* prim, float* t) {
 
 /**
  * http://www.vis.uky.edu/~ryang/teaching/cs535-2012spr/Lectures/13-RayTracing-II.pdf
+ * The direction is not assumed to be unit length, rays moved into a scaled
+ * instance keep the world space t.
  */
-int ray_sphere(Ray* ray, Primitive* prim, float* t) {
-    const float radius = prim->scale.x;
+int ray_sphere(Ray* ray, __global const Primitive* prim, float* t) {
+    const float radius = prim->scale[0];
     // vector from origin to primitive
     const float4 v = prim->pos - ray->origin;
+    const float a = dot(ray->dir, ray->dir);
     // compute dotproduct of ray and v
     const float dp = dot(ray->dir, v);
     // b^2 -4ac
-    const float det = dp*dp - dot(v, v) + radius*radius;
+    const float det = dp*dp - a * (dot(v, v) - radius*radius);
     // no solutions to quadratic formula
     if(det <= 0) return MISS;
 
     // solve for smaller t
-    float d = (dp - sqrt(det));
+    float d = (dp - sqrt(det)) / a;
 
     // if is t is less 0 then we have the wrong root
     if (d < 0 ) {
         // solve for the larger t
-        d = (dp + sqrt(det));
+        d = (dp + sqrt(det)) / a;
 
         // intersection is in opposite direction to ray if t < 0
         if(d < 0) return MISS;
     }
 
+    // further than the closest hit so far
+    if(d >= *t) return MISS;
+
     *t = d;
 
     return HIT;
 }
 
-int shade(Ray* ray, Primitive* prim, float4 intersection) {
-        // add constant amount of ambient light
-        ray->col += (float4)(0.1f, 0.1f, 0.1f, 1.0f);
+int ray_prim(Ray* ray, __global const Primitive* prim, float* t) {
+    switch(PRIM_TYPE(*prim))
+    {
+        case PRIM_PLANE:
+            return ray_plane(ray, prim, t);
+        case PRIM_SPHERE:
+            return ray_sphere(ray, prim, t);
+    }
+    return MISS;
+}
 
-        const float4 light_pos = (float4)(-3.0f, 4.0f, -1.0f, 0);
-        const float4 light_col = (float4)(0, 0, 0.8f, 1.0f);
+/**
+ * Slab test against a node box, only counts boxes entered before t.
+ */
+inline int ray_aabb(const Ray* ray, const float4 inv_dir, __global const float* node_min, __global const float* node_max, float t) {
+    const float3 bmin = (float3)(node_min[0], node_min[1], node_min[2]);
+    const float3 bmax = (float3)(node_max[0], node_max[1], node_max[2]);
+    const float3 t0 = (bmin - ray->origin.xyz) * inv_dir.xyz;
+    const float3 t1 = (bmax - ray->origin.xyz) * inv_dir.xyz;
+    const float3 tmin = fmin(t0, t1);
+    const float3 tmax = fmax(t0, t1);
+    const float enter = fmax(fmax(tmin.x, tmin.y), fmax(tmin.z, 0.0f));
+    const float exit = fmin(fmin(tmax.x, tmax.y), fmin(tmax.z, t));
+    return enter <= exit;
+}
 
-        // calculate direction of light
-        const float4 light_dir = light_pos - intersection;
+/**
+ * Applies the rows of a 3x4 affine matrix, w selects whether translation applies.
+ */
+inline float4 transform(__global const float4* m, float4 v, float w) {
+    const float4 p = (float4)(v.xyz, w);
+    return (float4)(dot(m[0], p), dot(m[1], p), dot(m[2], p), 0);
+}
+
+/**
+ * v moved into the object space of an instance at shutter time. With
+ * MOTION_BLUR world_to_object is blended between the open and close
+ * transforms, which is exact for the translations scene_animate makes and
+ * close for small turns. The blend is linear, so it is done on the results.
+ */
+inline float4 instance_to_object(const Scene* scene, int instance, float time, float4 v, float w) {
+    const float4 open = transform(scene->instances[instance].world_to_object, v, w);
+#if MOTION_BLUR
+    return mix(open, transform(scene->instances_close[instance].world_to_object, v, w), time);
+#else
+    return open;
+#endif
+}
+
+/**
+ * Object space normal n of an instance carried to world space with the
+ * transpose of its world_to_object at shutter time, not normalised.
+ */
+inline float4 instance_normal(const Scene* scene, int instance, float time, float4 n) {
+    __global const float4* m = scene->instances[instance].world_to_object;
+    float4 world = n.x * m[0] + n.y * m[1] + n.z * m[2];
+#if MOTION_BLUR
+    m = scene->instances_close[instance].world_to_object;
+    world = mix(world, n.x * m[0] + n.y * m[1] + n.z * m[2], time);
+#endif
+    return world;
+}
+
+/**
+ * Walks the compressed bottom level BVH of a mesh with an object space ray.
+ * Child slabs are decoded straight into ray distances: with the grid origin
+ * and cell size folded into the ray, each plane costs one multiply add.
+ */
+void traverse_blas(Ray* ray, __global const BVH8Node* nodes, uint root,
+        __global const Primitive* prims, Hit* hit, int instance) {
+    const float3 inv_dir = 1.0f / ray->dir.xyz;
+    uint stack[STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = root;
+
+    while(sp > 0) {
+        __global const BVH8Node* node = &nodes[stack[--sp]];
+        const float3 p = (float3)(node->p[0], node->p[1], node->p[2]);
+        const float3 scale = (float3)(as_float((uint)node->e[0] << 23),
+                                      as_float((uint)node->e[1] << 23),
+                                      as_float((uint)node->e[2] << 23));
+        const float3 o = (p - ray->origin.xyz) * inv_dir;
+        const float3 d = scale * inv_dir;
+        const uint imask = node->imask;
+
+        for(int i = 0; i < 8; i++) {
+            const uint meta = node->meta[i];
+            const uint interior = (imask >> i) & 1;
+            // empty slot
+            if(!interior && meta == 0) continue;
+
+            const float3 qlo = (float3)(node->qlo_x[i], node->qlo_y[i], node->qlo_z[i]);
+            const float3 qhi = (float3)(node->qhi_x[i], node->qhi_y[i], node->qhi_z[i]);
+            const float3 t0 = o + qlo * d;
+            const float3 t1 = o + qhi * d;
+            const float3 tmin = fmin(t0, t1);
+            const float3 tmax = fmax(t0, t1);
+            const float enter = fmax(fmax(tmin.x, tmin.y), fmax(tmin.z, 0.0f));
+            const float exit = fmin(fmin(tmax.x, tmax.y), fmin(tmax.z, hit->t));
+            if(enter > exit) continue;
 
-        // hack to get to primtive type from scale component
-        const int prim_type = (int)prim->scale.w;
-        if(prim_type == PRIM_SPHERE)
-        {
-            float radius = prim->scale.x;
-            prim->normal = (intersection - prim->pos) * radius;
+            if(interior) {
+                stack[sp++] = node->child_base + (meta & 31);
+            } else {
+                const uint first = node->prim_base + (meta & 31);
+                for(uint k = first; k < first + (meta >> 5); k++) {
+                    if(ray_prim(ray, &prims[k], &hit->t)) {
+                        hit->prim = k;
+                        hit->instance = instance;
+                    }
+                }
+            }
         }
+    }
+}
 
-        // normally normalised
-        prim->normal = normalize(prim->normal);
+/**
+ * Walks the binary BVH the device builder emits for a dynamic mesh, node
+ * and leaf references are relative to the mesh.
+ */
+void traverse_lbvh(Ray* ray, __global const LBVHNode* nodes, __global const Mesh* mesh,
+        __global const Primitive* prims, Hit* hit, int instance) {
+    const float4 inv_dir = 1.0f / ray->dir;
+    uint stack[STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
 
-        // calculate dot product of direction from light and surface normal at intersect
-        const float lambertian = max(dot(prim->normal, fast_normalize(light_dir)), 0.0f);
+    while(sp > 0) {
+        __global const LBVHNode* node = &nodes[mesh->root + stack[--sp]];
+        if(!ray_aabb(ray, inv_dir, node->bmin, node->bmax, hit->t)) continue;
 
-        // add diffuse shading
-        ray->col += prim->diffuse * lambertian * prim->diffuse_col;
+        const uint children[2] = { node->left, node->right };
+        for(int c = 0; c < 2; c++) {
+            if(children[c] & LBVH_LEAF) {
+                const uint p = mesh->first_prim + (children[c] & ~LBVH_LEAF);
+                if(ray_prim(ray, &prims[p], &hit->t)) {
+                    hit->prim = p;
+                    hit->instance = instance;
+                }
+            } else {
+                stack[sp++] = children[c];
+            }
+        }
+    }
+}
 
-        // add specular highlights
+/**
+ * Walks the top level BVH, moving the ray into object space for every
+ * instance it reaches at the ray's time. The direction is not renormalised
+ * so t is shared between world and object space. Node bounds sweep the
+ * instances over the whole shutter interval.
+ */
+void traverse_tlas(Ray* ray, const Scene* scene, Hit* hit) {
+    const float4 inv_dir = 1.0f / ray->dir;
+    uint stack[STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
 
-        const float4 bisec = fast_normalize(light_dir + ray->dir);
+    while(sp > 0) {
+        __global const BVHNode* node = &scene->tlas[stack[--sp]];
+        if(!ray_aabb(ray, inv_dir, node->bmin, node->bmax, hit->t)) continue;
 
-        // specular exponent
-        const float alpha = 16.0f;
+        if(node->count > 0) {
+            __global const Mesh* mesh = &scene->meshes[scene->instances[node->left_first].mesh];
+            Ray obj = *ray;
+            obj.origin = instance_to_object(scene, node->left_first, ray->time, ray->origin, 1.0f);
+            obj.dir = instance_to_object(scene, node->left_first, ray->time, ray->dir, 0.0f);
+            if(mesh->flags & MESH_DYNAMIC)
+                traverse_lbvh(&obj, scene->dynamic_nodes, mesh, scene->prims, hit, node->left_first);
+            else
+                traverse_blas(&obj, scene->blas, mesh->root, scene->prims, hit, node->left_first);
+        } else {
+            stack[sp++] = node->left_first + 1;
+            stack[sp++] = node->left_first;
+        }
+    }
+}
 
-        const float dp2 = pow( max(dot(bisec, prim->normal), 0.0f), alpha);
+/**
+ * Schlick's approximation of the Fresnel reflectance.
+ */
+inline float4 fresnel_schlick(float4 f0, float cos_theta) {
+    const float m = 1.0f - clamp(cos_theta, 0.0f, 1.0f);
+    return f0 + (1.0f - f0) * (m * m * m * m * m);
+}
+
+/**
+ * GGX normal distribution of roughness alpha.
+ */
+inline float ggx_distribution(float n_dot_h, float alpha) {
+    const float a2 = max(alpha * alpha, 1e-6f);
+    const float d = n_dot_h * n_dot_h * (a2 - 1.0f) + 1.0f;
+    return a2 / (M_PI_F * d * d);
+}
+
+/**
+ * GGX highlight of the light, specular reflectance f0 and roughness alpha:
+ * the distribution times the height correlated Smith visibility term.
+ */
+float4 ggx_specular(float4 normal, float4 view, float4 light, float4 f0, float alpha) {
+    const float4 h = fast_normalize(view + light);
+    const float n_dot_l = max(dot(normal, light), 0.0f);
+    const float n_dot_v = max(dot(normal, view), 1e-4f);
+    const float n_dot_h = max(dot(normal, h), 0.0f);
+    const float a2 = max(alpha * alpha, 1e-6f);
+    const float distribution = ggx_distribution(n_dot_h, alpha);
+    const float visibility = 0.5f / (n_dot_l * sqrt(n_dot_v * n_dot_v * (1.0f - a2) + a2) +
+        n_dot_v * sqrt(n_dot_l * n_dot_l * (1.0f - a2) + a2) + 1e-6f);
+    return fresnel_schlick(f0, dot(view, h)) * (distribution * visibility * n_dot_l);
+}
+
+/**
+ * Reflectance at normal incidence of a dielectric in air.
+ */
+inline float dielectric_f0(float ior) {
+    const float r = (ior - 1.0f) / (ior + 1.0f);
+    return r * r;
+}
+
+/**
+ * GGX reflectance at normal incidence, dielectrics get theirs from the ior.
+ */
+inline float4 material_f0(__global const Material* material) {
+    const float4 f0 = material->type == MATERIAL_DIELECTRIC ? (float4)(dielectric_f0(MATERIAL_HALF(material, ior)))
+        : rgb9e5_decode(material->specular);
+    return (float4)(f0.xyz, 0);
+}
+
+inline float luminance(float4 col) {
+    return dot(col.xyz, (float3)(0.2126f, 0.7152f, 0.0722f));
+}
+
+/**
+ * BSDF of the shading models times the cosine towards light: albedo / pi
+ * diffuse but for dielectrics, plus the GGX highlight but for
+ * MATERIAL_LAMBERT.
+ */
+float4 bsdf_eval(__global const Material* material, float4 albedo, float4 normal, float4 view, float4 light) {
+    const uint type = material->type;
+    const float cos_l = dot(normal, light);
+    float4 f = 0;
+    if(cos_l <= 0) return f;
+    if(type != MATERIAL_DIELECTRIC) f = albedo * (cos_l / M_PI_F);
+    if(type != MATERIAL_LAMBERT) f += ggx_specular(normal, view, light, material_f0(material), MATERIAL_HALF(material, roughness));
+    return (float4)(f.xyz, 0);
+}
+
+/**
+ * Chance that bsdf_sample draws from the GGX lobe rather than the cosine
+ * weighted one, from how much each of them reflects.
+ */
+inline float bsdf_specular_share(__global const Material* material, float4 albedo) {
+    if(material->type == MATERIAL_LAMBERT) return 0;
+    if(material->type == MATERIAL_DIELECTRIC) return 1.0f;
+    const float specular = luminance(material_f0(material));
+    return clamp(specular / (specular + luminance(albedo) + 1e-6f), 0.1f, 0.9f);
+}
+
+/**
+ * Solid angle density with which bsdf_sample picks light.
+ */
+float bsdf_pdf(__global const Material* material, float4 albedo, float4 normal, float4 view, float4 light) {
+    const float cos_l = dot(normal, light);
+    if(cos_l <= 0) return 0;
+    const float share = bsdf_specular_share(material, albedo);
+    float pdf = (1.0f - share) * cos_l / M_PI_F;
+    if(share > 0) {
+        const float4 h = fast_normalize(view + light);
+        const float n_dot_h = max(dot(normal, h), 0.0f);
+        pdf += share * ggx_distribution(n_dot_h, MATERIAL_HALF(material, roughness)) * n_dot_h /
+            (4.0f * max(dot(view, h), 1e-4f));
+    }
+    return pdf;
+}
+
+/**
+ * Direction towards which a surface scatters light coming back along view,
+ * drawn with the uniform numbers xi: xi.z picks the lobe, GGX half vectors
+ * from the distribution times its cosine or cosine weighted diffuse.
+ * Directions below the surface have a bsdf_pdf of 0.
+ */
+float4 bsdf_sample(__global const Material* material, float4 albedo, float4 normal, float4 view, float3 xi) {
+    const float phi = 2.0f * M_PI_F * xi.y;
+    float4 t, b;
+    orthonormal_basis(normal, &t, &b);
+
+    if(xi.z < bsdf_specular_share(material, albedo)) {
+        const float alpha = MATERIAL_HALF(material, roughness);
+        const float a2 = max(alpha * alpha, 1e-6f);
+        const float cos_h = sqrt((1.0f - xi.x) / (1.0f + (a2 - 1.0f) * xi.x));
+        const float sin_h = sqrt(max(1.0f - cos_h * cos_h, 0.0f));
+        const float4 h = cos_h * normal + sin_h * (cos(phi) * t + sin(phi) * b);
+        return 2.0f * dot(view, h) * h - view;
+    }
+
+    const float r = sqrt(xi.x);
+    return r * (cos(phi) * t + sin(phi) * b) + sqrt(1.0f - xi.x) * normal;
+}
+
+/**
+ * Continues a ray through a dielectric surface along the refracted
+ * direction, weighted by the transmitted share of the Fresnel term, or
+ * along the mirror direction under total internal reflection. Returns the
+ * weight. Rays leaving the surface's inside see the normal flipped.
+ */
+float dielectric_bounce(const Ray* ray, float4 intersection, float4 normal, float ior, Ray* next) {
+    const float4 d = fast_normalize(ray->dir);
+    float cos_i = -dot(d, normal);
+    float eta = 1.0f / ior;
+    float4 n = normal;
+    if(cos_i < 0) {
+        cos_i = -cos_i;
+        eta = ior;
+        n = -normal;
+    }
+
+    const float k = 1.0f - eta * eta * (1.0f - cos_i * cos_i);
+    if(k < 0) {
+        next->origin = (float4)((intersection - BOUNCE_BIAS * d).xyz, 0);
+        next->dir = d + 2.0f * cos_i * n;
+        return 1.0f;
+    }
+
+    // Schlick's term is taken on the side of the thinner medium
+    const float cos_t = sqrt(k);
+    const float fresnel = fresnel_schlick((float4)(dielectric_f0(ior)), eta > 1.0f ? cos_t : cos_i).x;
+    next->origin = (float4)((intersection + BOUNCE_BIAS * d).xyz, 0);
+    next->dir = eta * d + (eta * cos_i - cos_t) * n;
+    return 1.0f - fresnel;
+}
+
+/**
+ * World space surface normal at a hit, sphere normals are found in object
+ * space and carried back with the transpose of world_to_object, both at
+ * the ray's time.
+ */
+float4 hit_normal(Ray* ray, Hit* hit, const Scene* scene) {
+    if(hit->instance == NONE) return normalize(scene->planes[hit->prim].normal);
 
-        // temp hack to brighten up specular.
-        ray->col += prim->diffuse * dp2 * prim->specular_col;
+    __global const Primitive* prim = &scene->prims[hit->prim];
+    float4 n = prim->normal;
+
+    // hack to get to primtive type from scale component
+    if(PRIM_TYPE(*prim) == PRIM_SPHERE) {
+        const float4 p = instance_to_object(scene, hit->instance, ray->time, ray->origin + hit->t * ray->dir, 1.0f);
+        n = p - prim->pos;
+    }
 
-        // ray->col /= 2.0f;
+    const float4 world = instance_normal(scene, hit->instance, ray->time, n);
+    return normalize((float4)(world.xyz, 0));
 }
 
-int ray_trace(Ray* ray, Primitive* prims) {
-    const int num_prims = 10;
-    int hit = NONE;
-    float t = MAXFLOAT; // far away
+/**
+ * Texture coordinates at a hit at shutter time and the length in object
+ * space one unit of them spans, in extent. Planes repeat the texture every
+ * scale[0] units along a basis built from their normal, spheres are mapped
+ * by longitude and latitude.
+ */
+float2 hit_uv(const Hit* hit, const Scene* scene, __global const Primitive* prim, float4 intersection, float time,
+        float* extent) {
+    const float4 p = hit->instance == NONE ? intersection
+        : instance_to_object(scene, hit->instance, time, intersection, 1.0f);
+
+    if(PRIM_TYPE(*prim) == PRIM_SPHERE) {
+        const float4 n = normalize(p - prim->pos);
+        // v runs pole to pole, half way round
+        *extent = M_PI_F * prim->scale[0];
+        return (float2)(atan2(n.z, n.x) * (0.5f / M_PI_F) + 0.5f, acos(clamp(n.y, -1.0f, 1.0f)) * (1.0f / M_PI_F));
+    }
 
-    // find ray primitive intersections
-    for(int p = 0; p < num_prims; p++)
+    const float4 n = normalize(prim->normal);
+    const float4 axis = fabs(n.x) > 0.9f ? (float4)(0, 1.0f, 0, 0) : (float4)(1.0f, 0, 0, 0);
+    const float4 tangent = normalize(cross(axis, n));
+    const float4 bitangent = cross(n, tangent);
+    *extent = prim->scale[0];
+    return (float2)(dot(p - prim->pos, tangent), dot(p - prim->pos, bitangent)) / prim->scale[0];
+}
+
+/**
+ * Finds the closest hit before hit->t.
+ */
+void scene_intersect(Ray* ray, const Scene* scene, Hit* hit) {
+    // unbounded primitives are tested directly
+    for(uint p = 0; p < PLANE_COUNT(scene); p++)
     {
-        int prim_type = (int)(prims[p].scale.w);
-        switch(prim_type)
-        {
-            case PRIM_PLANE:
-                if(ray_plane(ray, &prims[p], &t)) {
-                    hit = p;
-                }
+        if(ray_plane(ray, &scene->planes[p], &hit->t)) {
+            hit->prim = p;
+            hit->instance = NONE;
+        }
+    }
+
+    // everything else through the two level BVH
+    if(scene->num_instances > 0)
+        traverse_tlas(ray, scene, hit);
+}
+
+/**
+ * 1 if nothing lies along dir from origin before t at shutter time, 0
+ * otherwise.
+ */
+float visible(float4 origin, float4 dir, float t, float time, const Scene* scene) {
+    Ray shadow;
+    Hit hit;
+    shadow.origin = origin;
+    shadow.dir = dir;
+    shadow.time = time;
+    hit.t = t;
+    hit.prim = NONE;
+    hit.instance = NONE;
+    scene_intersect(&shadow, scene, &hit);
+    return hit.prim == NONE ? 1.0f : 0.0f;
+}
 
-                break;
-            case PRIM_SPHERE:
-                if(ray_sphere(ray, &prims[p], &t)) hit = p;
-                break;
+/**
+ * Nearest area light along the normalised dir from origin that is closer
+ * than t, NONE if there is none. t becomes its distance.
+ */
+int nearest_light(const Scene* scene, float4 origin, float4 dir, float* t) {
+    int nearest = NONE;
+    for(uint l = 0; l < scene->num_lights; l++) {
+        const float d = light_intersect(&scene->lights[l], origin, dir);
+        if(d < *t) {
+            *t = d;
+            nearest = l;
         }
     }
+    return nearest;
+}
+
+/**
+ * Power heuristic weight (Veach 1997) of a sample drawn with density a
+ * against another strategy with density b, sample counts folded in.
+ */
+inline float mis_weight(float a, float b) {
+    return a * a / (a * a + b * b);
+}
+
+/**
+ * Area light a surface at point sends back along the ray. Every light gets
+ * light_grid^2 samples stratified over its cone or area, the BSDF one more
+ * sample for whichever light it reaches first, and multiple importance
+ * sampling combines them: light samples win on small lights and rough
+ * surfaces, the BSDF sample on large lights seen in sharp highlights. With
+ * SHADOWS each sample traces a shadow ray.
+ */
+float4 direct_light(const Ray* ray, const Scene* scene, __global const Material* material, float4 albedo,
+        float4 point, float4 normal, Rng* rng) {
+    const uint grid = scene->light_grid;
+    const float samples = grid * grid;
+    const float4 view = -fast_normalize(ray->dir);
+    float4 col = 0;
+    if(scene->num_lights == 0 || material->type == MATERIAL_EMISSIVE) return col;
+
+    for(uint l = 0; l < scene->num_lights; l++) {
+        __global const Light* light = &scene->lights[l];
+        const float4 radiance = rgb9e5_decode(light->radiance);
+        for(uint s = 0; s < grid * grid; s++) {
+            const float2 xi = ((float2)(s % grid, s / grid) + (float2)(rng_float(rng), rng_float(rng))) / grid;
+            float t, pdf;
+            const float4 dir = light_sample(light, point, xi, &t, &pdf);
+            if(pdf <= 0 || dot(normal, dir) <= 0) continue;
+#if SHADOWS
+            if(!visible(point, dir, t, ray->time, scene)) continue;
+#endif
+            const float weight = mis_weight(samples * pdf, bsdf_pdf(material, albedo, normal, view, dir));
+            col += radiance * bsdf_eval(material, albedo, normal, view, dir) * (weight / (samples * pdf));
+        }
+    }
+
+    const float3 xi = (float3)(rng_float(rng), rng_float(rng), rng_float(rng));
+    const float4 dir = bsdf_sample(material, albedo, normal, view, xi);
+    const float pdf = bsdf_pdf(material, albedo, normal, view, dir);
+    float t = MAXFLOAT;
+    const int light = pdf > 0 ? nearest_light(scene, point, dir, &t) : NONE;
+    if(light == NONE) return (float4)(col.xyz, 0);
+#if SHADOWS
+    if(!visible(point, dir, t, ray->time, scene)) return (float4)(col.xyz, 0);
+#endif
+    const float weight = mis_weight(pdf, samples * light_pdf(&scene->lights[light], point, dir, t));
+    col += rgb9e5_decode(scene->lights[light].radiance) * bsdf_eval(material, albedo, normal, view, dir) * (weight / pdf);
+    return (float4)(col.xyz, 0);
+}
+
+#if ENV_SAMPLES > 0
+/**
+ * Environment light a surface at point sends back along the ray, from
+ * ENV_SAMPLES directions drawn from the map's luminance, each with a shadow
+ * ray. Dielectrics pass the environment on through their bounce, emitters
+ * ignore it.
+ */
+float4 environment_light(const Ray* ray, const Scene* scene, __global const Material* material, float4 albedo,
+        float4 point, float4 normal, Rng* rng) {
+    const uint type = material->type;
+    float4 col = 0;
+    if(type == MATERIAL_DIELECTRIC || type == MATERIAL_EMISSIVE) return col;
+
+    const float4 view = -fast_normalize(ray->dir);
+    for(uint s = 0; s < ENV_SAMPLES; s++) {
+        float4 dir;
+        float pdf;
+        const float2 xi = (float2)(rng_float(rng), rng_float(rng));
+        const float4 radiance = environment_sample(&scene->environment, xi, &dir, &pdf);
+        if(pdf <= 0 || dot(normal, dir) <= 0 || !visible(point, dir, MAXFLOAT, ray->time, scene)) continue;
+        col += radiance * bsdf_eval(material, albedo, normal, view, dir) / pdf;
+    }
+    return (float4)(col.xyz * (1.0f / ENV_SAMPLES), 0);
+}
+#endif
+
+/**
+ * Adds the light a surface at point sends back along the ray: constant
+ * ambient, or the environment when it lights the scene, and the area
+ * lights. albedo is the material's, textured. Emissive surfaces only add
+ * albedo, their radiance.
+ */
+void shade(Ray* ray, const Scene* scene, __global const Material* material, float4 albedo, float4 point,
+        float4 normal, Rng* rng) {
+    const uint type = material->type;
+    if(type == MATERIAL_EMISSIVE) {
+        ray->col += albedo;
+        return;
+    }
+
+#if ENV_SAMPLES == 0
+    // add constant amount of ambient light, dielectrics pass it on through their bounce
+    if(type != MATERIAL_DIELECTRIC) ray->col += (float4)(0.1f, 0.1f, 0.1f, 1.0f);
+#else
+    ray->col += environment_light(ray, scene, material, albedo, point, normal, rng);
+#endif
+    ray->col += direct_light(ray, scene, material, albedo, point, normal, rng);
+}
+
+/**
+ * First surface a ray hits, collected for the AOVs. Planes are numbered
+ * before instanced primitives, time is the shutter time it was hit at.
+ */
+typedef struct {
+    float depth;
+    float4 normal;
+    float4 albedo;
+    uint prim;
+    float4 position;
+    int instance;
+    float time;
+} Surface;
+
+/**
+ * Traces and shades a ray, its direction normalised. Returns the weight of
+ * the bounce it sets up in reflection: the material's mirror reflectivity,
+ * the transmitted share of a dielectric, 0 on a miss, a light or an
+ * emissive surface. A miss sees the environment when it lights the scene,
+ * black otherwise. surface, unless NULL, is filled in on a hit, on a miss
+ * only its position is set, one unit along the ray. rng draws the light
+ * samples.
+ */
+float ray_trace(Ray* ray, const Scene* scene, Ray* reflection, Surface* surface, Rng* rng) {
+    Hit hit;
+    hit.t = MAXFLOAT; // far away
+    hit.prim = NONE;
+    hit.instance = NONE;
+
+    scene_intersect(ray, scene, &hit);
+    // lights are not in the BVH, one in front of the nearest surface is seen instead
+    float light_t = hit.t;
+    const int light = nearest_light(scene, ray->origin, ray->dir, &light_t);
 
     // no intersections
-    if (hit == NONE) return 0;
+    if (hit.prim == NONE || light != NONE) {
+#if AOVS
+        if(surface) surface->position = ray->origin + ray->dir;
+#endif
+        if(light != NONE) ray->col += rgb9e5_decode(scene->lights[light].radiance);
+#if ENV_SAMPLES > 0
+        else ray->col += environment_radiance(&scene->environment, ray->dir);
+#endif
+        return 0;
+    }
 
     // calculate point of intersection
-    const float4 intersection = ray->origin + t * ray->dir;
+    const float4 intersection = ray->origin + hit.t * ray->dir;
+    const float4 normal = hit_normal(ray, &hit, scene);
+    __global const Primitive* prim = hit.instance == NONE ? &scene->planes[hit.prim] : &scene->prims[hit.prim];
+    __global const Material* material = &scene->materials[prim->material];
+
+    // the cone where it meets the surface, widened by the angle it meets it at
+    const float cone_width = ray->cone_width + ray->cone_spread * hit.t;
+    float4 albedo = rgb9e5_decode(material->albedo);
+    if(material->texture != TEXTURE_NONE) {
+        float extent;
+        const float2 uv = hit_uv(&hit, scene, prim, intersection, ray->time, &extent);
+        const float footprint = cone_width / max(fabs(dot(ray->dir, normal)), 0.05f);
+        const float texels = scene->textures.info[material->texture].size / extent;
+        albedo *= texture_sample(&scene->textures, material->texture, uv, log2(footprint * texels));
+    }
+
+#if AOVS
+    if(surface) {
+        // primary directions are normalised, so t is the distance
+        surface->depth = hit.t;
+        surface->normal = normal;
+        // dielectrics pass on what lies behind them untinted
+        surface->albedo = material->type == MATERIAL_DIELECTRIC ? (float4)(1.0f) : (float4)(albedo.xyz, 1.0f);
+        surface->prim = hit.instance == NONE ? hit.prim : PLANE_COUNT(scene) + hit.prim;
+        surface->position = intersection;
+        surface->instance = hit.instance;
+        surface->time = ray->time;
+    }
+#endif
+
+    // backing off along the incoming ray stays on the visible side of planes
+    const float4 outside = (float4)((intersection - BOUNCE_BIAS * ray->dir).xyz, 0);
 
-    // shade with prim at intersection point
-    shade(ray, &prims[hit], intersection);
+    // shade with the material at intersection point
+    shade(ray, scene, material, albedo, outside, normal, rng);
 
-    return 0;
+    // bounces keep the cone's spread, curvature is ignored, and the ray's time
+    reflection->cone_width = cone_width;
+    reflection->cone_spread = ray->cone_spread;
+    reflection->time = ray->time;
+    if(material->type == MATERIAL_DIELECTRIC)
+        return dielectric_bounce(ray, intersection, normal, MATERIAL_HALF(material, ior), reflection);
+    if(material->type == MATERIAL_EMISSIVE) return 0;
+
+    reflection->origin = outside;
+    reflection->dir = ray->dir - 2.0f * dot(ray->dir, normal) * normal;
+    return MATERIAL_HALF(material, reflect);
 }
 
 /**
- * Calculates position of a pixel in the scene.
- * Returns the aspect ratio.
+ * Point of the unit disk for the uniform numbers u, with the concentric
+ * mapping (Shirley and Chiu 1997) so stratified u stay stratified.
  */
-inline float calc_uv(float* u, float *v, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
-    const float ratio = (float)width / height;
-    // calculate uv coordinates
-    *u = ((x+0.5) - (width/2)) / (2 * width) * ratio;
-    *v = ((y+0.5) - (height/2)) / (2 * height);
-    return ratio;
+inline float2 concentric_disk(float2 u) {
+    const float2 p = 2.0f * u - 1.0f;
+    if(p.x == 0 && p.y == 0) return p;
+    if(fabs(p.x) > fabs(p.y)) {
+        const float phi = 0.25f * M_PI_F * p.y / p.x;
+        return p.x * (float2)(cos(phi), sin(phi));
+    }
+    const float phi = 0.25f * M_PI_F * p.x / p.y;
+    return p.y * (float2)(sin(phi), cos(phi));
 }
 
 /**
- * Calculate ray from uv coordinates and focal length.
+ * Primary ray through a point of the frame, in pixels with pixel centres at
+ * whole numbers, at shutter time. A thin lens of lens_radius starts it at
+ * the point of the lens the uniform numbers lens pick and aims it at where
+ * the pinhole ray crosses the plane of focus, focus_distance in front of
+ * the camera. A lens_radius of 0 is the pinhole.
  */
-inline Ray calc_ray(float focal, float4 uv, float4 col) {
+inline Ray camera_ray(__constant const CameraBasis* camera, float2 pixel, float2 lens, float time, float4 col) {
     Ray ray;
-    ray.origin = (float4)(0, 0, -focal , 0);    // distance of camera from image plane
-    ray.dir = fast_normalize(uv - ray.origin);  // from camera to image plane
+    const float4 dir = camera->corner + pixel.x * camera->pixel_dx + pixel.y * camera->pixel_dy;
+    ray.origin = camera->position;
+    ray.dir = fast_normalize(dir);
+    if(camera->lens_radius > 0) {
+        // dir is one unit deep, the image plane's distance
+        const float2 d = camera->lens_radius * concentric_disk(lens);
+        const float4 offset = d.x * camera->right + d.y * camera->up;
+        ray.origin += offset;
+        ray.dir = fast_normalize(camera->focus_distance * dir - offset);
+    }
     ray.col = col;
+    // a pinhole cone, one pixel wide where the pixel is, defocus is left
+    // to the spread of the lens samples
+    ray.cone_width = 0;
+    ray.cone_spread = fast_length(camera->pixel_dy) / fast_length(dir);
+    ray.time = time;
     return ray;
 }
 
+/**
+ * Pixel coordinates a world space point projects to through the centre of
+ * the lens, the inverse of camera_ray. Points behind the camera give -1.
+ */
+float2 camera_project(__constant const CameraBasis* camera, float4 p) {
+    const float4 d = p - camera->position;
+    const float z = dot(d, camera->forward);
+    if(z <= 0) return (float2)(-1.0f, -1.0f);
+    const float4 q = d / z - camera->corner;
+    return (float2)(dot(q, camera->pixel_dx) / dot(camera->pixel_dx, camera->pixel_dx),
+        dot(q, camera->pixel_dy) / dot(camera->pixel_dy, camera->pixel_dy));
+}
+
+/**
+ * Where the surface of a primary hit was on screen in the previous frame
+ * and how far it was from the camera, from the camera and instance
+ * transforms of that frame. The position is taken relative to the pixel
+ * centre, so sample jitter does not show up as motion, and carried back
+ * from the time it was hit at to the previous shutter open. Dynamic meshes
+ * deform without a transform and are not followed.
+ */
+float4 surface_motion(const Surface* surface, __global const Instance* prev_instances,
+        const Scene* scene, __constant const CameraBasis* camera, __constant const CameraBasis* prev_camera,
+        unsigned int x, unsigned int y) {
+    float4 p = surface->position;
+    const float2 sample = camera_project(camera, p);
+    // nothing hit, the background only turns with the camera
+    if(surface->prim == AOV_MISS) {
+        const float2 prev = camera_project(prev_camera, prev_camera->position + (p - camera->position));
+        return (float4)(prev + (float2)(x, y) - sample, MAXFLOAT, 0);
+    }
+
+    if(surface->instance != NONE) {
+        const float4 object = instance_to_object(scene, surface->instance, surface->time, p, 1.0f);
+        p = transform(prev_instances[surface->instance].object_to_world, object, 1.0f);
+    }
+    const float2 prev = camera_project(prev_camera, p);
+    if(prev.x == -1.0f && prev.y == -1.0f) return (float4)(prev, MAXFLOAT, 0);
+    return (float4)(prev + (float2)(x, y) - sample, length(p - prev_camera->position), 0);
+}
+
+/**
+ * Whether a pixel whose sample luminances have the moments m (sum, sum of
+ * squares, count) needs more samples: the standard error of its mean is
+ * above threshold relative to the mean. One sample gives no estimate.
+ */
+int adaptive_refine(float4 m, float threshold) {
+    if(m.z >= ADAPTIVE_MAX_SAMPLES) return 0;
+    if(m.z < 2) return 1;
+    const float mean = m.x / m.z;
+    const float variance = max(m.y / m.z - mean * mean, 0.0f) * m.z / (m.z - 1);
+    return sqrt(variance / m.z) > threshold * (mean + ADAPTIVE_DARK);
+}
+
+/**
+ * Colour of one sample traced through all its bounces, as the primary and
+ * secondary passes add it up between them.
+ */
+float4 trace_path(Ray* ray, const Scene* scene, Rng* rng) {
+    Ray reflection;
+    float4 col = 0;
+    float weight = EXPOSURE;
+    for(int b = 0; b <= MAX_BOUNCES; b++) {
+        ray->col = (float4)(0, 0, 0, 1.0f);
+        const float reflect = ray_trace(ray, scene, &reflection, 0, rng);
+        col += weight * ray->col;
+        if(reflect <= 0) break;
+        weight *= reflect;
+        ray->origin = reflection.origin;
+        ray->dir = reflection.dir;
+        ray->cone_width = reflection.cone_width;
+        ray->cone_spread = reflection.cone_spread;
+    }
+    return col;
+}
+
+/**
+ * Gathers the scene kernel arguments.
+ */
+inline Scene make_scene(__global const Primitive* planes, unsigned int num_planes,
+        __global const Primitive* prims, __global const Mesh* meshes, __global const BVH8Node* blas,
+        __global const Instance* instances, unsigned int num_instances, __global const BVHNode* tlas,
+        __global const LBVHNode* dynamic_nodes, __global const Material* materials,
+        __global const TextureInfo* texture_info, __global const uint* texture_pages, __global const uint* atlas,
+        __global uint* texture_requests, __global const EnvironmentInfo* env_info, __global const uint* env_texels,
+        __global const float* env_cdf, __global const Light* lights, unsigned int num_lights, unsigned int light_grid,
+        __global const Instance* instances_close) {
+    Scene scene;
+    scene.planes = planes;
+    scene.num_planes = num_planes;
+    scene.prims = prims;
+    scene.meshes = meshes;
+    scene.blas = blas;
+    scene.dynamic_nodes = dynamic_nodes;
+    scene.instances = instances;
+    scene.instances_close = instances_close;
+    scene.num_instances = num_instances;
+    scene.tlas = tlas;
+    scene.materials = materials;
+    scene.textures.info = texture_info;
+    scene.textures.pages = texture_pages;
+    scene.textures.atlas = atlas;
+    scene.textures.requests = texture_requests;
+    scene.environment.info = env_info;
+    scene.environment.texels = env_texels;
+    scene.environment.cdf = env_cdf;
+    scene.lights = lights;
+    scene.num_lights = num_lights;
+    scene.light_grid = light_grid;
+    return scene;
+}
+
 /**
  * Entry point.
- * Receives parameters and grants write only access to the OpenGL texture.
+ * Traces the primary rays of a pixel into frame and queues a reflection ray
+ * per sample that hit a reflective surface, flags marks the queued slots.
+ * AOVs selected with -DAOVS are written in the same pass: the nearest depth
+ * of the samples, their mean normal and albedo, and the primitive id and
+ * motion of the first one. Unselected AOV buffers may be NULL. jitter moves
+ * the sample grid by a fraction of a pixel, for temporal accumulation.
+ * camera holds the basis of this frame followed by the previous one's.
+ * Sample positions come from sampler.cl, different every frame_index.
+ * With -DADAPTIVE the luminance of every primary sample is kept for
+ * resolve_kernel. The scene is built on the host, see scene.cpp, and lit
+ * by its area lights, light_grid^2 samples each per shaded point, and by
+ * the environment with -DENV_SAMPLES. The camera's thin lens is sampled
+ * per sample, and with -DMOTION_BLUR so is the shutter, between the
+ * instance transforms of instances and instances_close.
  */
-__kernel void pixel_kernel(__write_only image2d_t img, unsigned int width, unsigned int height, float time)
+__kernel void pixel_kernel(__global pixel_t* frame, unsigned int width, unsigned int height,
+        __global const Primitive* planes, unsigned int num_planes,
+        __global const Primitive* prims, __global const Mesh* meshes, __global const BVH8Node* blas,
+        __global const Instance* instances, unsigned int num_instances, __global const BVHNode* tlas,
+        __global const LBVHNode* dynamic_nodes, __global const Material* materials,
+        __global SecondaryRay* rays, __global uint* flags,
+        __global float* aov_depth, __global uint* aov_normal, __global pixel_t* aov_albedo, __global uint* aov_prim,
+        __global float4* aov_motion, __global const Instance* prev_instances, float2 jitter,
+        __constant const CameraBasis* camera, __global float* sample_luminance, __global const float2* blue_noise,
+        uint frame_index,
+        __global const TextureInfo* texture_info, __global const uint* texture_pages, __global const uint* atlas,
+        __global uint* texture_requests, __global const EnvironmentInfo* env_info, __global const uint* env_texels,
+        __global const float* env_cdf, __global const Light* lights, unsigned int num_lights, unsigned int light_grid,
+        __global const Instance* instances_close)
 {
     const unsigned int x = get_global_id(0);
     const unsigned int y = get_global_id(1);
+    const unsigned int pixel = y * width + x;
 
-    float u, v;
-    calc_uv(&u, &v, x, y, width, height);
-
-    // generate ray from camera position amd colour
-
-    // setup planes
-    Primitive prims[10];
-
-    // CECECD (nice grey) floor
-    prims[0].pos = (float4)(0,-.1f,0,0);
-    prims[0].diffuse_col =  (float4)(206.0f, 206.0f, 205.0f, 255.0f) / 255.0f;
-    prims[0].diffuse = 0.6f;
-    prims[0].specular_col = (float4)(206.0f, 206.0f, 205.0f, 255.0f) / 255.0f;
-    prims[0].specular = 0.2f;
-    prims[0].scale = (float4)(1.0f, 1.0f, 1.0f, PRIM_PLANE);
-    prims[0].normal = fast_normalize((float4)(0, 20.0f, -0.1f, 0));
-    prims[0].reflect = 0;
-
-    // 232323 (the new black) wall
-    prims[1].pos = (float4)(0, 0, 50.0f, 0);
-    prims[1].diffuse_col = (float4)(35.0f, 35.0f, 35.0f, 255.0f) / 255.0f;
-    prims[1].diffuse = 0.8f;
-    prims[1].specular_col = (float4)(30.0f, 30.0f, 30.0f, 255.0f) / 255.0f;
-    prims[1].specular = 0.2f;
-    prims[1].scale = (float4)(1.0f, 1.0f, 1.0f, PRIM_PLANE);
-    prims[1].normal = normalize((float4)(0.2f, -0.2f, -0.9f, 0));
-    prims[1].reflect = 0;
-
-
-    // FF9A0C (sun drums) sphere
-    prims[2].pos = (float4)(2.5f-time, 2.5f, 100.0f, 0);
-    prims[2].diffuse_col =  (float4)(255.0f, 154.0f, 12.0f, 255.0f) / 255.0f;
-    prims[2].diffuse = 0.7f;
-    prims[2].specular_col = (float4)(24.0f, 185.0f, 209.0f, 255.0f) / 255.0f;
-    prims[2].specular = 0.95f;
-    prims[2].scale = (float4)(1.0f, 1.0f, 1.0f, PRIM_SPHERE);
-    prims[2].normal = normalize((float4)(0, 0.1f, 1.0f, 0));
-    prims[2].reflect = 0.2f;
-
-
-    // FA7339 (casa) sphere
-    prims[3].pos = (float4)(5.0f*cos(time*10.0f), 1.0f, 50.0f+10.0f*sin(time*10.0f), 0);
-    prims[3].diffuse_col = (float4)(250.0f, 115.0f, 57.0f, 255.0f) / 255.0f;
-    prims[3].diffuse = 0.7f;
-    //prims[3].specular_col = (float4)(24.0f, 185.0f, 209.0f, 255.0f) / 255.0f;
-    prims[3].specular_col = (float4)(255.0f, 185.0f, 209.0f, 255.0f) / 255.0f;
-    prims[3].specular = 0.9f;
-    prims[3].scale = (float4)(2.0f, 1.0f, 1.0f, PRIM_SPHERE);
-    prims[3].normal = normalize((float4)(0, 0.1f, 1.0f, 0));
-    prims[3].reflect = 0.5f;
-
-    int i = 4;
-    for(;i<10;i++) {
-        // 18CEDB (blue lagoon) spheres
-        prims[i].pos = (float4)(-1.5f*i+8.0f, .5f, -2.5f*i+60.0f, 0);
-        prims[i].diffuse_col = (float4)(24.0f, 200.0f, 213.0f, 255.0f) / 255.0f;
-        prims[i].diffuse = 0.6f;
-        prims[i].specular_col = (float4)(24.0f, 190.0f, 210.0f, 255.0f) / 255.0f;
-        prims[i].specular = 1.0f;
-        prims[i].scale = (float4)(1.0f, 1.0f, 1.0f, PRIM_SPHERE);
-        prims[i].normal = normalize((float4)(0, 0.1f, 1.0f, 0));
-        prims[i].reflect = 1.0f;
-    }
+    const Scene scene = make_scene(planes, num_planes, prims, meshes, blas, instances, num_instances, tlas, dynamic_nodes, materials,
+        texture_info, texture_pages, atlas, texture_requests, env_info, env_texels, env_cdf,
+        lights, num_lights, light_grid, instances_close);
+
+    const float2 centre = (float2)(x, y) + jitter;
+#if MOTION_BLUR
+    // the samples' times are stratified over the shutter, rotated by a
+    // different amount in every pixel so they do not follow sample positions
+    Rng shutter;
+    rng_init(&shutter, x, y, frame_index, 0, RNG_STREAM_USER + 2);
+    const float rotation = rng_float(&shutter);
+#endif
 
     float4 col = (float4)(0,0,0,1.0f);
-    for(int i = -1; i < 1; i++) {
-        for(int j = -1; j < 1; j++) {
-            const Ray ray = calc_ray(0.95f, (float4)(u+i*DELTA,v+j*DELTA,0,0), (float4)(0, 0, 0, 1.0f));
-            ray_trace(&ray, &prims);
-            col += ray.col / 9.0f;
+    uint slot = pixel * PIXEL_SAMPLES;
+#if AOVS
+    Surface aov = { MAXFLOAT, (float4)(0), (float4)(0), AOV_MISS, (float4)(0), NONE, 0 };
+    Surface first;
+#endif
+    for(int i = 0; i < AA_GRID; i++) {
+        for(int j = 0; j < AA_GRID; j++) {
+            const float2 offset = sample_2d(x, y, frame_index, i * AA_GRID + j, AA_GRID, blue_noise) - 0.5f;
+            Ray reflection;
+            Rng rng;
+            rng_init(&rng, x, y, frame_index, i * AA_GRID + j, RNG_STREAM_USER);
+            const float2 lens = (float2)(rng_float(&rng), rng_float(&rng));
+#if MOTION_BLUR
+            float shutter_time = (i * AA_GRID + j + rng_float(&rng)) / PIXEL_SAMPLES + rotation;
+            shutter_time -= floor(shutter_time);
+#else
+            const float shutter_time = 0;
+#endif
+            Ray ray = camera_ray(camera, centre + offset, lens, shutter_time, (float4)(0, 0, 0, 1.0f));
+#if AOVS
+            Surface surface = { MAXFLOAT, (float4)(0), (float4)(0), AOV_MISS, (float4)(0), NONE, 0 };
+            const float reflect = ray_trace(&ray, &scene, &reflection, &surface, &rng);
+            aov.depth = min(aov.depth, surface.depth);
+            aov.normal += surface.normal;
+            aov.albedo += surface.albedo * (1.0f / PIXEL_SAMPLES);
+            if(i == 0 && j == 0) first = surface;
+#else
+            const float reflect = ray_trace(&ray, &scene, &reflection, 0, &rng);
+#endif
+            col += ray.col * (EXPOSURE / PIXEL_SAMPLES);
+#if ADAPTIVE
+            sample_luminance[pixel * PIXEL_SAMPLES + i * AA_GRID + j] = luminance(ray.col) * EXPOSURE;
+#endif
+
+#if MAX_BOUNCES > 0
+            // weighted like the primary sample it continues
+            const float weight = reflect * (EXPOSURE / PIXEL_SAMPLES);
+            flags[slot] = reflect > 0;
+            if(reflect > 0) {
+                rays[slot].origin = (float4)(reflection.origin.xyz, reflection.cone_width);
+                rays[slot].dir = (float4)(reflection.dir.xyz, reflection.cone_spread);
+                rays[slot].col = (float4)(weight, weight, weight, reflection.time);
+            }
+            slot++;
+#endif
         }
     }
 
-    //float4 col = ray.col;
-    col =  clamp(col, 0, 1.0f);
+    store_pixel(frame, pixel, col);
+
+#if AOVS & AOV_DEPTH
+    aov_depth[pixel] = aov.depth;
+#endif
+#if AOVS & AOV_NORMAL
+    aov_normal[pixel] = pack_normal(dot(aov.normal, aov.normal) > 0 ? normalize(aov.normal) : aov.normal);
+#endif
+#if AOVS & AOV_ALBEDO
+    store_pixel(aov_albedo, pixel, aov.albedo);
+#endif
+#if AOVS & AOV_PRIM_ID
+    aov_prim[pixel] = first.prim;
+#endif
+#if AOVS & AOV_MOTION
+    aov_motion[pixel] = surface_motion(&first, prev_instances, &scene, &camera[0], &camera[1], x, y);
+#endif
+}
+
+/**
+ * Spreads the low 8 bits of v so there are two zero bits between each.
+ */
+inline uint ray_spread_bits(uint v) {
+    v &= 0xFFu;
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/**
+ * 27 bit sort key of a queued ray: the direction octant on top, then the
+ * Morton order of its origin cell. Cell coordinates wrap every 256 cells,
+ * which only costs coherence, so the grid needs no scene bounds.
+ */
+__kernel void ray_keys(__global const SecondaryRay* rays, __global const uint* slots, uint n, __global uint* keys)
+{
+    const uint i = get_global_id(0);
+    if(i >= n) return;
+
+    __global const SecondaryRay* ray = &rays[slots[i]];
+    const uint octant = (ray->dir.x < 0 ? 4 : 0) | (ray->dir.y < 0 ? 2 : 0) | (ray->dir.z < 0 ? 1 : 0);
+    const int4 cell = convert_int4(floor(ray->origin / RAY_SORT_CELL));
+    keys[i] = (octant << 24) | (ray_spread_bits(cell.x) << 2) | (ray_spread_bits(cell.y) << 1) | ray_spread_bits(cell.z);
+}
+
+/**
+ * Traces the queued reflection rays in the order given by slots, following
+ * up to MAX_BOUNCES mirror bounces each at the shutter time of the sample
+ * that queued them. frame_index seeds their light samples like
+ * pixel_kernel's.
+ */
+__kernel void secondary_kernel(__global SecondaryRay* rays, __global const uint* slots, uint n,
+        __global const Primitive* planes, unsigned int num_planes,
+        __global const Primitive* prims, __global const Mesh* meshes, __global const BVH8Node* blas,
+        __global const Instance* instances, unsigned int num_instances, __global const BVHNode* tlas,
+        __global const LBVHNode* dynamic_nodes, __global const Material* materials,
+        __global const TextureInfo* texture_info, __global const uint* texture_pages, __global const uint* atlas,
+        __global uint* texture_requests, uint frame_index, __global const EnvironmentInfo* env_info,
+        __global const uint* env_texels, __global const float* env_cdf, __global const Light* lights,
+        unsigned int num_lights, unsigned int light_grid, __global const Instance* instances_close)
+{
+    const uint i = get_global_id(0);
+    if(i >= n) return;
+
+    const Scene scene = make_scene(planes, num_planes, prims, meshes, blas, instances, num_instances, tlas, dynamic_nodes, materials,
+        texture_info, texture_pages, atlas, texture_requests, env_info, env_texels, env_cdf,
+        lights, num_lights, light_grid, instances_close);
+    const uint slot = slots[i];
+    __global SecondaryRay* queued = &rays[slot];
+    // the queue has no pixel coordinates, a stream of its own keeps the
+    // slot keyed numbers apart from the primary samples'
+    Rng rng;
+    rng_init(&rng, slot / PIXEL_SAMPLES, 0, frame_index, slot % PIXEL_SAMPLES, RNG_STREAM_USER + 1);
+
+    // the queued ray is the first bounce, later ones continue inline
+    Ray ray, reflection;
+    ray.origin = (float4)(queued->origin.xyz, 0);
+    ray.dir = (float4)(queued->dir.xyz, 0);
+    ray.cone_width = queued->origin.w;
+    ray.cone_spread = queued->dir.w;
+    ray.time = queued->col.w;
+    float4 col = 0;
+    float weight = 1.0f;
+    for(int b = 0; b < MAX_BOUNCES; b++) {
+        ray.col = (float4)(0, 0, 0, 1.0f);
+        const float reflect = ray_trace(&ray, &scene, &reflection, 0, &rng);
+        col += weight * ray.col;
+        if(reflect <= 0) break;
+        weight *= reflect;
+        ray.origin = reflection.origin;
+        ray.dir = reflection.dir;
+        ray.cone_width = reflection.cone_width;
+        ray.cone_spread = reflection.cone_spread;
+    }
+
+    queued->col = (float4)(queued->col.xyz * col.xyz, 0);
+}
+
+/**
+ * Adds the reflections of a pixel to its primary colour and stores the
+ * result as half float radiance. With -DADAPTIVE the luminance moments of
+ * the pixel's samples go to moments and refine flags the pixels
+ * adaptive_kernel should add samples to.
+ */
+__kernel void resolve_kernel(__global half* radiance, unsigned int width, unsigned int height,
+        __global const pixel_t* frame, __global const SecondaryRay* rays, __global const uint* flags,
+        __global const float* sample_luminance, __global float4* moments, __global uint* refine, float threshold)
+{
+    const unsigned int x = get_global_id(0);
+    const unsigned int y = get_global_id(1);
+    const unsigned int pixel = y * width + x;
+
+    float4 col = load_pixel(frame, pixel);
+#if MAX_BOUNCES > 0
+    for(uint s = 0; s < PIXEL_SAMPLES; s++)
+        if(flags[pixel * PIXEL_SAMPLES + s]) col += rays[pixel * PIXEL_SAMPLES + s].col;
+#endif
+
+#if ADAPTIVE
+    float4 m = (float4)(0, 0, PIXEL_SAMPLES, 0);
+    for(uint s = 0; s < PIXEL_SAMPLES; s++) {
+        float l = sample_luminance[pixel * PIXEL_SAMPLES + s];
+#if MAX_BOUNCES > 0
+        // queued weights include the 1 / PIXEL_SAMPLES of the average
+        if(flags[pixel * PIXEL_SAMPLES + s]) l += luminance(rays[pixel * PIXEL_SAMPLES + s].col) * PIXEL_SAMPLES;
+#endif
+        m.x += l;
+        m.y += l * l;
+    }
+    moments[pixel] = m;
+    refine[pixel] = adaptive_refine(m, threshold);
+#endif
+
+    // unclamped, tonemap.cl turns it into the display image
+    vstore_half4(col, pixel, radiance);
+}
+
+/**
+ * Adds ADAPTIVE_SAMPLES samples, traced through all their bounces, to each
+ * of the n pixels listed, continuing the pixel's sample sequence after the
+ * ones it already has. The radiance mean and luminance moments are
+ * updated in place and refine says whether the pixel needs another round.
+ */
+__kernel void adaptive_kernel(__global const uint* pixels, uint n, __global half* radiance,
+        __global const Primitive* planes, unsigned int num_planes,
+        __global const Primitive* prims, __global const Mesh* meshes, __global const BVH8Node* blas,
+        __global const Instance* instances, unsigned int num_instances, __global const BVHNode* tlas,
+        __global const LBVHNode* dynamic_nodes, __global const Material* materials,
+        __global float4* moments, __global uint* refine, unsigned int width, float threshold,
+        __constant const CameraBasis* camera, __global const float2* blue_noise, uint frame_index,
+        __global const TextureInfo* texture_info, __global const uint* texture_pages, __global const uint* atlas,
+        __global uint* texture_requests, __global const EnvironmentInfo* env_info, __global const uint* env_texels,
+        __global const float* env_cdf, __global const Light* lights, unsigned int num_lights, unsigned int light_grid,
+        __global const Instance* instances_close)
+{
+    const uint i = get_global_id(0);
+    if(i >= n) return;
+
+    const Scene scene = make_scene(planes, num_planes, prims, meshes, blas, instances, num_instances, tlas, dynamic_nodes, materials,
+        texture_info, texture_pages, atlas, texture_requests, env_info, env_texels, env_cdf,
+        lights, num_lights, light_grid, instances_close);
+    const uint pixel = pixels[i];
+    const uint x = pixel % width, y = pixel / width;
+    const float2 centre = (float2)(x, y);
+    float4 m = moments[pixel];
+
+    float4 sum = 0;
+    for(uint k = 0; k < ADAPTIVE_SAMPLES; k++) {
+        const float2 offset = sample_2d(x, y, frame_index, (uint)m.z + k, AA_GRID, blue_noise) - 0.5f;
+        Rng rng;
+        rng_init(&rng, x, y, frame_index, (uint)m.z + k, RNG_STREAM_USER);
+        const float2 lens = (float2)(rng_float(&rng), rng_float(&rng));
+        // past the stratified primary samples, shutter times are uniform
+        const float time = MOTION_BLUR ? rng_float(&rng) : 0;
+        Ray ray = camera_ray(camera, centre + offset, lens, time, (float4)(0, 0, 0, 1.0f));
+        const float4 col = trace_path(&ray, &scene, &rng);
+        const float l = luminance(col);
+        sum += col;
+        m.x += l;
+        m.y += l * l;
+    }
 
-    // write pixel data to gpu
-    write_imagef(img, (int2)(x, y), col);
+    float4 col = vload_half4(pixel, radiance);
+    col.xyz = (col.xyz * m.z + sum.xyz) / (m.z + ADAPTIVE_SAMPLES);
+    m.z += ADAPTIVE_SAMPLES;
+    vstore_half4(col, pixel, radiance);
+    moments[pixel] = m;
+    refine[pixel] = adaptive_refine(m, threshold);
 }
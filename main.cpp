@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <GL/glew.h>
 
@@ -13,12 +14,12 @@
 
 #endif
 
-#define MEM_SIZE (128)
-#define MAX_SOURCE_SIZE (0x100000)
-
 #define FPS_ENABLED 1
 
 #include "compute.h"
+#include "reload.h"
+#include "encoder.h"
+#include "stream.h"
 
 using namespace glm;
 
@@ -26,6 +27,7 @@ double time = 0;
 #ifdef FPS_ENABLED
 double fps_update_time = 0;
 unsigned int frames = 0;
+double rays = 0;
 #endif
 
 GLuint texture;
@@ -41,16 +43,264 @@ cl_mem texture_cl;
 cl_platform_id pid;
 cl_device_id  did;
 cl_context context;
+cl_program program;
 cl_kernel kernel;
 cl_command_queue command_queue;
+// concatenated in this order, storage.cl first for the pixel buffer macros
+const char* trace_sources[] = { KERNEL_DIR "/storage.cl", KERNEL_DIR "/scene.cl", KERNEL_DIR "/texture.cl",
+  KERNEL_DIR "/environment.cl", KERNEL_DIR "/light.cl", KERNEL_DIR "/rng.h", KERNEL_DIR "/sampler.cl", KERNEL_DIR "/trace.cl" };
+#define TRACE_SOURCES 8
+KernelCache kernel_cache;
+// 2x2 samples, one reflection bounce, no shadows, scrambled Sobol, ambient light, no motion blur; planes, storage and AOVs are set at start up
+KernelConfig kernel_config = { 2, 1, 0, 0, STORAGE_FLOAT, 0, 0, SAMPLER_SOBOL, 0, 0 };
+// sample sequences, cycled with L
+static const char* sampler_names[SAMPLER_COUNT] = { "grid", "halton", "sobol", "blue" };
+cl_mem blue_noise;
+// variant the running kernels were built for
+KernelConfig active_config;
+// bounces used when reflections are toggled back on
+unsigned int max_bounces = 1;
+// environment light samples per shaded point when E turns the environment on
+unsigned int env_samples = 1;
+// shadow rays per pixel a frame may trace, shared out by scene_light_grid
+float shadow_budget = 16.0f;
+// side of the sample grid each light gets per shaded point, from the last frame's budget
+unsigned int light_grid = 1;
+// share of a frame the shutter stays open for while motion blur is on, toggled with M
+float shutter = 0.5f;
+int kernel_config_changed = 0;
+KernelReloader* reloader;
+// debug kernels, see cl_registry_add
+KernelRegistry registry;
+// registered kernel shown instead of the ray tracer, cycled with K
+cl_kernel display_kernel = NULL;
+// registered kernel drawn over the right half of the traced frame, toggled with C
+cl_kernel compare_kernel = NULL;
+cl_kernel compare_choice = NULL;
+
+// frame capture, enabled with --capture or --stream
+ReadbackRing* readback = NULL;
+FrameEncoder* encoder = NULL;
+FrameStream* stream = NULL;
+// frames waiting to be encoded before the render loop blocks
+unsigned int encode_depth = 4;
+unsigned int capture_index = 0;
+// stop after this many captured frames, 0 to run until closed
+unsigned int capture_frames = 0;
+
+// scene
+Scene scene;
+SceneBuffers scene_buffers;
+// scene textures, streamed in as lookups ask for their tiles
+TextureAtlas textures;
+ParallelPrimitives primitives;
+LBVHBuilder lbvh;
+int lbvh_optimize = 1;
+SecondaryPass secondary;
+// extra samples where the frame is noisy, on with --adaptive, toggled with A
+AdaptivePass adaptive;
+// extra outputs of the primary pass, chosen with --aovs
+AovBuffers aovs;
+// set up with --denoise, toggled with N
+Denoiser denoiser;
+int denoise_available = 0;
+int denoise = 0;
+// set up with --temporal, toggled with H
+TemporalPass temporal;
+int temporal_available = 0;
+int temporal_on = 0;
+unsigned int temporal_frame = 0;
+// random numbers and sample sequences are keyed on it, it only advances
+// while temporal accumulation can use new samples every frame
+unsigned int frame_index = 0;
+// sort reflection rays before tracing them, toggled with R
+int ray_sort = 1;
+float anim = 0;
+// animation time a frame moves on by
+#define ANIM_STEP 0.01f
+// display transform of the traced radiance, exposure with - and =, operator with T
+ToneMapper tonemapper;
+static const char* tonemap_names[TONEMAP_COUNT] = { "clamp", "reinhard", "aces" };
+// moved with the arrow keys and page up/down, turned by dragging with the
+// left button, zoomed with [ and ]
+Camera camera;
+// basis of the frame being traced and of the last one, for motion vectors
+CameraBasis cameras[2];
+int camera_dragging = 0;
+double camera_cursor[2];
+// world units per key press and radians per dragged pixel
+#define CAMERA_STEP 0.05f
+#define CAMERA_TURN 0.005f
+#define CAMERA_ZOOM 1.1f
+// P holds the animation, then frames are only traced again when something changes
+int paused = 0;
+int retrace = 1;
 
 static void error_callback(int error, const char *description) {
   fputs(description, stderr);
 }
 
+/**
+ * Registered kernel after current, NULL (the ray tracer) after the last.
+ */
+static cl_kernel next_kernel(cl_kernel current) {
+  unsigned int i;
+  if(!current) return registry.count > 0 ? registry.kernels[0] : NULL;
+  for(i = 0; i + 1 < registry.count; i++)
+    if(registry.kernels[i] == current) return registry.kernels[i + 1];
+  return NULL;
+}
+
+/**
+ * Looks up a kernel named on the command line, "trace" is the ray tracer.
+ */
+static cl_kernel find_kernel(const char* name) {
+  unsigned int i;
+  if(strcmp(name, "trace") == 0) return NULL;
+  cl_kernel found = cl_registry_find(&registry, name);
+  if(!found) {
+    fprintf(stderr, "Unknown kernel %s, available: trace", name);
+    for(i = 0; i < registry.count; i++) fprintf(stderr, " %s", registry.names[i]);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+  }
+  return found;
+}
+
 static void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods) {
   if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
     glfwSetWindowShouldClose(window, GL_TRUE);
+  if (key == GLFW_KEY_R && action == GLFW_PRESS)
+    ray_sort = !ray_sort;
+  if (key == GLFW_KEY_K && action == GLFW_PRESS)
+    display_kernel = next_kernel(display_kernel);
+  if (key == GLFW_KEY_C && action == GLFW_PRESS)
+    compare_kernel = compare_kernel ? NULL : compare_choice;
+  if (key == GLFW_KEY_B && action == GLFW_PRESS) {
+    kernel_config.max_bounces = kernel_config.max_bounces ? 0 : max_bounces;
+    kernel_config_changed = 1;
+  }
+  if (key == GLFW_KEY_S && action == GLFW_PRESS) {
+    kernel_config.shadows = !kernel_config.shadows;
+    kernel_config_changed = 1;
+  }
+  if (key == GLFW_KEY_L && action == GLFW_PRESS) {
+    kernel_config.sampler = (kernel_config.sampler + 1) % SAMPLER_COUNT;
+    kernel_config_changed = 1;
+  }
+  if (key == GLFW_KEY_A && action == GLFW_PRESS) {
+    kernel_config.adaptive = !kernel_config.adaptive;
+    kernel_config_changed = 1;
+  }
+  if (key == GLFW_KEY_E && action == GLFW_PRESS && scene.environment.info.width > 0) {
+    kernel_config.env_samples = kernel_config.env_samples ? 0 : env_samples;
+    kernel_config_changed = 1;
+  }
+  if (key == GLFW_KEY_M && action == GLFW_PRESS) {
+    kernel_config.motion_blur = !kernel_config.motion_blur;
+    kernel_config_changed = 1;
+  }
+  if (key == GLFW_KEY_MINUS && action != GLFW_RELEASE)
+    tonemapper.exposure -= 0.5f;
+  if (key == GLFW_KEY_EQUAL && action != GLFW_RELEASE)
+    tonemapper.exposure += 0.5f;
+  if (key == GLFW_KEY_T && action == GLFW_PRESS)
+    tonemapper.op = (tonemapper.op + 1) % TONEMAP_COUNT;
+  if (key == GLFW_KEY_P && action == GLFW_PRESS)
+    paused = !paused;
+  if (key == GLFW_KEY_N && action == GLFW_PRESS && denoise_available) {
+    denoise = !denoise;
+    retrace = 1;
+  }
+  if (key == GLFW_KEY_UP && action != GLFW_RELEASE)
+    camera_move(&camera, CAMERA_STEP, 0, 0);
+  if (key == GLFW_KEY_DOWN && action != GLFW_RELEASE)
+    camera_move(&camera, -CAMERA_STEP, 0, 0);
+  if (key == GLFW_KEY_LEFT && action != GLFW_RELEASE)
+    camera_move(&camera, 0, -CAMERA_STEP, 0);
+  if (key == GLFW_KEY_RIGHT && action != GLFW_RELEASE)
+    camera_move(&camera, 0, CAMERA_STEP, 0);
+  if (key == GLFW_KEY_PAGE_UP && action != GLFW_RELEASE)
+    camera_move(&camera, 0, 0, CAMERA_STEP);
+  if (key == GLFW_KEY_PAGE_DOWN && action != GLFW_RELEASE)
+    camera_move(&camera, 0, 0, -CAMERA_STEP);
+  if (key == GLFW_KEY_LEFT_BRACKET && action != GLFW_RELEASE)
+    camera_zoom(&camera, 1.0f / CAMERA_ZOOM);
+  if (key == GLFW_KEY_RIGHT_BRACKET && action != GLFW_RELEASE)
+    camera_zoom(&camera, CAMERA_ZOOM);
+  if (key == GLFW_KEY_H && action == GLFW_PRESS && temporal_available) {
+    temporal_on = !temporal_on;
+    cl_temporal_reset(&temporal);
+    retrace = 1;
+  }
+}
+
+static void mouse_button_callback(GLFWwindow *window, int button, int action, int mods) {
+  if (button != GLFW_MOUSE_BUTTON_LEFT) return;
+  camera_dragging = action == GLFW_PRESS;
+  glfwGetCursorPos(window, &camera_cursor[0], &camera_cursor[1]);
+}
+
+static void cursor_callback(GLFWwindow *window, double x, double y) {
+  if (!camera_dragging) return;
+  // window y grows downwards, the camera's up
+  camera_turn(&camera, (float)(x - camera_cursor[0]) * CAMERA_TURN, (float)(camera_cursor[1] - y) * CAMERA_TURN);
+  camera_cursor[0] = x;
+  camera_cursor[1] = y;
+}
+
+/**
+ * Element index of the Halton sequence in base, in [0, 1).
+ */
+static float halton(unsigned int index, unsigned int base) {
+  float result = 0, f = 1;
+  while(index > 0) {
+    f /= base;
+    result += f * (index % base);
+    index /= base;
+  }
+  return result;
+}
+
+/**
+ * Switches to the trace program variant for kernel_config, built on first
+ * use, and sets every kernel argument again. Returns 0 and keeps the
+ * running kernels if the variant does not build.
+ */
+static int load_trace_kernels() {
+  if(cl_load_kernel(&context, &did, &kernel_cache, trace_sources, TRACE_SOURCES, &kernel_config, &program, &kernel) != CL_SUCCESS)
+    return 0;
+  active_config = kernel_config;
+  cl_secondary_bind(&program, &kernel, &secondary, width, height);
+  cl_adaptive_bind(&program, &kernel, &adaptive, &secondary, width);
+  cl_set_constant_args(&kernel, &secondary.frame, width, height);
+  cl_aov_bind(&kernel, &aovs, &scene_buffers);
+  cl_set_camera_arg(&kernel, PIXEL_ARG_CAMERA, &scene_buffers);
+  cl_set_sampler_arg(&kernel, PIXEL_ARG_BLUE_NOISE, &blue_noise);
+  cl_set_scene_args(&kernel, PIXEL_ARG_SCENE, &scene, &scene_buffers);
+  cl_set_scene_args(&secondary.trace, SECONDARY_ARG_SCENE, &scene, &scene_buffers);
+  cl_set_texture_args(&secondary.trace, SECONDARY_ARG_TEXTURES, &textures);
+  cl_set_frame_index(&secondary.trace, SECONDARY_ARG_FRAME_INDEX, frame_index);
+  cl_set_environment_args(&secondary.trace, SECONDARY_ARG_ENVIRONMENT, &scene_buffers);
+  cl_set_light_args(&secondary.trace, SECONDARY_ARG_LIGHTS, &scene, &scene_buffers);
+  cl_set_light_grid(&secondary.trace, SECONDARY_ARG_LIGHT_GRID, light_grid);
+  cl_set_motion_arg(&secondary.trace, SECONDARY_ARG_INSTANCES_CLOSE, &scene_buffers);
+  cl_set_scene_args(&adaptive.kernel, ADAPTIVE_ARG_SCENE, &scene, &scene_buffers);
+  cl_set_camera_arg(&adaptive.kernel, ADAPTIVE_ARG_CAMERA, &scene_buffers);
+  cl_set_sampler_arg(&adaptive.kernel, ADAPTIVE_ARG_BLUE_NOISE, &blue_noise);
+  cl_set_frame_index(&kernel, PIXEL_ARG_FRAME_INDEX, frame_index);
+  cl_set_frame_index(&adaptive.kernel, ADAPTIVE_ARG_FRAME_INDEX, frame_index);
+  cl_set_texture_args(&kernel, PIXEL_ARG_TEXTURES, &textures);
+  cl_set_texture_args(&adaptive.kernel, ADAPTIVE_ARG_TEXTURES, &textures);
+  cl_set_environment_args(&kernel, PIXEL_ARG_ENVIRONMENT, &scene_buffers);
+  cl_set_environment_args(&adaptive.kernel, ADAPTIVE_ARG_ENVIRONMENT, &scene_buffers);
+  cl_set_light_args(&kernel, PIXEL_ARG_LIGHTS, &scene, &scene_buffers);
+  cl_set_light_args(&adaptive.kernel, ADAPTIVE_ARG_LIGHTS, &scene, &scene_buffers);
+  cl_set_light_grid(&kernel, PIXEL_ARG_LIGHT_GRID, light_grid);
+  cl_set_light_grid(&adaptive.kernel, ADAPTIVE_ARG_LIGHT_GRID, light_grid);
+  cl_set_motion_arg(&kernel, PIXEL_ARG_INSTANCES_CLOSE, &scene_buffers);
+  cl_set_motion_arg(&adaptive.kernel, ADAPTIVE_ARG_INSTANCES_CLOSE, &scene_buffers);
+  return 1;
 }
 
 static void render(GLFWwindow *window) {
@@ -60,16 +310,127 @@ static void render(GLFWwindow *window) {
   #ifdef FPS_ENABLED
   frames++;
   if(current_time - fps_update_time >= 1.0) {
-    char title[64];
-    sprintf(title, "GPU RAY TRACER (%f FPS)", 1000.0f / frames);
+    char title[256];
+    int length = sprintf(title, "GPU RAY TRACER (%f FPS, %.1f Mrays/s, ray sort %s, %s sampler, %s %+.1f EV%s", 1000.0f / frames,
+      rays / (current_time - fps_update_time) * 1e-6, ray_sort ? "on" : "off", sampler_names[active_config.sampler],
+      tonemap_names[tonemapper.op], tonemapper.exposure, paused ? ", paused" : "");
+    if(kernel_config.adaptive) length += sprintf(title + length, ", adaptive");
+    if(active_config.env_samples) length += sprintf(title + length, ", environment");
+    if(active_config.motion_blur) length += sprintf(title + length, ", motion blur");
+    if(camera.aperture > 0) length += sprintf(title + length, ", depth of field");
+    if(scene.num_lights > 0) length += sprintf(title + length, ", %ux%u light samples", light_grid, light_grid);
+    if(temporal_on) length += sprintf(title + length, ", temporal");
+    if(denoise) length += sprintf(title + length, ", denoised");
+    if(encoder) length += sprintf(title + length, ", encode queue %u/%u", encoder_depth(encoder), encode_depth);
+    sprintf(title + length, ")");
     glfwSetWindowTitle(window, title);
     fps_update_time = current_time;
     frames = 0;
+    rays = 0;
   }
   #endif
 
-  /*** run the ray tracing kernel ***/
-  cl_run_kernel(&command_queue, &kernel, &texture_cl, width, height);
+  /*** swap in kernels rebuilt after a source change ***/
+  KernelConfig reloaded_config;
+  cl_program reloaded = reload_take(reloader, &reloaded_config);
+  if(reloaded) {
+    // other variants were built from the old sources
+    cl_cache_clear(&kernel_cache);
+    cl_cache_store(&kernel_cache, &reloaded_config, reloaded);
+    kernel_config_changed = 1;
+  }
+
+  if(kernel_config_changed) {
+    if(!load_trace_kernels()) kernel_config = active_config;
+    reload_set_config(reloader, &kernel_config);
+    kernel_config_changed = 0;
+    retrace = 1;
+    // history was traced with the old kernels
+    cl_temporal_reset(&temporal);
+  }
+
+  /*** move instances and refresh the top level BVH ***/
+  if(!paused) {
+    anim += ANIM_STEP;
+    // the shutter opens at the frame's time, instances stand still without motion blur
+    scene_animate(&scene, anim, anim + (kernel_config.motion_blur ? shutter * ANIM_STEP : 0));
+    cl_update_instances(&command_queue, &scene, &scene_buffers);
+    cl_update_dynamic_meshes(&command_queue, &scene, &scene_buffers, &lbvh, lbvh_optimize);
+    retrace = 1;
+  }
+
+  /*** camera controls retrace the frame when they change it ***/
+  CameraBasis basis;
+  camera_basis(&camera, width, height, &basis);
+  if(memcmp(&basis, &cameras[0], sizeof(basis)) != 0) retrace = 1;
+
+  if(display_kernel) {
+    /*** a debug kernel replaces the whole frame ***/
+    cl_run_image_kernel(&command_queue, &display_kernel, &texture_cl, width, height, 0, anim);
+    // the scene moves on without the trace seeing it
+    cl_temporal_reset(&temporal);
+  } else {
+    /*** trace primary rays, then the reflections they queued ***/
+    // accumulation keeps refining a still frame
+    if(temporal_on) retrace = 1;
+    if(retrace) {
+      // the sample grid walks a Halton(2, 3) pattern for temporal to gather
+      if(temporal_on) {
+        temporal_frame = temporal_frame % 16 + 1;
+        cl_set_jitter(&kernel, halton(temporal_frame, 2) - 0.5f, halton(temporal_frame, 3) - 0.5f);
+        frame_index++;
+      } else {
+        cl_set_jitter(&kernel, 0, 0);
+      }
+      cl_set_frame_index(&kernel, PIXEL_ARG_FRAME_INDEX, frame_index);
+      cl_set_frame_index(&secondary.trace, SECONDARY_ARG_FRAME_INDEX, frame_index);
+      cl_set_frame_index(&adaptive.kernel, ADAPTIVE_ARG_FRAME_INDEX, frame_index);
+      cl_set_light_grid(&kernel, PIXEL_ARG_LIGHT_GRID, light_grid);
+      cl_set_light_grid(&secondary.trace, SECONDARY_ARG_LIGHT_GRID, light_grid);
+      cl_set_light_grid(&adaptive.kernel, ADAPTIVE_ARG_LIGHT_GRID, light_grid);
+      // the last frame finished in cl_tonemap, its camera writes are done
+      cameras[1] = cameras[0];
+      cameras[0] = basis;
+      cl_update_camera(&command_queue, &scene_buffers, &cameras[0], &cameras[1]);
+      cl_run_kernel(&command_queue, &kernel, width, height);
+      cl_keep_instances(&command_queue, &scene, &scene_buffers);
+      const unsigned int secondary_rays = kernel_config.max_bounces > 0 ? cl_trace_secondary(&command_queue, &secondary, ray_sort) : 0;
+      cl_resolve_frame(&command_queue, &secondary, width, height);
+      const unsigned int adaptive_samples = kernel_config.adaptive ? cl_adaptive(&command_queue, &adaptive) : 0;
+      if(temporal_on) cl_temporal(&command_queue, &temporal, &secondary.radiance, &aovs, width, height);
+      if(denoise) cl_denoise(&command_queue, &denoiser, &secondary.radiance, &aovs, width, height);
+      #ifdef FPS_ENABLED
+      rays += (double)width * height * secondary.samples + secondary_rays + adaptive_samples;
+      #endif
+      // every ray shaded a point, the next frame spends the budget over as many
+      light_grid = scene_light_grid(&scene, (double)shadow_budget * width * height,
+        (double)width * height * secondary.samples + secondary_rays + adaptive_samples);
+      // trace again once the tiles this frame asked for are in
+      retrace = cl_texture_stream(&command_queue, &textures) > 0;
+    }
+
+    /*** exposure and operator only need this pass ***/
+    cl_tonemap(&command_queue, &tonemapper, &secondary.radiance, &texture_cl, width, height);
+
+    /*** A/B against a debug kernel on the same frame ***/
+    if(compare_kernel)
+      cl_run_image_kernel(&command_queue, &compare_kernel, &texture_cl, width, height, width / 2, anim);
+  }
+
+  /*** hand finished readbacks on, then capture this frame ***/
+  if(readback) {
+    Frame frame;
+    while(readback_poll(readback, 0, &frame)) {
+      if(stream) stream_submit(stream, &frame);
+      else encoder_submit(encoder, &frame);
+    }
+    if(readback_format(readback) == FRAME_RGBA16F)
+      readback_capture_buffer(readback, &command_queue, &secondary.radiance, capture_index++);
+    else
+      readback_capture(readback, &command_queue, &texture_cl, capture_index++);
+    if((capture_frames > 0 && capture_index >= capture_frames) || (stream && stream_broken(stream)))
+      glfwSetWindowShouldClose(window, GL_TRUE);
+  }
 
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -91,14 +452,6 @@ static void render(GLFWwindow *window) {
   time = current_time;
 }
 
-void glPerspective(double fov, double aspectRatio, double znear, double zfar)
-{
-  double ymax, xmax;
-  ymax = znear * tanf(fov * M_PI / 360.0);
-  xmax = ymax * aspectRatio;
-  glFrustum(-xmax, xmax, -ymax, ymax, znear, zfar);
-}
-
 void init_gl()
 {
   // default initialization
@@ -110,21 +463,142 @@ void init_gl()
   // viewport
   glViewport(0, 0, window_width, window_height);
 
-  // projection
+  // the traced frame covers the window, the camera is in the kernels
   glMatrixMode(GL_PROJECTION);
   glLoadIdentity();
-  glPerspective(60.0, window_width/window_height, 0.1, 10.0);
 
-  // set view matrix
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
-  glTranslatef(0.0, 0.0, -1.0);
 }
 
 
-int main(void) {
+/**
+ * AOV_* mask from a comma separated list of names, exits on unknown ones.
+ */
+static unsigned int parse_aovs(const char* list) {
+  static const char* names[] = { "depth", "normal", "albedo", "prim", "motion" };
+  unsigned int mask = 0;
+  const char* name = list;
+  while(*name) {
+    const size_t length = strcspn(name, ",");
+    unsigned int i;
+    for(i = 0; i < 5; i++)
+      if(strlen(names[i]) == length && strncmp(name, names[i], length) == 0) break;
+    if(i == 5) {
+      fprintf(stderr, "Unknown AOV %.*s, available: depth normal albedo prim motion\n", (int)length, name);
+      exit(EXIT_FAILURE);
+    }
+    mask |= 1u << i;
+    name += length;
+    if(*name == ',') name++;
+  }
+  return mask;
+}
+
+static void usage(const char* program) {
+  fprintf(stderr, "usage: %s [--kernel name] [--compare name] [--capture prefix] [--frames n]\n", program);
+  fprintf(stderr, "          [--encode-threads n] [--encode-queue n] [--direct-io]\n");
+  fprintf(stderr, "          [--stream path] [--stream-format rgba8|rgba16f] [--storage float|half|rgbe]\n");
+  fprintf(stderr, "          [--aovs depth,normal,albedo,prim,motion] [--denoise] [--temporal] [--adaptive]\n");
+  fprintf(stderr, "          [--sampler grid|halton|sobol|blue] [--env path|sky]\n");
+  fprintf(stderr, "          [--shadow-budget n] [--aperture r] [--focus d] [--shutter s]\n");
+  fprintf(stderr, "  --kernel          kernel to show, trace (default), glow or xy\n");
+  fprintf(stderr, "  --compare         kernel drawn over the right half of the traced frame\n");
+  fprintf(stderr, "  --capture         write every frame to prefix00000.png onwards\n");
+  fprintf(stderr, "  --frames          stop after n captured frames\n");
+  fprintf(stderr, "  --encode-threads  compression threads, all but one core by default\n");
+  fprintf(stderr, "  --encode-queue    frames queued before rendering waits, 4 by default\n");
+  fprintf(stderr, "  --direct-io       write frames with O_DIRECT where supported\n");
+  fprintf(stderr, "  --stream          write raw frames to path, - for stdout, see stream.h\n");
+  fprintf(stderr, "  --stream-format   rgba8 display image (default) or rgba16f traced radiance\n");
+  fprintf(stderr, "  --storage         frame buffer format, half with cl_khr_fp16 and rgbe without by default\n");
+  fprintf(stderr, "  --aovs            extra outputs of the primary pass, none by default\n");
+  fprintf(stderr, "  --denoise         a-trous filter the traced frame, adds the AOVs it needs\n");
+  fprintf(stderr, "  --temporal        accumulate reprojected frames, adds the AOVs it needs\n");
+  fprintf(stderr, "  --adaptive        add samples to the pixels whose estimated error is high\n");
+  fprintf(stderr, "  --sampler         sample sequence, scrambled sobol by default\n");
+  fprintf(stderr, "  --env             light with an equirectangular .hdr map, or a procedural sky\n");
+  fprintf(stderr, "  --shadow-budget   light sample rays per pixel and frame, 16 by default\n");
+  fprintf(stderr, "  --aperture        lens radius for depth of field, 0 (a pinhole) by default\n");
+  fprintf(stderr, "  --focus           distance in front of the camera that is in focus, 1 by default\n");
+  fprintf(stderr, "  --shutter         motion blur over this share of a frame, 0.5 once turned on with M\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
   GLFWwindow *window;
+  const char* kernel_arg = NULL;
+  const char* compare_arg = NULL;
+  const char* capture_arg = NULL;
+  const char* stream_arg = NULL;
+  const char* env_arg = NULL;
+  float aperture = 0, focus = 1.0f;
+  FrameFormat stream_format = FRAME_RGBA8;
+  int storage = -1;
+  unsigned int encode_threads = 0;
+  int direct_io = 0;
+  int i;
+
+  for(i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+      kernel_arg = argv[++i];
+    } else if(strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+      compare_arg = argv[++i];
+    } else if(strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+      capture_arg = argv[++i];
+    } else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      capture_frames = (unsigned int)atoi(argv[++i]);
+    } else if(strcmp(argv[i], "--encode-threads") == 0 && i + 1 < argc) {
+      encode_threads = (unsigned int)atoi(argv[++i]);
+    } else if(strcmp(argv[i], "--encode-queue") == 0 && i + 1 < argc) {
+      encode_depth = (unsigned int)atoi(argv[++i]);
+      if(encode_depth < 1) encode_depth = 1;
+    } else if(strcmp(argv[i], "--direct-io") == 0) {
+      direct_io = 1;
+    } else if(strcmp(argv[i], "--storage") == 0 && i + 1 < argc) {
+      i++;
+      if(strcmp(argv[i], "float") == 0) storage = STORAGE_FLOAT;
+      else if(strcmp(argv[i], "half") == 0) storage = STORAGE_HALF;
+      else if(strcmp(argv[i], "rgbe") == 0) storage = STORAGE_RGBE;
+      else usage(argv[0]);
+    } else if(strcmp(argv[i], "--aovs") == 0 && i + 1 < argc) {
+      kernel_config.aovs = parse_aovs(argv[++i]);
+    } else if(strcmp(argv[i], "--denoise") == 0) {
+      denoise_available = denoise = 1;
+    } else if(strcmp(argv[i], "--sampler") == 0 && i + 1 < argc) {
+      const char* name = argv[++i];
+      for(kernel_config.sampler = 0; kernel_config.sampler < SAMPLER_COUNT; kernel_config.sampler++)
+        if(strcmp(name, sampler_names[kernel_config.sampler]) == 0) break;
+      if(kernel_config.sampler == SAMPLER_COUNT) usage(argv[0]);
+    } else if(strcmp(argv[i], "--env") == 0 && i + 1 < argc) {
+      env_arg = argv[++i];
+    } else if(strcmp(argv[i], "--shadow-budget") == 0 && i + 1 < argc) {
+      shadow_budget = (float)atof(argv[++i]);
+    } else if(strcmp(argv[i], "--aperture") == 0 && i + 1 < argc) {
+      aperture = (float)atof(argv[++i]);
+    } else if(strcmp(argv[i], "--focus") == 0 && i + 1 < argc) {
+      focus = (float)atof(argv[++i]);
+    } else if(strcmp(argv[i], "--shutter") == 0 && i + 1 < argc) {
+      shutter = (float)atof(argv[++i]);
+      kernel_config.motion_blur = shutter > 0;
+    } else if(strcmp(argv[i], "--adaptive") == 0) {
+      kernel_config.adaptive = 1;
+    } else if(strcmp(argv[i], "--temporal") == 0) {
+      temporal_available = temporal_on = 1;
+    } else if(strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+      stream_arg = argv[++i];
+    } else if(strcmp(argv[i], "--stream-format") == 0 && i + 1 < argc) {
+      i++;
+      if(strcmp(argv[i], "rgba16f") == 0) stream_format = FRAME_RGBA16F;
+      else if(strcmp(argv[i], "rgba8") != 0) usage(argv[0]);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if(capture_arg && stream_arg) usage(argv[0]);
+  // before anything is printed, stdout may carry the frames
+  if(stream_arg) stream = stream_open(stream_arg);
 
   glfwSetErrorCallback(error_callback);
 
@@ -171,12 +645,70 @@ int main(void) {
   cl_info();
   cl_select(&pid, &did);
   cl_select_context(&pid, &did, &context);
-  cl_load_kernel(&context, &did, "./trace.cl", &command_queue, &kernel);
+  cl_create_queue(&context, &did, &command_queue);
   cl_create_texture(&context, &texture, &texture_cl, width, height);
-  cl_set_constant_args(&kernel, &texture_cl, width, height);
+
+  scene_create_default(&scene);
+  if(env_arg) {
+    if(strcmp(env_arg, "sky") == 0) environment_sky(&scene.environment, 1024, 512);
+    else if(!environment_load_hdr(&scene.environment, env_arg)) exit(EXIT_FAILURE);
+    environment_build(&scene.environment);
+    kernel_config.env_samples = env_samples;
+  }
+  const unsigned int max_rays = width * height * kernel_config.aa_grid * kernel_config.aa_grid;
+  cl_primitives_init(&context, &did, &primitives, max_rays > scene.max_dynamic_prims ? max_rays : scene.max_dynamic_prims);
+  kernel_config.storage = storage >= 0 ? (unsigned int)storage : cl_default_storage(&did);
+  cl_secondary_init(&context, &secondary, &primitives, width, height, kernel_config.aa_grid * kernel_config.aa_grid, kernel_config.storage);
+  cl_adaptive_init(&context, &adaptive, &primitives, width, height, kernel_config.aa_grid * kernel_config.aa_grid);
+  cl_sampler_init(&context, &blue_noise);
+  if(denoise_available) {
+    kernel_config.aovs |= DENOISE_AOVS;
+    cl_denoise_init(&context, &did, &denoiser, width, height, kernel_config.storage);
+  }
+  if(temporal_available) {
+    kernel_config.aovs |= TEMPORAL_AOVS;
+    cl_temporal_init(&context, &did, &temporal, width, height);
+  }
+  cl_aov_init(&context, &aovs, kernel_config.aovs, width, height, kernel_config.storage);
+  cl_tonemap_init(&context, &did, &tonemapper);
+  cl_create_scene_buffers(&context, &scene, &scene_buffers);
+  cl_texture_init(&context, &command_queue, &textures, scene.textures, scene.num_textures);
+  camera_defaults(&camera);
+  camera.aperture = aperture;
+  camera.focus_distance = focus;
+  camera_basis(&camera, width, height, &cameras[0]);
+  cameras[1] = cameras[0];
+
+  kernel_config.num_planes = scene.num_planes;
+  if(!load_trace_kernels()) exit(EXIT_FAILURE);
+  reloader = reload_start(&context, &did, trace_sources, TRACE_SOURCES, &kernel_config);
+
+  // debug kernels are built once, switching between them costs nothing
+  const char* glow_sources[] = { KERNEL_DIR "/glow.cl" };
+  const char* xy_sources[] = { KERNEL_DIR "/xy.cl" };
+  cl_registry_add(&context, &did, &registry, "glow", glow_sources, 1, "sine_wave");
+  cl_registry_add(&context, &did, &registry, "xy", xy_sources, 1, "sine_wave");
+  if(kernel_arg) display_kernel = find_kernel(kernel_arg);
+  // C compares against the uv debug kernel unless another one was named
+  compare_choice = compare_arg ? find_kernel(compare_arg) : cl_registry_find(&registry, "xy");
+  if(compare_arg) compare_kernel = compare_choice;
+
+  if(capture_arg) {
+    // queued frames stay mapped, two more slots keep a copy and a map in flight
+    readback = readback_create(&context, width, height, encode_depth + 2, FRAME_RGBA8);
+    encoder = encoder_start(capture_arg, readback, encode_threads, encode_depth, direct_io);
+  } else if(stream) {
+    readback = readback_create(&context, width, height, READBACK_SLOTS, stream_format);
+    stream_start(stream, readback);
+  }
+  cl_lbvh_init(&context, &did, &lbvh, &primitives, scene.max_dynamic_prims);
+  // dynamic meshes need a BVH before the first frame, paused or not
+  cl_update_dynamic_meshes(&command_queue, &scene, &scene_buffers, &lbvh, lbvh_optimize);
   // END CL
 
   glfwSetKeyCallback(window, key_callback);
+  glfwSetMouseButtonCallback(window, mouse_button_callback);
+  glfwSetCursorPosCallback(window, cursor_callback);
 
   while (!glfwWindowShouldClose(window)) {
     render(window);
@@ -186,6 +718,19 @@ int main(void) {
     //glfwWaitEvents();
   }
 
+  if(readback) {
+    Frame frame;
+    while(readback_poll(readback, 1, &frame)) {
+      if(stream) stream_submit(stream, &frame);
+      else encoder_submit(encoder, &frame);
+    }
+    if(stream) stream_close(stream);
+    else encoder_stop(encoder);
+    readback_free(readback, &command_queue);
+  }
+  reload_stop(reloader);
+  scene_free(&scene);
+
   glfwDestroyWindow(window);
 
   glfwTerminate();
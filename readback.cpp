@@ -0,0 +1,215 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include "readback.h"
+
+enum SlotState {
+    SLOT_FREE,      // unmapped, ready for a copy
+    SLOT_PENDING,   // copy and map enqueued
+    SLOT_HELD,      // mapped and handed to the consumer
+    SLOT_RELEASED   // consumer is done, still mapped
+};
+
+struct ReadbackSlot {
+    cl_mem buffer;
+    void* mapped;
+    cl_event ready;
+    unsigned int index;
+    std::atomic<int> state;
+};
+
+struct ReadbackRing {
+    ReadbackSlot* slots;
+    unsigned int count;
+    unsigned int head;  // next slot to copy into
+    unsigned int tail;  // oldest slot not yet handed out
+    unsigned int width;
+    unsigned int height;
+    FrameFormat format;
+    size_t stride;
+    size_t size;
+
+    // wakes readback_capture when the consumer hands a slot back
+    std::mutex lock;
+    std::condition_variable released;
+};
+
+/**
+ * Allocates count staging buffers for frames of width x height.
+ */
+ReadbackRing* readback_create(cl_context* context, unsigned int width, unsigned int height, unsigned int count, FrameFormat format) {
+    ReadbackRing* ring = new ReadbackRing();
+    cl_int err;
+    unsigned int i;
+
+    // one slot is copied into while the others are consumed
+    ring->count = count > 1 ? count : 2;
+    ring->slots = new ReadbackSlot[ring->count];
+    ring->head = ring->tail = 0;
+    ring->width = width;
+    ring->height = height;
+    ring->format = format;
+    ring->stride = (size_t)width * (format == FRAME_RGBA16F ? 8 : 4);
+    ring->size = ring->stride * height;
+
+    for(i = 0; i < ring->count; i++) {
+        // host accessible allocation, mapping it needs no extra copy
+        ring->slots[i].buffer = clCreateBuffer(*context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, ring->size, NULL, &err);
+        CHECK_ERR(err);
+        ring->slots[i].mapped = NULL;
+        ring->slots[i].ready = NULL;
+        ring->slots[i].state = SLOT_FREE;
+    }
+    return ring;
+}
+
+FrameFormat readback_format(ReadbackRing* ring) {
+    return ring->format;
+}
+
+/**
+ * Waits until the head slot can be copied into and unmaps it, NULL when it
+ * was never polled and the frame has to be dropped.
+ */
+static ReadbackSlot* readback_begin(ReadbackRing* ring, cl_command_queue* command_queue, unsigned int index) {
+    ReadbackSlot* slot = &ring->slots[ring->head];
+    cl_int err;
+
+    {
+        std::unique_lock<std::mutex> guard(ring->lock);
+        while(slot->state == SLOT_HELD) ring->released.wait(guard);
+    }
+    if(slot->state == SLOT_PENDING) {
+        fprintf(stderr, "Readback slot %u was never polled, frame %u dropped.\n", ring->head, index);
+        return NULL;
+    }
+
+    // the device must not write a mapped buffer
+    if(slot->state == SLOT_RELEASED) {
+        err = clEnqueueUnmapMemObject(*command_queue, slot->buffer, slot->mapped, 0, NULL, NULL);
+        CHECK_ERR(err);
+        slot->mapped = NULL;
+        slot->state = SLOT_FREE;
+    }
+    return slot;
+}
+
+/**
+ * Maps the head slot after its copy has been enqueued and advances.
+ */
+static void readback_end(ReadbackRing* ring, cl_command_queue* command_queue, ReadbackSlot* slot, unsigned int index) {
+    cl_int err;
+
+    slot->mapped = clEnqueueMapBuffer(*command_queue, slot->buffer, CL_FALSE, CL_MAP_READ, 0, ring->size, 0, NULL, &slot->ready, &err);
+    CHECK_ERR(err);
+    err = clFlush(*command_queue);
+    CHECK_ERR(err);
+
+    slot->index = index;
+    slot->state = SLOT_PENDING;
+    ring->head = (ring->head + 1) % ring->count;
+}
+
+/**
+ * Copies the display texture into the next staging buffer and maps it,
+ * without waiting for either. Blocks only while the consumer still holds
+ * that buffer. Frames must be taken with readback_poll in between.
+ */
+void readback_capture(ReadbackRing* ring, cl_command_queue* command_queue, cl_mem* texture_cl, unsigned int index) {
+    ReadbackSlot* slot = readback_begin(ring, command_queue, index);
+    cl_int err;
+
+    if(!slot) return;
+
+    size_t origin[] = {0, 0, 0};
+    size_t region[] = {ring->width, ring->height, 1};
+    err = clEnqueueAcquireGLObjects(*command_queue, 1, texture_cl, 0, NULL, NULL);
+    CHECK_ERR(err);
+    err = clEnqueueCopyImageToBuffer(*command_queue, *texture_cl, slot->buffer, origin, region, 0, 0, NULL, NULL);
+    CHECK_ERR(err);
+    err = clEnqueueReleaseGLObjects(*command_queue, 1, texture_cl, 0, NULL, NULL);
+    CHECK_ERR(err);
+
+    readback_end(ring, command_queue, slot, index);
+}
+
+/**
+ * As readback_capture, from a buffer already in the ring's format such as
+ * SecondaryPass radiance.
+ */
+void readback_capture_buffer(ReadbackRing* ring, cl_command_queue* command_queue, cl_mem* buffer, unsigned int index) {
+    ReadbackSlot* slot = readback_begin(ring, command_queue, index);
+    cl_int err;
+
+    if(!slot) return;
+
+    err = clEnqueueCopyBuffer(*command_queue, *buffer, slot->buffer, 0, 0, ring->size, 0, NULL, NULL);
+    CHECK_ERR(err);
+
+    readback_end(ring, command_queue, slot, index);
+}
+
+/**
+ * Hands out the oldest captured frame once its map has completed, waiting
+ * for it when wait is set. Returns 0 when there is no frame to hand out.
+ */
+int readback_poll(ReadbackRing* ring, int wait, Frame* frame) {
+    ReadbackSlot* slot = &ring->slots[ring->tail];
+    cl_int status;
+    cl_int err;
+
+    if(slot->state != SLOT_PENDING) return 0;
+
+    if(wait) {
+        err = clWaitForEvents(1, &slot->ready);
+        CHECK_ERR(err);
+    } else {
+        err = clGetEventInfo(slot->ready, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+        CHECK_ERR(err);
+        if(status != CL_COMPLETE) return 0;
+    }
+    clReleaseEvent(slot->ready);
+    slot->ready = NULL;
+
+    frame->pixels = (const unsigned char*)slot->mapped;
+    frame->width = ring->width;
+    frame->height = ring->height;
+    frame->format = ring->format;
+    frame->stride = ring->stride;
+    frame->index = slot->index;
+    frame->slot = ring->tail;
+
+    slot->state = SLOT_HELD;
+    ring->tail = (ring->tail + 1) % ring->count;
+    return 1;
+}
+
+/**
+ * Gives a frame's staging buffer back, callable from the consumer thread.
+ * It is unmapped the next time the render thread captures into it.
+ */
+void readback_release(ReadbackRing* ring, const Frame* frame) {
+    std::lock_guard<std::mutex> guard(ring->lock);
+    ring->slots[frame->slot].state = SLOT_RELEASED;
+    ring->released.notify_all();
+}
+
+/**
+ * Frees the staging buffers. Every frame handed out must be released.
+ */
+void readback_free(ReadbackRing* ring, cl_command_queue* command_queue) {
+    unsigned int i;
+    for(i = 0; i < ring->count; i++) {
+        ReadbackSlot* slot = &ring->slots[i];
+        if(slot->ready) {
+            clWaitForEvents(1, &slot->ready);
+            clReleaseEvent(slot->ready);
+        }
+        if(slot->mapped) clEnqueueUnmapMemObject(*command_queue, slot->buffer, slot->mapped, 0, NULL, NULL);
+    }
+    clFinish(*command_queue);
+    for(i = 0; i < ring->count; i++) clReleaseMemObject(ring->slots[i].buffer);
+    delete[] ring->slots;
+    delete ring;
+}
@@ -0,0 +1,47 @@
+#ifndef READBACK_H
+#define READBACK_H
+
+#include "compute.h"
+
+// default staging buffers in flight, one being written while others are consumed
+#define READBACK_SLOTS 3
+
+/**
+ * Pixel layouts a ring can read back. RGBA16F comes from the half float
+ * radiance buffer, RGBA8 from the display texture.
+ */
+typedef enum {
+    FRAME_RGBA8,
+    FRAME_RGBA16F
+} FrameFormat;
+
+/**
+ * A frame mapped into host memory, rows bottom up. pixels stays valid until the frame is
+ * passed to readback_release, which any thread may do.
+ */
+typedef struct {
+    const unsigned char* pixels;
+    unsigned int width;
+    unsigned int height;
+    FrameFormat format;
+    size_t stride;
+    unsigned int index;
+    unsigned int slot;
+} Frame;
+
+/**
+ * Ring of CL_MEM_ALLOC_HOST_PTR staging buffers the display texture is
+ * copied into and mapped without blocking, so the mapped memory goes to
+ * the consumer as is and readback overlaps the next frame.
+ */
+typedef struct ReadbackRing ReadbackRing;
+
+ReadbackRing* readback_create(cl_context* context, unsigned int width, unsigned int height, unsigned int count, FrameFormat format);
+FrameFormat readback_format(ReadbackRing* ring);
+void readback_capture(ReadbackRing* ring, cl_command_queue* command_queue, cl_mem* texture_cl, unsigned int index);
+void readback_capture_buffer(ReadbackRing* ring, cl_command_queue* command_queue, cl_mem* buffer, unsigned int index);
+int readback_poll(ReadbackRing* ring, int wait, Frame* frame);
+void readback_release(ReadbackRing* ring, const Frame* frame);
+void readback_free(ReadbackRing* ring, cl_command_queue* command_queue);
+
+#endif
@@ -0,0 +1,232 @@
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "reload.h"
+
+// editors save in bursts, wait this long after a change before building
+#define RELOAD_SETTLE_MS 100
+// how often the worker checks whether it should stop or, without inotify, polls
+#define RELOAD_POLL_MS 250
+
+struct KernelReloader {
+    cl_context context;
+    cl_device_id device;
+    std::vector<std::string> sources;
+    std::thread worker;
+    std::atomic<bool> running;
+
+    // guarded by lock
+    std::mutex lock;
+    KernelConfig config;
+    cl_program pending;
+    KernelConfig pending_config;
+
+#ifdef __linux__
+    int fd;
+#else
+    std::vector<time_t> mtimes;
+#endif
+};
+
+static std::string base_name(const std::string& path) {
+    const size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+static std::string dir_name(const std::string& path) {
+    const size_t slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? std::string(".") : path.substr(0, slash);
+}
+
+#ifdef __linux__
+
+static bool is_source(KernelReloader* reloader, const char* name) {
+    for(size_t i = 0; i < reloader->sources.size(); i++)
+        if(base_name(reloader->sources[i]) == name) return true;
+    return false;
+}
+
+/**
+ * Reads pending inotify events, true if one of them touched a source.
+ */
+static bool read_events(KernelReloader* reloader) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t length;
+
+    while((length = read(reloader->fd, buffer, sizeof(buffer))) > 0) {
+        for(char* p = buffer; p < buffer + length; ) {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            if(event->len > 0 && is_source(reloader, event->name)) changed = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
+
+static void watch_init(KernelReloader* reloader) {
+    reloader->fd = inotify_init1(IN_NONBLOCK);
+    if(reloader->fd < 0) {
+        perror("inotify_init1");
+        return;
+    }
+    // watch directories, editors often replace files instead of writing them
+    for(size_t i = 0; i < reloader->sources.size(); i++)
+        if(inotify_add_watch(reloader->fd, dir_name(reloader->sources[i]).c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+            perror("inotify_add_watch");
+}
+
+/**
+ * Blocks until a source changes, false once the reloader is stopping.
+ */
+static bool wait_for_change(KernelReloader* reloader) {
+    while(reloader->running) {
+        struct pollfd fds = { reloader->fd, POLLIN, 0 };
+        if(reloader->fd < 0 || poll(&fds, 1, RELOAD_POLL_MS) <= 0) {
+            if(reloader->fd < 0) std::this_thread::sleep_for(std::chrono::milliseconds(RELOAD_POLL_MS));
+            continue;
+        }
+        if(!read_events(reloader)) continue;
+
+        // let the editor finish, then drop the events that came with it
+        std::this_thread::sleep_for(std::chrono::milliseconds(RELOAD_SETTLE_MS));
+        read_events(reloader);
+        return true;
+    }
+    return false;
+}
+
+static void watch_free(KernelReloader* reloader) {
+    if(reloader->fd >= 0) close(reloader->fd);
+}
+
+#else
+
+static time_t modified_time(const std::string& path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 ? info.st_mtime : 0;
+}
+
+static void watch_init(KernelReloader* reloader) {
+    for(size_t i = 0; i < reloader->sources.size(); i++)
+        reloader->mtimes.push_back(modified_time(reloader->sources[i]));
+}
+
+static bool wait_for_change(KernelReloader* reloader) {
+    while(reloader->running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(RELOAD_POLL_MS));
+        bool changed = false;
+        for(size_t i = 0; i < reloader->sources.size(); i++) {
+            const time_t mtime = modified_time(reloader->sources[i]);
+            if(mtime != reloader->mtimes[i]) {
+                reloader->mtimes[i] = mtime;
+                changed = true;
+            }
+        }
+        if(changed) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(RELOAD_SETTLE_MS));
+            return true;
+        }
+    }
+    return false;
+}
+
+static void watch_free(KernelReloader* reloader) {
+}
+
+#endif
+
+/**
+ * Worker thread: rebuilds the current variant after every change and
+ * leaves it for the render loop. A newer build replaces one not yet taken.
+ */
+static void reload_worker(KernelReloader* reloader) {
+    std::vector<const char*> paths;
+    for(size_t i = 0; i < reloader->sources.size(); i++) paths.push_back(reloader->sources[i].c_str());
+
+    while(wait_for_change(reloader)) {
+        KernelConfig config;
+        char options[256];
+        cl_program program;
+
+        {
+            std::lock_guard<std::mutex> guard(reloader->lock);
+            config = reloader->config;
+        }
+
+        cl_kernel_options(&config, options, sizeof(options));
+        printf("Reloading kernels: %s\n", options);
+        if(cl_build_program(&reloader->context, &reloader->device, paths.data(), (unsigned int)paths.size(), options, &program) != CL_SUCCESS) {
+            fprintf(stderr, "Kernel reload failed, keeping the running kernels.\n");
+            continue;
+        }
+
+        std::lock_guard<std::mutex> guard(reloader->lock);
+        if(reloader->pending) clReleaseProgram(reloader->pending);
+        reloader->pending = program;
+        reloader->pending_config = config;
+    }
+}
+
+/**
+ * Starts watching sources, rebuilt with the options of config.
+ */
+KernelReloader* reload_start(cl_context* context, cl_device_id* device, const char** sources, unsigned int num_sources, const KernelConfig* config) {
+    KernelReloader* reloader = new KernelReloader();
+    unsigned int i;
+
+    reloader->context = *context;
+    reloader->device = *device;
+    for(i = 0; i < num_sources; i++) reloader->sources.push_back(sources[i]);
+    reloader->config = *config;
+    reloader->pending = NULL;
+    reloader->running = true;
+
+    watch_init(reloader);
+    reloader->worker = std::thread(reload_worker, reloader);
+    return reloader;
+}
+
+/**
+ * Sets the variant later rebuilds use.
+ */
+void reload_set_config(KernelReloader* reloader, const KernelConfig* config) {
+    std::lock_guard<std::mutex> guard(reloader->lock);
+    reloader->config = *config;
+}
+
+/**
+ * Hands over the latest successfully rebuilt program and the config it was
+ * built for, or returns NULL when there is none. Call between frames.
+ */
+cl_program reload_take(KernelReloader* reloader, KernelConfig* config) {
+    std::lock_guard<std::mutex> guard(reloader->lock);
+    cl_program program = reloader->pending;
+    if(program) *config = reloader->pending_config;
+    reloader->pending = NULL;
+    return program;
+}
+
+/**
+ * Stops the worker, waiting for a build in progress.
+ */
+void reload_stop(KernelReloader* reloader) {
+    reloader->running = false;
+    reloader->worker.join();
+    if(reloader->pending) clReleaseProgram(reloader->pending);
+    watch_free(reloader);
+    delete reloader;
+}
@@ -0,0 +1,21 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include "compute.h"
+
+/**
+ * Watches kernel sources and rebuilds the trace program on a worker thread
+ * whenever one of them changes. Uses inotify on Linux and polls modification
+ * times elsewhere. The render loop picks finished programs up between frames
+ * with reload_take, a failed build leaves the running kernels alone.
+ * Only the trace program is reloaded, the other programs are built once at
+ * start up.
+ */
+typedef struct KernelReloader KernelReloader;
+
+KernelReloader* reload_start(cl_context* context, cl_device_id* device, const char** sources, unsigned int num_sources, const KernelConfig* config);
+void reload_set_config(KernelReloader* reloader, const KernelConfig* config);
+cl_program reload_take(KernelReloader* reloader, KernelConfig* config);
+void reload_stop(KernelReloader* reloader);
+
+#endif
@@ -0,0 +1,117 @@
+#include <math.h>
+
+#include <vector>
+
+#include "sampler.h"
+#include "kernels/rng.h"
+
+// width of the Gaussian the void-and-cluster energy is filtered with
+#define BLUE_NOISE_SIGMA 1.9f
+// share of the mask set in the initial binary pattern
+#define BLUE_NOISE_INITIAL 10
+
+/**
+ * Binary pattern on the torus with the Gaussian weighted energy of its set
+ * texels, as void-and-cluster (Ulichney 1993) keeps it.
+ */
+struct BlueNoisePattern {
+    std::vector<unsigned char> set;
+    std::vector<float> energy;
+    const std::vector<float>* weights;
+
+    void toggle(unsigned int i, int on) {
+        const unsigned int x = i % BLUE_NOISE_SIZE, y = i / BLUE_NOISE_SIZE;
+        const float sign = on ? 1.0f : -1.0f;
+        set[i] = on;
+        for(unsigned int j = 0; j < energy.size(); j++) {
+            const unsigned int dx = (j % BLUE_NOISE_SIZE + BLUE_NOISE_SIZE - x) % BLUE_NOISE_SIZE;
+            const unsigned int dy = (j / BLUE_NOISE_SIZE + BLUE_NOISE_SIZE - y) % BLUE_NOISE_SIZE;
+            energy[j] += sign * (*weights)[dy * BLUE_NOISE_SIZE + dx];
+        }
+    }
+
+    // set texel with the most energy around it, or the unset one with the least
+    unsigned int extreme(int cluster) const {
+        unsigned int best = 0;
+        int found = 0;
+        for(unsigned int i = 0; i < energy.size(); i++) {
+            if(set[i] != cluster) continue;
+            if(!found || (cluster ? energy[i] > energy[best] : energy[i] < energy[best])) best = i;
+            found = 1;
+        }
+        return best;
+    }
+};
+
+/**
+ * Ranks of a BLUE_NOISE_SIZE squared void-and-cluster mask, seed picks the
+ * initial random pattern.
+ */
+static void blue_noise_ranks(unsigned int seed, std::vector<unsigned int>& rank) {
+    const unsigned int n = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+    std::vector<float> weights(n);
+    unsigned int i, count = 0;
+
+    for(i = 0; i < n; i++) {
+        int dx = i % BLUE_NOISE_SIZE, dy = i / BLUE_NOISE_SIZE;
+        if(dx > BLUE_NOISE_SIZE / 2) dx -= BLUE_NOISE_SIZE;
+        if(dy > BLUE_NOISE_SIZE / 2) dy -= BLUE_NOISE_SIZE;
+        weights[i] = expf(-(float)(dx * dx + dy * dy) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+    }
+
+    BlueNoisePattern initial;
+    initial.set.assign(n, 0);
+    initial.energy.assign(n, 0);
+    initial.weights = &weights;
+
+    // random start, the same on every platform
+    Rng rng;
+    rng_init(&rng, seed, 0, 0, 0, RNG_STREAM_USER);
+    while(count < n / BLUE_NOISE_INITIAL) {
+        const unsigned int texel = rng_uint(&rng) % n;
+        if(!initial.set[texel]) {
+            initial.toggle(texel, 1);
+            count++;
+        }
+    }
+
+    // move texels from the tightest cluster to the largest void until stable
+    for(i = 0; i < n; i++) {
+        const unsigned int cluster = initial.extreme(1);
+        initial.toggle(cluster, 0);
+        const unsigned int largest = initial.extreme(0);
+        initial.toggle(largest, 1);
+        if(largest == cluster) break;
+    }
+
+    // ranks below count come from taking the initial texels away again
+    BlueNoisePattern pattern = initial;
+    for(i = count; i > 0; i--) {
+        const unsigned int cluster = pattern.extreme(1);
+        pattern.toggle(cluster, 0);
+        rank[cluster] = i - 1;
+    }
+    // the rest from filling the largest voids
+    pattern = initial;
+    for(i = count; i < n; i++) {
+        const unsigned int largest = pattern.extreme(0);
+        pattern.toggle(largest, 1);
+        rank[largest] = i;
+    }
+}
+
+/**
+ * Tile of 2D toroidal shifts for SAMPLER_BLUE_NOISE: two void-and-cluster
+ * masks, one per axis, with ranks mapped to [0, 1). shifts holds
+ * 2 * BLUE_NOISE_SIZE^2 floats, x and y interleaved.
+ */
+void sampler_blue_noise(unsigned int seed, float* shifts) {
+    const unsigned int n = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+    std::vector<unsigned int> rank(n);
+    unsigned int axis, i;
+
+    for(axis = 0; axis < 2; axis++) {
+        blue_noise_ranks(seed + axis, rank);
+        for(i = 0; i < n; i++) shifts[2 * i + axis] = (rank[i] + 0.5f) / n;
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+// sample sequences of kernels/sampler.cl, picked with -DSAMPLER
+#define SAMPLER_GRID 0
+#define SAMPLER_HALTON 1
+#define SAMPLER_SOBOL 2
+#define SAMPLER_BLUE_NOISE 3
+#define SAMPLER_COUNT 4
+
+// side of the tiled blue noise mask, must match kernels/sampler.cl
+#define BLUE_NOISE_SIZE 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void sampler_blue_noise(unsigned int seed, float* shifts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,603 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scene.h"
+
+static cl_float4 make_float4(float x, float y, float z, float w) {
+    cl_float4 v;
+    v.s[0] = x;
+    v.s[1] = y;
+    v.s[2] = z;
+    v.s[3] = w;
+    return v;
+}
+
+static cl_float4 normalize3(float x, float y, float z) {
+    const float len = sqrtf(x*x + y*y + z*z);
+    return make_float4(x / len, y / len, z / len, 0);
+}
+
+/**
+ * Object space bounds of a bounded primitive.
+ */
+static void prim_bounds(const Primitive* prim, AABB* box) {
+    int a;
+    const float radius = prim->scale[0];
+    for(a = 0; a < 3; a++) {
+        box->bmin[a] = prim->pos.s[a] - radius;
+        box->bmax[a] = prim->pos.s[a] + radius;
+    }
+}
+
+/**
+ * Inverts a 3x4 affine matrix, rows hold the linear part with translation in w.
+ */
+static void affine_inverse(const float m[3][4], float inv[3][4]) {
+    const float det =
+        m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1]) -
+        m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0]) +
+        m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    const float inv_det = 1.0f / det;
+    int r;
+
+    inv[0][0] =  (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * inv_det;
+    inv[0][1] = -(m[0][1]*m[2][2] - m[0][2]*m[2][1]) * inv_det;
+    inv[0][2] =  (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+    inv[1][0] = -(m[1][0]*m[2][2] - m[1][2]*m[2][0]) * inv_det;
+    inv[1][1] =  (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+    inv[1][2] = -(m[0][0]*m[1][2] - m[0][2]*m[1][0]) * inv_det;
+    inv[2][0] =  (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * inv_det;
+    inv[2][1] = -(m[0][0]*m[2][1] - m[0][1]*m[2][0]) * inv_det;
+    inv[2][2] =  (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+
+    // inverse translation is -R^-1 * t
+    for(r = 0; r < 3; r++)
+        inv[r][3] = -(inv[r][0]*m[0][3] + inv[r][1]*m[1][3] + inv[r][2]*m[2][3]);
+}
+
+void scene_init(Scene* scene) {
+    memset(scene, 0, sizeof(Scene));
+}
+
+void scene_free(Scene* scene) {
+    unsigned int i;
+    free(scene->planes);
+    free(scene->prims);
+    free(scene->meshes);
+    free(scene->instances);
+    free(scene->instances_close);
+    free(scene->blas_nodes);
+    free(scene->tlas_nodes);
+    free(scene->materials);
+    for(i = 0; i < scene->num_textures; i++)
+        texture_free(&scene->textures[i]);
+    free(scene->textures);
+    free(scene->lights);
+    environment_free(&scene->environment);
+    scene_init(scene);
+}
+
+/**
+ * Nearest half float, values past its range become infinity.
+ */
+static cl_half float_to_half(float value) {
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    const unsigned int sign = (bits >> 16) & 0x8000;
+    const int exponent = (int)((bits >> 23) & 0xFF) - 127 + 15;
+    const unsigned int mantissa = bits & 0x7FFFFF;
+
+    if(exponent >= 31) return (cl_half)(sign | 0x7C00);
+    if(exponent <= 0) {
+        // denormal, the implicit bit shifted in with the rest
+        if(exponent < -10) return (cl_half)sign;
+        const unsigned int shift = 14 - exponent;
+        return (cl_half)(sign | (((mantissa | 0x800000) + (1u << (shift - 1))) >> shift));
+    }
+    // a rounding carry moves into the exponent, which is still correct
+    return (cl_half)(sign | ((((unsigned int)exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1)));
+}
+
+/**
+ * Shared exponent RGB as in EXT_texture_shared_exponent: 9 bit mantissas,
+ * a 5 bit exponent with a bias of 15 on top. Negative values clamp to 0.
+ */
+cl_uint rgb9e5_encode(const float rgb[3]) {
+    const float max_value = 65408.0f;
+    float c[3], m = 0, f;
+    unsigned int q[3];
+    int a, e;
+
+    for(a = 0; a < 3; a++) {
+        c[a] = fminf(fmaxf(rgb[a], 0.0f), max_value);
+        m = fmaxf(m, c[a]);
+    }
+    // floor(log2(m)) is e - 1
+    frexpf(m, &e);
+    e = m > 0 && e + 15 > 0 ? e + 15 : 0;
+    f = ldexpf(1.0f, e - 24);
+    if(floorf(m / f + 0.5f) >= 512.0f) {
+        e++;
+        f *= 2.0f;
+    }
+    for(a = 0; a < 3; a++) q[a] = (unsigned int)floorf(c[a] / f + 0.5f);
+    return q[0] | (q[1] << 9) | (q[2] << 18) | ((cl_uint)e << 27);
+}
+
+/**
+ * Inverse of rgb9e5_encode, as rgb9e5_decode in kernels/scene.cl.
+ */
+void rgb9e5_decode(cl_uint v, float rgb[3]) {
+    const float f = ldexpf(1.0f, (int)(v >> 27) - 24);
+    int a;
+    for(a = 0; a < 3; a++) rgb[a] = (float)((v >> (9 * a)) & 0x1FF) * f;
+}
+
+/**
+ * Packs a material into the table and returns its index for
+ * Primitive.material. specular and roughness only apply to MATERIAL_GGX
+ * and MATERIAL_DIELECTRIC, ior only to the latter.
+ */
+unsigned int scene_add_material(Scene* scene, unsigned int type, const float albedo[3], const float specular[3],
+        float roughness, float ior, float reflect) {
+    if(scene->num_materials == MAX_MATERIALS) {
+        fprintf(stderr, "Material table full, using material 0\n");
+        return 0;
+    }
+    scene->materials = (Material*) realloc(scene->materials, sizeof(Material) * (scene->num_materials + 1));
+    Material* material = &scene->materials[scene->num_materials];
+    material->albedo = rgb9e5_encode(albedo);
+    material->specular = rgb9e5_encode(specular);
+    material->type = (cl_ushort)type;
+    material->texture = TEXTURE_NONE;
+    material->roughness = float_to_half(roughness);
+    material->ior = float_to_half(ior);
+    material->reflect = float_to_half(reflect);
+    material->pad = 0;
+    return scene->num_materials++;
+}
+
+/**
+ * Takes over a texture with its mip chain built, for Material.texture.
+ */
+unsigned int scene_add_texture(Scene* scene, Texture* texture) {
+    scene->textures = (Texture*) realloc(scene->textures, sizeof(Texture) * (scene->num_textures + 1));
+    scene->textures[scene->num_textures] = *texture;
+    memset(texture, 0, sizeof(Texture));
+    return scene->num_textures++;
+}
+
+static Light* add_light(Scene* scene, unsigned int type, const float position[3], const float radiance[3]) {
+    scene->lights = (Light*) realloc(scene->lights, sizeof(Light) * (scene->num_lights + 1));
+    Light* light = &scene->lights[scene->num_lights++];
+    memset(light, 0, sizeof(Light));
+    light->position = make_float4(position[0], position[1], position[2], 0);
+    light->radiance = rgb9e5_encode(radiance);
+    light->type = type;
+    return light;
+}
+
+unsigned int scene_add_sphere_light(Scene* scene, const float centre[3], float radius, const float radiance[3]) {
+    Light* light = add_light(scene, LIGHT_SPHERE, centre, radiance);
+    light->radius = radius;
+    light->area = 4.0f * (float)M_PI * radius * radius;
+    return scene->num_lights - 1;
+}
+
+/**
+ * Adds a rectangular light, edge0 and edge1 must be perpendicular. It
+ * faces along edge0 x edge1.
+ */
+unsigned int scene_add_quad_light(Scene* scene, const float corner[3], const float edge0[3], const float edge1[3],
+        const float radiance[3]) {
+    Light* light = add_light(scene, LIGHT_QUAD, corner, radiance);
+    const float n[3] = {
+        edge0[1] * edge1[2] - edge0[2] * edge1[1],
+        edge0[2] * edge1[0] - edge0[0] * edge1[2],
+        edge0[0] * edge1[1] - edge0[1] * edge1[0]
+    };
+    light->edge0 = make_float4(edge0[0], edge0[1], edge0[2], 0);
+    light->edge1 = make_float4(edge1[0], edge1[1], edge1[2], 0);
+    light->area = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    return scene->num_lights - 1;
+}
+
+/**
+ * Side of the stratified sample grid every light gets at each shaded point
+ * so that shaded points trace about budget shadow rays, counting the one
+ * BSDF sample each point adds. At least 1, at most LIGHT_MAX_GRID.
+ */
+unsigned int scene_light_grid(const Scene* scene, double budget, double shaded) {
+    unsigned int grid = 1;
+    if(scene->num_lights == 0 || shaded <= 0) return grid;
+    const double per_light = (budget / shaded - 1.0) / scene->num_lights;
+    while(grid < LIGHT_MAX_GRID && (grid + 1) * (grid + 1) <= per_light) grid++;
+    return grid;
+}
+
+unsigned int scene_add_plane(Scene* scene, const Primitive* plane) {
+    scene->planes = (Primitive*) realloc(scene->planes, sizeof(Primitive) * (scene->num_planes + 1));
+    scene->planes[scene->num_planes] = *plane;
+    return scene->num_planes++;
+}
+
+/**
+ * Copies count object space primitives into the scene and builds their
+ * bottom level BVH: a binary SAH tree collapsed into 8 wide nodes. Leaves
+ * index the scene primitive array directly, so the copied primitives are
+ * stored in the order the wide leaves expect.
+ */
+unsigned int scene_add_mesh(Scene* scene, const Primitive* prims, unsigned int count) {
+    AABB* bounds = (AABB*) malloc(sizeof(AABB) * count);
+    unsigned int* indices = (unsigned int*) malloc(sizeof(unsigned int) * count);
+    unsigned int* order = (unsigned int*) malloc(sizeof(unsigned int) * count);
+    BVHNode* nodes = (BVHNode*) malloc(sizeof(BVHNode) * 2 * count);
+    const unsigned int first_prim = scene->num_prims;
+    const unsigned int first_node = scene->num_blas_nodes;
+    unsigned int i;
+    int a;
+
+    for(i = 0; i < count; i++)
+        prim_bounds(&prims[i], &bounds[i]);
+
+    const unsigned int binary_count = bvh_build(bounds, count, BVH_MAX_LEAF_SIZE, BVH8_MAX_DEPTH, nodes, indices);
+
+    // a wide node consumes at least one binary interior node
+    scene->blas_nodes = (BVH8Node*) realloc(scene->blas_nodes, sizeof(BVH8Node) * (first_node + binary_count / 2 + 1));
+    const unsigned int node_count = bvh_collapse(nodes, indices, &scene->blas_nodes[first_node], order);
+
+    // rebase child and primitive offsets into the shared arrays
+    for(i = first_node; i < first_node + node_count; i++) {
+        scene->blas_nodes[i].child_base += first_node;
+        scene->blas_nodes[i].prim_base += first_prim;
+    }
+
+    scene->prims = (Primitive*) realloc(scene->prims, sizeof(Primitive) * (first_prim + count));
+    for(i = 0; i < count; i++)
+        scene->prims[first_prim + i] = prims[order[i]];
+
+    scene->num_prims += count;
+    scene->num_blas_nodes += node_count;
+
+    scene->meshes = (Mesh*) realloc(scene->meshes, sizeof(Mesh) * (scene->num_meshes + 1));
+    Mesh* mesh = &scene->meshes[scene->num_meshes];
+    memset(mesh, 0, sizeof(Mesh));
+    for(a = 0; a < 3; a++) {
+        mesh->bmin[a] = nodes[0].bmin[a];
+        mesh->bmax[a] = nodes[0].bmax[a];
+    }
+    mesh->root = first_node;
+    mesh->first_prim = first_prim;
+    mesh->prim_count = count;
+    mesh->node_count = node_count;
+
+    free(bounds);
+    free(indices);
+    free(order);
+    free(nodes);
+    return scene->num_meshes++;
+}
+
+static void mesh_update_bounds(Scene* scene, Mesh* mesh) {
+    AABB box, prim;
+    unsigned int i;
+    int a;
+
+    aabb_empty(&box);
+    for(i = mesh->first_prim; i < mesh->first_prim + mesh->prim_count; i++) {
+        prim_bounds(&scene->prims[i], &prim);
+        aabb_grow(&box, &prim);
+    }
+    for(a = 0; a < 3; a++) {
+        mesh->bmin[a] = box.bmin[a];
+        mesh->bmax[a] = box.bmax[a];
+    }
+}
+
+/**
+ * Adds a mesh whose primitives change every frame. No BVH is built on the
+ * host, cl_lbvh_build emits one on the device after each scene_update_mesh.
+ */
+unsigned int scene_add_dynamic_mesh(Scene* scene, const Primitive* prims, unsigned int count) {
+    const unsigned int first_prim = scene->num_prims;
+
+    scene->prims = (Primitive*) realloc(scene->prims, sizeof(Primitive) * (first_prim + count));
+    memcpy(&scene->prims[first_prim], prims, sizeof(Primitive) * count);
+    scene->num_prims += count;
+
+    scene->meshes = (Mesh*) realloc(scene->meshes, sizeof(Mesh) * (scene->num_meshes + 1));
+    Mesh* mesh = &scene->meshes[scene->num_meshes];
+    memset(mesh, 0, sizeof(Mesh));
+    mesh->root = scene->num_dynamic_nodes;
+    mesh->first_prim = first_prim;
+    mesh->prim_count = count;
+    // n - 1 internal nodes, a single primitive still needs a root
+    mesh->node_count = count > 1 ? count - 1 : 1;
+    mesh->flags = MESH_DYNAMIC;
+    mesh_update_bounds(scene, mesh);
+
+    scene->num_dynamic_nodes += mesh->node_count;
+    if(count > scene->max_dynamic_prims) scene->max_dynamic_prims = count;
+
+    return scene->num_meshes++;
+}
+
+/**
+ * Replaces the primitives of a dynamic mesh, call scene_build_tlas after
+ * moving meshes so instance bounds follow.
+ */
+void scene_update_mesh(Scene* scene, unsigned int mesh, const Primitive* prims) {
+    Mesh* m = &scene->meshes[mesh];
+    memcpy(&scene->prims[m->first_prim], prims, sizeof(Primitive) * m->prim_count);
+    mesh_update_bounds(scene, m);
+}
+
+unsigned int scene_add_instance(Scene* scene, unsigned int mesh, const float transform[3][4]) {
+    scene->instances = (Instance*) realloc(scene->instances, sizeof(Instance) * (scene->num_instances + 1));
+    scene->instances_close = (Instance*) realloc(scene->instances_close, sizeof(Instance) * (scene->num_instances + 1));
+    memset(&scene->instances[scene->num_instances], 0, sizeof(Instance));
+    scene->instances[scene->num_instances].mesh = mesh;
+    scene_set_transform(scene, scene->num_instances, transform);
+    return scene->num_instances++;
+}
+
+static void instance_set_transform(Instance* inst, const float transform[3][4]) {
+    float inv[3][4];
+    int r, c;
+
+    affine_inverse(transform, inv);
+    for(r = 0; r < 3; r++) {
+        for(c = 0; c < 4; c++) {
+            inst->object_to_world[r].s[c] = transform[r][c];
+            inst->world_to_object[r].s[c] = inv[r][c];
+        }
+    }
+}
+
+/**
+ * Places an instance that holds still while the shutter is open.
+ */
+void scene_set_transform(Scene* scene, unsigned int instance, const float transform[3][4]) {
+    instance_set_transform(&scene->instances[instance], transform);
+    scene->instances_close[instance] = scene->instances[instance];
+}
+
+/**
+ * Places an instance at shutter open and close. The kernels blend the two
+ * linearly, so an instance that turns should move in steps small enough
+ * for the blend to follow.
+ */
+void scene_set_motion(Scene* scene, unsigned int instance, const float open[3][4], const float close[3][4]) {
+    instance_set_transform(&scene->instances[instance], open);
+    instance_set_transform(&scene->instances_close[instance], close);
+    scene->instances_close[instance].mesh = scene->instances[instance].mesh;
+}
+
+/**
+ * World space bounds of an instance from the eight corners of its mesh bounds.
+ */
+static void instance_bounds(const Scene* scene, const Instance* inst, AABB* box) {
+    const Mesh* root = &scene->meshes[inst->mesh];
+    int corner, r;
+
+    aabb_empty(box);
+    for(corner = 0; corner < 8; corner++) {
+        const float p[3] = {
+            corner & 1 ? root->bmax[0] : root->bmin[0],
+            corner & 2 ? root->bmax[1] : root->bmin[1],
+            corner & 4 ? root->bmax[2] : root->bmin[2]
+        };
+        float w[3];
+        for(r = 0; r < 3; r++) {
+            const cl_float4* row = &inst->object_to_world[r];
+            w[r] = row->s[0]*p[0] + row->s[1]*p[1] + row->s[2]*p[2] + row->s[3];
+        }
+        aabb_grow_point(box, w);
+    }
+}
+
+/**
+ * Rebuilds the top level BVH over the current instance transforms, each
+ * instance bounded at shutter open and close together. Top level leaves
+ * hold a single instance and reference it directly.
+ */
+void scene_build_tlas(Scene* scene) {
+    const unsigned int count = scene->num_instances;
+    unsigned int i;
+
+    if(count == 0) {
+        scene->num_tlas_nodes = 0;
+        return;
+    }
+
+    AABB* bounds = (AABB*) malloc(sizeof(AABB) * count);
+    unsigned int* indices = (unsigned int*) malloc(sizeof(unsigned int) * count);
+
+    for(i = 0; i < count; i++) {
+        AABB close;
+        instance_bounds(scene, &scene->instances[i], &bounds[i]);
+        instance_bounds(scene, &scene->instances_close[i], &close);
+        aabb_grow(&bounds[i], &close);
+    }
+
+    scene->tlas_nodes = (BVHNode*) realloc(scene->tlas_nodes, sizeof(BVHNode) * (2 * count - 1));
+    scene->num_tlas_nodes = bvh_build(bounds, count, 1, BVH_MAX_DEPTH, scene->tlas_nodes, indices);
+
+    for(i = 0; i < scene->num_tlas_nodes; i++) {
+        BVHNode* node = &scene->tlas_nodes[i];
+        if(node->count > 0) node->left_first = indices[node->left_first];
+    }
+
+    free(bounds);
+    free(indices);
+}
+
+static void translation(float m[3][4], float x, float y, float z) {
+    memset(m, 0, sizeof(float) * 12);
+    m[0][0] = m[1][1] = m[2][2] = 1.0f;
+    m[0][3] = x;
+    m[1][3] = y;
+    m[2][3] = z;
+}
+
+// instances moved by scene_animate
+#define SUN_DRUMS 0
+#define CASA 1
+// dynamic mesh whose spheres scene_animate moves, and how many it has
+#define SWARM 3
+#define SWARM_SIZE 64
+
+// GGX alpha with a highlight close to the Phong exponent of 16 the scene was lit with
+#define DEMO_ROUGHNESS 0.33f
+
+/**
+ * Demo scene material from 0xRRGGBB colours, each scaled by its coefficient.
+ */
+static unsigned int demo_material(Scene* scene, unsigned int diffuse_rgb, float diffuse,
+        unsigned int specular_rgb, float specular, float reflect) {
+    float albedo[3], f0[3];
+    int a;
+    for(a = 0; a < 3; a++) {
+        albedo[a] = diffuse * ((diffuse_rgb >> (16 - 8 * a)) & 0xFF) / 255.0f;
+        f0[a] = specular * ((specular_rgb >> (16 - 8 * a)) & 0xFF) / 255.0f;
+    }
+    return scene_add_material(scene, MATERIAL_GGX, albedo, f0, DEMO_ROUGHNESS, 1.5f, reflect);
+}
+
+/**
+ * squares x squares checkerboard of RGBA8 colours a and b over a texture
+ * of side size, with its mip chain.
+ */
+static unsigned int demo_checker(Scene* scene, unsigned int size, unsigned int squares, cl_uint a, cl_uint b) {
+    Texture texture;
+    unsigned int x, y;
+
+    texture_init(&texture, size);
+    for(y = 0; y < size; y++)
+        for(x = 0; x < size; x++)
+            texture.texels[y * size + x] = ((x * squares / size) + (y * squares / size)) % 2 ? b : a;
+    texture_build_mips(&texture);
+    return scene_add_texture(scene, &texture);
+}
+
+/**
+ * Spheres of the swarm mesh at time t: a ring turning about the mesh y axis
+ * and rippling up and down, so the device rebuilds its BVH every frame.
+ */
+static void demo_swarm(Primitive* prims, unsigned int material, float t) {
+    int i;
+
+    memset(prims, 0, sizeof(Primitive) * SWARM_SIZE);
+    for(i = 0; i < SWARM_SIZE; i++) {
+        const float angle = 2.0f * (float)M_PI * i / SWARM_SIZE + 5.0f * t;
+        prims[i].pos = make_float4(4.0f * cosf(angle), 0.5f * sinf(3.0f * angle + 20.0f * t), 4.0f * sinf(angle), 0);
+        prims[i].normal = normalize3(0, 0.1f, 1.0f);
+        prims[i].scale[0] = prims[i].scale[1] = prims[i].scale[2] = 0.3f;
+        prims[i].type = PRIM_SPHERE;
+        prims[i].material = (cl_ushort)material;
+    }
+}
+
+/**
+ * The demo scene: a tiled floor, a back wall, three sphere meshes, one of
+ * which is instanced six times, and a dynamic swarm of small spheres, lit
+ * by a distant sphere light and a panel above the spheres.
+ */
+void scene_create_default(Scene* scene) {
+    // where the point light the scene used to be lit by shone from, far enough
+    // away that it reaches the whole scene about as brightly
+    const float sun[3] = { -6.0f, 8.0f, -50.0f };
+    const float sun_radiance[3] = { 1600.0f, 1600.0f, 1600.0f };
+    const float panel[3] = { -6.0f, 8.0f, 35.0f };
+    const float panel_edge0[3] = { 8.0f, 0, 0 };
+    const float panel_edge1[3] = { 0, 0, 15.0f };
+    const float panel_radiance[3] = { 1.0f, 0.8f, 0.6f };
+    Primitive prim;
+    Primitive swarm[SWARM_SIZE];
+    float m[3][4];
+    unsigned int mesh;
+    int i;
+
+    scene_init(scene);
+
+    // CECECD (nice grey) floor, unit tiles in two shades
+    memset(&prim, 0, sizeof(Primitive));
+    prim.pos = make_float4(0, -.1f, 0, 0);
+    prim.material = demo_material(scene, 0xCECECD, 0.6f, 0xCECECD, 0.2f, 0);
+    scene->materials[prim.material].texture = demo_checker(scene, 1024, 8, 0xFFFFFFFFu, 0xFFB4B4B4u);
+    // one texture repeat every 8 units
+    prim.scale[0] = prim.scale[1] = prim.scale[2] = 8.0f;
+    prim.type = PRIM_PLANE;
+    prim.normal = normalize3(0, 20.0f, -0.1f);
+    scene_add_plane(scene, &prim);
+
+    // 232323 (the new black) wall
+    prim.pos = make_float4(0, 0, 50.0f, 0);
+    prim.material = demo_material(scene, 0x232323, 0.8f, 0x1E1E1E, 0.2f, 0);
+    prim.normal = normalize3(0.2f, -0.2f, -0.9f);
+    scene_add_plane(scene, &prim);
+
+    // FF9A0C (sun drums) sphere
+    prim.pos = make_float4(0, 0, 0, 0);
+    prim.material = demo_material(scene, 0xFF9A0C, 0.7f, 0x18B9D1, 0.95f, 0.2f);
+    prim.type = PRIM_SPHERE;
+    prim.scale[0] = prim.scale[1] = prim.scale[2] = 1.0f;
+    prim.normal = normalize3(0, 0.1f, 1.0f);
+    mesh = scene_add_mesh(scene, &prim, 1);
+    translation(m, 2.5f, 2.5f, 100.0f);
+    scene_add_instance(scene, mesh, m);
+
+    // FA7339 (casa) sphere
+    prim.material = demo_material(scene, 0xFA7339, 0.7f, 0xFFB9D1, 0.9f, 0.5f);
+    prim.scale[0] = 2.0f;
+    mesh = scene_add_mesh(scene, &prim, 1);
+    translation(m, 5.0f, 1.0f, 50.0f);
+    scene_add_instance(scene, mesh, m);
+
+    // 18C8D5 (blue lagoon) spheres, one mesh placed six times
+    prim.material = demo_material(scene, 0x18C8D5, 0.6f, 0x18BED2, 1.0f, 1.0f);
+    prim.scale[0] = 1.0f;
+    mesh = scene_add_mesh(scene, &prim, 1);
+    for(i = 4; i < 10; i++) {
+        translation(m, -1.5f*i + 8.0f, .5f, -2.5f*i + 60.0f);
+        scene_add_instance(scene, mesh, m);
+    }
+
+    // 8CD790 (mint) swarm
+    demo_swarm(swarm, demo_material(scene, 0x8CD790, 0.7f, 0xFFFFFF, 0.5f, 0.1f), 0);
+    mesh = scene_add_dynamic_mesh(scene, swarm, SWARM_SIZE);
+    translation(m, -2.0f, 3.0f, 42.0f);
+    scene_add_instance(scene, mesh, m);
+
+    scene_add_sphere_light(scene, sun, 2.5f, sun_radiance);
+    // faces down
+    scene_add_quad_light(scene, panel, panel_edge0, panel_edge1, panel_radiance);
+
+    scene_build_tlas(scene);
+}
+
+/**
+ * Moves the animated instances of the default scene to where they are
+ * while the shutter is open from time open to close and refreshes the TLAS.
+ * The swarm has no motion blur, its spheres are placed at open.
+ */
+void scene_animate(Scene* scene, float open, float close) {
+    const Mesh* swarm_mesh = &scene->meshes[SWARM];
+    Primitive swarm[SWARM_SIZE];
+    float m[3][4], n[3][4];
+
+    translation(m, 2.5f - open, 2.5f, 100.0f);
+    translation(n, 2.5f - close, 2.5f, 100.0f);
+    scene_set_motion(scene, SUN_DRUMS, m, n);
+
+    translation(m, 5.0f * cosf(open * 10.0f), 1.0f, 50.0f + 10.0f * sinf(open * 10.0f));
+    translation(n, 5.0f * cosf(close * 10.0f), 1.0f, 50.0f + 10.0f * sinf(close * 10.0f));
+    scene_set_motion(scene, CASA, m, n);
+
+    demo_swarm(swarm, scene->prims[swarm_mesh->first_prim].material, open);
+    scene_update_mesh(scene, SWARM, swarm);
+
+    scene_build_tlas(scene);
+}
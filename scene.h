@@ -0,0 +1,192 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "bvh.h"
+#include "environment.h"
+#include "texture.h"
+
+#define PRIM_PLANE 1
+#define PRIM_SPHERE 2
+
+// mesh rebuilt on the device every frame, see cl_lbvh_build
+#define MESH_DYNAMIC 1
+
+// shading models of the material table
+#define MATERIAL_LAMBERT 0
+#define MATERIAL_GGX 1
+#define MATERIAL_DIELECTRIC 2
+#define MATERIAL_EMISSIVE 3
+// Primitive.material is 16 bit
+#define MAX_MATERIALS 65536
+
+// area light shapes
+#define LIGHT_SPHERE 0
+#define LIGHT_QUAD 1
+// largest per light sample grid side the shadow ray budget buys
+#define LIGHT_MAX_GRID 4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Host copies of the structs in kernels/scene.cl, the layouts must match.
+ * Positions and directions keep w = 0. A primitive holds only what
+ * intersection reads, 48 bytes, and indexes the material table for the rest.
+ */
+typedef struct {
+    cl_float4 pos;
+    cl_float4 normal;
+    cl_float scale[3];
+    cl_ushort type;
+    cl_ushort material;
+} Primitive;
+
+/**
+ * Shading parameters shared by every primitive using them, 20 bytes packed
+ * by scene_add_material. Colours are RGB9E5, scalars half floats. albedo is
+ * the diffuse colour, or the emitted radiance of MATERIAL_EMISSIVE, times
+ * texture unless that is TEXTURE_NONE.
+ * specular is the GGX reflectance at normal incidence, roughness the GGX
+ * alpha of the light's highlight. reflect weights the mirror bounce,
+ * dielectrics refract instead, weighted by their Fresnel term.
+ */
+typedef struct {
+    cl_uint albedo;
+    cl_uint specular;
+    cl_ushort type;
+    cl_ushort texture;
+    cl_half roughness;
+    cl_half ior;
+    cl_half reflect;
+    cl_half pad;
+} Material;
+
+/**
+ * Area light, Light in kernels/light.cl. Spheres of radius around position
+ * emit from their whole surface. Quads span the rectangle edge0 x edge1 from
+ * the corner at position and emit towards edge0 x edge1 only. radiance is
+ * RGB9E5, area the emitting area. Lights are not scene geometry: they only
+ * show up in direct lighting and where rays see them.
+ */
+typedef struct {
+    cl_float4 position;
+    cl_float4 edge0;
+    cl_float4 edge1;
+    cl_uint radiance;
+    cl_uint type;
+    cl_float radius;
+    cl_float area;
+} Light;
+
+/**
+ * Geometry shared between instances: a range of object space primitives,
+ * their bounds and the root of the compressed bottom level BVH over them.
+ * Dynamic meshes keep their primitives unsorted and root indexes the device
+ * side LBVH node buffer instead.
+ */
+typedef struct {
+    cl_float bmin[3];
+    cl_uint root;
+    cl_float bmax[3];
+    cl_uint first_prim;
+    cl_uint prim_count;
+    cl_uint node_count;
+    cl_uint flags;
+    cl_uint pad;
+} Mesh;
+
+/**
+ * Placement of a mesh in the world as two 3x4 affine matrices stored by row,
+ * translation in w. The kernel uses world_to_object to move rays into mesh
+ * space and its transpose to bring normals back.
+ */
+typedef struct {
+    cl_float4 world_to_object[3];
+    cl_float4 object_to_world[3];
+    cl_uint mesh;
+    cl_uint pad[3];
+} Instance;
+
+#ifdef __cplusplus
+static_assert(sizeof(Primitive) == 48, "Primitive must match kernels/scene.cl");
+static_assert(sizeof(Material) == 20, "Material must match kernels/scene.cl");
+static_assert(sizeof(Light) == 64, "Light must match kernels/scene.cl");
+static_assert(sizeof(Mesh) == 48, "Mesh must match kernels/scene.cl");
+static_assert(sizeof(Instance) == 112, "Instance must match kernels/scene.cl");
+#endif
+
+/**
+ * Two level scene. Planes are unbounded world space primitives tested by
+ * every ray, everything else belongs to a mesh. Each mesh owns an 8 wide
+ * bottom level BVH in blas_nodes, the binary top level BVH in tlas_nodes
+ * is built over instance bounds and rebuilt whenever instances move.
+ * instances hold the transforms at shutter open and instances_close those
+ * at shutter close, the same unless scene_set_motion set them apart. The
+ * top level bounds sweep both.
+ */
+typedef struct {
+    Primitive* planes;
+    unsigned int num_planes;
+
+    Primitive* prims;
+    unsigned int num_prims;
+
+    Mesh* meshes;
+    unsigned int num_meshes;
+
+    Instance* instances;
+    Instance* instances_close;
+    unsigned int num_instances;
+
+    BVH8Node* blas_nodes;
+    unsigned int num_blas_nodes;
+
+    BVHNode* tlas_nodes;
+    unsigned int num_tlas_nodes;
+
+    Material* materials;
+    unsigned int num_materials;
+
+    Texture* textures;
+    unsigned int num_textures;
+
+    Light* lights;
+    unsigned int num_lights;
+
+    // lights rays that leave the scene, width 0 when there is none
+    Environment environment;
+
+    // LBVH nodes reserved on the device for dynamic meshes
+    unsigned int num_dynamic_nodes;
+    unsigned int max_dynamic_prims;
+} Scene;
+
+cl_uint rgb9e5_encode(const float rgb[3]);
+void rgb9e5_decode(cl_uint v, float rgb[3]);
+void scene_init(Scene* scene);
+void scene_free(Scene* scene);
+unsigned int scene_add_material(Scene* scene, unsigned int type, const float albedo[3], const float specular[3],
+    float roughness, float ior, float reflect);
+unsigned int scene_add_texture(Scene* scene, Texture* texture);
+unsigned int scene_add_sphere_light(Scene* scene, const float centre[3], float radius, const float radiance[3]);
+unsigned int scene_add_quad_light(Scene* scene, const float corner[3], const float edge0[3], const float edge1[3],
+    const float radiance[3]);
+unsigned int scene_light_grid(const Scene* scene, double budget, double shaded);
+unsigned int scene_add_plane(Scene* scene, const Primitive* plane);
+unsigned int scene_add_mesh(Scene* scene, const Primitive* prims, unsigned int count);
+unsigned int scene_add_dynamic_mesh(Scene* scene, const Primitive* prims, unsigned int count);
+void scene_update_mesh(Scene* scene, unsigned int mesh, const Primitive* prims);
+unsigned int scene_add_instance(Scene* scene, unsigned int mesh, const float transform[3][4]);
+void scene_set_transform(Scene* scene, unsigned int instance, const float transform[3][4]);
+void scene_set_motion(Scene* scene, unsigned int instance, const float open[3][4], const float close[3][4]);
+void scene_build_tlas(Scene* scene);
+
+void scene_create_default(Scene* scene);
+void scene_animate(Scene* scene, float open, float close);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
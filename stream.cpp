@@ -0,0 +1,308 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#endif
+
+#include "stream.h"
+
+// pipe buffer requested so a frame needs fewer round trips through the reader
+#define STREAM_PIPE_SIZE (1 << 20)
+// how often spliced frames are checked for having been read
+#define STREAM_DRAIN_MS 1
+
+/**
+ * A frame whose pages are still referenced by the pipe. It is released once
+ * the reader has consumed everything up to end.
+ */
+struct SplicedFrame {
+    Frame frame;
+    StreamHeader header;
+    unsigned long long end;
+};
+
+struct FrameStream {
+    ReadbackRing* ring;
+    std::thread worker;
+    std::atomic<bool> broken;
+#ifdef _WIN32
+    FILE* fp;
+#else
+    int fd;
+    bool pipe;
+#endif
+
+    // guarded by lock
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<Frame> frames;
+    bool stopping;
+
+    // worker only
+    std::deque<SplicedFrame> spliced;
+    unsigned long long written;
+};
+
+static void stream_header(const Frame* frame, StreamHeader* header) {
+    header->magic = STREAM_MAGIC;
+    header->width = frame->width;
+    header->height = frame->height;
+    header->format = frame->format;
+    header->stride = (unsigned int)frame->stride;
+    header->index = frame->index;
+}
+
+#ifdef _WIN32
+
+static bool stream_write(FrameStream* stream, const Frame* frame) {
+    StreamHeader header;
+    stream_header(frame, &header);
+    const size_t size = frame->stride * frame->height;
+    bool ok = fwrite(&header, sizeof(header), 1, stream->fp) == 1 && fwrite(frame->pixels, 1, size, stream->fp) == size;
+    readback_release(stream->ring, frame);
+    return ok;
+}
+
+static void stream_drain(FrameStream* stream, bool wait) {
+    fflush(stream->fp);
+}
+
+#else
+
+/**
+ * Writes all of iov, advancing it as parts go out. vmsplice only maps the
+ * pages into the pipe, the memory must stay untouched until it is read.
+ */
+static bool write_all(FrameStream* stream, struct iovec* iov, int count) {
+    while(count > 0) {
+        ssize_t n;
+#ifdef __linux__
+        if(stream->pipe) n = vmsplice(stream->fd, iov, count, 0);
+        else
+#endif
+        n = writev(stream->fd, iov, count);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+
+        stream->written += n;
+        while(count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+/**
+ * Releases spliced frames the reader is done with, waiting for all of them
+ * when wait is set.
+ */
+static void stream_drain(FrameStream* stream, bool wait) {
+#ifdef __linux__
+    while(!stream->spliced.empty()) {
+        int unread = 0;
+        if(ioctl(stream->fd, FIONREAD, &unread) < 0) unread = 0;
+        const unsigned long long consumed = stream->written - unread;
+        while(!stream->spliced.empty() && stream->spliced.front().end <= consumed) {
+            readback_release(stream->ring, &stream->spliced.front().frame);
+            stream->spliced.pop_front();
+        }
+        if(!wait || stream->spliced.empty()) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(STREAM_DRAIN_MS));
+    }
+#endif
+}
+
+static bool stream_write(FrameStream* stream, const Frame* frame) {
+    const size_t size = frame->stride * frame->height;
+    struct iovec iov[2];
+    bool ok;
+
+    if(stream->pipe) {
+        // the header has to outlive the call as well
+        SplicedFrame entry;
+        entry.frame = *frame;
+        stream_header(frame, &entry.header);
+        entry.end = stream->written + sizeof(StreamHeader) + size;
+        stream->spliced.push_back(entry);
+
+        iov[0].iov_base = &stream->spliced.back().header;
+        iov[0].iov_len = sizeof(StreamHeader);
+        iov[1].iov_base = (void*)frame->pixels;
+        iov[1].iov_len = size;
+        ok = write_all(stream, iov, 2);
+        stream_drain(stream, false);
+        return ok;
+    }
+
+    StreamHeader header;
+    stream_header(frame, &header);
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)frame->pixels;
+    iov[1].iov_len = size;
+    ok = write_all(stream, iov, 2);
+    readback_release(stream->ring, frame);
+    return ok;
+}
+
+#endif
+
+static void stream_worker(FrameStream* stream) {
+    while(1) {
+        Frame frame;
+        {
+            std::unique_lock<std::mutex> guard(stream->lock);
+            // wake up now and then to hand back frames the reader has drained
+            while(stream->frames.empty() && !stream->stopping) {
+                if(stream->spliced.empty()) {
+                    stream->ready.wait(guard);
+                } else {
+                    stream->ready.wait_for(guard, std::chrono::milliseconds(STREAM_DRAIN_MS));
+                    guard.unlock();
+                    stream_drain(stream, false);
+                    guard.lock();
+                }
+            }
+            if(stream->frames.empty()) break;
+            frame = stream->frames.front();
+            stream->frames.pop_front();
+        }
+
+        if(stream->broken) {
+            readback_release(stream->ring, &frame);
+        } else if(!stream_write(stream, &frame)) {
+            fprintf(stderr, "Frame stream closed by the reader at frame %u.\n", frame.index);
+            stream->broken = true;
+        }
+    }
+    stream_drain(stream, !stream->broken);
+    // nobody will read what is left
+    while(!stream->spliced.empty()) {
+        readback_release(stream->ring, &stream->spliced.front().frame);
+        stream->spliced.pop_front();
+    }
+}
+
+/**
+ * Opens path for streaming, "-" for stdout. A named pipe is created when
+ * path does not exist and opening it waits for a reader. With stdout taken
+ * for frames, whatever the program prints goes to stderr instead. Call
+ * before anything is printed.
+ */
+FrameStream* stream_open(const char* path) {
+    FrameStream* stream = new FrameStream();
+    const bool to_stdout = strcmp(path, "-") == 0;
+
+    stream->ring = NULL;
+    stream->broken = false;
+    stream->stopping = false;
+    stream->written = 0;
+
+#ifdef _WIN32
+    if(to_stdout) {
+        const int fd = _dup(_fileno(stdout));
+        _dup2(_fileno(stderr), _fileno(stdout));
+        _setmode(fd, _O_BINARY);
+        stream->fp = _fdopen(fd, "wb");
+    } else {
+        stream->fp = fopen(path, "wb");
+    }
+    if(!stream->fp) {
+        fprintf(stderr, "Failed to open %s for streaming.\n", path);
+        exit(1);
+    }
+#else
+    struct stat info;
+
+    if(to_stdout) {
+        fflush(stdout);
+        stream->fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    } else {
+        if(stat(path, &info) != 0 && mkfifo(path, 0644) != 0) perror("mkfifo");
+        fprintf(stderr, "Waiting for a reader on %s\n", path);
+        stream->fd = open(path, O_WRONLY);
+    }
+    if(stream->fd < 0) {
+        fprintf(stderr, "Failed to open %s for streaming.\n", path);
+        exit(1);
+    }
+
+    // a reader going away shows up as EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    stream->pipe = fstat(stream->fd, &info) == 0 && S_ISFIFO(info.st_mode);
+#ifdef __linux__
+    if(stream->pipe) fcntl(stream->fd, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+#else
+    stream->pipe = false;
+#endif
+#endif
+    return stream;
+}
+
+/**
+ * Starts writing the frames of ring as they are submitted.
+ */
+void stream_start(FrameStream* stream, ReadbackRing* ring) {
+    stream->ring = ring;
+    stream->worker = std::thread(stream_worker, stream);
+}
+
+/**
+ * Queues a mapped frame, it goes back to the ring once written and read.
+ */
+void stream_submit(FrameStream* stream, const Frame* frame) {
+    std::lock_guard<std::mutex> guard(stream->lock);
+    stream->frames.push_back(*frame);
+    stream->ready.notify_one();
+}
+
+/**
+ * True once the reader has gone away.
+ */
+int stream_broken(FrameStream* stream) {
+    return stream->broken;
+}
+
+/**
+ * Writes the queued frames, waits for the reader to take them and closes.
+ */
+void stream_close(FrameStream* stream) {
+    {
+        std::lock_guard<std::mutex> guard(stream->lock);
+        stream->stopping = true;
+        stream->ready.notify_one();
+    }
+    if(stream->worker.joinable()) stream->worker.join();
+#ifdef _WIN32
+    fclose(stream->fp);
+#else
+    close(stream->fd);
+#endif
+    delete stream;
+}
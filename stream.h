@@ -0,0 +1,34 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "readback.h"
+
+#define STREAM_MAGIC 0x52465452    // "RTFR" in little endian
+
+/**
+ * Precedes every frame on the stream, in host byte order. stride * height
+ * bytes of pixels follow, rows bottom up.
+ */
+typedef struct {
+    unsigned int magic;
+    unsigned int width;
+    unsigned int height;
+    unsigned int format;    // FrameFormat
+    unsigned int stride;
+    unsigned int index;
+} StreamHeader;
+
+/**
+ * Raw frame output to stdout or a named pipe for an external encoder.
+ * Frames are written straight from the mapped staging buffers, spliced into a
+ * pipe with vmsplice where available and with one large write otherwise.
+ */
+typedef struct FrameStream FrameStream;
+
+FrameStream* stream_open(const char* path);
+void stream_start(FrameStream* stream, ReadbackRing* ring);
+void stream_submit(FrameStream* stream, const Frame* frame);
+int stream_broken(FrameStream* stream);
+void stream_close(FrameStream* stream);
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <math.h>
+
+#include "bvh.h"
+#include "check.h"
+
+/**
+ * Walks a binary BVH from node like the kernels do, checking that children
+ * lie inside their parent and counting how often each item is reached.
+ * Returns the most stack entries the walk needs below this node.
+ */
+static unsigned int check_node(const BVHNode* nodes, const unsigned int* indices, unsigned int node,
+        unsigned int depth, unsigned int* seen, unsigned int* max_depth) {
+    const BVHNode* n = &nodes[node];
+    unsigned int i, c;
+
+    if(n->count > 0) {
+        for(i = n->left_first; i < n->left_first + n->count; i++) seen[indices[i]]++;
+        if(depth > *max_depth) *max_depth = depth;
+        return 0;
+    }
+
+    for(c = 0; c < 2; c++) {
+        const BVHNode* child = &nodes[n->left_first + c];
+        for(i = 0; i < 3; i++) {
+            CHECK(child->bmin[i] >= n->bmin[i]);
+            CHECK(child->bmax[i] <= n->bmax[i]);
+        }
+    }
+    // both children pushed, the left one popped first with its sibling below
+    const unsigned int left = 1 + check_node(nodes, indices, n->left_first, depth + 1, seen, max_depth);
+    const unsigned int right = check_node(nodes, indices, n->left_first + 1, depth + 1, seen, max_depth);
+    return left > right ? (left > 2 ? left : 2) : (right > 2 ? right : 2);
+}
+
+static void check_build(const AABB* bounds, unsigned int count, unsigned int max_leaf, const char* name) {
+    BVHNode* nodes = (BVHNode*) malloc(sizeof(BVHNode) * (2 * count - 1));
+    unsigned int* indices = (unsigned int*) malloc(sizeof(unsigned int) * count);
+    unsigned int* seen = (unsigned int*) calloc(count, sizeof(unsigned int));
+    unsigned int max_depth = 0, i;
+
+    bvh_build(bounds, count, max_leaf, BVH_MAX_DEPTH, nodes, indices);
+    // the root is pushed before the walk starts
+    const unsigned int below = check_node(nodes, indices, 0, 0, seen, &max_depth);
+    const unsigned int stack = below > 1 ? below : 1;
+    for(i = 0; i < count; i++) CHECK(seen[i] == 1);
+    CHECK(max_depth <= BVH_MAX_DEPTH);
+    CHECK(stack <= BVH_STACK_SIZE);
+    printf("%s: %u items, depth %u, stack %u\n", name, count, max_depth, stack);
+
+    free(nodes);
+    free(indices);
+    free(seen);
+}
+
+/**
+ * Walks a wide BVH from bvh_collapse pushing every interior slot in order
+ * like traverse_blas, checking that leaf boxes hold their items. Returns the
+ * most stack entries the walk needs below this node.
+ */
+static unsigned int check_wide(const BVH8Node* wide, const unsigned int* order, const AABB* bounds,
+        unsigned int node, unsigned int* seen) {
+    const BVH8Node* n = &wide[node];
+    const cl_uchar* qlo[3] = { n->qlo_x, n->qlo_y, n->qlo_z };
+    const cl_uchar* qhi[3] = { n->qhi_x, n->qhi_y, n->qhi_z };
+    unsigned int pushed = 0, result = 0, k;
+    int i, a;
+
+    for(i = 0; i < BVH8_WIDTH; i++) {
+        if((n->imask >> i) & 1) {
+            const unsigned int below = pushed + check_wide(wide, order, bounds, n->child_base + (n->meta[i] & 31), seen);
+            if(below > result) result = below;
+            pushed++;
+            continue;
+        }
+        const unsigned int first = n->prim_base + (n->meta[i] & 31);
+        for(k = first; k < first + (n->meta[i] >> 5); k++) {
+            seen[order[k]]++;
+            for(a = 0; a < 3; a++) {
+                const float scale = ldexpf(1.0f, n->e[a] - 127);
+                CHECK(n->p[a] + qlo[a][i] * scale <= bounds[order[k]].bmin[a]);
+                CHECK(n->p[a] + qhi[a][i] * scale >= bounds[order[k]].bmax[a]);
+            }
+        }
+    }
+    return pushed > result ? pushed : result;
+}
+
+static void check_collapse(const AABB* bounds, unsigned int count, const char* name) {
+    BVHNode* nodes = (BVHNode*) malloc(sizeof(BVHNode) * (2 * count - 1));
+    BVH8Node* wide = (BVH8Node*) malloc(sizeof(BVH8Node) * count);
+    unsigned int* indices = (unsigned int*) malloc(sizeof(unsigned int) * count);
+    unsigned int* order = (unsigned int*) malloc(sizeof(unsigned int) * count);
+    unsigned int* seen = (unsigned int*) calloc(count, sizeof(unsigned int));
+    unsigned int i;
+
+    bvh_build(bounds, count, BVH_MAX_LEAF_SIZE, BVH8_MAX_DEPTH, nodes, indices);
+    const unsigned int wide_count = bvh_collapse(nodes, indices, wide, order);
+    const unsigned int below = check_wide(wide, order, bounds, 0, seen);
+    const unsigned int stack = below > 1 ? below : 1;
+    for(i = 0; i < count; i++) CHECK(seen[i] == 1);
+    CHECK(stack <= BVH_STACK_SIZE);
+    printf("%s, collapsed: %u wide nodes, stack %u\n", name, wide_count, stack);
+
+    free(nodes);
+    free(wide);
+    free(indices);
+    free(order);
+    free(seen);
+}
+
+int main() {
+    const unsigned int count = 100000;
+    AABB* bounds = (AABB*) malloc(sizeof(AABB) * count);
+    unsigned int state = 1, i;
+    int a;
+
+    for(i = 0; i < count; i++) {
+        for(a = 0; a < 3; a++) {
+            const float c = 100.0f * check_random(&state);
+            bounds[i].bmin[a] = c - 0.1f;
+            bounds[i].bmax[a] = c + 0.1f;
+        }
+    }
+    check_build(bounds, count, BVH_MAX_LEAF_SIZE, "random");
+    check_build(bounds, count, 1, "random, single item leaves");
+    // as many as a tree of BVH8_MAX_DEPTH can hold
+    const unsigned int collapse_count = (BVH_MAX_LEAF_SIZE << BVH8_MAX_DEPTH) < count ? BVH_MAX_LEAF_SIZE << BVH8_MAX_DEPTH : count;
+    check_collapse(bounds, collapse_count, "random");
+
+    // geometrically spaced boxes make SAH splits peel off a few items at a
+    // time, deeper than the shallow stack of bvh_shallow_test allows
+    for(i = 0; i < 120; i++) {
+        for(a = 0; a < 3; a++) {
+            const float c = ldexpf(1.0f, (int)i);
+            bounds[i].bmin[a] = c;
+            bounds[i].bmax[a] = c * 1.5f;
+        }
+    }
+    check_build(bounds, 120, 1, "geometric");
+    check_collapse(bounds, 120, "geometric");
+
+    // all centroids in one place
+    for(i = 0; i < 1000; i++) {
+        for(a = 0; a < 3; a++) {
+            bounds[i].bmin[a] = -1.0f;
+            bounds[i].bmax[a] = 1.0f;
+        }
+    }
+    check_build(bounds, 1000, 1, "coincident");
+    check_collapse(bounds, 1000, "coincident");
+
+    free(bounds);
+    return check_result();
+}
@@ -0,0 +1,13 @@
+/**
+ * Primary rays through the pixel positions in samples.xy from the lens
+ * points samples.zw, built after the trace sources for camera_test.cpp.
+ * Writes each ray's origin and direction.
+ */
+__kernel void camera_ray_kernel(__constant const CameraBasis* camera, __global const float4* samples,
+        __global float4* out)
+{
+    const uint i = get_global_id(0);
+    const Ray ray = camera_ray(camera, samples[i].xy, samples[i].zw, 0.5f, (float4)(0));
+    out[2 * i] = ray.origin;
+    out[2 * i + 1] = ray.dir;
+}
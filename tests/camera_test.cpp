@@ -0,0 +1,141 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "check_cl.h"
+#include "camera.h"
+
+#define WIDTH 64
+#define HEIGHT 48
+// lens samples per camera, on a jittered grid
+#define LENS_GRID 32
+#define SAMPLES (LENS_GRID * LENS_GRID)
+
+static cl_device_id device;
+static cl_context context;
+static cl_command_queue command_queue;
+static cl_kernel kernel;
+
+static float dot3(const float* a, const float* b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+/**
+ * Traces SAMPLES rays of camera through pixel (px, py) and checks they
+ * leave from the lens, a disk of the aperture's radius across the view,
+ * and meet where the pinhole ray crosses the plane of focus.
+ */
+static void check_camera(const Camera* camera, float px, float py, unsigned int* state) {
+    std::vector<cl_float4> samples(SAMPLES), out(2 * SAMPLES);
+    const size_t work = SAMPLES;
+    CameraBasis basis;
+    float pinhole[3], focus[3];
+    double spread = 0, mean[2] = { 0, 0 };
+    unsigned int i, wrong = 0;
+    int a;
+    cl_int err;
+
+    camera_basis(camera, WIDTH, HEIGHT, &basis);
+    for(a = 0; a < 3; a++) {
+        pinhole[a] = basis.corner.s[a] + px * basis.pixel_dx.s[a] + py * basis.pixel_dy.s[a];
+        focus[a] = basis.position.s[a] + camera->focus_distance * pinhole[a];
+    }
+    const float length = sqrtf(dot3(pinhole, pinhole));
+    for(i = 0; i < SAMPLES; i++) {
+        samples[i].s[0] = px;
+        samples[i].s[1] = py;
+        samples[i].s[2] = (i % LENS_GRID + check_random(state)) / LENS_GRID;
+        samples[i].s[3] = (i / LENS_GRID + check_random(state)) / LENS_GRID;
+    }
+
+    cl_mem basis_cl = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(CameraBasis), &basis, &err);
+    CHECK_ERR(err);
+    cl_mem samples_cl = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float4) * SAMPLES, &samples[0], &err);
+    CHECK_ERR(err);
+    cl_mem out_cl = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_float4) * out.size(), NULL, &err);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &basis_cl);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, 1, sizeof(cl_mem), &samples_cl);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &out_cl);
+    CHECK_ERR(err);
+    err = clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL, &work, NULL, 0, NULL, NULL);
+    CHECK_ERR(err);
+    err = clEnqueueReadBuffer(command_queue, out_cl, CL_TRUE, 0, sizeof(cl_float4) * out.size(), &out[0], 0, NULL, NULL);
+    CHECK_ERR(err);
+
+    for(i = 0; i < SAMPLES; i++) {
+        const float* origin = out[2 * i].s;
+        const float* raw = out[2 * i + 1].s;
+        // the kernel normalises with fast_normalize
+        const float norm = sqrtf(dot3(raw, raw));
+        const float dir[3] = { raw[0] / norm, raw[1] / norm, raw[2] / norm };
+        float offset[3], to_focus[3], miss[3];
+        for(a = 0; a < 3; a++) {
+            offset[a] = origin[a] - basis.position.s[a];
+            to_focus[a] = focus[a] - origin[a];
+        }
+        const float along = dot3(to_focus, dir);
+        for(a = 0; a < 3; a++) miss[a] = to_focus[a] - along * dir[a];
+
+        if(fabsf(norm - 1.0f) > 1e-3f) wrong++;
+        if(fabsf(dot3(offset, basis.forward.s)) > 1e-5f) wrong++;
+        if(dot3(offset, offset) > camera->aperture * camera->aperture * 1.0001f + 1e-10f) wrong++;
+        if(camera->aperture == 0 && fabsf(dot3(dir, pinhole) / length - 1.0f) > 1e-5f) wrong++;
+        // the rays converge on the focus point
+        if(sqrtf(dot3(miss, miss)) > 1e-4f * camera->focus_distance * length) wrong++;
+
+        spread += dot3(offset, offset);
+        mean[0] += dot3(offset, basis.right.s);
+        mean[1] += dot3(offset, basis.up.s);
+    }
+    CHECK(wrong == 0);
+
+    // uniform over the disk: centred, mean squared radius half the squared
+    // aperture
+    const double r2 = (double)camera->aperture * camera->aperture;
+    printf("aperture %.3f: mean squared lens radius %.6f of %.6f\n", camera->aperture, spread / SAMPLES, r2 / 2);
+    CHECK(fabs(spread / SAMPLES - r2 / 2) <= 0.01 * r2);
+    CHECK(fabs(mean[0] / SAMPLES) <= 0.01 * camera->aperture && fabs(mean[1] / SAMPLES) <= 0.01 * camera->aperture);
+
+    clReleaseMemObject(basis_cl);
+    clReleaseMemObject(samples_cl);
+    clReleaseMemObject(out_cl);
+}
+
+int main() {
+    const char* sources[] = { KERNEL_DIR "/storage.cl", KERNEL_DIR "/scene.cl", KERNEL_DIR "/texture.cl",
+        KERNEL_DIR "/environment.cl", KERNEL_DIR "/light.cl", KERNEL_DIR "/rng.h", KERNEL_DIR "/sampler.cl",
+        KERNEL_DIR "/trace.cl", TEST_DIR "/camera_test.cl" };
+    // the variant main.cpp starts with
+    const KernelConfig config = { 2, 1, 0, 0, STORAGE_FLOAT, 0, 0, SAMPLER_SOBOL, 0, 0 };
+    unsigned int state = 1;
+    cl_program program;
+    char options[256];
+    Camera camera;
+    cl_int err;
+
+    if(!check_cl_device(&device, &context, &command_queue)) return TEST_SKIPPED;
+    cl_kernel_options(&config, options, sizeof(options));
+    if(cl_build_program(&context, &device, sources, sizeof(sources) / sizeof(sources[0]), options, &program) != CL_SUCCESS) return 1;
+    kernel = clCreateKernel(program, "camera_ray_kernel", &err);
+    CHECK_ERR(err);
+
+    // the pinhole, then thin lenses, looking straight on and turned away
+    camera_defaults(&camera);
+    check_camera(&camera, 20.0f, 30.0f, &state);
+    camera.aperture = 0.05f;
+    camera.focus_distance = 4.0f;
+    check_camera(&camera, 0, 0, &state);
+    check_camera(&camera, 31.5f, 23.5f, &state);
+    camera_turn(&camera, 0.7f, -0.3f);
+    camera.aperture = 0.2f;
+    camera.focus_distance = 12.0f;
+    check_camera(&camera, 63.0f, 5.0f, &state);
+
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    return check_result();
+}
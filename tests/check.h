@@ -0,0 +1,39 @@
+#ifndef TESTS_CHECK_H
+#define TESTS_CHECK_H
+
+#include <stdio.h>
+
+/**
+ * Minimal checks for the test executables: a failed CHECK prints where and
+ * what, and main returns check_result() so CTest sees the failure.
+ */
+static int check_failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        check_failures++; \
+    } \
+} while(0)
+
+// exit status CTest reports as skipped, see SKIP_RETURN_CODE in CMakeLists.txt
+#define TEST_SKIPPED 77
+
+static inline int check_result() {
+    if(check_failures > 0) fprintf(stderr, "%d checks failed\n", check_failures);
+    return check_failures > 0 ? 1 : 0;
+}
+
+/**
+ * Uniform float in [0, 1) from a xorshift state, tests stay reproducible.
+ */
+static inline float check_random(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef TESTS_CHECK_CL_H
+#define TESTS_CHECK_CL_H
+
+#include "compute.h"
+#include "check.h"
+
+/**
+ * Context and queue on the first OpenCL CPU device, such as PoCL, so kernel
+ * tests run without a GPU or a window. Returns 0 when there is none and the
+ * test should exit with TEST_SKIPPED.
+ */
+static inline int check_cl_device(cl_device_id* device, cl_context* context, cl_command_queue* command_queue) {
+    cl_platform_id platforms[8];
+    cl_uint count = 0, i;
+    cl_int err;
+
+    if(clGetPlatformIDs(8, platforms, &count) != CL_SUCCESS) count = 0;
+    for(i = 0; i < count && i < 8; i++) {
+        if(clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_CPU, 1, device, NULL) != CL_SUCCESS) continue;
+        *context = clCreateContext(NULL, 1, device, NULL, NULL, &err);
+        if(err != CL_SUCCESS) continue;
+        cl_create_queue(context, device, command_queue);
+        return 1;
+    }
+    fprintf(stderr, "no OpenCL CPU device\n");
+    return 0;
+}
+
+#endif
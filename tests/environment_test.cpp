@@ -0,0 +1,96 @@
+#include <math.h>
+
+#include "environment.h"
+#include "check.h"
+
+static float luminance(const float* rgb) {
+    return 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+}
+
+/**
+ * A CDF of n intervals starts at 0, never falls and ends at 1.
+ */
+static void check_cdf(const float* cdf, unsigned int n) {
+    unsigned int i, falls = 0;
+    CHECK(cdf[0] == 0);
+    for(i = 0; i < n; i++)
+        if(cdf[i + 1] < cdf[i]) falls++;
+    CHECK(falls == 0);
+    CHECK(fabsf(cdf[n] - 1.0f) < 1e-5f);
+}
+
+/**
+ * Density per unit solid angle environment_sample in kernels/environment.cl
+ * gives directions in texel (x, y) at polar angle theta.
+ */
+static float sample_pdf(const Environment* env, unsigned int x, unsigned int y, float theta) {
+    const unsigned int width = env->info.width, height = env->info.height;
+    const float* marginal = env->cdf;
+    const float* conditional = env->cdf + (height + 1) + (size_t)y * (width + 1);
+    const float row = marginal[y + 1] - marginal[y];
+    const float column = conditional[x + 1] - conditional[x];
+    return row * column * width * height / (2.0f * (float)M_PI * (float)M_PI * sinf(theta));
+}
+
+/**
+ * Checks the CDFs of env and that its sampling density integrates to 1
+ * over the sphere, in steps of a quarter texel, and follows luminance
+ * wherever the map is lit.
+ */
+static void check_environment(Environment* env) {
+    const unsigned int width = env->info.width, height = env->info.height, steps = 4;
+    double integral = 0;
+    float ratio = 0, worst = 0;
+    unsigned int x, y, i, j;
+
+    environment_build(env);
+    check_cdf(env->cdf, height);
+    for(y = 0; y < height; y++) check_cdf(env->cdf + (height + 1) + (size_t)y * (width + 1), width);
+
+    for(y = 0; y < height; y++) {
+        for(x = 0; x < width; x++) {
+            for(j = 0; j < steps; j++) {
+                const float theta = (float)M_PI * (y + (j + 0.5f) / steps) / height;
+                const double area = (M_PI / (height * steps)) * (2.0 * M_PI / width) * sin(theta);
+                for(i = 0; i < steps; i++) integral += sample_pdf(env, x, y, theta) * area / steps;
+            }
+
+            // at the texel centre, where the CDF took its sine
+            const float l = luminance(&env->radiance[3 * ((size_t)y * width + x)]);
+            if(l <= 0 || env->info.integral <= 0) continue;
+            const float r = sample_pdf(env, x, y, (float)M_PI * (y + 0.5f) / height) / l;
+            if(ratio == 0) ratio = r;
+            worst = fmaxf(worst, fabsf(r / ratio - 1.0f));
+        }
+    }
+    printf("%ux%u map: density integrates to %.6f, strays %.6f from luminance\n", width, height, integral, worst);
+    CHECK(fabs(integral - 1.0) < 1e-3);
+    CHECK(worst < 1e-3f);
+}
+
+int main() {
+    Environment env;
+    unsigned int x;
+
+    // smooth sky with a small sun
+    environment_sky(&env, 256, 128);
+    check_environment(&env);
+    environment_free(&env);
+
+    // black rows above a single bright texel, rows without light fall back
+    // to uniform CDFs
+    environment_init(&env, 64, 32);
+    for(x = 0; x < 3 * 64 * 16; x++) env.radiance[x] = 0;
+    for(x = 3 * 64 * 16; x < 3 * 64 * 32; x++) env.radiance[x] = 0.25f;
+    env.radiance[3 * (64 * 20 + 7) + 1] = 1000.0f;
+    check_environment(&env);
+    environment_free(&env);
+
+    // no light at all
+    environment_init(&env, 16, 8);
+    check_environment(&env);
+    CHECK(env.info.integral == 0);
+    environment_free(&env);
+
+    return check_result();
+}
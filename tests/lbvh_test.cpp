@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "check_cl.h"
+
+// the largest mesh built, also the one rebuilds are timed on
+#define LBVH_TEST_CAPACITY (1u << 20)
+#define LBVH_TEST_REBUILDS 10
+
+static cl_device_id device;
+static cl_context context;
+static cl_command_queue command_queue;
+static ParallelPrimitives primitives;
+static LBVHBuilder lbvh;
+
+/**
+ * Spheres of random size in a 100 unit cube. Every fourth one sits on the
+ * one before, so equal Morton codes fall back to the index order.
+ */
+static void random_spheres(Primitive* prims, unsigned int n, unsigned int* state) {
+    unsigned int i;
+    int a;
+
+    memset(prims, 0, sizeof(Primitive) * n);
+    for(i = 0; i < n; i++) {
+        for(a = 0; a < 3; a++) prims[i].pos.s[a] = i % 4 == 3 ? prims[i - 1].pos.s[a] : 100.0f * check_random(state);
+        prims[i].scale[0] = prims[i].scale[1] = prims[i].scale[2] = 0.05f + check_random(state);
+        prims[i].type = PRIM_SPHERE;
+    }
+}
+
+static void check_inside(const LBVHNode* node, const float* bmin, const float* bmax) {
+    int a;
+    for(a = 0; a < 3; a++) {
+        CHECK(bmin[a] >= node->bmin[a]);
+        CHECK(bmax[a] <= node->bmax[a]);
+    }
+}
+
+/**
+ * Walks the LBVH from node, checking that every node holds the boxes of its
+ * children and counting how often nodes and primitives are reached.
+ * Returns the depth of the deepest leaf.
+ */
+static unsigned int check_node(const LBVHNode* nodes, const Primitive* prims, unsigned int n, unsigned int node,
+        unsigned int depth, unsigned int* seen_nodes, unsigned int* seen_prims) {
+    const LBVHNode* parent = &nodes[node];
+    const cl_uint children[2] = { parent->left, parent->right };
+    unsigned int deepest = depth + 1, c;
+    int a;
+
+    seen_nodes[node]++;
+    for(c = 0; c < 2; c++) {
+        if(children[c] & LBVH_LEAF) {
+            const unsigned int p = children[c] & ~LBVH_LEAF;
+            float bmin[3], bmax[3];
+            CHECK(p < n);
+            if(p >= n) continue;
+            for(a = 0; a < 3; a++) {
+                bmin[a] = prims[p].pos.s[a] - prims[p].scale[0];
+                bmax[a] = prims[p].pos.s[a] + prims[p].scale[0];
+            }
+            check_inside(parent, bmin, bmax);
+            seen_prims[p]++;
+        } else {
+            CHECK(children[c] < n - 1);
+            if(children[c] >= n - 1 || seen_nodes[children[c]] > 0) continue;
+            check_inside(parent, nodes[children[c]].bmin, nodes[children[c]].bmax);
+            const unsigned int below = check_node(nodes, prims, n, children[c], depth + 1, seen_nodes, seen_prims);
+            if(below > deepest) deepest = below;
+        }
+    }
+    return deepest;
+}
+
+/**
+ * Builds the LBVH of n random spheres on the device and checks the tree.
+ */
+static void check_build(unsigned int n, int optimize, unsigned int* state) {
+    Primitive* prims = (Primitive*) malloc(sizeof(Primitive) * n);
+    const unsigned int node_count = n > 1 ? n - 1 : 1;
+    LBVHNode* nodes = (LBVHNode*) malloc(sizeof(LBVHNode) * node_count);
+    unsigned int* seen_nodes = (unsigned int*) calloc(node_count, sizeof(unsigned int));
+    unsigned int* seen_prims = (unsigned int*) calloc(n, sizeof(unsigned int));
+    Mesh mesh;
+    unsigned int i;
+    cl_int err;
+    int a;
+
+    random_spheres(prims, n, state);
+    memset(&mesh, 0, sizeof(Mesh));
+    mesh.prim_count = n;
+    mesh.node_count = node_count;
+    mesh.flags = MESH_DYNAMIC;
+    for(a = 0; a < 3; a++) {
+        mesh.bmin[a] = 1e30f;
+        mesh.bmax[a] = -1e30f;
+        for(i = 0; i < n; i++) {
+            if(prims[i].pos.s[a] - prims[i].scale[0] < mesh.bmin[a]) mesh.bmin[a] = prims[i].pos.s[a] - prims[i].scale[0];
+            if(prims[i].pos.s[a] + prims[i].scale[0] > mesh.bmax[a]) mesh.bmax[a] = prims[i].pos.s[a] + prims[i].scale[0];
+        }
+    }
+
+    cl_mem prims_cl = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Primitive) * n, prims, &err);
+    CHECK_ERR(err);
+    cl_mem nodes_cl = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(LBVHNode) * node_count, NULL, &err);
+    CHECK_ERR(err);
+    cl_lbvh_build(&command_queue, &lbvh, &prims_cl, &mesh, &nodes_cl, optimize);
+    err = clEnqueueReadBuffer(command_queue, nodes_cl, CL_TRUE, 0, sizeof(LBVHNode) * node_count, nodes, 0, NULL, NULL);
+    CHECK_ERR(err);
+
+    const unsigned int depth = check_node(nodes, prims, n, 0, 0, seen_nodes, seen_prims);
+    if(n == 1) {
+        // the single leaf hangs off both sides of the root
+        CHECK(seen_prims[0] == 2);
+    } else {
+        for(i = 0; i < n; i++) CHECK(seen_prims[i] == 1);
+        for(i = 0; i < node_count; i++) CHECK(seen_nodes[i] == 1);
+    }
+    CHECK(depth <= BVH_MAX_DEPTH);
+    printf("%u primitives%s: depth %u\n", n, optimize ? ", rotated" : "", depth);
+
+    clReleaseMemObject(prims_cl);
+    clReleaseMemObject(nodes_cl);
+    free(prims);
+    free(nodes);
+    free(seen_nodes);
+    free(seen_prims);
+}
+
+/**
+ * Times rebuilds of a mesh of n random spheres, primitives already on the
+ * device as they are for cl_update_dynamic_meshes after the upload.
+ */
+static void time_rebuild(unsigned int n, int optimize, unsigned int* state) {
+    Primitive* prims = (Primitive*) malloc(sizeof(Primitive) * n);
+    Mesh mesh;
+    cl_int err;
+    int i;
+
+    random_spheres(prims, n, state);
+    memset(&mesh, 0, sizeof(Mesh));
+    mesh.prim_count = n;
+    mesh.node_count = n - 1;
+    mesh.bmax[0] = mesh.bmax[1] = mesh.bmax[2] = 100.0f;
+
+    cl_mem prims_cl = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Primitive) * n, prims, &err);
+    CHECK_ERR(err);
+    cl_mem nodes_cl = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(LBVHNode) * (n - 1), NULL, &err);
+    CHECK_ERR(err);
+
+    // the first build also compiles kernels lazily on some runtimes
+    cl_lbvh_build(&command_queue, &lbvh, &prims_cl, &mesh, &nodes_cl, optimize);
+    clFinish(command_queue);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(i = 0; i < LBVH_TEST_REBUILDS; i++)
+        cl_lbvh_build(&command_queue, &lbvh, &prims_cl, &mesh, &nodes_cl, optimize);
+    clFinish(command_queue);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / LBVH_TEST_REBUILDS;
+    printf("%u primitives%s: %.2f ms per rebuild, %.1f M primitives/s\n", n, optimize ? ", rotated" : "",
+        1000.0 * seconds, n / seconds / 1e6);
+
+    clReleaseMemObject(prims_cl);
+    clReleaseMemObject(nodes_cl);
+    free(prims);
+}
+
+int main() {
+    const unsigned int sizes[] = { 1, 2, 3, 1000, 4097, 100000, LBVH_TEST_CAPACITY };
+    unsigned int state = 1, i;
+    int optimize;
+
+    if(!check_cl_device(&device, &context, &command_queue)) return TEST_SKIPPED;
+    cl_primitives_init(&context, &device, &primitives, LBVH_TEST_CAPACITY);
+    cl_lbvh_init(&context, &device, &lbvh, &primitives, LBVH_TEST_CAPACITY);
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        for(optimize = 0; optimize < 2; optimize++)
+            check_build(sizes[i], optimize, &state);
+
+    time_rebuild(LBVH_TEST_CAPACITY, 0, &state);
+    time_rebuild(LBVH_TEST_CAPACITY, 1, &state);
+
+    return check_result();
+}
@@ -0,0 +1,16 @@
+/**
+ * Samples light from origin with the numbers xi, built after scene.cl and
+ * light.cl for light_test.cpp. Writes each direction, then the distance and
+ * density light_sample gave it and the ones light_intersect and light_pdf
+ * give the same direction.
+ */
+__kernel void light_sample_kernel(__global const Light* lights, uint light, float4 origin,
+        __global const float2* xi, __global float4* out)
+{
+    const uint i = get_global_id(0);
+    float t, pdf;
+    const float4 dir = light_sample(&lights[light], origin, xi[i], &t, &pdf);
+    const float hit = light_intersect(&lights[light], origin, dir);
+    out[2 * i] = dir;
+    out[2 * i + 1] = (float4)(t, pdf, hit, light_pdf(&lights[light], origin, dir, hit));
+}
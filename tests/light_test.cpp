@@ -0,0 +1,170 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "check_cl.h"
+
+// light samples per origin, on a jittered grid
+#define SAMPLE_GRID 64
+#define SAMPLES (SAMPLE_GRID * SAMPLE_GRID)
+
+static cl_device_id device;
+static cl_context context;
+static cl_command_queue command_queue;
+static cl_kernel kernel;
+static cl_mem lights_cl, xi_cl, out_cl;
+
+static void sub(const float* a, const float* b, float* d) {
+    int i;
+    for(i = 0; i < 3; i++) d[i] = a[i] - b[i];
+}
+
+static float dot3(const float* a, const float* b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static float length3(const float* a) {
+    return sqrtf(dot3(a, a));
+}
+
+/**
+ * Solid angle of triangle abc seen from the origin (Van Oosterom and
+ * Strackee 1983).
+ */
+static double triangle_solid_angle(const float* a, const float* b, const float* c) {
+    const float bc[3] = { b[1] * c[2] - b[2] * c[1], b[2] * c[0] - b[0] * c[2], b[0] * c[1] - b[1] * c[0] };
+    const double la = length3(a), lb = length3(b), lc = length3(c);
+    const double den = la * lb * lc + dot3(a, b) * lc + dot3(a, c) * lb + dot3(b, c) * la;
+    return 2.0 * fabs(atan2(fabs(dot3(a, bc)), den));
+}
+
+/**
+ * Solid angle light covers seen from origin.
+ */
+static double solid_angle(const Light* light, const float* origin) {
+    const float p[3] = { light->position.s[0], light->position.s[1], light->position.s[2] };
+    float corners[4][3];
+    int i;
+
+    if(light->type == LIGHT_SPHERE) {
+        float v[3];
+        sub(p, origin, v);
+        return 2.0 * M_PI * (1.0 - sqrt(1.0 - light->radius * light->radius / dot3(v, v)));
+    }
+    for(i = 0; i < 3; i++) {
+        corners[0][i] = p[i] - origin[i];
+        corners[1][i] = corners[0][i] + light->edge0.s[i];
+        corners[2][i] = corners[1][i] + light->edge1.s[i];
+        corners[3][i] = corners[0][i] + light->edge1.s[i];
+    }
+    return triangle_solid_angle(corners[0], corners[1], corners[2]) + triangle_solid_angle(corners[0], corners[2], corners[3]);
+}
+
+/**
+ * Samples light number index of scene from origin. Every direction must
+ * reach the light where light_sample says, with the density light_pdf
+ * gives it, and the densities must integrate to the light's solid angle.
+ * Origins that cannot see the light get no density at all.
+ */
+static void check_light(const Scene* scene, unsigned int index, const float* origin, bool visible) {
+    const Light* light = &scene->lights[index];
+    const size_t work = SAMPLES;
+    cl_float4 o;
+    std::vector<cl_float4> out(2 * SAMPLES);
+    double inverse = 0;
+    unsigned int i, wrong = 0;
+    cl_int err;
+
+    o.s[0] = origin[0];
+    o.s[1] = origin[1];
+    o.s[2] = origin[2];
+    o.s[3] = 0;
+    err = clSetKernelArg(kernel, 1, sizeof(cl_uint), &index);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, 2, sizeof(cl_float4), &o);
+    CHECK_ERR(err);
+    err = clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL, &work, NULL, 0, NULL, NULL);
+    CHECK_ERR(err);
+    err = clEnqueueReadBuffer(command_queue, out_cl, CL_TRUE, 0, sizeof(cl_float4) * out.size(), &out[0], 0, NULL, NULL);
+    CHECK_ERR(err);
+
+    for(i = 0; i < SAMPLES; i++) {
+        const cl_float4* dir = &out[2 * i];
+        const float t = out[2 * i + 1].s[0], pdf = out[2 * i + 1].s[1];
+        const float hit = out[2 * i + 1].s[2], hit_pdf = out[2 * i + 1].s[3];
+        if(!visible) {
+            if(pdf != 0) wrong++;
+            continue;
+        }
+        const float length = sqrtf(dir->s[0] * dir->s[0] + dir->s[1] * dir->s[1] + dir->s[2] * dir->s[2]);
+        if(fabsf(length - 1.0f) > 1e-4f) wrong++;
+        if(!(fabsf(hit - t) <= 1e-3f * t)) wrong++;
+        if(!(pdf > 0 && fabsf(hit_pdf - pdf) <= 1e-3f * pdf)) wrong++;
+        if(pdf > 0) inverse += 1.0 / pdf;
+    }
+    CHECK(wrong == 0);
+    if(!visible) return;
+
+    const double expected = solid_angle(light, origin), estimate = inverse / SAMPLES;
+    printf("light %u: solid angle %.6f, from the densities %.6f\n", index, expected, estimate);
+    CHECK(fabs(estimate - expected) < 0.005 * expected);
+}
+
+int main() {
+    const float radiance[3] = { 1.0f, 1.0f, 1.0f };
+    const float centre[3] = { 0, 0, 10.0f };
+    // faces the origin, down the z axis
+    const float corner[3] = { -1.0f, -1.5f, 5.0f };
+    const float edge0[3] = { 0, 3.0f, 0 }, edge1[3] = { 2.0f, 0, 0 };
+    const float origin[3] = { 0, 0, 0 }, oblique[3] = { 4.0f, 1.0f, 1.0f };
+    const float behind[3] = { 0, 0, 8.0f }, inside[3] = { 0.5f, 0, 10.0f };
+    std::vector<cl_float2> xi(SAMPLES);
+    unsigned int state = 1, i;
+    Scene scene;
+    cl_int err;
+
+    if(!check_cl_device(&device, &context, &command_queue)) return TEST_SKIPPED;
+
+    scene_init(&scene);
+    scene_add_sphere_light(&scene, centre, 2.0f, radiance);
+    scene_add_quad_light(&scene, corner, edge0, edge1, radiance);
+
+    const char* sources[] = { KERNEL_DIR "/scene.cl", KERNEL_DIR "/light.cl", TEST_DIR "/light_test.cl" };
+    cl_program program;
+    if(cl_build_program(&context, &device, sources, 3, "", &program) != CL_SUCCESS) return 1;
+    kernel = clCreateKernel(program, "light_sample_kernel", &err);
+    CHECK_ERR(err);
+
+    for(i = 0; i < SAMPLES; i++) {
+        xi[i].s[0] = (i % SAMPLE_GRID + check_random(&state)) / SAMPLE_GRID;
+        xi[i].s[1] = (i / SAMPLE_GRID + check_random(&state)) / SAMPLE_GRID;
+    }
+    lights_cl = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(Light) * scene.num_lights, scene.lights, &err);
+    CHECK_ERR(err);
+    xi_cl = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(cl_float2) * SAMPLES, &xi[0], &err);
+    CHECK_ERR(err);
+    out_cl = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_float4) * 2 * SAMPLES, NULL, &err);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &lights_cl);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, 3, sizeof(cl_mem), &xi_cl);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, 4, sizeof(cl_mem), &out_cl);
+    CHECK_ERR(err);
+
+    check_light(&scene, 0, origin, true);
+    check_light(&scene, 0, oblique, true);
+    check_light(&scene, 0, inside, false);
+    check_light(&scene, 1, origin, true);
+    check_light(&scene, 1, oblique, true);
+    check_light(&scene, 1, behind, false);
+
+    clReleaseMemObject(lights_cl);
+    clReleaseMemObject(xi_cl);
+    clReleaseMemObject(out_cl);
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    scene_free(&scene);
+    return check_result();
+}
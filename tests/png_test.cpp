@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <zlib.h>
+
+#include "encoder.h"
+#include "check.h"
+
+static unsigned int released = 0;
+
+/**
+ * Frames here are the test's own memory, this stands in for readback.cpp.
+ * Called from the encoder's writer thread, which is joined before the count
+ * is read.
+ */
+void readback_release(ReadbackRing*, const Frame*) {
+    released++;
+}
+
+static unsigned int get_u32(const unsigned char* p) {
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+static bool read_file(const char* path, std::vector<unsigned char>* data) {
+    FILE* fp = fopen(path, "rb");
+    unsigned char buffer[4096];
+    size_t n;
+
+    if(!fp) return false;
+    while((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) data->insert(data->end(), buffer, buffer + n);
+    fclose(fp);
+    return true;
+}
+
+/**
+ * Decodes the PNG at path with zlib, checking chunk CRCs and that
+ * uncompress accepts the stream and its Adler-32, then undoes the row
+ * filters and compares against frame, whose rows are bottom up.
+ */
+static void check_png(const char* path, const Frame* frame) {
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    std::vector<unsigned char> file, idat;
+    unsigned int width = 0, height = 0, x, y, c;
+    bool ended = false;
+    size_t p = 8;
+
+    CHECK(read_file(path, &file));
+    CHECK(file.size() > 8 && memcmp(&file[0], signature, 8) == 0);
+    if(file.size() <= 8) return;
+
+    while(p + 12 <= file.size() && !ended) {
+        const unsigned int length = get_u32(&file[p]);
+        const unsigned char* type = &file[p + 4];
+        CHECK(p + 12 + length <= file.size());
+        if(p + 12 + length > file.size()) return;
+        CHECK(crc32(0, type, length + 4) == get_u32(&file[p + 8 + length]));
+
+        if(memcmp(type, "IHDR", 4) == 0) {
+            width = get_u32(&file[p + 8]);
+            height = get_u32(&file[p + 12]);
+            CHECK(file[p + 16] == 8 && file[p + 17] == 2);
+        } else if(memcmp(type, "IDAT", 4) == 0) {
+            idat.insert(idat.end(), &file[p + 8], &file[p + 8] + length);
+        } else if(memcmp(type, "IEND", 4) == 0) {
+            ended = true;
+        }
+        p += 12 + length;
+    }
+    CHECK(ended && p == file.size());
+    CHECK(width == frame->width && height == frame->height);
+    if(width != frame->width || height != frame->height) return;
+
+    // one spare byte, so a stream longer than the image is caught
+    const size_t row_size = 1 + (size_t)width * 3;
+    std::vector<unsigned char> raw(row_size * height + 1);
+    uLongf raw_length = (uLongf)raw.size();
+    CHECK(uncompress(&raw[0], &raw_length, &idat[0], (uLong)idat.size()) == Z_OK);
+    CHECK(raw_length == row_size * height);
+    if(raw_length != row_size * height) return;
+
+    unsigned int wrong = 0;
+    for(y = 0; y < height; y++) {
+        unsigned char* row = &raw[y * row_size];
+        const unsigned char* above = y > 0 ? row - row_size + 1 : NULL;
+        const unsigned char* src = frame->pixels + (size_t)(height - 1 - y) * frame->stride;
+        CHECK(row[0] == 0 || row[0] == 2);
+        for(x = 0; x < width; x++) {
+            for(c = 0; c < 3; c++) {
+                unsigned char* value = &row[1 + 3 * x + c];
+                if(row[0] == 2 && above) *value = (unsigned char)(*value + above[3 * x + c]);
+                if(*value != src[4 * x + c]) wrong++;
+            }
+        }
+    }
+    CHECK(wrong == 0);
+}
+
+int main() {
+    // single pixel, partial last strip, strips above the stored block size
+    const unsigned int sizes[][2] = { { 1, 1 }, { 37, 70 }, { 1000, 97 } };
+    const unsigned int count = sizeof(sizes) / sizeof(sizes[0]);
+    std::vector<std::vector<unsigned char> > pixels(count);
+    Frame frames[sizeof(sizes) / sizeof(sizes[0])];
+    unsigned int state = 1, i;
+    size_t j;
+    char path[64];
+
+    FrameEncoder* encoder = encoder_start("png_test_", NULL, 3, 2, 0);
+    for(i = 0; i < count; i++) {
+        Frame* frame = &frames[i];
+        frame->width = sizes[i][0];
+        frame->height = sizes[i][1];
+        frame->format = FRAME_RGBA8;
+        // rows padded like a staging buffer with a wider pitch
+        frame->stride = (size_t)frame->width * 4 + 12;
+        frame->index = i;
+        frame->slot = 0;
+        // smooth with noise, so the Up filter and deflate both have work
+        pixels[i].resize(frame->stride * frame->height);
+        for(j = 0; j < pixels[i].size(); j++)
+            pixels[i][j] = (unsigned char)(j / frame->stride + (check_random(&state) < 0.1f ? j * 7 : 0));
+        frame->pixels = &pixels[i][0];
+        encoder_submit(encoder, frame);
+    }
+    encoder_stop(encoder);
+    CHECK(released == count);
+
+    for(i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "png_test_%05u.png", i);
+        check_png(path, &frames[i]);
+        remove(path);
+    }
+    return check_result();
+}
@@ -0,0 +1,85 @@
+#include <stdlib.h>
+
+#include <chrono>
+#include <vector>
+
+#include "check_cl.h"
+
+// runs timed per primitive after one warm up run
+#define BENCH_RUNS 10
+
+static cl_command_queue command_queue;
+static ParallelPrimitives primitives;
+
+typedef void (*BenchRun)(cl_mem* a, cl_mem* b, cl_mem* c, cl_mem* count, unsigned int n);
+
+static void run_scan(cl_mem* a, cl_mem* b, cl_mem* c, cl_mem* count, unsigned int n) {
+    cl_scan(&command_queue, &primitives, a, b, n);
+}
+
+static void run_compact(cl_mem* a, cl_mem* b, cl_mem* c, cl_mem* count, unsigned int n) {
+    cl_compact(&command_queue, &primitives, a, b, c, count, n);
+}
+
+static void run_sort_32(cl_mem* a, cl_mem* b, cl_mem* c, cl_mem* count, unsigned int n) {
+    cl_radix_sort(&command_queue, &primitives, c, a, n, 32);
+}
+
+static void run_sort_64(cl_mem* a, cl_mem* b, cl_mem* c, cl_mem* count, unsigned int n) {
+    cl_radix_sort(&command_queue, &primitives, c, a, n, 64);
+}
+
+static void bench(const char* name, BenchRun run, cl_mem* a, cl_mem* b, cl_mem* c, cl_mem* count, unsigned int n) {
+    int i;
+
+    run(a, b, c, count, n);
+    clFinish(command_queue);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(i = 0; i < BENCH_RUNS; i++) run(a, b, c, count, n);
+    clFinish(command_queue);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / BENCH_RUNS;
+    printf("%-12s %u keys: %8.3f ms, %8.1f M keys/s\n", name, n, 1000.0 * seconds, n / seconds / 1e6);
+}
+
+/**
+ * Times scan, compaction and radix sort of n elements, 2^22 by default, on
+ * the first OpenCL CPU device.
+ */
+int main(int argc, char** argv) {
+    const unsigned int n = argc > 1 ? (unsigned int) strtoul(argv[1], NULL, 10) : 1u << 22;
+    std::vector<cl_ulong> keys(n);
+    std::vector<cl_uint> flags(n);
+    unsigned int state = 1, i;
+    cl_device_id device;
+    cl_context context;
+    cl_int err;
+
+    if(n == 0 || !check_cl_device(&device, &context, &command_queue)) return 1;
+    cl_primitives_init(&context, &device, &primitives, n);
+
+    for(i = 0; i < n; i++) {
+        keys[i] = ((cl_ulong)(check_random(&state) * 16777216.0f) << 40) | (cl_ulong)(check_random(&state) * 16777216.0f);
+        flags[i] = check_random(&state) < 0.5f ? 1 : 0;
+    }
+    // a holds values or flags, b scan output, c keys or compaction output
+    cl_mem a = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint) * n, &flags[0], &err);
+    CHECK_ERR(err);
+    cl_mem b = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * n, NULL, &err);
+    CHECK_ERR(err);
+    cl_mem c = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_ulong) * n, &keys[0], &err);
+    CHECK_ERR(err);
+    cl_mem count = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &err);
+    CHECK_ERR(err);
+
+    bench("scan", run_scan, &a, &b, &c, &count, n);
+    // a as flags, its own values
+    bench("compact", run_compact, &a, &a, &b, &count, n);
+    bench("sort 32 bit", run_sort_32, &a, &b, &c, &count, n);
+    bench("sort 64 bit", run_sort_64, &a, &b, &c, &count, n);
+
+    clReleaseMemObject(a);
+    clReleaseMemObject(b);
+    clReleaseMemObject(c);
+    clReleaseMemObject(count);
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+
+#include <algorithm>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include "check_cl.h"
+
+// three scan levels above SCAN_BLOCK * SCAN_BLOCK elements
+#define PRIMITIVES_TEST_CAPACITY (1u << 20)
+
+static cl_device_id device;
+static cl_context context;
+static cl_command_queue command_queue;
+static ParallelPrimitives primitives;
+
+static cl_mem upload(const void* data, size_t size) {
+    cl_int err;
+    cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, (void*) data, &err);
+    CHECK_ERR(err);
+    return buffer;
+}
+
+static void download(cl_mem buffer, void* data, size_t size) {
+    cl_int err = clEnqueueReadBuffer(command_queue, buffer, CL_TRUE, 0, size, data, 0, NULL, NULL);
+    CHECK_ERR(err);
+}
+
+/**
+ * Exclusive scan of n random uints in place, against std::partial_sum.
+ */
+static void check_scan(unsigned int n, unsigned int* state) {
+    std::vector<cl_uint> in(n), out(n), expected(n);
+    unsigned int i;
+
+    for(i = 0; i < n; i++) in[i] = (cl_uint)(check_random(state) * 1000.0f);
+    expected[0] = 0;
+    std::partial_sum(in.begin(), in.end() - 1, expected.begin() + 1);
+
+    cl_mem buffer = upload(&in[0], sizeof(cl_uint) * n);
+    cl_scan(&command_queue, &primitives, &buffer, &buffer, n);
+    download(buffer, &out[0], sizeof(cl_uint) * n);
+    CHECK(out == expected);
+    clReleaseMemObject(buffer);
+}
+
+/**
+ * Compaction of n values with about a third of the flags set, of the values
+ * and of the indices, against a sequential copy.
+ */
+static void check_compact(unsigned int n, unsigned int* state) {
+    std::vector<cl_uint> values(n), flags(n), expected_values, expected_indices, out(n);
+    cl_uint count = 0;
+    unsigned int i;
+
+    for(i = 0; i < n; i++) {
+        values[i] = (cl_uint)(check_random(state) * 16777216.0f);
+        flags[i] = check_random(state) < 0.3f ? 1 : 0;
+        if(!flags[i]) continue;
+        expected_values.push_back(values[i]);
+        expected_indices.push_back(i);
+    }
+
+    cl_mem values_cl = upload(&values[0], sizeof(cl_uint) * n);
+    cl_mem flags_cl = upload(&flags[0], sizeof(cl_uint) * n);
+    cl_mem out_cl = upload(&out[0], sizeof(cl_uint) * n);
+    cl_mem count_cl = upload(&count, sizeof(cl_uint));
+
+    cl_compact(&command_queue, &primitives, &values_cl, &flags_cl, &out_cl, &count_cl, n);
+    download(count_cl, &count, sizeof(cl_uint));
+    download(out_cl, &out[0], sizeof(cl_uint) * n);
+    CHECK(count == expected_values.size());
+    CHECK(std::equal(expected_values.begin(), expected_values.end(), out.begin()));
+
+    cl_compact(&command_queue, &primitives, NULL, &flags_cl, &out_cl, &count_cl, n);
+    download(count_cl, &count, sizeof(cl_uint));
+    download(out_cl, &out[0], sizeof(cl_uint) * n);
+    CHECK(count == expected_indices.size());
+    CHECK(std::equal(expected_indices.begin(), expected_indices.end(), out.begin()));
+
+    clReleaseMemObject(values_cl);
+    clReleaseMemObject(flags_cl);
+    clReleaseMemObject(out_cl);
+    clReleaseMemObject(count_cl);
+}
+
+static bool key_less(const std::pair<cl_ulong, cl_uint>& a, const std::pair<cl_ulong, cl_uint>& b) {
+    return a.first < b.first;
+}
+
+/**
+ * Sort of n random keys of key_bits bits with their indices as values,
+ * against std::stable_sort. Keys repeat often so stability is visible.
+ */
+template<typename Key>
+static void check_sort(unsigned int n, unsigned int key_bits, unsigned int* state) {
+    const cl_ulong mask = key_bits < 64 ? (1ull << key_bits) - 1 : ~0ull;
+    std::vector<Key> keys(n);
+    std::vector<cl_uint> values(n);
+    std::vector<std::pair<cl_ulong, cl_uint> > expected(n);
+    unsigned int i;
+
+    for(i = 0; i < n; i++) {
+        // few distinct values in the low bits, random ones above
+        cl_ulong key = (cl_ulong)(check_random(state) * 16.0f);
+        key |= (cl_ulong)(check_random(state) * 16777216.0f) << 24;
+        key |= (cl_ulong)(check_random(state) * 16777216.0f) << 48;
+        keys[i] = (Key)(key & mask);
+        values[i] = i;
+        expected[i] = std::make_pair((cl_ulong)keys[i], i);
+    }
+    std::stable_sort(expected.begin(), expected.end(), key_less);
+
+    cl_mem keys_cl = upload(&keys[0], sizeof(Key) * n);
+    cl_mem values_cl = upload(&values[0], sizeof(cl_uint) * n);
+    cl_radix_sort(&command_queue, &primitives, &keys_cl, &values_cl, n, key_bits);
+    download(keys_cl, &keys[0], sizeof(Key) * n);
+    download(values_cl, &values[0], sizeof(cl_uint) * n);
+
+    unsigned int wrong = 0;
+    for(i = 0; i < n; i++)
+        if(keys[i] != expected[i].first || values[i] != expected[i].second) wrong++;
+    CHECK(wrong == 0);
+
+    clReleaseMemObject(keys_cl);
+    clReleaseMemObject(values_cl);
+}
+
+int main() {
+    // single elements, around a scan block, around a radix block, two and
+    // three scan levels
+    const unsigned int sizes[] = { 1, 2, 255, 256, 257, 1000, 1024, 1025, 65536, 65537, 300007, PRIMITIVES_TEST_CAPACITY };
+    unsigned int state = 1, i;
+
+    if(!check_cl_device(&device, &context, &command_queue)) return TEST_SKIPPED;
+    cl_primitives_init(&context, &device, &primitives, PRIMITIVES_TEST_CAPACITY);
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        const unsigned int n = sizes[i];
+        check_scan(n, &state);
+        check_compact(n, &state);
+        // an odd pass count ends with the copy back
+        check_sort<cl_uint>(n, 28, &state);
+        check_sort<cl_uint>(n, 32, &state);
+        check_sort<cl_ulong>(n, 44, &state);
+        check_sort<cl_ulong>(n, 64, &state);
+        printf("%u elements checked\n", n);
+    }
+
+    return check_result();
+}
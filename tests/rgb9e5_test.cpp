@@ -0,0 +1,57 @@
+#include <math.h>
+
+#include "scene.h"
+#include "check.h"
+
+/**
+ * Encodes rgb and decodes it again. Every channel must come back within
+ * half a step of the shared exponent, about 1/512 of the largest
+ * channel or less.
+ */
+static void check_round_trip(float r, float g, float b) {
+    const float rgb[3] = { r, g, b };
+    float out[3], m = 0, expected;
+    int a;
+
+    rgb9e5_decode(rgb9e5_encode(rgb), out);
+    for(a = 0; a < 3; a++) m = fmaxf(m, fminf(fmaxf(rgb[a], 0.0f), 65408.0f));
+    for(a = 0; a < 3; a++) {
+        expected = fminf(fmaxf(rgb[a], 0.0f), 65408.0f);
+        CHECK(fabsf(out[a] - expected) <= m / 511.0f + ldexpf(1.0f, -25));
+    }
+}
+
+int main() {
+    const float zero[3] = { 0, 0, 0 };
+    const float largest[3] = { 65408.0f, 65408.0f, 65408.0f };
+    const float above[3] = { 1e9f, -1.0f, 2.0f };
+    float out[3];
+    unsigned int state = 1, i;
+    int a;
+
+    // the ends of the range decode exactly
+    CHECK(rgb9e5_encode(zero) == 0);
+    rgb9e5_decode(0, out);
+    for(a = 0; a < 3; a++) CHECK(out[a] == 0);
+    CHECK(rgb9e5_encode(largest) == 0xFFFFFFFFu);
+    rgb9e5_decode(rgb9e5_encode(largest), out);
+    for(a = 0; a < 3; a++) CHECK(out[a] == 65408.0f);
+
+    // out of range channels clamp
+    rgb9e5_decode(rgb9e5_encode(above), out);
+    CHECK(out[0] == 65408.0f && out[1] == 0);
+
+    // rounding up to the next exponent, and the smallest exponent
+    check_round_trip(511.9f, 1.0f, 0.25f);
+    check_round_trip(1.0f, 0.5f, 0.0f);
+    check_round_trip(ldexpf(1.0f, -15), 0, ldexpf(1.0f, -20));
+    check_round_trip(1e-9f, 1e-10f, 0);
+
+    // random colours over the whole range
+    for(i = 0; i < 100000; i++) {
+        const float scale = ldexpf(1.0f, (int)(check_random(&state) * 32.0f) - 16);
+        check_round_trip(check_random(&state) * scale, check_random(&state) * scale, check_random(&state) * scale);
+    }
+
+    return check_result();
+}
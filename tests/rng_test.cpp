@@ -0,0 +1,58 @@
+#include <string.h>
+
+#include "kernels/rng.h"
+#include "check.h"
+
+/**
+ * Known answers of Philox4x32-10 from the Random123 distribution
+ * (kat_vectors): counter, key, result.
+ */
+static const unsigned int philox_kat[][10] = {
+    { 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+      0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 },
+    { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+      0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd },
+    { 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344, 0xa4093822, 0x299f31d0,
+      0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1 },
+};
+
+int main() {
+    unsigned int counter[4], i, j;
+
+    for(i = 0; i < sizeof(philox_kat) / sizeof(philox_kat[0]); i++) {
+        memcpy(counter, philox_kat[i], sizeof(counter));
+        rng_philox(counter, philox_kat[i][4], philox_kat[i][5]);
+        for(j = 0; j < 4; j++) CHECK(counter[j] == philox_kat[i][6 + j]);
+    }
+
+    // rng_uint hands out the block of the initial counter, then the next one
+    Rng rng, again;
+    rng_init(&rng, 17, 5, 3, 2, RNG_STREAM_USER);
+    for(j = 0; j < 2; j++) {
+        unsigned int block[4] = { 2, 3, RNG_STREAM_USER, j };
+        rng_philox(block, 17, 5);
+        for(i = 0; i < 4; i++) CHECK(rng_uint(&rng) == block[i]);
+    }
+
+    // the same pixel, frame, sample and stream draw the same numbers, any
+    // one of them changed draws others
+    rng_init(&rng, 17, 5, 3, 2, RNG_STREAM_USER);
+    rng_init(&again, 17, 5, 3, 2, RNG_STREAM_USER);
+    for(i = 0; i < 16; i++) {
+        const float a = rng_float(&rng), b = rng_float(&again);
+        CHECK(a == b);
+        CHECK(a >= 0.0f && a < 1.0f);
+    }
+    const unsigned int base[5] = { 17, 5, 3, 2, RNG_STREAM_USER };
+    rng_init(&rng, base[0], base[1], base[2], base[3], base[4]);
+    const unsigned int first = rng_uint(&rng);
+    for(i = 0; i < 5; i++) {
+        unsigned int changed[5];
+        memcpy(changed, base, sizeof(changed));
+        changed[i]++;
+        rng_init(&again, changed[0], changed[1], changed[2], changed[3], changed[4]);
+        CHECK(rng_uint(&again) != first);
+    }
+
+    return check_result();
+}
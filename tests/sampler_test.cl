@@ -0,0 +1,11 @@
+/**
+ * The first samples of every pixel of a width wide image in frame, built
+ * after rng.h and sampler.cl for sampler_test.cpp.
+ */
+__kernel void sample_kernel(__global float2* out, uint width, uint frame, uint samples, uint grid,
+        __global const float2* blue_noise)
+{
+    const uint pixel = get_global_id(0);
+    for(uint i = 0; i < samples; i++)
+        out[pixel * samples + i] = sample_2d(pixel % width, pixel / width, frame, i, grid, blue_noise);
+}
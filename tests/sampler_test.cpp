@@ -0,0 +1,159 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "check_cl.h"
+#include "sampler.h"
+
+#define WIDTH 16
+#define PIXELS (WIDTH * WIDTH)
+// 2^2 x 3^2 strata of scrambled Halton, and past the 16 of Sobol
+#define SAMPLES 36
+#define GRID 4
+
+static cl_device_id device;
+static cl_context context;
+static cl_command_queue command_queue;
+static cl_mem blue_noise;
+
+/**
+ * Whether the first n samples put exactly one into every cell of a
+ * cols x rows grid.
+ */
+static bool stratified(const cl_float2* p, unsigned int n, unsigned int cols, unsigned int rows) {
+    std::vector<unsigned int> count(cols * rows, 0);
+    unsigned int i;
+    for(i = 0; i < n; i++) {
+        const unsigned int cx = (unsigned int)(p[i].s[0] * cols), cy = (unsigned int)(p[i].s[1] * rows);
+        if(cx >= cols || cy >= rows) return false;
+        count[cy * cols + cx]++;
+    }
+    return std::count(count.begin(), count.end(), 1u) == (long)(cols * rows);
+}
+
+/**
+ * Whether the first n samples, a power of two, form a (0, m, 2) net: one
+ * sample in every elementary interval of area 1 / n.
+ */
+static bool net(const cl_float2* p, unsigned int n) {
+    unsigned int cols;
+    for(cols = 1; cols <= n; cols *= 2)
+        if(!stratified(p, n, cols, n / cols)) return false;
+    return true;
+}
+
+/**
+ * SAMPLES samples of each of PIXELS pixels from the sequence sampler.
+ */
+static bool run_sampler(unsigned int sampler, unsigned int frame, std::vector<cl_float2>* out) {
+    const char* sources[] = { KERNEL_DIR "/rng.h", KERNEL_DIR "/sampler.cl", TEST_DIR "/sampler_test.cl" };
+    const cl_uint width = WIDTH, samples = SAMPLES, grid = GRID;
+    const size_t work = PIXELS;
+    cl_program program;
+    char options[64];
+    cl_int err;
+
+    snprintf(options, sizeof(options), "-DSAMPLER=%u", sampler);
+    if(cl_build_program(&context, &device, sources, 3, options, &program) != CL_SUCCESS) return false;
+    cl_kernel kernel = clCreateKernel(program, "sample_kernel", &err);
+    CHECK_ERR(err);
+    cl_mem buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_float2) * PIXELS * SAMPLES, NULL, &err);
+    CHECK_ERR(err);
+
+    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffer);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, 1, sizeof(cl_uint), &width);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, 2, sizeof(cl_uint), &frame);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, 3, sizeof(cl_uint), &samples);
+    CHECK_ERR(err);
+    err = clSetKernelArg(kernel, 4, sizeof(cl_uint), &grid);
+    CHECK_ERR(err);
+    cl_set_sampler_arg(&kernel, 5, &blue_noise);
+    err = clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL, &work, NULL, 0, NULL, NULL);
+    CHECK_ERR(err);
+    out->resize(PIXELS * SAMPLES);
+    err = clEnqueueReadBuffer(command_queue, buffer, CL_TRUE, 0, sizeof(cl_float2) * out->size(), &(*out)[0], 0, NULL, NULL);
+    CHECK_ERR(err);
+
+    clReleaseMemObject(buffer);
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    return true;
+}
+
+/**
+ * Distance of a and b on the unit circle.
+ */
+static float wrapped(float a, float b) {
+    const float d = fabsf(a - b);
+    return fminf(d, 1.0f - d);
+}
+
+/**
+ * Checks every pixel's prefix of the sequence sampler, and that pixels do
+ * not repeat each other where the sequence is scrambled per pixel.
+ */
+static void check_sampler(unsigned int sampler) {
+    std::vector<cl_float2> s;
+    unsigned int p, i, same = 0, wrong = 0;
+
+    CHECK(run_sampler(sampler, 5, &s));
+    if(s.empty()) return;
+    for(i = 0; i < s.size(); i++)
+        if(!(s[i].s[0] >= 0 && s[i].s[0] < 1.0f && s[i].s[1] >= 0 && s[i].s[1] < 1.0f)) wrong++;
+
+    for(p = 0; p < PIXELS; p++) {
+        const cl_float2* q = &s[p * SAMPLES];
+        if(q[0].s[0] == s[0].s[0] && q[0].s[1] == s[0].s[1]) same++;
+        if(sampler == SAMPLER_GRID) {
+            // cell centres first
+            if(!stratified(q, GRID * GRID, GRID, GRID)) wrong++;
+            for(i = 0; i < GRID * GRID; i++)
+                if(fmodf(q[i].s[0] * GRID, 1.0f) != 0.5f || fmodf(q[i].s[1] * GRID, 1.0f) != 0.5f) wrong++;
+        } else if(sampler == SAMPLER_HALTON) {
+            if(!stratified(q, 6, 2, 3) || !stratified(q, 36, 4, 9)) wrong++;
+        } else if(sampler == SAMPLER_SOBOL) {
+            if(!net(q, 4) || !net(q, 16)) wrong++;
+        } else {
+            // one toroidal shift of the same points in every pixel
+            for(i = 1; i < SAMPLES; i++) {
+                const float dx = q[i].s[0] - q[0].s[0], dy = q[i].s[1] - q[0].s[1];
+                const float ex = s[i].s[0] - s[0].s[0], ey = s[i].s[1] - s[0].s[1];
+                if(wrapped(dx - floorf(dx), ex - floorf(ex)) > 1e-5f || wrapped(dy - floorf(dy), ey - floorf(ey)) > 1e-5f) wrong++;
+            }
+        }
+    }
+    printf("sampler %u: %u of %u pixels start like the first\n", sampler, same, PIXELS);
+    CHECK(wrong == 0);
+    if(sampler == SAMPLER_HALTON || sampler == SAMPLER_SOBOL) CHECK(same < PIXELS / 8);
+}
+
+int main() {
+    const unsigned int n = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+    std::vector<float> shifts(2 * n), axis(n);
+    unsigned int a, i, sampler;
+
+    // each channel of the mask holds every rank once
+    sampler_blue_noise(0, &shifts[0]);
+    for(a = 0; a < 2; a++) {
+        for(i = 0; i < n; i++) axis[i] = shifts[2 * i + a];
+        std::sort(axis.begin(), axis.end());
+        for(i = 0; i < n; i++) CHECK(axis[i] == (i + 0.5f) / n);
+    }
+
+    // the mask checks above still stand without a CPU device, so the test
+    // passes on them instead of reporting itself skipped
+    if(!check_cl_device(&device, &context, &command_queue)) {
+        printf("sequences not checked\n");
+        return check_result();
+    }
+    cl_sampler_init(&context, &blue_noise);
+    for(sampler = 0; sampler < SAMPLER_COUNT; sampler++) check_sampler(sampler);
+    clReleaseMemObject(blue_noise);
+
+    return check_result();
+}
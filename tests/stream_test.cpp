@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "stream.h"
+#include "check.h"
+
+#define FRAMES 4
+
+static unsigned int released = 0;
+
+/**
+ * Frames here are the test's own memory, this stands in for readback.cpp.
+ * Called from the stream's worker thread, which is joined before the count
+ * is read.
+ */
+void readback_release(ReadbackRing*, const Frame*) {
+    released++;
+}
+
+/**
+ * FRAMES frames of width x height, every byte of frame i set to i + 1,
+ * rows padded like a staging buffer with a wider pitch.
+ */
+static void make_frames(unsigned int width, unsigned int height, std::vector<std::vector<unsigned char> >* pixels, Frame* frames) {
+    unsigned int i;
+    pixels->resize(FRAMES);
+    for(i = 0; i < FRAMES; i++) {
+        frames[i].width = width;
+        frames[i].height = height;
+        frames[i].format = FRAME_RGBA8;
+        frames[i].stride = (size_t)width * 4 + 16;
+        frames[i].index = i;
+        frames[i].slot = 0;
+        (*pixels)[i].assign(frames[i].stride * height, (unsigned char)(i + 1));
+        frames[i].pixels = &(*pixels)[i][0];
+    }
+}
+
+/**
+ * Checks that data holds the frames in order, each behind its header.
+ */
+static void check_stream(const std::vector<unsigned char>& data, const Frame* frames) {
+    size_t p = 0;
+    unsigned int i;
+
+    for(i = 0; i < FRAMES; i++) {
+        StreamHeader header;
+        const size_t size = frames[i].stride * frames[i].height;
+        CHECK(p + sizeof(header) + size <= data.size());
+        if(p + sizeof(header) + size > data.size()) return;
+        memcpy(&header, &data[p], sizeof(header));
+        CHECK(header.magic == STREAM_MAGIC);
+        CHECK(header.width == frames[i].width && header.height == frames[i].height);
+        CHECK(header.format == FRAME_RGBA8 && header.stride == frames[i].stride && header.index == i);
+        CHECK(memcmp(&data[p + sizeof(header)], frames[i].pixels, size) == 0);
+        p += sizeof(header) + size;
+    }
+    CHECK(p == data.size());
+}
+
+static void read_all(int fd, std::vector<unsigned char>* data) {
+    unsigned char buffer[65536];
+    ssize_t n;
+    while((n = read(fd, buffer, sizeof(buffer))) > 0) data->insert(data->end(), buffer, buffer + n);
+}
+
+/**
+ * Reader end of the named pipe at path, which the writer creates.
+ */
+static void read_fifo(const char* path, std::vector<unsigned char>* data) {
+    int fd;
+    while((fd = open(path, O_RDONLY)) < 0) usleep(1000);
+    read_all(fd, data);
+    close(fd);
+}
+
+/**
+ * A reader that goes away after the first header.
+ */
+static void read_fifo_header(const char* path) {
+    StreamHeader header;
+    int fd;
+    while((fd = open(path, O_RDONLY)) < 0) usleep(1000);
+    CHECK(read(fd, &header, sizeof(header)) == sizeof(header));
+    close(fd);
+}
+
+static void submit_all(FrameStream* stream, const Frame* frames) {
+    unsigned int i;
+    stream_start(stream, NULL);
+    for(i = 0; i < FRAMES; i++) stream_submit(stream, &frames[i]);
+}
+
+int main() {
+    std::vector<std::vector<unsigned char> > pixels;
+    std::vector<unsigned char> data;
+    Frame frames[FRAMES];
+    const char* path = "stream_test.raw";
+
+    // an existing file gets one write per frame
+    make_frames(37, 21, &pixels, frames);
+    FILE* fp = fopen(path, "wb");
+    CHECK(fp != NULL);
+    if(fp) fclose(fp);
+    FrameStream* stream = stream_open(path);
+    submit_all(stream, frames);
+    stream_close(stream);
+    CHECK(released == FRAMES);
+    int fd = open(path, O_RDONLY);
+    read_all(fd, &data);
+    close(fd);
+    check_stream(data, frames);
+    remove(path);
+
+    // a named pipe is created and the frames, larger than its buffer, are
+    // spliced into it
+    make_frames(640, 360, &pixels, frames);
+    released = 0;
+    data.clear();
+    std::thread reader(read_fifo, path, &data);
+    stream = stream_open(path);
+    submit_all(stream, frames);
+    stream_close(stream);
+    reader.join();
+    CHECK(released == FRAMES);
+    check_stream(data, frames);
+
+    // a reader leaving early breaks the stream, the frames still go back
+    released = 0;
+    std::thread quitter(read_fifo_header, path);
+    stream = stream_open(path);
+    submit_all(stream, frames);
+    quitter.join();
+    // the worker notices on its next write
+    while(!stream_broken(stream)) usleep(1000);
+    stream_close(stream);
+    CHECK(released == FRAMES);
+    remove(path);
+
+    return check_result();
+}
@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <vector>
+
+#include "texture.h"
+#include "check.h"
+
+#define SLOTS 5
+
+/**
+ * Every occupied slot is the one its page points at and no other page is
+ * resident.
+ */
+static void check_table(const TextureCache* cache) {
+    unsigned int slot, page, occupied = 0, resident = 0;
+
+    for(slot = 0; slot < cache->slots; slot++) {
+        if(cache->slot_page[slot] == TEXTURE_FREE_SLOT) continue;
+        CHECK(cache->pages[cache->slot_page[slot]] == slot + 1);
+        occupied++;
+    }
+    for(page = 0; page < cache->num_pages; page++)
+        if(cache->pages[page]) resident++;
+    CHECK(occupied == resident);
+}
+
+static unsigned int update(TextureCache* cache, std::vector<cl_uint>* requests, const unsigned int* pages,
+        unsigned int count, unsigned int max_uploads, unsigned int* uploads) {
+    unsigned int i;
+    std::fill(requests->begin(), requests->end(), 0);
+    for(i = 0; i < count; i++) (*requests)[pages[i]] = 1;
+    const unsigned int n = texture_cache_update(cache, &(*requests)[0], max_uploads, uploads);
+    check_table(cache);
+    return n;
+}
+
+int main() {
+    Texture textures[2];
+    TextureCache cache;
+    unsigned int uploads[64], t, level, tx, ty, page;
+
+    // 4x4, 2x2 and then single tiles, and a texture of single tiles
+    texture_init(&textures[0], 256);
+    texture_init(&textures[1], 64);
+    texture_cache_init(&cache, textures, 2, SLOTS);
+    CHECK(cache.num_pages == 16 + 4 + 7 + 7);
+    std::vector<cl_uint> requests(cache.num_pages);
+
+    for(page = 0; page < cache.num_pages; page++) {
+        texture_cache_page_tile(&cache, page, &t, &level, &tx, &ty);
+        const unsigned int tiles = level == 0 && t == 0 ? 4 : level == 1 && t == 0 ? 2 : 1;
+        CHECK(tx < tiles && ty < tiles);
+        CHECK(cache.info[t].pages[level] + ty * tiles + tx == page);
+    }
+
+    // the last levels start out pinned in the first slots
+    const unsigned int last[2] = { cache.info[0].pages[8], cache.info[1].pages[6] };
+    for(t = 0; t < 2; t++) {
+        CHECK(cache.pages[last[t]] == t + 1);
+        CHECK(cache.slot_used[t] == TEXTURE_PINNED);
+    }
+    check_table(&cache);
+
+    // level 0 tiles a to f of the first texture
+    const unsigned int a = 0, b = 1, c = 2, d = 3, e = 4, f = 5;
+    const unsigned int first[] = { a, b, c };
+    CHECK(update(&cache, &requests, first, 3, 8, uploads) == 3);
+    CHECK(uploads[0] == a && uploads[1] == b && uploads[2] == c);
+
+    // a resident tile is only marked used
+    CHECK(update(&cache, &requests, &a, 1, 8, uploads) == 0);
+    const unsigned int slot_b = cache.pages[b] - 1;
+
+    // b and c were requested longest ago, the tie goes to the lower slot
+    CHECK(update(&cache, &requests, &d, 1, 8, uploads) == 1);
+    CHECK(uploads[0] == d && cache.pages[b] == 0 && cache.pages[d] == slot_b + 1);
+    CHECK(cache.pages[a] && cache.pages[c]);
+
+    // then c, then a, while d was used last
+    const unsigned int second[] = { e, f };
+    CHECK(update(&cache, &requests, second, 2, 8, uploads) == 2);
+    CHECK(cache.pages[c] == 0 && cache.pages[a] == 0);
+    CHECK(cache.pages[d] && cache.pages[e] && cache.pages[f]);
+
+    // tiles requested in the same update never replace one another and
+    // the pinned ones are never replaced
+    std::vector<unsigned int> all(cache.num_pages);
+    for(page = 0; page < cache.num_pages; page++) all[page] = page;
+    CHECK(update(&cache, &requests, &all[0], cache.num_pages, 64, uploads) == 0);
+    CHECK(update(&cache, &requests, first, 3, 64, uploads) == 3);
+    for(t = 0; t < 2; t++) {
+        CHECK(cache.pages[last[t]] == t + 1);
+        CHECK(cache.slot_used[t] == TEXTURE_PINNED);
+    }
+
+    // no more than max_uploads at a time
+    const unsigned int missing[] = { 8, 9, 10 };
+    CHECK(update(&cache, &requests, missing, 3, 1, uploads) == 1);
+    CHECK(uploads[0] == 8 && cache.pages[9] == 0 && cache.pages[10] == 0);
+
+    texture_cache_free(&cache);
+    texture_free(&textures[0]);
+    texture_free(&textures[1]);
+    return check_result();
+}
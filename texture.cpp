@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "texture.h"
+
+static unsigned int level_side(unsigned int size, unsigned int level) {
+    return size >> level > 0 ? size >> level : 1;
+}
+
+// tiles along each side of a level, levels smaller than a tile take one
+static unsigned int level_tiles(unsigned int size, unsigned int level) {
+    const unsigned int side = level_side(size, level);
+    return side > TEXTURE_TILE ? side / TEXTURE_TILE : 1;
+}
+
+/**
+ * Allocates a cleared texture with a full mip chain, size must be a power
+ * of two no larger than 2^(TEXTURE_MAX_LEVELS - 1).
+ */
+void texture_init(Texture* texture, unsigned int size) {
+    size_t texels = 0;
+    unsigned int level;
+
+    texture->size = size;
+    texture->levels = 1;
+    while(size >> texture->levels) texture->levels++;
+    for(level = 0; level < texture->levels; level++)
+        texels += (size_t)level_side(size, level) * level_side(size, level);
+    texture->texels = (cl_uint*) calloc(texels, sizeof(cl_uint));
+}
+
+void texture_free(Texture* texture) {
+    free(texture->texels);
+    memset(texture, 0, sizeof(Texture));
+}
+
+cl_uint* texture_level(const Texture* texture, unsigned int level) {
+    cl_uint* texels = texture->texels;
+    unsigned int l;
+    for(l = 0; l < level; l++)
+        texels += level_side(texture->size, l) * level_side(texture->size, l);
+    return texels;
+}
+
+/**
+ * Fills levels 1 and up from level 0, averaging 2x2 texels per channel.
+ */
+void texture_build_mips(Texture* texture) {
+    unsigned int level, x, y, c;
+
+    for(level = 1; level < texture->levels; level++) {
+        const unsigned int side = level_side(texture->size, level);
+        const unsigned int above = level_side(texture->size, level - 1);
+        const cl_uint* src = texture_level(texture, level - 1);
+        cl_uint* dst = texture_level(texture, level);
+
+        for(y = 0; y < side; y++) {
+            for(x = 0; x < side; x++) {
+                const cl_uint quad[4] = {
+                    src[2 * y * above + 2 * x], src[2 * y * above + 2 * x + 1],
+                    src[(2 * y + 1) * above + 2 * x], src[(2 * y + 1) * above + 2 * x + 1]
+                };
+                cl_uint texel = 0;
+                for(c = 0; c < 32; c += 8) {
+                    const unsigned int sum = ((quad[0] >> c) & 0xFF) + ((quad[1] >> c) & 0xFF) +
+                        ((quad[2] >> c) & 0xFF) + ((quad[3] >> c) & 0xFF);
+                    texel |= ((sum + 2) / 4) << c;
+                }
+                dst[y * side + x] = texel;
+            }
+        }
+    }
+}
+
+/**
+ * Copies tile (tx, ty) of a level into TEXTURE_TILE squared texels, levels
+ * smaller than a tile fill its top left corner.
+ */
+void texture_copy_tile(const Texture* texture, unsigned int level, unsigned int tx, unsigned int ty, cl_uint* tile) {
+    const unsigned int side = level_side(texture->size, level);
+    const unsigned int width = side < TEXTURE_TILE ? side : TEXTURE_TILE;
+    const cl_uint* texels = texture_level(texture, level);
+    unsigned int y;
+
+    if(width < TEXTURE_TILE) memset(tile, 0, sizeof(cl_uint) * TEXTURE_TILE * TEXTURE_TILE);
+    for(y = 0; y < width; y++)
+        memcpy(&tile[y * TEXTURE_TILE], &texels[(ty * TEXTURE_TILE + y) * side + tx * TEXTURE_TILE], sizeof(cl_uint) * width);
+}
+
+/**
+ * Lays out the page table of count textures for an atlas of slots tiles,
+ * which must exceed count. The last level of each texture is pinned to the
+ * first slots, the caller uploads those tiles before the first lookup.
+ */
+void texture_cache_init(TextureCache* cache, const Texture* textures, unsigned int count, unsigned int slots) {
+    unsigned int t, level, slot;
+
+    memset(cache, 0, sizeof(TextureCache));
+    cache->info = (TextureInfo*) calloc(count > 0 ? count : 1, sizeof(TextureInfo));
+    cache->num_textures = count;
+    for(t = 0; t < count; t++) {
+        TextureInfo* info = &cache->info[t];
+        info->size = textures[t].size;
+        info->levels = textures[t].levels;
+        for(level = 0; level < info->levels; level++) {
+            const unsigned int tiles = level_tiles(info->size, level);
+            info->pages[level] = cache->num_pages;
+            cache->num_pages += tiles * tiles;
+        }
+    }
+
+    cache->pages = (cl_uint*) calloc(cache->num_pages > 0 ? cache->num_pages : 1, sizeof(cl_uint));
+    cache->slots = slots;
+    cache->slot_page = (unsigned int*) malloc(sizeof(unsigned int) * slots);
+    cache->slot_used = (unsigned int*) calloc(slots, sizeof(unsigned int));
+    for(slot = 0; slot < slots; slot++) cache->slot_page[slot] = TEXTURE_FREE_SLOT;
+
+    for(t = 0; t < count && t < slots; t++) {
+        const unsigned int page = cache->info[t].pages[cache->info[t].levels - 1];
+        cache->pages[page] = t + 1;
+        cache->slot_page[t] = page;
+        cache->slot_used[t] = TEXTURE_PINNED;
+    }
+}
+
+void texture_cache_free(TextureCache* cache) {
+    free(cache->info);
+    free(cache->pages);
+    free(cache->slot_page);
+    free(cache->slot_used);
+    memset(cache, 0, sizeof(TextureCache));
+}
+
+/**
+ * Texture, level and tile position a page table entry stands for.
+ */
+void texture_cache_page_tile(const TextureCache* cache, unsigned int page,
+        unsigned int* texture, unsigned int* level, unsigned int* tx, unsigned int* ty) {
+    unsigned int t = 0, l = 0;
+    while(t + 1 < cache->num_textures && cache->info[t + 1].pages[0] <= page) t++;
+    const TextureInfo* info = &cache->info[t];
+    while(l + 1 < info->levels && info->pages[l + 1] <= page) l++;
+
+    const unsigned int tiles = level_tiles(info->size, l);
+    *texture = t;
+    *level = l;
+    *tx = (page - info->pages[l]) % tiles;
+    *ty = (page - info->pages[l]) / tiles;
+}
+
+/**
+ * Takes the tiles the kernels requested since the last update, a flag per
+ * page, and assigns slots to up to max_uploads of the missing ones,
+ * replacing the least recently requested tiles. Their pages go to uploads,
+ * the caller copies them into the atlas along with the new page table.
+ * Returns how many there are.
+ */
+unsigned int texture_cache_update(TextureCache* cache, const cl_uint* requests, unsigned int max_uploads, unsigned int* uploads) {
+    unsigned int page, slot, count = 0;
+
+    cache->frame++;
+
+    // tiles still in use are not replaced this update
+    for(page = 0; page < cache->num_pages; page++) {
+        if(!requests[page] || !cache->pages[page]) continue;
+        slot = cache->pages[page] - 1;
+        if(cache->slot_used[slot] != TEXTURE_PINNED) cache->slot_used[slot] = cache->frame;
+    }
+
+    for(page = 0; page < cache->num_pages && count < max_uploads; page++) {
+        if(!requests[page] || cache->pages[page]) continue;
+
+        // free slots have never been used, so they come first
+        unsigned int victim = TEXTURE_FREE_SLOT;
+        for(slot = 0; slot < cache->slots; slot++) {
+            if(cache->slot_used[slot] >= cache->frame) continue;
+            if(victim == TEXTURE_FREE_SLOT || cache->slot_used[slot] < cache->slot_used[victim]) victim = slot;
+        }
+        // every slot holds a tile requested this update
+        if(victim == TEXTURE_FREE_SLOT) break;
+
+        if(cache->slot_page[victim] != TEXTURE_FREE_SLOT) cache->pages[cache->slot_page[victim]] = 0;
+        cache->slot_page[victim] = page;
+        cache->slot_used[victim] = cache->frame;
+        cache->pages[page] = victim + 1;
+        uploads[count++] = page;
+    }
+    return count;
+}
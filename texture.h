@@ -0,0 +1,81 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+// side of the square tiles textures are streamed in, must match kernels/texture.cl
+#define TEXTURE_TILE 64
+// levels of an 8192 texel texture, the largest supported
+#define TEXTURE_MAX_LEVELS 14
+// Material.texture of untextured materials
+#define TEXTURE_NONE 0xFFFF
+// slot_used of tiles that are never evicted
+#define TEXTURE_PINNED 0xFFFFFFFFu
+#define TEXTURE_FREE_SLOT 0xFFFFFFFFu
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Host copy of a texture, RGBA8 texels of every level of its mip chain,
+ * level 0 first. size is the side of level 0, a power of two.
+ */
+typedef struct {
+    unsigned int size;
+    unsigned int levels;
+    cl_uint* texels;
+} Texture;
+
+/**
+ * Per texture record the kernels read, TextureInfo in kernels/scene.cl.
+ * pages holds the page table index of the first tile of each level, tiles
+ * follow row by row. Levels smaller than a tile take one.
+ */
+typedef struct {
+    cl_uint size;
+    cl_uint levels;
+    cl_uint pages[TEXTURE_MAX_LEVELS];
+} TextureInfo;
+
+/**
+ * Which tiles of a set of textures are resident in an atlas of slots
+ * tiles. pages holds slot + 1 of each resident tile and 0 for the rest,
+ * the kernels read a copy of it. slot_used is the update a slot's tile was
+ * last requested in, least recently used tiles are replaced first. The
+ * last level of every texture is pinned, so lookups always find a level.
+ */
+typedef struct {
+    TextureInfo* info;
+    unsigned int num_textures;
+
+    cl_uint* pages;
+    unsigned int num_pages;
+
+    unsigned int slots;
+    unsigned int* slot_page;
+    unsigned int* slot_used;
+    unsigned int frame;
+} TextureCache;
+
+void texture_init(Texture* texture, unsigned int size);
+void texture_free(Texture* texture);
+cl_uint* texture_level(const Texture* texture, unsigned int level);
+void texture_build_mips(Texture* texture);
+void texture_copy_tile(const Texture* texture, unsigned int level, unsigned int tx, unsigned int ty, cl_uint* tile);
+
+void texture_cache_init(TextureCache* cache, const Texture* textures, unsigned int count, unsigned int slots);
+void texture_cache_free(TextureCache* cache);
+void texture_cache_page_tile(const TextureCache* cache, unsigned int page,
+    unsigned int* texture, unsigned int* level, unsigned int* tx, unsigned int* ty);
+unsigned int texture_cache_update(TextureCache* cache, const cl_uint* requests, unsigned int max_uploads, unsigned int* uploads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif